@@ -0,0 +1,868 @@
+/* hexgl-bench: times the hot paths of the game on synthetic data
+ *
+ * Everything is built from the maps tests/testmaps.c draws, so nothing
+ * needs baking, a track model or a display, and the numbers can be
+ * compared between machines and changes. With no arguments all the
+ * benchmarks run, otherwise the ones named.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "analysismap.h"
+#include "particles.h"
+#include "ships.h"
+#include "sim.h"
+#include "testmaps.h"
+
+/* The map-size option, passed in by meson */
+#ifndef MAP_SIZE
+#define MAP_SIZE ANALYSIS_MAP_DEFAULT_SIZE
+#endif
+
+/* Each timing is the best of this many rounds, of at least ROUND_TIME
+ * us each, which steadies it against whatever else the machine does */
+#define N_ROUNDS 5
+#define ROUND_TIME 50000
+
+#define N_POINTS (1 << 20)
+
+static int map_size = MAP_SIZE;
+
+static GOptionEntry entries[] = {
+  { "size", 's', 0, G_OPTION_ARG_INT, &map_size, "Width and height of the maps", "N" },
+  { NULL }
+};
+
+/* Results go here, so the compiler can't drop the work */
+static volatile float sink;
+
+typedef void (*BenchFunc) (gpointer data);
+
+/* Calls func on data for N_ROUNDS rounds, and returns the time per
+ * call in ns of the fastest */
+static double
+time_func (BenchFunc func,
+           gpointer data)
+{
+  double best = G_MAXDOUBLE;
+
+  /* Once first, to fault everything in */
+  func (data);
+
+  for (int round = 0; round < N_ROUNDS; round++)
+    {
+      gint64 start_time, elapsed;
+      guint64 n = 0;
+
+      start_time = g_get_monotonic_time ();
+      do
+        {
+          func (data);
+          n++;
+          elapsed = g_get_monotonic_time () - start_time;
+        }
+      while (elapsed < ROUND_TIME);
+
+      best = MIN (best, elapsed * 1000.0 / n);
+    }
+
+  return best;
+}
+
+typedef struct {
+  AnalysisMap *map;
+  cairo_surface_t *surface;
+  graphene_point3d_t min, max;
+  float *x;
+  float *z;
+  float *heights;
+} LookupBench;
+
+/* Random points all over the box */
+static void
+lookup_bench_init (LookupBench *bench,
+                   AnalysisMap *map)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  graphene_box_t box;
+
+  test_maps_get_bounding_box (&box);
+  graphene_box_get_min (&box, &bench->min);
+  graphene_box_get_max (&box, &bench->max);
+
+  bench->map = map;
+  bench->surface = NULL;
+  bench->x = g_new (float, N_POINTS);
+  bench->z = g_new (float, N_POINTS);
+  bench->heights = g_new (float, N_POINTS);
+
+  for (int i = 0; i < N_POINTS; i++)
+    {
+      bench->x[i] = g_rand_double_range (rand, bench->min.x, bench->max.x);
+      bench->z[i] = g_rand_double_range (rand, bench->min.z, bench->max.z);
+    }
+}
+
+static void
+lookup_bench_clear (LookupBench *bench)
+{
+  g_free (bench->x);
+  g_free (bench->z);
+  g_free (bench->heights);
+}
+
+/* A texel of the packed depth surface, decoded like the lookups did
+ * before the heights were decoded up front */
+static float
+surface_depth (cairo_surface_t *surface,
+               int x, int y)
+{
+  unsigned char *data = cairo_image_surface_get_data (surface);
+  int stride = cairo_image_surface_get_stride (surface);
+  guint32 pixel;
+  GdkRGBA color;
+
+  if (x < 0 || y < 0 ||
+      x >= cairo_image_surface_get_width (surface) ||
+      y >= cairo_image_surface_get_height (surface))
+    return 0;
+
+  pixel = *(guint32 *)(data + x * 4 + y * stride);
+  color.alpha = ((pixel & 0xff000000) >> 24) / 255.0;
+  color.red = ((pixel & 0x00ff0000) >> 16) / 255.0;
+  color.green = ((pixel & 0x0000ff00) >> 8) / 255.0;
+  color.blue = (pixel & 0x000000ff) / 255.0;
+
+  return
+    color.alpha * (255.0 / 256.0) +
+    color.red * (255.0 / 256.0) / (256.0 * 256.0 * 256.0) +
+    color.green * (255.0 / 256.0) / (256.0 * 256.0) +
+    color.blue * (255.0 / 256.0) / (256.0);
+}
+
+static float
+lerp (float a, float b, float alpha)
+{
+  return a * alpha + b * (1.0 - alpha);
+}
+
+/* The bilinear lookup on the surface, decoding all four taps */
+static float
+surface_lookup (LookupBench *bench,
+                float x,
+                float z)
+{
+  cairo_surface_t *surface = bench->surface;
+  float u, v, depth;
+
+  u = map_size * (x - bench->min.x) / (bench->max.x - bench->min.x);
+  v = map_size * (z - bench->min.z) / (bench->max.z - bench->min.z);
+
+  depth = lerp (lerp (surface_depth (surface, floorf (u), floorf (v)),
+                      surface_depth (surface, ceilf (u), floorf (v)),
+                      ceilf (u) - u),
+                lerp (surface_depth (surface, floorf (u), ceilf (v)),
+                      surface_depth (surface, ceilf (u), ceilf (v)),
+                      ceilf (u) - u),
+                ceilf (v) - v);
+
+  return bench->max.y - depth * (bench->max.y - bench->min.y);
+}
+
+static void
+lookup_surface (gpointer data)
+{
+  LookupBench *bench = data;
+  float sum = 0;
+
+  for (int i = 0; i < N_POINTS; i++)
+    sum += surface_lookup (bench, bench->x[i], bench->z[i]);
+
+  sink = sum;
+}
+
+static void
+lookup_grid (gpointer data)
+{
+  LookupBench *bench = data;
+  float sum = 0;
+
+  for (int i = 0; i < N_POINTS; i++)
+    sum += analysis_map_lookup_depthmapped (bench->map, bench->x[i], bench->z[i]);
+
+  sink = sum;
+}
+
+static void
+lookup_grid_batch (gpointer data)
+{
+  LookupBench *bench = data;
+
+  analysis_map_lookup_depthmapped_batch (bench->map, bench->x, bench->z,
+                                         bench->heights, N_POINTS);
+  sink = bench->heights[N_POINTS - 1];
+}
+
+/* Height lookups at random points, on the packed depth surface as they
+ * used to be and on the grids decoded from it */
+static void
+bench_lookup (void)
+{
+  graphene_box_t box;
+  LookupBench bench;
+  AnalysisMap *map;
+
+  test_maps_get_bounding_box (&box);
+  map = test_maps_height_map_new (map_size, map_size, ANALYSIS_MAP_LAYOUT_LINEAR,
+                                  ANALYSIS_MAP_PRECISION_FLOAT);
+  lookup_bench_init (&bench, map);
+  bench.surface = test_maps_height_surface_new (map_size, map_size, &box, test_maps_hills);
+
+  g_print ("lookup: %dx%d, per lookup: surface %.1f ns",
+           map_size, map_size, time_func (lookup_surface, &bench) / N_POINTS);
+  g_print (", float grid %.1f ns, batched %.1f ns",
+           time_func (lookup_grid, &bench) / N_POINTS,
+           time_func (lookup_grid_batch, &bench) / N_POINTS);
+
+  analysis_map_set_height_precision (map, ANALYSIS_MAP_PRECISION_16BIT);
+  g_print (", 16-bit grid %.1f ns, batched %.1f ns\n",
+           time_func (lookup_grid, &bench) / N_POINTS,
+           time_func (lookup_grid_batch, &bench) / N_POINTS);
+
+  cairo_surface_destroy (bench.surface);
+  lookup_bench_clear (&bench);
+  analysis_map_unref (map);
+}
+
+/* Ships spread around the ring track, each probing the maps like a
+ * step of the simulation does */
+#define N_TRAJECTORIES 64
+#define N_TRAJECTORY_STEPS 2048
+#define N_TRAJECTORY_PROBES 4
+/* Units per step, the top speed */
+#define TRAJECTORY_SPEED 7.0
+
+typedef struct {
+  AnalysisMap *height_map;
+  AnalysisMap *collision_map;
+  int n_points;
+  float *x;
+  float *z;
+  float *heights;
+  AnalysisClass *classes;
+} TrajectoryBench;
+
+/* Every step of every ship, in the order the simulation steps them:
+ * all ships one step, then the next. The probes are where
+ * sim_height_probes() puts them. */
+static void
+trajectory_bench_init (TrajectoryBench *bench)
+{
+  static const float probe_x[N_TRAJECTORY_PROBES] = { 0, 0, 5, -5 };
+  static const float probe_z[N_TRAJECTORY_PROBES] = { 0, 5, 0, 0 };
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  float radius[N_TRAJECTORIES], start[N_TRAJECTORIES], wobble[N_TRAJECTORIES];
+  int i = 0;
+
+  bench->n_points = N_TRAJECTORIES * N_TRAJECTORY_STEPS * N_TRAJECTORY_PROBES;
+  bench->x = g_new (float, bench->n_points);
+  bench->z = g_new (float, bench->n_points);
+  bench->heights = g_new (float, bench->n_points);
+  bench->classes = g_new (AnalysisClass, bench->n_points);
+
+  for (int ship = 0; ship < N_TRAJECTORIES; ship++)
+    {
+      radius[ship] = g_rand_double_range (rand, TEST_MAPS_RING_INNER + 20, TEST_MAPS_RING_OUTER - 20);
+      start[ship] = g_rand_double_range (rand, 0, 2 * G_PI);
+      wobble[ship] = g_rand_double_range (rand, 0, 2 * G_PI);
+    }
+
+  for (int step = 0; step < N_TRAJECTORY_STEPS; step++)
+    for (int ship = 0; ship < N_TRAJECTORIES; ship++)
+      {
+        /* Weaving across the track as it goes around */
+        float r = radius[ship] + 10 * sinf (wobble[ship] + step * 0.05);
+        float angle = start[ship] + step * TRAJECTORY_SPEED / r;
+        float sin_angle = sinf (angle), cos_angle = cosf (angle);
+        float x = TEST_MAPS_RING_X + r * cos_angle;
+        float z = TEST_MAPS_RING_Z + r * sin_angle;
+
+        /* Heading along the ring, with the ship x axis pointing in */
+        for (int probe = 0; probe < N_TRAJECTORY_PROBES; probe++, i++)
+          {
+            bench->x[i] = x - probe_x[probe] * cos_angle - probe_z[probe] * sin_angle;
+            bench->z[i] = z - probe_x[probe] * sin_angle + probe_z[probe] * cos_angle;
+          }
+      }
+}
+
+static void
+trajectory_bench_clear (TrajectoryBench *bench)
+{
+  g_free (bench->x);
+  g_free (bench->z);
+  g_free (bench->heights);
+  g_free (bench->classes);
+}
+
+static void
+trajectory_heights (gpointer data)
+{
+  TrajectoryBench *bench = data;
+  float sum = 0;
+
+  for (int i = 0; i < bench->n_points; i++)
+    sum += analysis_map_lookup_depthmapped (bench->height_map, bench->x[i], bench->z[i]);
+
+  sink = sum;
+}
+
+/* The probes of all ships in a batch each step, as sim_step_batch()
+ * does */
+static void
+trajectory_heights_batch (gpointer data)
+{
+  TrajectoryBench *bench = data;
+  int n = N_TRAJECTORIES * N_TRAJECTORY_PROBES;
+
+  for (int i = 0; i < bench->n_points; i += n)
+    analysis_map_lookup_depthmapped_batch (bench->height_map, bench->x + i, bench->z + i,
+                                           bench->heights + i, n);
+
+  sink = bench->heights[bench->n_points - 1];
+}
+
+/* At the ship positions only */
+static void
+trajectory_classes (gpointer data)
+{
+  TrajectoryBench *bench = data;
+  guint sum = 0;
+
+  for (int i = 0; i < bench->n_points; i += N_TRAJECTORY_PROBES)
+    sum += analysis_map_lookup_class (bench->collision_map, bench->x[i], bench->z[i]);
+
+  sink = sum;
+}
+
+static void
+trajectory_distances (gpointer data)
+{
+  TrajectoryBench *bench = data;
+  graphene_vec2_t gradient;
+  float sum = 0;
+
+  for (int i = 0; i < bench->n_points; i += N_TRAJECTORY_PROBES)
+    sum += analysis_map_lookup_distance (bench->collision_map, bench->x[i], bench->z[i], &gradient);
+
+  sink = sum;
+}
+
+/* The lookups of ships driving around the track, in each layout of the
+ * grids */
+static void
+bench_layout (void)
+{
+  static const char *layout_names[] = { "linear", "tiled", "sparse" };
+  TrajectoryBench bench;
+  int n_steps = N_TRAJECTORIES * N_TRAJECTORY_STEPS;
+
+  trajectory_bench_init (&bench);
+
+  for (int layout = 0; layout < G_N_ELEMENTS (layout_names); layout++)
+    {
+      gsize height_size, collision_size;
+
+      bench.height_map = test_maps_height_map_new (map_size, map_size, layout,
+                                                   ANALYSIS_MAP_PRECISION_FLOAT);
+      bench.collision_map = test_maps_collision_map_new (map_size, map_size, layout);
+      height_size = analysis_map_get_memory_size (bench.height_map, NULL);
+      collision_size = analysis_map_get_memory_size (bench.collision_map, NULL);
+
+      g_print ("layout: %dx%d %s, %.1f + %.1f MB, per probe: height %.1f ns, batched %.1f ns",
+               map_size, map_size, layout_names[layout],
+               height_size / (1024.0 * 1024.0), collision_size / (1024.0 * 1024.0),
+               time_func (trajectory_heights, &bench) / bench.n_points,
+               time_func (trajectory_heights_batch, &bench) / bench.n_points);
+      g_print (", class %.1f ns, distance %.1f ns\n",
+               time_func (trajectory_classes, &bench) / n_steps,
+               time_func (trajectory_distances, &bench) / n_steps);
+
+      analysis_map_unref (bench.height_map);
+      analysis_map_unref (bench.collision_map);
+    }
+
+  trajectory_bench_clear (&bench);
+}
+
+/* Ships for the pose benchmark */
+#define N_POSE_SHIPS 256
+#define N_POSE_STEPS 64
+
+/* What the simulation kept before the pose became a yaw angle: a
+ * quaternion and the matrix built from it and the position */
+typedef struct {
+  graphene_vec3_t position;
+  graphene_quaternion_t quaternion;
+  graphene_matrix_t matrix;
+  graphene_matrix_t mesh_matrix;
+  graphene_matrix_t previous_mesh_matrix;
+} MatrixPose;
+
+typedef struct {
+  MatrixPose matrix_poses[N_POSE_SHIPS];
+  SimState states[N_POSE_SHIPS];
+  SimPose poses[N_POSE_SHIPS];
+  SimPose previous_poses[N_POSE_SHIPS];
+  SimInput inputs[N_POSE_SHIPS];
+  SimEvents events[N_POSE_SHIPS];
+  /* The turn and ship space movement of each step */
+  float angular[N_POSE_STEPS];
+  graphene_vec3_t movement[N_POSE_STEPS];
+} PoseBench;
+
+static const float pose_probe_x[4] = { 0, 0, 5, -5 };
+static const float pose_probe_z[4] = { 0, 5, 0, 0 };
+
+static void
+matrix_pose_update_matrix (MatrixPose *pose)
+{
+  graphene_point3d_t pos;
+
+  graphene_matrix_init_identity (&pose->matrix);
+  graphene_matrix_rotate_quaternion (&pose->matrix, &pose->quaternion);
+  graphene_matrix_translate (&pose->matrix, graphene_point3d_init_from_vec3 (&pos, &pose->position));
+}
+
+static void
+matrix_pose_translate (MatrixPose *pose,
+                       float x, float y, float z,
+                       float distance)
+{
+  graphene_vec3_t v;
+
+  graphene_vec3_init (&v, x, y, z);
+  graphene_matrix_transform_vec3 (&pose->matrix, &v, &v);
+  graphene_vec3_scale (&v, distance, &v);
+  graphene_vec3_add (&pose->position, &v, &pose->position);
+}
+
+/* The pose work of a step as it was: moving along the ship axes, the
+ * height probes, turning and rebuilding the matrices */
+static void
+matrix_pose_step (MatrixPose *pose,
+                  float angular,
+                  const graphene_vec3_t *movement,
+                  float *xs,
+                  float *zs)
+{
+  graphene_quaternion_t quaternion;
+
+  matrix_pose_translate (pose, 1, 0, 0, graphene_vec3_get_x (movement));
+  matrix_pose_translate (pose, 0, 0, 1, graphene_vec3_get_z (movement));
+
+  for (int i = 0; i < 4; i++)
+    {
+      graphene_vec3_t probe;
+
+      graphene_vec3_init (&probe, pose_probe_x[i], 0, pose_probe_z[i]);
+      graphene_matrix_transform_vec3 (&pose->matrix, &probe, &probe);
+      xs[i] = graphene_vec3_get_x (&pose->position) + graphene_vec3_get_x (&probe);
+      zs[i] = graphene_vec3_get_z (&pose->position) + graphene_vec3_get_z (&probe);
+    }
+
+  matrix_pose_translate (pose, 0, 1, 0, graphene_vec3_get_y (movement));
+
+  graphene_quaternion_init (&quaternion, 0, angular, 0, 1);
+  graphene_quaternion_normalize (&quaternion, &quaternion);
+  graphene_quaternion_multiply (&quaternion, &pose->quaternion, &pose->quaternion);
+  matrix_pose_update_matrix (pose);
+
+  pose->previous_mesh_matrix = pose->mesh_matrix;
+  graphene_matrix_init_identity (&pose->mesh_matrix);
+  graphene_matrix_multiply (&pose->mesh_matrix, &pose->matrix, &pose->mesh_matrix);
+}
+
+/* The same with the yaw angle, as sim_step() does it */
+static void
+yaw_pose_step (SimState *state,
+               SimPose *pose,
+               SimPose *previous_pose,
+               float angular,
+               const graphene_vec3_t *movement,
+               float *xs,
+               float *zs)
+{
+  float x = graphene_vec3_get_x (movement), z = graphene_vec3_get_z (movement);
+
+  state->position.x += x * state->cos_yaw + z * state->sin_yaw;
+  state->position.z += z * state->cos_yaw - x * state->sin_yaw;
+
+  for (int i = 0; i < 4; i++)
+    {
+      xs[i] = state->position.x + pose_probe_x[i] * state->cos_yaw + pose_probe_z[i] * state->sin_yaw;
+      zs[i] = state->position.z + pose_probe_z[i] * state->cos_yaw - pose_probe_x[i] * state->sin_yaw;
+    }
+
+  state->position.y += graphene_vec3_get_y (movement);
+
+  state->yaw += 2 * atanf (angular);
+  state->cos_yaw = cosf (state->yaw);
+  state->sin_yaw = sinf (state->yaw);
+
+  *previous_pose = *pose;
+  sim_state_get_pose (state, pose);
+}
+
+static void
+pose_matrix_steps (gpointer data)
+{
+  PoseBench *bench = data;
+  float xs[4], zs[4], sum = 0;
+
+  for (int step = 0; step < N_POSE_STEPS; step++)
+    for (int i = 0; i < N_POSE_SHIPS; i++)
+      {
+        matrix_pose_step (&bench->matrix_poses[i], bench->angular[step], &bench->movement[step], xs, zs);
+        sum += xs[3] + zs[3];
+      }
+
+  sink = sum;
+}
+
+static void
+pose_yaw_steps (gpointer data)
+{
+  PoseBench *bench = data;
+  float xs[4], zs[4], sum = 0;
+
+  for (int step = 0; step < N_POSE_STEPS; step++)
+    for (int i = 0; i < N_POSE_SHIPS; i++)
+      {
+        yaw_pose_step (&bench->states[i], &bench->poses[i], &bench->previous_poses[i],
+                       bench->angular[step], &bench->movement[step], xs, zs);
+        sum += xs[3] + zs[3];
+      }
+
+  sink = sum;
+}
+
+/* What a frame did to draw the ships between two steps */
+static void
+pose_matrix_frame (gpointer data)
+{
+  PoseBench *bench = data;
+  graphene_matrix_t matrix;
+  float sum = 0;
+
+  for (int i = 0; i < N_POSE_SHIPS; i++)
+    {
+      graphene_matrix_interpolate (&bench->matrix_poses[i].previous_mesh_matrix,
+                                   &bench->matrix_poses[i].mesh_matrix,
+                                   0.5, &matrix);
+      sum += graphene_matrix_get_value (&matrix, 3, 0);
+    }
+
+  sink = sum;
+}
+
+static void
+pose_yaw_frame (gpointer data)
+{
+  PoseBench *bench = data;
+  graphene_matrix_t matrix;
+  SimPose pose;
+  float sum = 0;
+
+  for (int i = 0; i < N_POSE_SHIPS; i++)
+    {
+      sim_pose_interpolate (&bench->previous_poses[i], &bench->poses[i], 0.5, &pose);
+      sim_pose_to_matrix (&pose, &matrix);
+      sum += graphene_matrix_get_value (&matrix, 3, 0);
+    }
+
+  sink = sum;
+}
+
+/* Whole steps of ships going around the ring track, in one batch */
+static void
+pose_sim_steps (gpointer data)
+{
+  PoseBench *bench = data;
+
+  for (int step = 0; step < N_POSE_STEPS; step++)
+    sim_step_batch (bench->states, bench->inputs, bench->events, N_POSE_SHIPS, 1.0);
+}
+
+static void
+pose_bench_start_ships (PoseBench *bench,
+                        AnalysisMap *height_map,
+                        AnalysisMap *collision_map)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+
+  for (int i = 0; i < N_POSE_SHIPS; i++)
+    {
+      float r = g_rand_double_range (rand, TEST_MAPS_RING_INNER + 50, TEST_MAPS_RING_OUTER - 50);
+      float angle = g_rand_double_range (rand, 0, 2 * G_PI);
+      graphene_vec3_t position;
+      SimState *state = &bench->states[i];
+
+      graphene_vec3_init (&position,
+                          TEST_MAPS_RING_X + r * cosf (angle),
+                          test_maps_hills (TEST_MAPS_RING_X + r * cosf (angle),
+                                           TEST_MAPS_RING_Z + r * sinf (angle)),
+                          TEST_MAPS_RING_Z + r * sinf (angle));
+
+      sim_state_init (state);
+      state->height_map = height_map;
+      state->collision_map = collision_map;
+      /* Heading around the ring */
+      sim_state_reset (state, &position, -angle);
+      state->active = TRUE;
+
+      bench->inputs[i] = SIM_INPUT_FORWARD | (i % 2 ? SIM_INPUT_LEFT : 0);
+      sim_state_get_pose (state, &bench->poses[i]);
+      bench->previous_poses[i] = bench->poses[i];
+
+      bench->matrix_poses[i].position = position;
+      graphene_quaternion_init (&bench->matrix_poses[i].quaternion, 0, sinf (-angle / 2), 0, cosf (-angle / 2));
+      matrix_pose_update_matrix (&bench->matrix_poses[i]);
+      bench->matrix_poses[i].mesh_matrix = bench->matrix_poses[i].matrix;
+      bench->matrix_poses[i].previous_mesh_matrix = bench->matrix_poses[i].matrix;
+    }
+}
+
+/* The pose work of a step and a frame, with the old quaternion and
+ * matrix and with the yaw angle, and whole simulation steps */
+static void
+bench_pose (void)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  PoseBench *bench = g_new0 (PoseBench, 1);
+  AnalysisMap *height_map, *collision_map;
+  int n_steps = N_POSE_SHIPS * N_POSE_STEPS;
+
+  height_map = test_maps_height_map_new (map_size, map_size, ANALYSIS_MAP_LAYOUT_TILED,
+                                         ANALYSIS_MAP_PRECISION_FLOAT);
+  collision_map = test_maps_collision_map_new (map_size, map_size, ANALYSIS_MAP_LAYOUT_TILED);
+
+  for (int step = 0; step < N_POSE_STEPS; step++)
+    {
+      bench->angular[step] = g_rand_double_range (rand, -0.02, 0.02);
+      graphene_vec3_init (&bench->movement[step],
+                          g_rand_double_range (rand, -1, 1),
+                          g_rand_double_range (rand, -0.5, 0.5),
+                          g_rand_double_range (rand, 0, 7));
+    }
+
+  pose_bench_start_ships (bench, height_map, collision_map);
+
+  g_print ("pose: %d ships, per ship step: matrix %.1f ns, yaw %.1f ns",
+           N_POSE_SHIPS,
+           time_func (pose_matrix_steps, bench) / n_steps,
+           time_func (pose_yaw_steps, bench) / n_steps);
+  g_print (", per ship frame: matrix %.1f ns, yaw %.1f ns",
+           time_func (pose_matrix_frame, bench) / N_POSE_SHIPS,
+           time_func (pose_yaw_frame, bench) / N_POSE_SHIPS);
+
+  pose_bench_start_ships (bench, height_map, collision_map);
+  g_print (", sim_step_batch() %.1f ns\n",
+           time_func (pose_sim_steps, bench) / n_steps);
+
+  analysis_map_unref (height_map);
+  analysis_map_unref (collision_map);
+  g_free (bench);
+}
+
+/* Up to this many ships in a race, from one, doubling */
+#define N_RACE_SHIPS 256
+#define N_RACE_STEPS 16
+/* The length of a frame at 60 Hz, in ns */
+#define FRAME_NS (1e9 / 60)
+
+/* Ships spread over the ring track, all going around it, every other one
+ * turning */
+static Ships *
+race_new (guint n_ships,
+          AnalysisMap *height_map,
+          AnalysisMap *collision_map)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  Ships *ships = ships_new ();
+
+  ships_set_maps (ships, height_map, collision_map);
+
+  for (guint i = 0; i < n_ships; i++)
+    {
+      float r = g_rand_double_range (rand, TEST_MAPS_RING_INNER + 50, TEST_MAPS_RING_OUTER - 50);
+      float angle = g_rand_double_range (rand, 0, 2 * G_PI);
+      float x = TEST_MAPS_RING_X + r * cosf (angle);
+      float z = TEST_MAPS_RING_Z + r * sinf (angle);
+      guint ship = ships_add (ships);
+      graphene_vec3_t position;
+
+      ships_reset (ships, ship, graphene_vec3_init (&position, x, test_maps_hills (x, z), z), -angle);
+      ships_get_state (ships, ship)->active = TRUE;
+      ships_set_input (ships, ship, SIM_INPUT_FORWARD | (i % 2 ? SIM_INPUT_LEFT : 0));
+    }
+
+  return ships;
+}
+
+static void
+race_steps (gpointer data)
+{
+  Ships *ships = data;
+
+  for (int step = 0; step < N_RACE_STEPS; step++)
+    ships_update (ships, 1.0);
+}
+
+static double
+time_race (guint n_ships,
+           AnalysisMap *height_map,
+           AnalysisMap *collision_map)
+{
+  Ships *ships = race_new (n_ships, height_map, collision_map);
+  double ns = time_func (race_steps, ships) / (N_RACE_STEPS * n_ships);
+
+  ships_free (ships);
+
+  return ns;
+}
+
+/* Whole steps of races of more and more ships, bumping into each other,
+ * through ships_update(). Without the maps only the work on the ship
+ * state is left, which is all another layout of it could speed up. */
+static void
+bench_ships (void)
+{
+  AnalysisMap *height_map, *collision_map;
+
+  height_map = test_maps_height_map_new (map_size, map_size, ANALYSIS_MAP_LAYOUT_TILED,
+                                         ANALYSIS_MAP_PRECISION_FLOAT);
+  collision_map = test_maps_collision_map_new (map_size, map_size, ANALYSIS_MAP_LAYOUT_TILED);
+
+  for (guint n = 1; n <= N_RACE_SHIPS; n *= 2)
+    {
+      double ns = time_race (n, height_map, collision_map);
+
+      g_print ("ships: %u, %.1f ns per ship step (%.1f ns without the maps), %.3f%% of a 60 Hz frame\n",
+               n, ns, time_race (n, NULL, NULL), ns * n * 100 / FRAME_NS);
+    }
+
+  analysis_map_unref (height_map);
+  analysis_map_unref (collision_map);
+}
+
+#define N_PARTICLES 100000
+/* Updates each particle lives for, and how many are emitted in each,
+ * which keeps the system full */
+#define PARTICLE_LIFE 500
+#define PARTICLE_EMIT (N_PARTICLES / PARTICLE_LIFE)
+/* What a frame may take, for the figure to be compared to */
+#define PARTICLE_TARGET_MS 1.0
+
+/* An update of a full system, as a frame does it. Nothing draws the
+ * points, so marking the attributes for upload costs nothing here. */
+static void
+particles_frame (gpointer data)
+{
+  Particles *particles = data;
+
+  particles_emit (particles, PARTICLE_EMIT);
+  particles_update (particles, 1.0);
+}
+
+/* A system as big as the request for it, kept full with particles of
+ * every age, like a long burst */
+static void
+bench_particles (void)
+{
+  Particles *particles = particles_new (N_PARTICLES, 2);
+  graphene_vec3_t v;
+  double ms;
+
+  particles_set_seed (particles, 42);
+  particles_set_life (particles, PARTICLE_LIFE);
+  particles_set_spawn_radius (particles, graphene_vec3_init (&v, 5, 5, 5));
+  particles_set_velocity (particles, graphene_vec3_init (&v, 0, 0.2, 0));
+  particles_set_velocity_randomness (particles, graphene_vec3_init (&v, 0.4, 0.4, 0.4));
+
+  for (int i = 0; i < PARTICLE_LIFE; i++)
+    particles_frame (particles);
+
+  ms = time_func (particles_frame, particles) / 1e6;
+  g_print ("particles: %d, %.3f ms per update, target %.1f ms\n",
+           N_PARTICLES, ms, PARTICLE_TARGET_MS);
+
+  particles_free (particles);
+}
+
+typedef struct {
+  const char *name;
+  void (*run) (void);
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+  { "lookup", bench_lookup },
+  { "layout", bench_layout },
+  { "pose", bench_pose },
+  { "ships", bench_ships },
+  { "particles", bench_particles },
+};
+
+static const Benchmark *
+find_benchmark (const char *name)
+{
+  for (int i = 0; i < G_N_ELEMENTS (benchmarks); i++)
+    if (strcmp (benchmarks[i].name, name) == 0)
+      return &benchmarks[i];
+
+  return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GString) names = g_string_new ("Benchmarks:");
+  gboolean usage;
+
+  for (int i = 0; i < G_N_ELEMENTS (benchmarks); i++)
+    g_string_append_printf (names, " %s", benchmarks[i].name);
+
+  context = g_option_context_new ("[BENCHMARK...] - time the game on synthetic data");
+  g_option_context_set_summary (context, names->str);
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  usage = map_size < 64;
+  for (int i = 1; i < argc; i++)
+    if (find_benchmark (argv[i]) == NULL)
+      usage = TRUE;
+
+  if (usage)
+    {
+      g_autofree char *help = g_option_context_get_help (context, TRUE, NULL);
+      g_printerr ("%s", help);
+      return EXIT_FAILURE;
+    }
+
+  if (argc < 2)
+    for (int i = 0; i < G_N_ELEMENTS (benchmarks); i++)
+      benchmarks[i].run ();
+
+  for (int i = 1; i < argc; i++)
+    find_benchmark (argv[i])->run ();
+
+  return EXIT_SUCCESS;
+}
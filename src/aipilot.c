@@ -0,0 +1,146 @@
+#include <math.h>
+#include <string.h>
+#include "aipilot.h"
+
+/* How far ahead along the line to aim, in units plus per unit of speed */
+#define AI_PILOT_LOOKAHEAD 20.0f
+#define AI_PILOT_LOOKAHEAD_SPEED 6.0f
+/* Heading errors in radians to steer at, and to use the air brakes at */
+#define AI_PILOT_STEER_ANGLE 0.02f
+#define AI_PILOT_BRAKE_ANGLE 0.35f
+/* How much too fast to go before braking, rather than just coasting */
+#define AI_PILOT_BRAKE_SPEED 0.5f
+/* How much of the fastest turn the speeds are planned with, as the
+ * line and the ship don't quite follow each other */
+#define AI_PILOT_TURN_MARGIN 0.9f
+
+struct _AiPilot {
+  RacingLine *line;
+
+  /* The fastest speed at each point of the line, for the ship params
+   * it was worked out for. They change with the difficulty, and when
+   * the ship profiles are reloaded. */
+  gboolean has_speeds;
+  SimParams params;
+  float *speeds;
+};
+
+AiPilot *
+ai_pilot_new (RacingLine *line)
+{
+  AiPilot *pilot = g_new0 (AiPilot, 1);
+
+  pilot->line = racing_line_ref (line);
+  pilot->speeds = g_new (float, racing_line_get_n_points (line));
+
+  return pilot;
+}
+
+void
+ai_pilot_free (AiPilot *pilot)
+{
+  racing_line_unref (pilot->line);
+  g_free (pilot->speeds);
+  g_free (pilot);
+}
+
+/* The fastest the ship turns holding a direction, in radians per step.
+ * Each step sim_step() eases state->angular towards the input and then
+ * halfway back, so it settles short of the input, and the yaw turns by
+ * about twice that. The air brakes turn faster, but also slow down, so
+ * they are left for when the ship is off the line. */
+static float
+get_turn_rate (const SimParams *p)
+{
+  float l = p->angularLerp;
+  float settled = l / (1 - (1 - l / 2) * (1 - l));
+
+  return 2 * atanf (settled * p->angularSpeed);
+}
+
+/* Works out how fast each point of the line can be taken: no faster
+ * than the ship can turn for the curvature there, nor than it can slow
+ * down from in time for the next points, braking with both air brakes. */
+static void
+update_speeds (AiPilot *pilot,
+               const SimParams *p)
+{
+  guint n = racing_line_get_n_points (pilot->line);
+  float spacing = racing_line_get_spacing (pilot->line);
+  float turn_rate = get_turn_rate (p) * AI_PILOT_TURN_MARGIN;
+  float slow_down = 2 * (p->airResist + 2 * p->airBrake) * spacing;
+
+  for (guint i = 0; i < n; i++)
+    {
+      float curvature = fabsf (racing_line_get_curvature (pilot->line, i * spacing));
+
+      pilot->speeds[i] = curvature > 0 ? MIN (turn_rate / curvature, p->maxSpeed) : p->maxSpeed;
+    }
+
+  /* Backwards, twice around as the line is a loop. The speed drops by
+   * the braking a step, and a step covers about speed units, so v^2
+   * drops by twice that a unit. */
+  for (guint k = 2 * n; k > 0; k--)
+    {
+      guint i = (k - 1) % n;
+      float next = pilot->speeds[(i + 1) % n];
+
+      pilot->speeds[i] = MIN (pilot->speeds[i], sqrtf (next * next + slow_down));
+    }
+}
+
+static float
+get_target_speed (AiPilot *pilot,
+                  float s)
+{
+  /* s is never negative here, but may be past the end */
+  guint i = (guint)(s / racing_line_get_spacing (pilot->line));
+
+  return pilot->speeds[i % racing_line_get_n_points (pilot->line)];
+}
+
+/* Returns the keys to hold for the next step of the ship in state */
+SimInput
+ai_pilot_get_input (AiPilot *pilot,
+                    const SimState *state)
+{
+  SimInput input = 0;
+  float speed = state->speed + state->boost;
+  float lookahead = AI_PILOT_LOOKAHEAD + AI_PILOT_LOOKAHEAD_SPEED * speed;
+  float s, x, z, error, target;
+
+  if (!pilot->has_speeds ||
+      memcmp (&state->params, &pilot->params, sizeof (SimParams)) != 0)
+    {
+      update_speeds (pilot, &state->params);
+      pilot->params = state->params;
+      pilot->has_speeds = TRUE;
+    }
+
+  s = racing_line_find (pilot->line, state->position.x, state->position.z);
+
+  /* The ship flies towards (sin yaw, cos yaw) */
+  racing_line_get_position (pilot->line, s + lookahead, &x, &z);
+  error = remainderf (atan2f (x - state->position.x, z - state->position.z) - state->yaw,
+                      2 * G_PI);
+
+  if (error > AI_PILOT_STEER_ANGLE)
+    input |= SIM_INPUT_LEFT;
+  else if (error < -AI_PILOT_STEER_ANGLE)
+    input |= SIM_INPUT_RIGHT;
+
+  if (error > AI_PILOT_BRAKE_ANGLE)
+    input |= SIM_INPUT_LTRIGGER;
+  else if (error < -AI_PILOT_BRAKE_ANGLE)
+    input |= SIM_INPUT_RTRIGGER;
+
+  target = get_target_speed (pilot, s + lookahead / 2);
+  if (speed < target)
+    input |= SIM_INPUT_FORWARD;
+  else if (speed > target + AI_PILOT_BRAKE_SPEED &&
+           (input & (SIM_INPUT_LTRIGGER | SIM_INPUT_RTRIGGER)) == 0)
+    /* Their turning cancels out */
+    input |= SIM_INPUT_LTRIGGER | SIM_INPUT_RTRIGGER;
+
+  return input;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <glib.h>
+#include "racingline.h"
+#include "sim.h"
+
+/* A computer pilot, which flies a ship along a racing line by giving it
+ * the same inputs as the keys would. */
+typedef struct _AiPilot AiPilot;
+
+AiPilot * ai_pilot_new        (RacingLine     *line);
+void      ai_pilot_free       (AiPilot        *pilot);
+SimInput  ai_pilot_get_input  (AiPilot        *pilot,
+                               const SimState *state);
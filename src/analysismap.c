@@ -1,25 +1,360 @@
 #include "analysismap.h"
+#include "distancetransform.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
 
 #define EPSILON 0.00000001
 
+/* In the tiled layout the grids are stored as 8x8 texel tiles, each
+ * one contiguous in memory, so that the four taps of a bilinear lookup
+ * and probes close to each other mostly hit the same cache lines */
+#define TILE_SHIFT 3
+#define TILE_SIZE (1 << TILE_SHIFT)
+#define TILE_MASK (TILE_SIZE - 1)
+#define TILE_AREA (TILE_SIZE * TILE_SIZE)
+
+/* In the sparse layout only the tiles that differ from the background
+ * are stored, the others all share the void tile. For collision maps
+ * tiles this close to the track are kept too, so the distance field
+ * is exact up to SPARSE_BORDER_TILES * TILE_SIZE texels from it. */
+#define SPARSE_BORDER_TILES 2
+#define VOID_TILE 0
+
+/* All grids have a guard border of one texel on each side, holding what
+ * lookups outside the map return, so texel coordinates go from -1 to
+ * width/height inclusive. See the sampler below. */
+#define GUARD 1
+
 struct _AnalysisMap {
   grefcount refcount;
-  cairo_surface_t *surface;
+  AnalysisMapMode mode;
+  AnalysisMapLayout layout;
+  int width;
+  int height;
+  /* Size of the grids including the guard border */
+  int padded_width;
+  int padded_height;
+  int tiles_x;
+  int tiles_y;
+
+  /* ANALYSIS_MAP_LAYOUT_SPARSE, the index in the grids of each tile
+   * (VOID_TILE if it's not stored), and the number of stored tiles */
+  guint32 *tile_table;
+  int n_tiles;
+
+  /* All grids below are indexed by texel_index() */
+
+  /* ANALYSIS_MAP_HEIGHT, world space heights, or with
+   * ANALYSIS_MAP_PRECISION_16BIT heights quantized over the height of the
+   * bounding box, see HEIGHT16_TO_FLOAT() */
+  float *heights;
+  guint16 *heights16;
+  float height16_scale;
+
+  /* ANALYSIS_MAP_COLLISION, see CLASS_TEXEL() */
+  guint8 *classes;
+
+  /* Optional signed distance to the edge of the classes given to
+   * analysis_map_build_distance_field(), in world units */
+  float *distances;
+
   graphene_point3d_t min;
   graphene_point3d_t max;
 
   graphene_box_t bounding_box;
+
+  /* Set if the grids were loaded from a cache file */
+  GMappedFile *mapped;
 };
 
-AnalysisMap *
-analysis_map_new (cairo_surface_t *surface,
-                  const graphene_box_t *bounding_box)
+/* A classified texel has the AnalysisClass in the high nibble and the
+ * red channel (how much of the track covers it) in the low nibble */
+#define CLASS_TEXEL(class, coverage) (((class) << 4) | (coverage))
+#define TEXEL_CLASS(texel) ((texel) >> 4)
+#define TEXEL_COVERAGE(texel) ((texel) & 0xf)
+
+#define HEIGHT16_TO_FLOAT(map, h) ((map)->min.y + (float)(h) * (map)->height16_scale)
+
+/* Maps a classified texel to ANALYSIS_CLASS_MASK() of its class */
+static guint32 class_mask_table[256];
+
+static float decode_depth (GdkRGBA *color);
+static float analysis_map_lookup_height (AnalysisMap *map,
+                                         int x, int y);
+
+static void
+init_class_mask_table (void)
+{
+  if (class_mask_table[0] != 0)
+    return;
+
+  for (int i = 0; i < 256; i++)
+    class_mask_table[i] = ANALYSIS_CLASS_MASK (TEXEL_CLASS (i));
+}
+
+/* x and y may be in the guard border, from -1 to width/height */
+static inline gsize
+texel_index (AnalysisMap *map,
+             int x, int y)
+{
+  x += GUARD;
+  y += GUARD;
+
+  switch (map->layout)
+    {
+    case ANALYSIS_MAP_LAYOUT_TILED:
+      return ((gsize)(y >> TILE_SHIFT) * map->tiles_x + (x >> TILE_SHIFT)) * TILE_AREA +
+        ((y & TILE_MASK) << TILE_SHIFT) + (x & TILE_MASK);
+    case ANALYSIS_MAP_LAYOUT_SPARSE:
+      return (gsize)map->tile_table[(y >> TILE_SHIFT) * map->tiles_x + (x >> TILE_SHIFT)] * TILE_AREA +
+        ((y & TILE_MASK) << TILE_SHIFT) + (x & TILE_MASK);
+    case ANALYSIS_MAP_LAYOUT_LINEAR:
+    default:
+      return (gsize)y * map->padded_width + x;
+    }
+}
+
+/* Size of a grid in the layout of the map. This is rounded up to whole
+ * 32-bit words, so the gathers can load the 16-bit heights as words. */
+static gsize
+analysis_map_get_grid_size (AnalysisMap *map,
+                            gsize element_size)
+{
+  gsize size;
+
+  switch (map->layout)
+    {
+    case ANALYSIS_MAP_LAYOUT_TILED:
+      size = (gsize)map->tiles_x * map->tiles_y * TILE_AREA * element_size;
+      break;
+    case ANALYSIS_MAP_LAYOUT_SPARSE:
+      size = (gsize)map->n_tiles * TILE_AREA * element_size;
+      break;
+    case ANALYSIS_MAP_LAYOUT_LINEAR:
+    default:
+      size = (gsize)map->padded_width * map->padded_height * element_size;
+      break;
+    }
+
+  return (size + 3) & ~(gsize)3;
+}
+
+/* Allocates a row-major grid without the guard border, to be passed to
+ * analysis_map_store_grid() */
+static gpointer
+analysis_map_new_linear_grid (AnalysisMap *map,
+                              gsize element_size)
+{
+  return g_new0 (guint8, (gsize)map->width * map->height * element_size);
+}
+
+/* Returns the element of a row-major grid at x,y, which may be in the
+ * guard border. There it is guard, or the nearest edge element if
+ * guard is NULL. */
+static inline gconstpointer
+linear_grid_get (AnalysisMap *map,
+                 gconstpointer linear,
+                 gsize element_size,
+                 gconstpointer guard,
+                 int x, int y)
+{
+  if (guard && (x < 0 || y < 0 || x >= map->width || y >= map->height))
+    return guard;
+
+  x = CLAMP (x, 0, map->width - 1);
+  y = CLAMP (y, 0, map->height - 1);
+
+  return (const guint8 *)linear + ((gsize)y * map->width + x) * element_size;
+}
+
+/* Builds the tile table of a sparse map from a row-major grid and its
+ * guard (as for analysis_map_store_grid()). Tiles where all elements
+ * equal void_element are left out, unless they are within border tiles
+ * of one that isn't. */
+static void
+analysis_map_build_tile_table (AnalysisMap *map,
+                               gconstpointer linear,
+                               gsize element_size,
+                               gconstpointer guard,
+                               gconstpointer void_element,
+                               int border)
+{
+  int n_table = map->tiles_x * map->tiles_y;
+  g_autofree gboolean *used = g_new0 (gboolean, n_table);
+
+  for (int y = -GUARD; y < map->height + GUARD; y++)
+    for (int x = -GUARD; x < map->width + GUARD; x++)
+      {
+        int tile = ((y + GUARD) >> TILE_SHIFT) * map->tiles_x + ((x + GUARD) >> TILE_SHIFT);
+
+        if (!used[tile] &&
+            memcmp (linear_grid_get (map, linear, element_size, guard, x, y),
+                    void_element, element_size) != 0)
+          used[tile] = TRUE;
+      }
+
+  map->tile_table = g_new0 (guint32, n_table);
+  map->n_tiles = 1; /* The void tile */
+
+  for (int ty = 0; ty < map->tiles_y; ty++)
+    for (int tx = 0; tx < map->tiles_x; tx++)
+      {
+        gboolean keep = FALSE;
+
+        for (int y = MAX (ty - border, 0); !keep && y <= MIN (ty + border, map->tiles_y - 1); y++)
+          for (int x = MAX (tx - border, 0); !keep && x <= MIN (tx + border, map->tiles_x - 1); x++)
+            keep = used[y * map->tiles_x + x];
+
+        if (keep)
+          map->tile_table[ty * map->tiles_x + tx] = map->n_tiles++;
+      }
+
+  g_debug ("Sparse analysis map: %d of %d tiles stored",
+           map->n_tiles - 1, n_table);
+}
+
+/* Takes a row-major grid of elements, adds the guard border and returns
+ * it in the layout of the map, freeing the original. The border is
+ * filled with guard, or with the nearest edge element if that is NULL.
+ * In the sparse layout all the left out tiles land on the void tile,
+ * which works as they hold the same elements. */
+static gpointer
+analysis_map_store_grid (AnalysisMap *map,
+                         gpointer linear,
+                         gsize element_size,
+                         gconstpointer guard)
+{
+  guint8 *dest;
+
+  dest = g_malloc0 (analysis_map_get_grid_size (map, element_size));
+
+  for (int y = -GUARD; y < map->height + GUARD; y++)
+    for (int x = -GUARD; x < map->width + GUARD; x++)
+      memcpy (dest + texel_index (map, x, y) * element_size,
+              linear_grid_get (map, linear, element_size, guard, x, y),
+              element_size);
+
+  g_free (linear);
+
+  return dest;
+}
+
+static float
+decode_height_pixel (AnalysisMap *map,
+                     guint32 pixel)
+{
+  GdkRGBA color;
+
+  color.alpha = ((pixel & 0xff000000) >> 24) / 255.0;
+  color.red = ((pixel & 0x00ff0000) >> 16) / 255.0;
+  color.green = ((pixel & 0x0000ff00) >> 8) / 255.0;
+  color.blue = (pixel & 0x000000ff) / 255.0;
+
+  return map->max.y - decode_depth (&color) * (map->max.y - map->min.y);
+}
+
+static void
+analysis_map_decode_heights (AnalysisMap *map,
+                             cairo_surface_t *surface)
+{
+  unsigned char *data = cairo_image_surface_get_data (surface);
+  int stride = cairo_image_surface_get_stride (surface);
+  float *heights = analysis_map_new_linear_grid (map, sizeof (float));
+
+  for (int y = 0; y < map->height; y++)
+    {
+      guint32 *row = (guint32 *)(data + y * stride);
+      float *dest = heights + y * map->width;
+
+      for (int x = 0; x < map->width; x++)
+        dest[x] = decode_height_pixel (map, row[x]);
+    }
+
+  /* The background is cleared to white, the far plane */
+  if (map->layout == ANALYSIS_MAP_LAYOUT_SPARSE)
+    {
+      float void_height = decode_height_pixel (map, 0xffffffff);
+
+      analysis_map_build_tile_table (map, heights, sizeof (float), &map->max.y,
+                                     &void_height, 0);
+    }
+
+  /* Outside the map we're at depth 0, i.e. the top of the bounding box */
+  map->heights = analysis_map_store_grid (map, heights, sizeof (float), &map->max.y);
+}
+
+static guint8
+classify_pixel (guint32 pixel)
+{
+  int r = (pixel & 0x00ff0000) >> 16;
+  int g = (pixel & 0x0000ff00) >> 8;
+  int b = (pixel & 0x000000ff);
+  int class;
+
+  /* Same thresholds the collision code used to apply to the colours */
+  if (r >= 230 && g < 128 && b < 128)
+    class = ANALYSIS_CLASS_BOOSTER;
+  else if (r >= 230 && g >= 230 && b < 204)
+    class = ANALYSIS_CLASS_CHECKPOINT_0 + (b * 10) / 255;
+  else if (r == 255)
+    class = ANALYSIS_CLASS_TRACK;
+  else if (r >= 26)
+    class = ANALYSIS_CLASS_WALL;
+  else
+    class = ANALYSIS_CLASS_VOID;
+
+  return CLASS_TEXEL (class, r >> 4);
+}
+
+static void
+analysis_map_classify (AnalysisMap *map,
+                       cairo_surface_t *surface)
+{
+  unsigned char *data = cairo_image_surface_get_data (surface);
+  int stride = cairo_image_surface_get_stride (surface);
+  guint8 void_texel = CLASS_TEXEL (ANALYSIS_CLASS_VOID, 0);
+  guint8 *classes = analysis_map_new_linear_grid (map, 1);
+
+  for (int y = 0; y < map->height; y++)
+    {
+      guint32 *row = (guint32 *)(data + y * stride);
+      guint8 *dest = classes + y * map->width;
+
+      for (int x = 0; x < map->width; x++)
+        dest[x] = classify_pixel (row[x]);
+    }
+
+  if (map->layout == ANALYSIS_MAP_LAYOUT_SPARSE)
+    analysis_map_build_tile_table (map, classes, 1, &void_texel, &void_texel,
+                                   SPARSE_BORDER_TILES);
+
+  map->classes = analysis_map_store_grid (map, classes, 1, &void_texel);
+}
+
+static AnalysisMap *
+analysis_map_alloc (AnalysisMapMode mode,
+                    AnalysisMapLayout layout,
+                    int width,
+                    int height,
+                    const graphene_box_t *bounding_box)
 {
   AnalysisMap *map = g_new0 (AnalysisMap, 1);
 
   g_ref_count_init (&map->refcount);
 
-  map->surface = cairo_surface_reference (surface);
+  init_class_mask_table ();
+
+  map->mode = mode;
+  map->layout = layout;
+  map->width = width;
+  map->height = height;
+  map->padded_width = width + 2 * GUARD;
+  map->padded_height = height + 2 * GUARD;
+  map->tiles_x = (map->padded_width + TILE_MASK) >> TILE_SHIFT;
+  map->tiles_y = (map->padded_height + TILE_MASK) >> TILE_SHIFT;
   map->bounding_box = *bounding_box;
 
   graphene_box_get_min (bounding_box, &map->min);
@@ -29,51 +364,161 @@ analysis_map_new (cairo_surface_t *surface,
 }
 
 AnalysisMap *
-analysis_map_ref (AnalysisMap *map)
+analysis_map_new (cairo_surface_t *surface,
+                  const graphene_box_t *bounding_box,
+                  AnalysisMapMode mode,
+                  AnalysisMapLayout layout)
 {
-  g_ref_count_inc (&map->refcount);
+  AnalysisMap *map;
+
+  map = analysis_map_alloc (mode, layout,
+                            cairo_image_surface_get_width (surface),
+                            cairo_image_surface_get_height (surface),
+                            bounding_box);
+
+  cairo_surface_flush (surface);
+
+  switch (mode)
+    {
+    /* Decode once, the surface itself is not needed after this */
+    case ANALYSIS_MAP_HEIGHT:
+      analysis_map_decode_heights (map, surface);
+      break;
+    case ANALYSIS_MAP_COLLISION:
+      analysis_map_classify (map, surface);
+      break;
+    }
+
   return map;
 }
 
-void
-analysis_map_unref (AnalysisMap *map)
+/* Frees a grid, unless it points into the mapped cache file */
+static void
+analysis_map_free_grid (AnalysisMap *map,
+                        gpointer grid)
 {
-  if (g_ref_count_dec (&map->refcount))
+  if (map->mapped)
     {
-      cairo_surface_destroy (map->surface);
-      g_free (map);
+      const char *contents = g_mapped_file_get_contents (map->mapped);
+      gsize length = g_mapped_file_get_length (map->mapped);
+
+      if ((const char *)grid >= contents && (const char *)grid < contents + length)
+        return;
     }
+
+  g_free (grid);
 }
 
-static gboolean
-analysis_map_lookup_pixel (AnalysisMap *map,
-                           int x, int y,
-                           GdkRGBA *color)
+static void
+union_extents (GthreeObject *top,
+               const char *name,
+               graphene_box_t *box)
 {
-  if (x < 0 || y < 0 ||
-      x >= cairo_image_surface_get_width (map->surface) ||
-      x >= cairo_image_surface_get_height (map->surface))
+  g_autoptr(GList) objects = NULL;
+  GList *l;
+
+  objects = gthree_object_find_by_name (top, name);
+  for (l = objects; l != NULL; l = l->next)
     {
-      color->red = color->green = color->blue = 0.0;
-      color->alpha = 0.0;
-      return FALSE;
+      graphene_box_t extents;
+
+      gthree_object_get_mesh_extents (GTHREE_OBJECT (l->data), &extents);
+      graphene_box_union (box, &extents, box);
     }
+}
 
-  unsigned char *data = cairo_image_surface_get_data (map->surface);
-  int stride = cairo_image_surface_get_stride (map->surface);
-  guint32 pixel = *(guint32 *)(data + x * 4 + y * stride);
+/* The maps only need to cover the objects they are built from, not the
+ * whole scene, so that all texels are spent on the track */
+void
+analysis_map_get_track_extents (GthreeObject *top,
+                                graphene_box_t *box)
+{
+  graphene_box_init_from_box (box, graphene_box_empty ());
+  union_extents (top, "tracks", box);
+  union_extents (top, "bonus-base", box);
+}
 
-  int a = (pixel & 0xff000000) >> 24;
-  int r = (pixel & 0x00ff0000) >> 16;
-  int g = (pixel & 0x0000ff00) >> 8;
-  int b = (pixel & 0x000000ff);
+/* Changes how the heights are stored. 16-bit heights take half the
+ * memory, with steps of 1/65535 of the height of the bounding box. */
+void
+analysis_map_set_height_precision (AnalysisMap *map,
+                                   AnalysisMapPrecision precision)
+{
+  g_return_if_fail (map->mode == ANALYSIS_MAP_HEIGHT);
+
+  if (analysis_map_get_height_precision (map) == precision)
+    return;
+
+  switch (precision)
+    {
+    case ANALYSIS_MAP_PRECISION_FLOAT:
+      {
+        float *heights = analysis_map_new_linear_grid (map, sizeof (float));
+
+        for (int y = 0; y < map->height; y++)
+          for (int x = 0; x < map->width; x++)
+            heights[y * map->width + x] = analysis_map_lookup_height (map, x, y);
+
+        analysis_map_free_grid (map, map->heights16);
+        map->heights16 = NULL;
+        map->heights = analysis_map_store_grid (map, heights, sizeof (float), &map->max.y);
+      }
+      break;
+
+    case ANALYSIS_MAP_PRECISION_16BIT:
+      {
+        guint16 *heights = analysis_map_new_linear_grid (map, sizeof (guint16));
+        float range = map->max.y - map->min.y;
+        guint16 guard = 65535;
+
+        for (int y = 0; y < map->height; y++)
+          for (int x = 0; x < map->width; x++)
+            {
+              float h = analysis_map_lookup_height (map, x, y);
+
+              heights[y * map->width + x] =
+                CLAMP ((h - map->min.y) / range * 65535.0f + 0.5f, 0, 65535);
+            }
+
+        analysis_map_free_grid (map, map->heights);
+        map->heights = NULL;
+        map->heights16 = analysis_map_store_grid (map, heights, sizeof (guint16), &guard);
+        map->height16_scale = range / 65535.0f;
+      }
+      break;
+    }
+}
+
+AnalysisMapPrecision
+analysis_map_get_height_precision (AnalysisMap *map)
+{
+  if (map->heights16)
+    return ANALYSIS_MAP_PRECISION_16BIT;
+
+  return ANALYSIS_MAP_PRECISION_FLOAT;
+}
 
-  color->red = r / 255.0;
-  color->green = g / 255.0;
-  color->blue = b / 255.0;
-  color->alpha = a / 255.0;
+AnalysisMap *
+analysis_map_ref (AnalysisMap *map)
+{
+  g_ref_count_inc (&map->refcount);
+  return map;
+}
 
-  return TRUE;
+void
+analysis_map_unref (AnalysisMap *map)
+{
+  if (g_ref_count_dec (&map->refcount))
+    {
+      analysis_map_free_grid (map, map->heights);
+      analysis_map_free_grid (map, map->heights16);
+      analysis_map_free_grid (map, map->classes);
+      analysis_map_free_grid (map, map->distances);
+      analysis_map_free_grid (map, map->tile_table);
+      if (map->mapped)
+        g_mapped_file_unref (map->mapped);
+      g_free (map);
+    }
 }
 
 static float
@@ -86,10 +531,104 @@ decode_depth (GdkRGBA *color)
     color->blue  * (255.0 / 256.0)  / (256.0);
 }
 
+/* Kept in single precision so the batch kernels can match it exactly */
 static float
 lerp (float a, float b, float alpha)
 {
-  return a * alpha + b * (1.0-alpha);
+  return a * alpha + b * (1.0f - alpha);
+}
+
+/* Converts world x,z to (fractional) texel coordinates */
+static void
+world_to_texel (AnalysisMap *map,
+                float x,
+                float z,
+                float *tx,
+                float *tz)
+{
+  *tx = map->width * (x - map->min.x) / (map->max.x - map->min.x);
+  *tz = map->height * (map->max.z - z) / (map->max.z - map->min.z);
+
+  /* y flip */
+  *tz = map->height - *tz;
+}
+
+/* The sampler
+ *
+ * Texel coordinates are clamped to the guard border before they are
+ * converted to integers, so every tap lands on the grid or the border
+ * and reads what is stored for outside the map there. No tap needs a
+ * bounds check, and coordinates far outside the map (or NaN, which
+ * clamps to the far edge) can't read outside the grids. */
+
+static inline float
+clamp_texel_coord (float v, int size)
+{
+  /* In this order NaN ends up as size */
+  return MAX (-1.0f, MIN (v, (float)size));
+}
+
+typedef struct {
+  int x0, x1, y0, y1;
+  /* Weights of the x0 and y0 taps */
+  float ax, ay;
+} BilinearTaps;
+
+/* Same tap placement as the original lookups: the floor and ceil of
+ * the coordinate, which are the same tap on texel centers */
+static inline void
+bilinear_taps (AnalysisMap *map,
+               float x,
+               float y,
+               BilinearTaps *taps)
+{
+  float x0, x1, y0, y1;
+
+  x = clamp_texel_coord (x, map->width);
+  y = clamp_texel_coord (y, map->height);
+
+  x0 = floorf (x);
+  x1 = ceilf (x);
+  y0 = floorf (y);
+  y1 = ceilf (y);
+
+  taps->x0 = x0;
+  taps->x1 = x1;
+  taps->y0 = y0;
+  taps->y1 = y1;
+  taps->ax = x1 - x;
+  taps->ay = y1 - y;
+}
+
+/* x,y must be within the guard border */
+static float
+analysis_map_lookup_height (AnalysisMap *map,
+                            int x, int y)
+{
+  if (map->heights16)
+    return HEIGHT16_TO_FLOAT (map, map->heights16[texel_index (map, x, y)]);
+
+  return map->heights[texel_index (map, x, y)];
+}
+
+static float
+analysis_map_lookup_height_bilinear (AnalysisMap *map,
+                                     float x,
+                                     float z)
+{
+  BilinearTaps t;
+  float sum1, sum2;
+
+  bilinear_taps (map, x, z, &t);
+
+  sum1 = lerp (analysis_map_lookup_height (map, t.x0, t.y0),
+               analysis_map_lookup_height (map, t.x1, t.y0),
+               t.ax);
+  sum2 = lerp (analysis_map_lookup_height (map, t.x0, t.y1),
+               analysis_map_lookup_height (map, t.x1, t.y1),
+               t.ax);
+
+  return lerp (sum1, sum2, t.ay);
 }
 
 /* Returns height (==y) at x,z */
@@ -98,89 +637,875 @@ analysis_map_lookup_depthmapped (AnalysisMap *map,
                                  float x,
                                  float z)
 {
-  float sum1, sum2, depth;
-  GdkRGBA c1, c2;
+  g_return_val_if_fail (map->heights != NULL || map->heights16 != NULL, 0.0);
 
-  x = cairo_image_surface_get_width (map->surface) * (x - map->min.x) / (map->max.x - map->min.x);
-  z = cairo_image_surface_get_height (map->surface) * (map->max.z - z) / (map->max.z - map->min.z);
+  world_to_texel (map, x, z, &x, &z);
 
-  /* y flip */
-  z = cairo_image_surface_get_height (map->surface) - z;
+  return analysis_map_lookup_height_bilinear (map, x, z);
+}
+
+/* x,y must be within the guard border */
+static guint8
+analysis_map_lookup_texel (AnalysisMap *map,
+                           int x, int y)
+{
+  return map->classes[texel_index (map, x, y)];
+}
+
+static guint8
+analysis_map_lookup_texel_nearest (AnalysisMap *map,
+                                   float x,
+                                   float z)
+{
+  world_to_texel (map, x, z, &x, &z);
+
+  x = clamp_texel_coord (x, map->width);
+  z = clamp_texel_coord (z, map->height);
+
+  /* Rounding can only move up to the far guard texel */
+  return analysis_map_lookup_texel (map,
+                                    MIN ((int)floorf (x + 0.5f), map->width),
+                                    MIN ((int)floorf (z + 0.5f), map->height));
+}
+
+/* Returns the class of the texel nearest to x,z */
+AnalysisClass
+analysis_map_lookup_class (AnalysisMap *map,
+                           float x,
+                           float z)
+{
+  g_return_val_if_fail (map->classes != NULL, ANALYSIS_CLASS_VOID);
+
+  return TEXEL_CLASS (analysis_map_lookup_texel_nearest (map, x, z));
+}
+
+/* Returns ANALYSIS_CLASS_MASK() of the class at x,z, for testing
+ * against a set of classes like ANALYSIS_MASK_RIDEABLE */
+guint32
+analysis_map_lookup_class_mask (AnalysisMap *map,
+                                float x,
+                                float z)
+{
+  g_return_val_if_fail (map->classes != NULL, 0);
+
+  return class_mask_table[analysis_map_lookup_texel_nearest (map, x, z)];
+}
+
+/* analysis_map_lookup_class() at n points, so callers with many to look
+ * up at once go through the map in one pass */
+void
+analysis_map_lookup_class_batch (AnalysisMap *map,
+                                 const float *x,
+                                 const float *z,
+                                 AnalysisClass *classes,
+                                 int n)
+{
+  g_return_if_fail (map->classes != NULL);
 
-  /* Nearest */
-  if (0)
+  for (int i = 0; i < n; i++)
+    classes[i] = TEXEL_CLASS (analysis_map_lookup_texel_nearest (map, x[i], z[i]));
+}
+
+static inline float
+trace_texel_coord (float v, int size)
+{
+  return MAX (-size - 1.0f, MIN (v + 0.5f, 2.0f * size + 1.0f));
+}
+
+/* Walks the texels the segment from x0,z0 to x1,z1 passes through, in
+ * order, as analysis_map_lookup_class() sees them, and stops at the
+ * first whose class isn't in pass_mask. Its class is stored in *class,
+ * and in *fraction how far along the segment it starts, from 0 to 1.
+ *
+ * The texels the ends are in are left out, they are what
+ * analysis_map_lookup_class() gives there. So this finds what a single
+ * lookup at x1,z1 would step over, like a thin wall crossed in one go.
+ * Returns FALSE if there's nothing in between to stop at. */
+gboolean
+analysis_map_trace_class (AnalysisMap *map,
+                          float x0,
+                          float z0,
+                          float x1,
+                          float z1,
+                          guint32 pass_mask,
+                          AnalysisClass *class,
+                          float *fraction)
+{
+  float u0, v0, u1, v1, du, dv;
+  float t_max_x, t_max_y, t_delta_x, t_delta_y;
+  int x, y, end_x, end_y, step_x, step_y, n;
+
+  g_return_val_if_fail (map->classes != NULL, FALSE);
+
+  world_to_texel (map, x0, z0, &u0, &v0);
+  world_to_texel (map, x1, z1, &u1, &v1);
+
+  /* Texel x,y covers x-0.5 to x+0.5 for the nearest lookups, so in
+   * these coordinates it is the cell from x to x+1. The ends aren't
+   * clamped to the guard border like in the sampler, that would bend
+   * the segment, just kept to a map's size around it (and NaN to its
+   * far side) so the walk stays short. Off the map the cells read the
+   * guard border, like the lookups do. */
+  u0 = trace_texel_coord (u0, map->width);
+  v0 = trace_texel_coord (v0, map->height);
+  u1 = trace_texel_coord (u1, map->width);
+  v1 = trace_texel_coord (v1, map->height);
+
+  x = floorf (u0);
+  y = floorf (v0);
+  end_x = floorf (u1);
+  end_y = floorf (v1);
+
+  /* Every step goes to the next texel over in x or y, so this many get
+   * to the end */
+  n = ABS (end_x - x) + ABS (end_y - y);
+  if (n < 2)
+    return FALSE;
+
+  du = u1 - u0;
+  dv = v1 - v0;
+  step_x = du > 0 ? 1 : -1;
+  step_y = dv > 0 ? 1 : -1;
+
+  /* How far along the segment the next x and y texel edges are, and
+   * the distance between them */
+  t_delta_x = du != 0 ? 1.0f / fabsf (du) : G_MAXFLOAT;
+  t_delta_y = dv != 0 ? 1.0f / fabsf (dv) : G_MAXFLOAT;
+  t_max_x = du > 0 ? (x + 1 - u0) * t_delta_x : du < 0 ? (u0 - x) * t_delta_x : G_MAXFLOAT;
+  t_max_y = dv > 0 ? (y + 1 - v0) * t_delta_y : dv < 0 ? (v0 - y) * t_delta_y : G_MAXFLOAT;
+
+  /* The last step is onto the end texel */
+  for (int i = 0; i < n - 1; i++)
     {
-      x = floor (x + 0.5);
-      z = floor (z + 0.5);
-      analysis_map_lookup_pixel (map, x, z, &c1);
-      depth = decode_depth (&c1);
+      float t;
+      guint8 texel;
+
+      /* Once one of x or y is at the end, only the other can move, so
+       * rounding can't step past the end */
+      if (y == end_y || (x != end_x && t_max_x < t_max_y))
+        {
+          t = t_max_x;
+          x += step_x;
+          t_max_x += t_delta_x;
+        }
+      else
+        {
+          t = t_max_y;
+          y += step_y;
+          t_max_y += t_delta_y;
+        }
 
-      return map->max.y - depth * (map->max.y - map->min.y);
+      texel = analysis_map_lookup_texel (map,
+                                         CLAMP (x, -1, map->width),
+                                         CLAMP (y, -1, map->height));
+      if ((class_mask_table[texel] & pass_mask) == 0)
+        {
+          *class = TEXEL_CLASS (texel);
+          *fraction = CLAMP (t, 0.0f, 1.0f);
+          return TRUE;
+        }
     }
 
-  /* Bilinear */
-  analysis_map_lookup_pixel (map, floor (x), floor (z), &c1);
-  analysis_map_lookup_pixel (map, ceil (x), floor (z), &c2);
-  sum1 = lerp (decode_depth (&c1), decode_depth (&c2), (ceil (x) - x));
+  return FALSE;
+}
 
-  analysis_map_lookup_pixel (map, floor (x), ceil (z), &c1);
-  analysis_map_lookup_pixel (map, ceil (x), ceil (z), &c2);
-  sum2 = lerp (decode_depth (&c1),
-               decode_depth (&c2),
-               (ceil (x) - x));
+static float
+analysis_map_lookup_coverage_texel (AnalysisMap *map,
+                                    int x, int y)
+{
+  return TEXEL_COVERAGE (analysis_map_lookup_texel (map, x, y)) / 15.0f;
+}
 
-  depth = lerp (sum1, sum2, (ceil (z) - z));
-  return map->max.y - depth * (map->max.y - map->min.y);
+/* Returns the bilinear filtered track coverage at x,z, 0 is off track
+ * and 1 fully on it */
+float
+analysis_map_lookup_coverage (AnalysisMap *map,
+                              float x,
+                              float z)
+{
+  BilinearTaps t;
+  float sum1, sum2;
+
+  g_return_val_if_fail (map->classes != NULL, 0.0);
+
+  world_to_texel (map, x, z, &x, &z);
+  bilinear_taps (map, x, z, &t);
+
+  sum1 = lerp (analysis_map_lookup_coverage_texel (map, t.x0, t.y0),
+               analysis_map_lookup_coverage_texel (map, t.x1, t.y0),
+               t.ax);
+  sum2 = lerp (analysis_map_lookup_coverage_texel (map, t.x0, t.y1),
+               analysis_map_lookup_coverage_texel (map, t.x1, t.y1),
+               t.ax);
+
+  return lerp (sum1, sum2, t.ay);
 }
 
+/* Builds a signed distance field for the edge of the area covered by
+ * the classes in inside_mask. It is positive inside the area and
+ * negative outside, so for ANALYSIS_MASK_RIDEABLE its gradient points
+ * away from the walls. */
 void
-analysis_map_lookup_rgba_nearest (AnalysisMap *map,
-                                  float x,
-                                  float z,
-                                  GdkRGBA *color)
+analysis_map_build_distance_field (AnalysisMap *map,
+                                   guint32 inside_mask)
 {
-  x = cairo_image_surface_get_width (map->surface) * (x - map->min.x) / (map->max.x - map->min.x);
-  z = cairo_image_surface_get_height (map->surface) * (map->max.z - z) / (map->max.z - map->min.z);
+  int n = map->width * map->height;
+  float spacing_x = (map->max.x - map->min.x) / map->width;
+  float spacing_z = (map->max.z - map->min.z) / map->height;
+  int n_threads = g_get_num_processors ();
+  float *inside, *outside;
 
-  /* y flip */
-  z = cairo_image_surface_get_height (map->surface) - z;
+  g_return_if_fail (map->classes != NULL);
+
+  inside = g_new (float, n);
+  outside = g_new (float, n);
+
+  /* Distance to the nearest outside texel, and to the nearest inside one */
+  for (int y = 0; y < map->height; y++)
+    for (int x = 0; x < map->width; x++)
+      {
+        guint8 texel = map->classes[texel_index (map, x, y)];
+        gboolean is_inside = (class_mask_table[texel] & inside_mask) != 0;
+        int i = y * map->width + x;
+
+        inside[i] = is_inside ? DISTANCE_TRANSFORM_INF : 0;
+        outside[i] = is_inside ? 0 : DISTANCE_TRANSFORM_INF;
+      }
+
+  distance_transform (inside, map->width, map->height,
+                      spacing_x, spacing_z, n_threads);
+  distance_transform (outside, map->width, map->height,
+                      spacing_x, spacing_z, n_threads);
+
+  for (int i = 0; i < n; i++)
+    inside[i] -= outside[i];
+
+  /* Everything in the void tile is at least this far outside, clamp to
+   * it so the void tile holds a single value */
+  if (map->layout == ANALYSIS_MAP_LAYOUT_SPARSE)
+    {
+      float border = SPARSE_BORDER_TILES * TILE_SIZE * MIN (spacing_x, spacing_z);
+
+      for (int i = 0; i < n; i++)
+        inside[i] = MAX (inside[i], -border);
+    }
+
+  g_free (outside);
+
+  analysis_map_free_grid (map, map->distances);
+  /* Outside the map is as far off track as the edge */
+  map->distances = analysis_map_store_grid (map, inside, sizeof (float), NULL);
+}
+
+/* x,y must be within the guard border */
+static float
+analysis_map_lookup_distance_texel (AnalysisMap *map,
+                                    int x, int y)
+{
+  return map->distances[texel_index (map, x, y)];
+}
+
+/* Returns the bilinear filtered signed distance at x,z, and its gradient
+ * in world x,z in gradient (if not NULL). */
+float
+analysis_map_lookup_distance (AnalysisMap *map,
+                              float x,
+                              float z,
+                              graphene_vec2_t *gradient)
+{
+  float x0, x1, z0, z1;
+  float d00, d10, d01, d11;
+  float sum1, sum2;
+
+  g_return_val_if_fail (map->distances != NULL, 0.0);
+
+  world_to_texel (map, x, z, &x, &z);
+
+  /* The taps are a texel apart here, so the gradient is never lost on
+   * texel centers. The guard border repeats the edge, so stopping a
+   * texel short of the far guard gives the same values. */
+  x = clamp_texel_coord (x, map->width - 1);
+  z = clamp_texel_coord (z, map->height - 1);
+
+  x0 = floorf (x);
+  x1 = x0 + 1;
+  z0 = floorf (z);
+  z1 = z0 + 1;
+
+  d00 = analysis_map_lookup_distance_texel (map, x0, z0);
+  d10 = analysis_map_lookup_distance_texel (map, x1, z0);
+  d01 = analysis_map_lookup_distance_texel (map, x0, z1);
+  d11 = analysis_map_lookup_distance_texel (map, x1, z1);
+
+  sum1 = lerp (d00, d10, x1 - x);
+  sum2 = lerp (d01, d11, x1 - x);
+
+  if (gradient)
+    {
+      /* Derivative of the bilinear patch, texel rows grow with world z */
+      float dx = lerp (d10 - d00, d11 - d01, z1 - z);
+      float dz = sum2 - sum1;
+
+      graphene_vec2_init (gradient,
+                          dx * map->width / (map->max.x - map->min.x),
+                          dz * map->height / (map->max.z - map->min.z));
+    }
+
+  return lerp (sum1, sum2, z1 - z);
+}
+
+/* Cache files
+ *
+ * A cache file holds the decoded grids of one map, in the layout of the
+ * map and in native byte order, behind a CacheHeader. Grids start at
+ * CACHE_ALIGNMENT aligned offsets so they can be used straight from a
+ * mapping of the file. The key is chosen by the caller and identifies
+ * what the map was built from, a file with another key is rejected. */
+
+#define CACHE_MAGIC "HEXGLMAP"
+#define CACHE_VERSION 4
+#define CACHE_ALIGNMENT 64
+#define CACHE_KEY_SIZE 72
+
+enum {
+  CACHE_GRID_HEIGHTS,
+  CACHE_GRID_HEIGHTS16,
+  CACHE_GRID_CLASSES,
+  CACHE_GRID_DISTANCES,
+  CACHE_GRID_TILE_TABLE,
+  N_CACHE_GRIDS
+};
+
+typedef struct {
+  char magic[8];
+  guint32 version;
+  guint32 header_size;
+  guint32 mode;
+  guint32 layout;
+  gint32 width;
+  gint32 height;
+  gint32 n_tiles;
+  float min[3];
+  float max[3];
+  char key[CACHE_KEY_SIZE];
+  guint64 grid_offset[N_CACHE_GRIDS];
+} CacheHeader;
+
+/* Returns where a grid is stored in the map, and its size in bytes */
+static gpointer *
+analysis_map_get_cache_grid (AnalysisMap *map,
+                             int grid,
+                             gsize *size)
+{
+  switch (grid)
+    {
+    case CACHE_GRID_HEIGHTS:
+      *size = analysis_map_get_grid_size (map, sizeof (float));
+      return (gpointer *)&map->heights;
+    case CACHE_GRID_HEIGHTS16:
+      *size = analysis_map_get_grid_size (map, sizeof (guint16));
+      return (gpointer *)&map->heights16;
+    case CACHE_GRID_CLASSES:
+      *size = analysis_map_get_grid_size (map, 1);
+      return (gpointer *)&map->classes;
+    case CACHE_GRID_DISTANCES:
+      *size = analysis_map_get_grid_size (map, sizeof (float));
+      return (gpointer *)&map->distances;
+    case CACHE_GRID_TILE_TABLE:
+      *size = (gsize)map->tiles_x * map->tiles_y * sizeof (guint32);
+      return (gpointer *)&map->tile_table;
+    }
+
+  g_assert_not_reached ();
+}
+
+/* Returns a key for maps built from the model at model_path, or NULL
+ * if it can't be read. The resolution and precision are recorded in the
+ * file itself, so maps baked with other settings are still accepted. */
+char *
+analysis_map_make_key (const char *model_path)
+{
+  g_autoptr(GMappedFile) model = NULL;
+
+  model = g_mapped_file_new (model_path, FALSE, NULL);
+  if (model == NULL)
+    return NULL;
+
+  return g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                      (const guchar *)g_mapped_file_get_contents (model),
+                                      g_mapped_file_get_length (model));
+}
+
+gboolean
+analysis_map_save (AnalysisMap *map,
+                   const char *path,
+                   const char *key,
+                   GError **error)
+{
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  g_autoptr(GFile) parent = g_file_get_parent (file);
+  g_autoptr(GFileOutputStream) out = NULL;
+  g_autoptr(GError) local_error = NULL;
+  static const guint8 padding[CACHE_ALIGNMENT] = { 0 };
+  CacheHeader header = { { 0 } };
+  guint64 offset;
+
+  g_return_val_if_fail (strlen (key) < CACHE_KEY_SIZE, FALSE);
+
+  memcpy (header.magic, CACHE_MAGIC, sizeof (header.magic));
+  header.version = CACHE_VERSION;
+  header.header_size = sizeof (CacheHeader);
+  header.mode = map->mode;
+  header.layout = map->layout;
+  header.width = map->width;
+  header.height = map->height;
+  header.n_tiles = map->n_tiles;
+  header.min[0] = map->min.x;
+  header.min[1] = map->min.y;
+  header.min[2] = map->min.z;
+  header.max[0] = map->max.x;
+  header.max[1] = map->max.y;
+  header.max[2] = map->max.z;
+  strcpy (header.key, key);
+
+  offset = sizeof (CacheHeader);
+  for (int i = 0; i < N_CACHE_GRIDS; i++)
+    {
+      gsize size;
+
+      if (*analysis_map_get_cache_grid (map, i, &size) == NULL)
+        continue;
+
+      offset = (offset + CACHE_ALIGNMENT - 1) & ~(guint64)(CACHE_ALIGNMENT - 1);
+      header.grid_offset[i] = offset;
+      offset += size;
+    }
+
+  if (!g_file_make_directory_with_parents (parent, NULL, &local_error) &&
+      !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  /* Written to a temporary and renamed, so readers never see a partial file */
+  out = g_file_replace (file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, error);
+  if (out == NULL)
+    return FALSE;
+
+  if (!g_output_stream_write_all (G_OUTPUT_STREAM (out), &header, sizeof (header), NULL, NULL, error))
+    return FALSE;
+
+  offset = sizeof (CacheHeader);
+  for (int i = 0; i < N_CACHE_GRIDS; i++)
+    {
+      gsize size;
+      gpointer grid = *analysis_map_get_cache_grid (map, i, &size);
+
+      if (grid == NULL)
+        continue;
 
-  analysis_map_lookup_pixel (map, floor (x + 0.5), floor (z + 0.5), color);
+      if (!g_output_stream_write_all (G_OUTPUT_STREAM (out), padding,
+                                      header.grid_offset[i] - offset, NULL, NULL, error) ||
+          !g_output_stream_write_all (G_OUTPUT_STREAM (out), grid, size, NULL, NULL, error))
+        return FALSE;
+
+      offset = header.grid_offset[i] + size;
+    }
+
+  return g_output_stream_close (G_OUTPUT_STREAM (out), NULL, error);
 }
 
+/* Maps a file written by analysis_map_save(), the grids are used in
+ * place and are only paged in as they are touched */
+AnalysisMap *
+analysis_map_new_from_file (const char *path,
+                            const char *key,
+                            GError **error)
+{
+  g_autoptr(GMappedFile) mapped = NULL;
+  const CacheHeader *header;
+  const char *contents;
+  gsize length;
+  graphene_box_t bounding_box;
+  graphene_point3d_t min, max;
+  AnalysisMap *map;
+
+  mapped = g_mapped_file_new (path, FALSE, error);
+  if (mapped == NULL)
+    return NULL;
+
+  contents = g_mapped_file_get_contents (mapped);
+  length = g_mapped_file_get_length (mapped);
+  header = (const CacheHeader *)contents;
+
+  if (length < sizeof (CacheHeader) ||
+      memcmp (header->magic, CACHE_MAGIC, sizeof (header->magic)) != 0 ||
+      header->version != CACHE_VERSION ||
+      header->header_size != sizeof (CacheHeader) ||
+      header->mode > ANALYSIS_MAP_COLLISION ||
+      header->layout > ANALYSIS_MAP_LAYOUT_SPARSE ||
+      header->width <= 0 || header->height <= 0 ||
+      (header->layout == ANALYSIS_MAP_LAYOUT_SPARSE && header->n_tiles <= 0))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s is not a valid analysis map cache", path);
+      return NULL;
+    }
+
+  if (strncmp (header->key, key, CACHE_KEY_SIZE) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s is out of date", path);
+      return NULL;
+    }
+
+  graphene_point3d_init (&min, header->min[0], header->min[1], header->min[2]);
+  graphene_point3d_init (&max, header->max[0], header->max[1], header->max[2]);
+  graphene_box_init (&bounding_box, &min, &max);
+
+  map = analysis_map_alloc (header->mode, header->layout,
+                            header->width, header->height,
+                            &bounding_box);
+  map->n_tiles = header->n_tiles;
+  map->mapped = g_mapped_file_ref (mapped);
+
+  for (int i = 0; i < N_CACHE_GRIDS; i++)
+    {
+      gsize size;
+      gpointer *grid = analysis_map_get_cache_grid (map, i, &size);
+      guint64 offset = header->grid_offset[i];
+
+      if (offset == 0)
+        continue;
+
+      if (offset % CACHE_ALIGNMENT != 0 ||
+          offset > length ||
+          length - offset < size)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "%s is truncated", path);
+          analysis_map_unref (map);
+          return NULL;
+        }
+
+      *grid = (gpointer)(contents + offset);
+    }
+
+  map->height16_scale = (map->max.y - map->min.y) / 65535.0f;
+
+  if ((map->mode == ANALYSIS_MAP_HEIGHT && map->heights == NULL && map->heights16 == NULL) ||
+      (map->mode == ANALYSIS_MAP_COLLISION && map->classes == NULL) ||
+      (map->layout == ANALYSIS_MAP_LAYOUT_SPARSE && map->tile_table == NULL))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s has no data", path);
+      analysis_map_unref (map);
+      return NULL;
+    }
+
+  /* Out of range tiles would make lookups read outside the grids */
+  for (int i = 0; map->tile_table && i < map->tiles_x * map->tiles_y; i++)
+    if (map->tile_table[i] >= (guint32)map->n_tiles)
+      {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                     "%s has an invalid tile table", path);
+        analysis_map_unref (map);
+        return NULL;
+      }
+
+  return map;
+}
+
+/* Returns the bytes used by the grids of the map, and in dense_size
+ * what they would take in the tiled layout */
+gsize
+analysis_map_get_memory_size (AnalysisMap *map,
+                              gsize *dense_size)
+{
+  gsize size = 0;
+
+  if (dense_size)
+    *dense_size = 0;
+
+  for (int i = 0; i < N_CACHE_GRIDS; i++)
+    {
+      gsize grid_size;
+
+      if (*analysis_map_get_cache_grid (map, i, &grid_size) == NULL)
+        continue;
+
+      size += grid_size;
+
+      if (dense_size && i != CACHE_GRID_TILE_TABLE)
+        {
+          if (map->layout == ANALYSIS_MAP_LAYOUT_SPARSE)
+            *dense_size += grid_size / map->n_tiles * map->tiles_x * map->tiles_y;
+          else
+            *dense_size += grid_size;
+        }
+    }
+
+  return size;
+}
+
+gboolean
+analysis_map_has_distance_field (AnalysisMap *map)
+{
+  return map->distances != NULL;
+}
+
+/* Batched lookups
+ *
+ * These take structure-of-arrays inputs and give the same results as
+ * calling the scalar lookups once per point. Heights are done by SSE2 or
+ * AVX2 kernels when the cpu supports them. */
+
+typedef void (*HeightBatchFunc) (AnalysisMap *map,
+                                 const float *x,
+                                 const float *z,
+                                 float *heights,
+                                 int n);
+
 static void
-lerp_color (const GdkRGBA *a, const GdkRGBA *b, float alpha, GdkRGBA *dest)
+height_batch_scalar (AnalysisMap *map,
+                     const float *x,
+                     const float *z,
+                     float *heights,
+                     int n)
 {
-  dest->red = lerp (a->red, b->red, alpha);
-  dest->green = lerp (a->green, b->green, alpha);
-  dest->blue = lerp (a->blue, b->blue, alpha);
-  dest->alpha = lerp (a->alpha, b->alpha, alpha);
+  for (int i = 0; i < n; i++)
+    {
+      float tx, tz;
+
+      world_to_texel (map, x[i], z[i], &tx, &tz);
+      heights[i] = analysis_map_lookup_height_bilinear (map, tx, tz);
+    }
 }
 
-void
-analysis_map_lookup_rgba_bilinear (AnalysisMap *map,
-                                   float x,
-                                   float z,
-                                   GdkRGBA *color)
+#ifdef HAVE_X86_KERNELS
+
+/* floorf() for SSE2, which lacks roundps. Values too large for an int
+ * are already integral and are passed through unchanged. */
+__attribute__((target("sse2"))) static inline __m128
+floor_sse2 (__m128 v)
 {
-  GdkRGBA sum1, sum2;
-  GdkRGBA c1, c2;
+  const __m128 big = _mm_set1_ps (8388608.0f);
+  const __m128 abs_mask = _mm_castsi128_ps (_mm_set1_epi32 (0x7fffffff));
+  __m128 t = _mm_cvtepi32_ps (_mm_cvttps_epi32 (v));
+  __m128 f = _mm_sub_ps (t, _mm_and_ps (_mm_cmpgt_ps (t, v), _mm_set1_ps (1.0f)));
+  __m128 is_big = _mm_cmpge_ps (_mm_and_ps (v, abs_mask), big);
 
-  x = cairo_image_surface_get_width (map->surface) * (x - map->min.x) / (map->max.x - map->min.x);
-  z = cairo_image_surface_get_height (map->surface) * (map->max.z - z) / (map->max.z - map->min.z);
+  return _mm_or_ps (_mm_and_ps (is_big, v), _mm_andnot_ps (is_big, f));
+}
 
-  /* y flip */
-  z = cairo_image_surface_get_height (map->surface) - z;
+__attribute__((target("sse2"))) static inline __m128
+ceil_sse2 (__m128 v)
+{
+  const __m128 sign = _mm_set1_ps (-0.0f);
 
+  return _mm_xor_ps (floor_sse2 (_mm_xor_ps (v, sign)), sign);
+}
 
-  /* Bilinear */
-  analysis_map_lookup_pixel (map, floor (x), floor (z), &c1);
-  analysis_map_lookup_pixel (map, ceil (x), floor (z), &c2);
-  lerp_color (&c1, &c2, (ceil (x) - x), &sum1);
+__attribute__((target("sse2"))) static inline __m128
+lerp_sse2 (__m128 a, __m128 b, __m128 alpha)
+{
+  return _mm_add_ps (_mm_mul_ps (a, alpha),
+                     _mm_mul_ps (b, _mm_sub_ps (_mm_set1_ps (1.0f), alpha)));
+}
 
-  analysis_map_lookup_pixel (map, floor (x), ceil (z), &c1);
-  analysis_map_lookup_pixel (map, ceil (x), ceil (z), &c2);
-  lerp_color (&c1, &c2, (ceil (x) - x), &sum2);
+/* SSE2 has no gather, so the four taps are fetched through the scalar
+ * accessor, the coordinate math and filtering is vectorized. The taps
+ * are already clamped to the guard border. */
+__attribute__((target("sse2"))) static inline __m128
+fetch_sse2 (AnalysisMap *map, __m128 x, __m128 z)
+{
+  int ix[4], iz[4];
+  float h[4];
+
+  _mm_storeu_si128 ((__m128i *)ix, _mm_cvttps_epi32 (x));
+  _mm_storeu_si128 ((__m128i *)iz, _mm_cvttps_epi32 (z));
+  for (int i = 0; i < 4; i++)
+    h[i] = analysis_map_lookup_height (map, ix[i], iz[i]);
+
+  return _mm_loadu_ps (h);
+}
+
+__attribute__((target("sse2"))) static void
+height_batch_sse2 (AnalysisMap *map,
+                   const float *x,
+                   const float *z,
+                   float *heights,
+                   int n)
+{
+  const __m128 width = _mm_set1_ps (map->width);
+  const __m128 height = _mm_set1_ps (map->height);
+  const __m128 min_x = _mm_set1_ps (map->min.x);
+  const __m128 max_z = _mm_set1_ps (map->max.z);
+  const __m128 size_x = _mm_set1_ps (map->max.x - map->min.x);
+  const __m128 size_z = _mm_set1_ps (map->max.z - map->min.z);
+  int i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      __m128 tx, tz, x0, x1, z0, z1, ax, sum1, sum2;
+
+      tx = _mm_div_ps (_mm_mul_ps (width, _mm_sub_ps (_mm_loadu_ps (x + i), min_x)), size_x);
+      tz = _mm_div_ps (_mm_mul_ps (height, _mm_sub_ps (max_z, _mm_loadu_ps (z + i))), size_z);
+      tz = _mm_sub_ps (height, tz);
+
+      /* clamp_texel_coord() */
+      tx = _mm_max_ps (_mm_set1_ps (-1.0f), _mm_min_ps (tx, width));
+      tz = _mm_max_ps (_mm_set1_ps (-1.0f), _mm_min_ps (tz, height));
+
+      x0 = floor_sse2 (tx);
+      x1 = ceil_sse2 (tx);
+      z0 = floor_sse2 (tz);
+      z1 = ceil_sse2 (tz);
+      ax = _mm_sub_ps (x1, tx);
+
+      sum1 = lerp_sse2 (fetch_sse2 (map, x0, z0), fetch_sse2 (map, x1, z0), ax);
+      sum2 = lerp_sse2 (fetch_sse2 (map, x0, z1), fetch_sse2 (map, x1, z1), ax);
+      _mm_storeu_ps (heights + i, lerp_sse2 (sum1, sum2, _mm_sub_ps (z1, tz)));
+    }
+
+  height_batch_scalar (map, x + i, z + i, heights + i, n - i);
+}
+
+__attribute__((target("avx2"))) static inline __m256
+lerp_avx2 (__m256 a, __m256 b, __m256 alpha)
+{
+  return _mm256_add_ps (_mm256_mul_ps (a, alpha),
+                        _mm256_mul_ps (b, _mm256_sub_ps (_mm256_set1_ps (1.0f), alpha)));
+}
+
+/* Gather of heights, the taps are already clamped to the guard border */
+__attribute__((target("avx2"))) static inline __m256
+fetch_avx2 (AnalysisMap *map, __m256 x, __m256 z)
+{
+  __m256i ix = _mm256_add_epi32 (_mm256_cvttps_epi32 (x), _mm256_set1_epi32 (GUARD));
+  __m256i iz = _mm256_add_epi32 (_mm256_cvttps_epi32 (z), _mm256_set1_epi32 (GUARD));
+  __m256i index;
+
+  if (map->layout != ANALYSIS_MAP_LAYOUT_LINEAR)
+    {
+      const __m256i mask = _mm256_set1_epi32 (TILE_MASK);
+      __m256i tile;
+
+      tile = _mm256_add_epi32 (_mm256_mullo_epi32 (_mm256_srli_epi32 (iz, TILE_SHIFT),
+                                                   _mm256_set1_epi32 (map->tiles_x)),
+                               _mm256_srli_epi32 (ix, TILE_SHIFT));
+      if (map->layout == ANALYSIS_MAP_LAYOUT_SPARSE)
+        tile = _mm256_i32gather_epi32 ((const int *)map->tile_table, tile, 4);
+      index = _mm256_add_epi32 (_mm256_slli_epi32 (tile, 2 * TILE_SHIFT),
+                                _mm256_add_epi32 (_mm256_slli_epi32 (_mm256_and_si256 (iz, mask), TILE_SHIFT),
+                                                  _mm256_and_si256 (ix, mask)));
+    }
+  else
+    index = _mm256_add_epi32 (_mm256_mullo_epi32 (iz, _mm256_set1_epi32 (map->padded_width)), ix);
+
+  /* 16-bit heights are gathered as the 32-bit word holding them, grids
+   * are padded to whole words so this stays inside */
+  if (map->heights16)
+    {
+      __m256i words, h;
+
+      words = _mm256_i32gather_epi32 ((const int *)map->heights16,
+                                      _mm256_srli_epi32 (index, 1), 4);
+      h = _mm256_and_si256 (_mm256_srlv_epi32 (words,
+                                               _mm256_slli_epi32 (_mm256_and_si256 (index, _mm256_set1_epi32 (1)), 4)),
+                            _mm256_set1_epi32 (0xffff));
+
+      return _mm256_add_ps (_mm256_set1_ps (map->min.y),
+                            _mm256_mul_ps (_mm256_cvtepi32_ps (h),
+                                           _mm256_set1_ps (map->height16_scale)));
+    }
+
+  return _mm256_i32gather_ps (map->heights, index, 4);
+}
+
+__attribute__((target("avx2"))) static void
+height_batch_avx2 (AnalysisMap *map,
+                   const float *x,
+                   const float *z,
+                   float *heights,
+                   int n)
+{
+  const __m256 width = _mm256_set1_ps (map->width);
+  const __m256 height = _mm256_set1_ps (map->height);
+  const __m256 min_x = _mm256_set1_ps (map->min.x);
+  const __m256 max_z = _mm256_set1_ps (map->max.z);
+  const __m256 size_x = _mm256_set1_ps (map->max.x - map->min.x);
+  const __m256 size_z = _mm256_set1_ps (map->max.z - map->min.z);
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      __m256 tx, tz, x0, x1, z0, z1, ax, sum1, sum2;
+
+      tx = _mm256_div_ps (_mm256_mul_ps (width, _mm256_sub_ps (_mm256_loadu_ps (x + i), min_x)), size_x);
+      tz = _mm256_div_ps (_mm256_mul_ps (height, _mm256_sub_ps (max_z, _mm256_loadu_ps (z + i))), size_z);
+      tz = _mm256_sub_ps (height, tz);
+
+      /* clamp_texel_coord() */
+      tx = _mm256_max_ps (_mm256_set1_ps (-1.0f), _mm256_min_ps (tx, width));
+      tz = _mm256_max_ps (_mm256_set1_ps (-1.0f), _mm256_min_ps (tz, height));
+
+      x0 = _mm256_floor_ps (tx);
+      x1 = _mm256_ceil_ps (tx);
+      z0 = _mm256_floor_ps (tz);
+      z1 = _mm256_ceil_ps (tz);
+      ax = _mm256_sub_ps (x1, tx);
+
+      sum1 = lerp_avx2 (fetch_avx2 (map, x0, z0), fetch_avx2 (map, x1, z0), ax);
+      sum2 = lerp_avx2 (fetch_avx2 (map, x0, z1), fetch_avx2 (map, x1, z1), ax);
+      _mm256_storeu_ps (heights + i, lerp_avx2 (sum1, sum2, _mm256_sub_ps (z1, tz)));
+    }
+
+  height_batch_sse2 (map, x + i, z + i, heights + i, n - i);
+}
+
+#endif
+
+static HeightBatchFunc
+get_height_batch_func (void)
+{
+  static HeightBatchFunc func = NULL;
+
+  if (func == NULL)
+    {
+      func = height_batch_scalar;
+#ifdef HAVE_X86_KERNELS
+      __builtin_cpu_init ();
+      if (__builtin_cpu_supports ("avx2"))
+        func = height_batch_avx2;
+      else if (__builtin_cpu_supports ("sse2"))
+        func = height_batch_sse2;
+#endif
+    }
+
+  return func;
+}
+
+/* Returns heights (==y) at each x[i],z[i] */
+void
+analysis_map_lookup_depthmapped_batch (AnalysisMap *map,
+                                       const float *x,
+                                       const float *z,
+                                       float *heights,
+                                       int n)
+{
+  g_return_if_fail (map->heights != NULL || map->heights16 != NULL);
+
+  get_height_batch_func () (map, x, z, heights, n);
+}
+
+int
+analysis_class_get_check_point (AnalysisClass class)
+{
+  if (class >= ANALYSIS_CLASS_CHECKPOINT_0 &&
+      class <= ANALYSIS_CLASS_CHECKPOINT_LAST)
+    return class - ANALYSIS_CLASS_CHECKPOINT_0;
 
-  lerp_color (&sum1, &sum2, (ceil (z) - z), color);
+  return -1;
 }
@@ -6,20 +6,108 @@
 
 typedef struct _AnalysisMap AnalysisMap;
 
-AnalysisMap *analysis_map_new                  (cairo_surface_t      *surface,
-                                                const graphene_box_t *bounding_box);
-AnalysisMap *analysis_map_ref                  (AnalysisMap          *map);
-void         analysis_map_unref                (AnalysisMap          *map);
-float        analysis_map_lookup_depthmapped   (AnalysisMap          *map,
-                                                float                 x,
-                                                float                 z);
-void         analysis_map_lookup_rgba_nearest  (AnalysisMap          *map,
-                                                float                 x,
-                                                float                 z,
-                                                GdkRGBA              *color);
-void         analysis_map_lookup_rgba_bilinear (AnalysisMap          *map,
-                                                float                 x,
-                                                float                 z,
-                                                GdkRGBA              *color);
+/* Width and height of the maps the game builds, and the default for
+ * hexgl-bake */
+#define ANALYSIS_MAP_DEFAULT_SIZE 2048
+
+typedef enum {
+  /* Decode an RGBA packed depth surface into world space heights */
+  ANALYSIS_MAP_HEIGHT,
+  /* Classify the collision colours into AnalysisClass texels */
+  ANALYSIS_MAP_COLLISION,
+} AnalysisMapMode;
+
+typedef enum {
+  /* Plain row-major grids */
+  ANALYSIS_MAP_LAYOUT_LINEAR,
+  /* Grids stored as 8x8 texel tiles, for better locality */
+  ANALYSIS_MAP_LAYOUT_TILED,
+  /* Like tiled, but only the tiles on and around the track are stored */
+  ANALYSIS_MAP_LAYOUT_SPARSE,
+} AnalysisMapLayout;
+
+typedef enum {
+  /* Heights as floats */
+  ANALYSIS_MAP_PRECISION_FLOAT,
+  /* Heights quantized to 16 bits over the bounding box */
+  ANALYSIS_MAP_PRECISION_16BIT,
+} AnalysisMapPrecision;
+
+typedef enum {
+  ANALYSIS_CLASS_VOID,
+  ANALYSIS_CLASS_WALL,
+  ANALYSIS_CLASS_TRACK,
+  ANALYSIS_CLASS_BOOSTER,
+  ANALYSIS_CLASS_CHECKPOINT_0,
+  ANALYSIS_CLASS_CHECKPOINT_LAST = ANALYSIS_CLASS_CHECKPOINT_0 + 9,
+} AnalysisClass;
+
+#define ANALYSIS_CLASS_MASK(class) (1u << (class))
+#define ANALYSIS_MASK_CHECKPOINTS (((1u << 10) - 1) << ANALYSIS_CLASS_CHECKPOINT_0)
+#define ANALYSIS_MASK_RIDEABLE (ANALYSIS_CLASS_MASK (ANALYSIS_CLASS_TRACK) | \
+                                ANALYSIS_CLASS_MASK (ANALYSIS_CLASS_BOOSTER) | \
+                                ANALYSIS_MASK_CHECKPOINTS)
+
+AnalysisMap * analysis_map_new                      (cairo_surface_t      *surface,
+                                                     const graphene_box_t *bounding_box,
+                                                     AnalysisMapMode       mode,
+                                                     AnalysisMapLayout     layout);
+char *        analysis_map_make_key                 (const char           *model_path);
+void          analysis_map_get_track_extents        (GthreeObject         *top,
+                                                     graphene_box_t       *box);
+AnalysisMap * analysis_map_new_from_file            (const char           *path,
+                                                     const char           *key,
+                                                     GError              **error);
+gboolean      analysis_map_save                     (AnalysisMap          *map,
+                                                     const char           *path,
+                                                     const char           *key,
+                                                     GError              **error);
+void          analysis_map_set_height_precision     (AnalysisMap          *map,
+                                                     AnalysisMapPrecision  precision);
+AnalysisMapPrecision analysis_map_get_height_precision (AnalysisMap       *map);
+AnalysisMap * analysis_map_ref                      (AnalysisMap          *map);
+void          analysis_map_unref                    (AnalysisMap          *map);
+float         analysis_map_lookup_depthmapped       (AnalysisMap          *map,
+                                                     float                 x,
+                                                     float                 z);
+AnalysisClass analysis_map_lookup_class             (AnalysisMap          *map,
+                                                     float                 x,
+                                                     float                 z);
+guint32       analysis_map_lookup_class_mask        (AnalysisMap          *map,
+                                                     float                 x,
+                                                     float                 z);
+float         analysis_map_lookup_coverage          (AnalysisMap          *map,
+                                                     float                 x,
+                                                     float                 z);
+gboolean      analysis_map_trace_class              (AnalysisMap          *map,
+                                                     float                 x0,
+                                                     float                 z0,
+                                                     float                 x1,
+                                                     float                 z1,
+                                                     guint32               pass_mask,
+                                                     AnalysisClass        *class,
+                                                     float                *fraction);
+void          analysis_map_build_distance_field     (AnalysisMap          *map,
+                                                     guint32               inside_mask);
+gsize         analysis_map_get_memory_size          (AnalysisMap          *map,
+                                                     gsize                *dense_size);
+gboolean      analysis_map_has_distance_field       (AnalysisMap          *map);
+float         analysis_map_lookup_distance          (AnalysisMap          *map,
+                                                     float                 x,
+                                                     float                 z,
+                                                     graphene_vec2_t      *gradient);
+
+void          analysis_map_lookup_depthmapped_batch (AnalysisMap          *map,
+                                                     const float          *x,
+                                                     const float          *z,
+                                                     float                *heights,
+                                                     int                   n);
+void          analysis_map_lookup_class_batch       (AnalysisMap          *map,
+                                                     const float          *x,
+                                                     const float          *z,
+                                                     AnalysisClass        *classes,
+                                                     int                   n);
+
+int           analysis_class_get_check_point        (AnalysisClass         class);
 
 #endif
@@ -0,0 +1,154 @@
+#include <math.h>
+#include "distancetransform.h"
+
+/* Exact euclidean distance transform in linear time, as described in
+ * "Distance Transforms of Sampled Functions" by Felzenszwalb and
+ * Huttenlocher. It is separable, so it is done as a 1D transform of
+ * every column followed by one of every row. The lines within a pass are
+ * independent and are split between threads. */
+
+typedef struct {
+  float *grid;
+  int width;
+  int height;
+  float spacing;
+  gboolean rows;
+  int start;
+  int end;
+} Job;
+
+/* 1D squared distance transform of the n samples in f into d. v and z
+ * are scratch space of n and n + 1 entries. */
+static void
+transform_line (const double *f,
+                double *d,
+                int *v,
+                double *z,
+                int n,
+                double s2)
+{
+  int k = 0;
+
+  v[0] = 0;
+  z[0] = -HUGE_VAL;
+  z[1] = HUGE_VAL;
+
+  for (int q = 1; q < n; q++)
+    {
+      double s;
+
+      while (TRUE)
+        {
+          int p = v[k];
+
+          s = ((f[q] + s2 * q * q) - (f[p] + s2 * p * p)) / (2 * s2 * (q - p));
+          if (s > z[k])
+            break;
+          k--;
+        }
+
+      k++;
+      v[k] = q;
+      z[k] = s;
+      z[k + 1] = HUGE_VAL;
+    }
+
+  k = 0;
+  for (int q = 0; q < n; q++)
+    {
+      while (z[k + 1] < q)
+        k++;
+      d[q] = s2 * (q - v[k]) * (q - v[k]) + f[v[k]];
+    }
+}
+
+static gpointer
+run_job (gpointer data)
+{
+  Job *job = data;
+  int n = job->rows ? job->width : job->height;
+  int stride = job->rows ? 1 : job->width;
+  double s2 = job->spacing * job->spacing;
+  double *f = g_new (double, n);
+  double *d = g_new (double, n);
+  double *z = g_new (double, n + 1);
+  int *v = g_new (int, n);
+
+  for (int line = job->start; line < job->end; line++)
+    {
+      float *p = job->grid + (job->rows ? line * job->width : line);
+
+      for (int i = 0; i < n; i++)
+        f[i] = p[i * stride];
+
+      transform_line (f, d, v, z, n, s2);
+
+      /* The row pass is the last one, so finish off with the root */
+      for (int i = 0; i < n; i++)
+        p[i * stride] = job->rows ? sqrt (d[i]) : d[i];
+    }
+
+  g_free (f);
+  g_free (d);
+  g_free (z);
+  g_free (v);
+
+  return NULL;
+}
+
+static void
+run_pass (float *grid,
+          int width,
+          int height,
+          float spacing,
+          gboolean rows,
+          int n_threads)
+{
+  int lines = rows ? height : width;
+  GThread **threads = g_new (GThread *, n_threads);
+  Job *jobs = g_new (Job, n_threads);
+
+  for (int i = 0; i < n_threads; i++)
+    {
+      Job *job = &jobs[i];
+
+      job->grid = grid;
+      job->width = width;
+      job->height = height;
+      job->spacing = spacing;
+      job->rows = rows;
+      job->start = lines * i / n_threads;
+      job->end = lines * (i + 1) / n_threads;
+
+      if (i == 0)
+        threads[i] = NULL;
+      else
+        threads[i] = g_thread_new ("distance-transform", run_job, job);
+    }
+
+  /* The calling thread does the first share itself */
+  run_job (&jobs[0]);
+
+  for (int i = 1; i < n_threads; i++)
+    g_thread_join (threads[i]);
+
+  g_free (threads);
+  g_free (jobs);
+}
+
+/* Replaces each cell of grid, which should be 0 for seeds and
+ * DISTANCE_TRANSFORM_INF otherwise, with the distance to the nearest
+ * seed. The spacings are the distances between neighbouring cells. */
+void
+distance_transform (float *grid,
+                    int width,
+                    int height,
+                    float spacing_x,
+                    float spacing_y,
+                    int n_threads)
+{
+  n_threads = CLAMP (n_threads, 1, MIN (width, height));
+
+  run_pass (grid, width, height, spacing_y, FALSE, n_threads);
+  run_pass (grid, width, height, spacing_x, TRUE, n_threads);
+}
@@ -0,0 +1,16 @@
+#ifndef DISTANCETRANSFORM_H
+#define DISTANCETRANSFORM_H
+
+#include <glib.h>
+
+/* Value for grid cells that are not seeds */
+#define DISTANCE_TRANSFORM_INF 1e20f
+
+void distance_transform (float *grid,
+                         int    width,
+                         int    height,
+                         float  spacing_x,
+                         float  spacing_y,
+                         int    n_threads);
+
+#endif
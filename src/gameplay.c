@@ -1,4 +1,6 @@
 #include "gameplay.h"
+#include "ghost.h"
+#include "shipeffects.h"
 #include "utils.h"
 #include "sounds.h"
 
@@ -6,9 +8,27 @@ struct _Gameplay {
   ShipControls *controls;
   CameraChase *chase;
   HUD *hud;
-  GTimer *timer;
   GCallback finished_cb;
 
+  /* Seconds into the countdown, race or end, counted in simulation
+   * steps so a replay sees the same countdown */
+  double time;
+
+  char *track_key;
+  /* The race being recorded, or played back */
+  Replay *replay;
+  gboolean playback;
+
+  /* The lap being driven, and the fastest one on this track which is
+   * drawn racing alongside */
+  Ghost *lap_ghost;
+  Ghost *best_ghost;
+  gboolean best_ghost_loaded;
+  double lap_start_time;
+  guint lap_steps;
+  GthreeObject *ghost_mesh;
+  ShipEffects *effects;
+
   gboolean active;
   int result;
   int step;
@@ -41,7 +61,6 @@ gameplay_new (ShipControls *controls,
   gameplay->controls = controls;
   gameplay->hud = hud;
   gameplay->chase = chase;
-  gameplay->timer = g_timer_new ();
   gameplay->finished_cb = finished_cb;
 
   return gameplay;
@@ -50,14 +69,122 @@ gameplay_new (ShipControls *controls,
 void
 gameplay_free (Gameplay *gameplay)
 {
+  g_clear_pointer (&gameplay->replay, replay_free);
+  g_clear_pointer (&gameplay->lap_ghost, ghost_free);
+  g_clear_pointer (&gameplay->best_ghost, ghost_free);
+  g_clear_object (&gameplay->ghost_mesh);
+  g_free (gameplay->track_key);
   g_free (gameplay);
 }
 
+/* The key of the maps the race runs on, saved in replays */
 void
-gameplay_start (Gameplay *gameplay)
+gameplay_set_track_key (Gameplay *gameplay,
+                        const char *key)
+{
+  g_free (gameplay->track_key);
+  gameplay->track_key = g_strdup (key);
+
+  /* The best lap may be on another track */
+  g_clear_pointer (&gameplay->best_ghost, ghost_free);
+  gameplay->best_ghost_loaded = FALSE;
+}
+
+/* The key replays are recorded with, "" if the maps have none */
+const char *
+gameplay_get_track_key (Gameplay *gameplay)
+{
+  return gameplay->track_key ? gameplay->track_key : "";
+}
+
+/* The mesh drawn where the best lap was at the same point of the lap */
+void
+gameplay_set_ghost_mesh (Gameplay *gameplay,
+                         GthreeObject *mesh)
+{
+  g_set_object (&gameplay->ghost_mesh, mesh);
+}
+
+/* The effects of the ship, seeded from the replay at the start of each
+ * race so they come out the same when it is played back */
+void
+gameplay_set_ship_effects (Gameplay *gameplay,
+                           ShipEffects *effects)
+{
+  gameplay->effects = effects;
+}
+
+static void
+gameplay_load_best_ghost (Gameplay *gameplay)
+{
+  g_autofree char *path = get_replay_path ("best-lap.ghost");
+  g_autoptr(GError) error = NULL;
+  Ghost *ghost;
+
+  if (gameplay->best_ghost_loaded)
+    return;
+  gameplay->best_ghost_loaded = TRUE;
+
+  if (!g_file_test (path, G_FILE_TEST_EXISTS))
+    return;
+
+  ghost = ghost_new_from_file (path, &error);
+  if (ghost == NULL)
+    {
+      g_warning ("Failed to load ghost: %s", error->message);
+      return;
+    }
+
+  if (g_strcmp0 (ghost_get_key (ghost), gameplay->track_key) != 0)
+    {
+      ghost_free (ghost);
+      return;
+    }
+
+  gameplay->best_ghost = ghost;
+}
+
+static void
+gameplay_start_lap (Gameplay *gameplay)
+{
+  g_clear_pointer (&gameplay->lap_ghost, ghost_free);
+  gameplay->lap_ghost = ghost_new (gameplay->track_key ? gameplay->track_key : "");
+  gameplay->lap_start_time = gameplay->time;
+  gameplay->lap_steps = 0;
+}
+
+static void
+gameplay_end_lap (Gameplay *gameplay)
+{
+  g_autofree char *path = NULL;
+  g_autoptr(GError) error = NULL;
+  Ghost *ghost = gameplay->lap_ghost;
+
+  ghost_set_lap_time (ghost, gameplay->time - gameplay->lap_start_time);
+
+  if (gameplay->best_ghost != NULL &&
+      ghost_get_lap_time (gameplay->best_ghost) <= ghost_get_lap_time (ghost))
+    return;
+
+  g_clear_pointer (&gameplay->best_ghost, ghost_free);
+  gameplay->best_ghost = g_steal_pointer (&gameplay->lap_ghost);
+
+  if (gameplay->playback)
+    return;
+
+  path = get_replay_path ("best-lap.ghost");
+  if (!ghost_save (gameplay->best_ghost, path, &error))
+    g_warning ("Failed to save ghost: %s", error->message);
+}
+
+static void
+gameplay_begin (Gameplay *gameplay,
+                Replay *replay,
+                gboolean playback)
 {
   graphene_vec3_t pos;
   graphene_vec3_t rot;
+  float yaw;
 
  if (gameplay->message)
     hud_remove_message (gameplay->hud, gameplay->message);
@@ -75,15 +202,40 @@ gameplay_start (Gameplay *gameplay)
   gameplay->score = -1;
   gameplay->active = TRUE;
 
-  graphene_vec3_init (&pos,
-                      -1134*2,
-                      387,
-                      -443*2);
-  graphene_vec3_init (&rot, 0, 0, 0);
+  ship_controls_record (gameplay->controls, NULL);
+  ship_controls_play (gameplay->controls, NULL);
+  g_clear_pointer (&gameplay->replay, replay_free);
+  g_clear_pointer (&gameplay->lap_ghost, ghost_free);
+  gameplay_load_best_ghost (gameplay);
+
+  if (replay == NULL)
+    {
+      graphene_vec3_init (&pos, SIM_START_X, SIM_START_Y, SIM_START_Z);
+      replay = replay_new (gameplay_get_track_key (gameplay),
+                           g_random_int (),
+                           ship_controls_get_difficulty (gameplay->controls),
+                           &pos, 0);
+    }
+
+  gameplay->replay = replay;
+  gameplay->playback = playback;
 
+  if (gameplay->effects)
+    ship_effects_set_seed (gameplay->effects, replay_get_seed (replay));
+
+  replay_get_start (replay, &pos, &yaw);
+  graphene_vec3_init (&rot, 0, yaw, 0);
+
+  ship_controls_set_difficulty (gameplay->controls, replay_get_difficulty (replay));
+  ship_controls_set_params (gameplay->controls, replay_get_params (replay));
   ship_controls_reset (gameplay->controls,
                        &pos, &rot);
 
+  if (playback)
+    ship_controls_play (gameplay->controls, replay);
+  else
+    ship_controls_record (gameplay->controls, replay);
+
   gameplay->message = hud_show_message (gameplay->hud, "GET READY");
 
   play_sound ("bg", TRUE);
@@ -91,7 +243,31 @@ gameplay_start (Gameplay *gameplay)
 
   hud_set_lap (gameplay->hud, gameplay->lap, gameplay->max_laps);
   hud_set_time (gameplay->hud, -1.0);
-  g_timer_start (gameplay->timer);
+  gameplay->time = 0;
+}
+
+void
+gameplay_start (Gameplay *gameplay)
+{
+  gameplay_begin (gameplay, NULL, FALSE);
+}
+
+/* Plays back replay, which is freed when done */
+void
+gameplay_start_replay (Gameplay *gameplay,
+                       Replay *replay)
+{
+  gameplay_begin (gameplay, replay, TRUE);
+}
+
+static void
+gameplay_save_replay (Gameplay *gameplay)
+{
+  g_autofree char *path = get_replay_path ("last.replay");
+  g_autoptr(GError) error = NULL;
+
+  if (!replay_save (gameplay->replay, path, &error))
+    g_warning ("Failed to save replay: %s", error->message);
 }
 
 static void
@@ -118,13 +294,17 @@ gameplay_end (Gameplay *gameplay,
               int result)
 {
   gameplay->result = result;
-  gameplay->score = g_timer_elapsed (gameplay->timer, NULL);
+  gameplay->score = gameplay->time;
   ship_controls_set_active (gameplay->controls, FALSE);
-  g_timer_start (gameplay->timer);
+  gameplay->time = 0;
+
+  ship_controls_record (gameplay->controls, NULL);
+  if (!gameplay->playback)
+    gameplay_save_replay (gameplay);
 
   if (result == RESULT_FINISHED)
     {
-      // TODO: Go to replay
+      // The race can be watched again from the menu
       camera_chase_set_mode (gameplay->chase, MODE_ORBIT);
       ship_controls_stop (gameplay->controls);
       gameplay_message (gameplay, "Finished", 2.0);
@@ -144,7 +324,9 @@ gameplay_update (Gameplay *gameplay,
   if (!gameplay->active)
     return;
 
-  double elapsed = g_timer_elapsed (gameplay->timer, NULL);
+  gameplay->time += dt * SIM_STEP_MS / 1000.0;
+
+  double elapsed = gameplay->time;
 
   // Clear old messages
   if (gameplay->message != NULL &&
@@ -187,8 +369,9 @@ gameplay_update (Gameplay *gameplay,
           gameplay_message (gameplay, NULL, -1);
           gameplay->step = 4;
 
-          g_timer_start (gameplay->timer);
+          gameplay->time = 0;
           ship_controls_set_active (gameplay->controls, TRUE);
+          gameplay_start_lap (gameplay);
         }
       break;
 
@@ -201,6 +384,9 @@ gameplay_update (Gameplay *gameplay,
           gameplay->previous_checkpoint = cp;
           gameplay->lap++;
 
+          gameplay_end_lap (gameplay);
+          gameplay_start_lap (gameplay);
+
           if (gameplay->lap > gameplay->max_laps)
             {
               gameplay_end (gameplay, RESULT_FINISHED);
@@ -218,6 +404,15 @@ gameplay_update (Gameplay *gameplay,
           gameplay->previous_checkpoint = cp;
         }
 
+      if (gameplay->lap_ghost != NULL)
+        {
+          SimPose pose;
+
+          ship_controls_get_pose (gameplay->controls, &pose);
+          ghost_add_step (gameplay->lap_ghost, &pose);
+          gameplay->lap_steps++;
+        }
+
       if (gameplay->result == RESULT_NONE &&
           ship_controls_is_destroyed (gameplay->controls))
         {
@@ -230,6 +425,7 @@ gameplay_update (Gameplay *gameplay,
       if (elapsed > 2)
         {
           gameplay->active = FALSE;
+          ship_controls_play (gameplay->controls, NULL);
           gameplay->finished_cb ();
         }
       break;
@@ -237,6 +433,37 @@ gameplay_update (Gameplay *gameplay,
     }
 }
 
+/* Draws the ghost alpha of the way from the previous step to the last
+ * one, like ship_controls_interpolate() does for the ship */
+void
+gameplay_interpolate (Gameplay *gameplay,
+                      float alpha)
+{
+  Ghost *ghost = gameplay->best_ghost;
+  graphene_matrix_t matrix;
+  SimPose pose;
+  float step;
+
+  if (gameplay->ghost_mesh == NULL)
+    return;
+
+  /* The last step is the lap_steps-1:th pose of the lap */
+  step = (float)gameplay->lap_steps - 2 + MIN (alpha, 1.0);
+
+  if (!gameplay->active || gameplay->step != 4 || gameplay->result != RESULT_NONE ||
+      ghost == NULL || gameplay->lap_steps == 0 || step > ghost_get_n_steps (ghost))
+    {
+      gthree_object_set_visible (gameplay->ghost_mesh, FALSE);
+      return;
+    }
+
+  ghost_get_pose (ghost, step, &pose);
+  sim_pose_to_matrix (&pose, &matrix);
+  gthree_object_set_matrix (gameplay->ghost_mesh, &matrix);
+  gthree_object_update_matrix_world (gameplay->ghost_mesh, TRUE);
+  gthree_object_set_visible (gameplay->ghost_mesh, TRUE);
+}
+
 gboolean
 gameplay_key_press (Gameplay *gameplay,
                     GdkEventKey *event)
@@ -244,7 +471,14 @@ gameplay_key_press (Gameplay *gameplay,
   switch (event->keyval)
     {
     case GDK_KEY_Escape:
-      if (gameplay->active)
+      if (gameplay->active && gameplay->playback)
+        {
+          gameplay->active = FALSE;
+          ship_controls_play (gameplay->controls, NULL);
+          ship_controls_set_active (gameplay->controls, FALSE);
+          gameplay->finished_cb ();
+        }
+      else if (gameplay->active)
         gameplay_start (gameplay);
       break;
     }
@@ -2,6 +2,7 @@
 #include "shipcontrols.h"
 #include "hud.h"
 #include "camerachase.h"
+#include "shipeffects.h"
 
 typedef struct _Gameplay Gameplay;
 
@@ -16,4 +17,15 @@ gboolean  gameplay_key_press   (Gameplay     *gameplay,
                                 GdkEventKey  *event);
 gboolean  gameplay_key_release (Gameplay     *gameplay,
                                 GdkEventKey  *event);
+void      gameplay_set_track_key (Gameplay   *gameplay,
+                                const char   *key);
+const char *gameplay_get_track_key (Gameplay *gameplay);
+void      gameplay_set_ghost_mesh (Gameplay  *gameplay,
+                                GthreeObject *mesh);
+void      gameplay_set_ship_effects (Gameplay *gameplay,
+                                ShipEffects  *effects);
+void      gameplay_interpolate (Gameplay     *gameplay,
+                                float         alpha);
 void      gameplay_start       (Gameplay     *gameplay);
+void      gameplay_start_replay (Gameplay    *gameplay,
+                                Replay       *replay);
@@ -0,0 +1,333 @@
+#include <math.h>
+#include <string.h>
+#include <gio/gio.h>
+#include "ghost.h"
+
+/* A sample every 4 steps, about 15 per second */
+#define GHOST_SAMPLE_STEPS 4
+/* Positions are stored in 1/64ths of a unit */
+#define GHOST_POSITION_SCALE 64.0f
+/* Angles are stored as 16 bit fractions of a turn, so they wrap by
+ * themselves */
+#define GHOST_ANGLE_SCALE (65536.0f / (2 * G_PI))
+
+/* The file is the magic followed by varints, the samples as zigzag
+ * encoded deltas from the previous one, which are mostly a byte or two:
+ *
+ *   magic[8] version key_length key[key_length] sample_steps
+ *   lap_time_ms n_samples { x y z yaw gradient tilt roll }[n_samples]
+ */
+#define GHOST_MAGIC "HEXGLGST"
+#define GHOST_VERSION 1
+#define GHOST_MAX_KEY_LENGTH 256
+#define GHOST_N_FIELDS 7
+
+typedef struct {
+  gint32 x, y, z;
+  gint16 yaw, gradient, tilt, roll;
+} GhostSample;
+
+struct _Ghost {
+  char *key;
+  guint sample_steps;
+  guint n_steps;
+  double lap_time;
+  GArray *samples;
+};
+
+Ghost *
+ghost_new (const char *key)
+{
+  Ghost *ghost = g_new0 (Ghost, 1);
+
+  ghost->key = g_strdup (key);
+  ghost->sample_steps = GHOST_SAMPLE_STEPS;
+  ghost->samples = g_array_new (FALSE, FALSE, sizeof (GhostSample));
+
+  return ghost;
+}
+
+void
+ghost_free (Ghost *ghost)
+{
+  g_free (ghost->key);
+  g_array_unref (ghost->samples);
+  g_free (ghost);
+}
+
+const char *
+ghost_get_key (Ghost *ghost)
+{
+  return ghost->key;
+}
+
+static gint16
+quantize_angle (float angle)
+{
+  return (gint16)(guint16)(lrintf (angle * GHOST_ANGLE_SCALE) & 0xffff);
+}
+
+/* Records the pose after a step, every few are kept */
+void
+ghost_add_step (Ghost *ghost,
+                const SimPose *pose)
+{
+  GhostSample sample;
+
+  if (ghost->n_steps++ % ghost->sample_steps != 0)
+    return;
+
+  sample.x = lrintf (pose->position.x * GHOST_POSITION_SCALE);
+  sample.y = lrintf (pose->position.y * GHOST_POSITION_SCALE);
+  sample.z = lrintf (pose->position.z * GHOST_POSITION_SCALE);
+  sample.yaw = quantize_angle (pose->yaw);
+  sample.gradient = quantize_angle (pose->gradient);
+  sample.tilt = quantize_angle (pose->tilt);
+  sample.roll = quantize_angle (pose->roll);
+
+  g_array_append_val (ghost->samples, sample);
+}
+
+void
+ghost_set_lap_time (Ghost *ghost,
+                    double lap_time)
+{
+  ghost->lap_time = lap_time;
+}
+
+double
+ghost_get_lap_time (Ghost *ghost)
+{
+  return ghost->lap_time;
+}
+
+/* How many steps of the lap can be played back */
+float
+ghost_get_n_steps (Ghost *ghost)
+{
+  if (ghost->samples->len == 0)
+    return 0;
+
+  return (ghost->samples->len - 1) * ghost->sample_steps;
+}
+
+static float
+lerp_angle (gint16 a, gint16 b, float alpha)
+{
+  /* The difference wraps, so this goes the short way around */
+  return (a + (gint16)(b - a) * alpha) / GHOST_ANGLE_SCALE;
+}
+
+/* Returns the pose step steps into the lap, interpolated between the
+ * two nearest samples */
+void
+ghost_get_pose (Ghost *ghost,
+                float step,
+                SimPose *pose)
+{
+  const GhostSample *a, *b;
+  float t;
+  guint i;
+
+  g_return_if_fail (ghost->samples->len > 0);
+
+  t = CLAMP (step, 0, ghost_get_n_steps (ghost)) / ghost->sample_steps;
+  i = MIN ((guint)t, ghost->samples->len - 1);
+  t -= i;
+
+  a = &g_array_index (ghost->samples, GhostSample, i);
+  b = &g_array_index (ghost->samples, GhostSample, MIN (i + 1, ghost->samples->len - 1));
+
+  pose->position.x = (a->x + (b->x - a->x) * t) / GHOST_POSITION_SCALE;
+  pose->position.y = (a->y + (b->y - a->y) * t) / GHOST_POSITION_SCALE;
+  pose->position.z = (a->z + (b->z - a->z) * t) / GHOST_POSITION_SCALE;
+  pose->yaw = lerp_angle (a->yaw, b->yaw, t);
+  pose->gradient = lerp_angle (a->gradient, b->gradient, t);
+  pose->tilt = lerp_angle (a->tilt, b->tilt, t);
+  pose->roll = lerp_angle (a->roll, b->roll, t);
+}
+
+static void
+sample_get_fields (const GhostSample *sample,
+                   gint32 fields[GHOST_N_FIELDS])
+{
+  fields[0] = sample->x;
+  fields[1] = sample->y;
+  fields[2] = sample->z;
+  fields[3] = sample->yaw;
+  fields[4] = sample->gradient;
+  fields[5] = sample->tilt;
+  fields[6] = sample->roll;
+}
+
+static void
+sample_set_fields (GhostSample *sample,
+                   const gint32 fields[GHOST_N_FIELDS])
+{
+  sample->x = fields[0];
+  sample->y = fields[1];
+  sample->z = fields[2];
+  sample->yaw = fields[3];
+  sample->gradient = fields[4];
+  sample->tilt = fields[5];
+  sample->roll = fields[6];
+}
+
+static void
+append_varint (GByteArray *data,
+               guint32 v)
+{
+  do
+    {
+      guint8 byte = (v & 0x7f) | (v >= 0x80 ? 0x80 : 0);
+
+      g_byte_array_append (data, &byte, 1);
+      v >>= 7;
+    }
+  while (v != 0);
+}
+
+static void
+append_zigzag (GByteArray *data,
+               gint32 v)
+{
+  append_varint (data, ((guint32)v << 1) ^ (guint32)(v >> 31));
+}
+
+gboolean
+ghost_save (Ghost *ghost,
+            const char *path,
+            GError **error)
+{
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  g_autoptr(GFile) parent = g_file_get_parent (file);
+  g_autoptr(GByteArray) data = g_byte_array_new ();
+  g_autoptr(GError) local_error = NULL;
+  gint32 previous[GHOST_N_FIELDS] = { 0 };
+  gsize key_length = strlen (ghost->key);
+
+  g_return_val_if_fail (key_length <= GHOST_MAX_KEY_LENGTH, FALSE);
+
+  g_byte_array_append (data, (const guint8 *)GHOST_MAGIC, 8);
+  append_varint (data, GHOST_VERSION);
+  append_varint (data, key_length);
+  g_byte_array_append (data, (const guint8 *)ghost->key, key_length);
+  append_varint (data, ghost->sample_steps);
+  append_varint (data, lrint (ghost->lap_time * 1000));
+  append_varint (data, ghost->samples->len);
+
+  for (guint i = 0; i < ghost->samples->len; i++)
+    {
+      gint32 fields[GHOST_N_FIELDS];
+
+      sample_get_fields (&g_array_index (ghost->samples, GhostSample, i), fields);
+      for (int j = 0; j < GHOST_N_FIELDS; j++)
+        {
+          /* Wrapping is fine, decoding wraps back */
+          append_zigzag (data, (gint32)((guint32)fields[j] - (guint32)previous[j]));
+          previous[j] = fields[j];
+        }
+    }
+
+  if (!g_file_make_directory_with_parents (parent, NULL, &local_error) &&
+      !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  return g_file_replace_contents (file, (const char *)data->data, data->len,
+                                  NULL, FALSE, G_FILE_CREATE_NONE, NULL, NULL, error);
+}
+
+static gboolean
+read_varint (const guint8 **p,
+             const guint8 *end,
+             guint32 *v)
+{
+  *v = 0;
+
+  for (int shift = 0; shift < 35; shift += 7)
+    {
+      if (*p == end)
+        return FALSE;
+
+      *v |= (guint32)(**p & 0x7f) << shift;
+      if ((*(*p)++ & 0x80) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+Ghost *
+ghost_new_from_file (const char *path,
+                     GError **error)
+{
+  g_autofree char *contents = NULL;
+  g_autofree char *key = NULL;
+  const guint8 *p, *end;
+  guint32 version, key_length, sample_steps, lap_time_ms, n_samples;
+  gint32 fields[GHOST_N_FIELDS] = { 0 };
+  gsize length;
+  Ghost *ghost;
+
+  if (!g_file_get_contents (path, &contents, &length, error))
+    return NULL;
+
+  p = (const guint8 *)contents;
+  end = p + length;
+
+  if (length < 8 || memcmp (p, GHOST_MAGIC, 8) != 0)
+    goto invalid;
+  p += 8;
+
+  if (!read_varint (&p, end, &version) ||
+      version != GHOST_VERSION ||
+      !read_varint (&p, end, &key_length) ||
+      key_length > GHOST_MAX_KEY_LENGTH ||
+      (gsize)(end - p) < key_length)
+    goto invalid;
+
+  key = g_strndup ((const char *)p, key_length);
+  p += key_length;
+
+  if (!read_varint (&p, end, &sample_steps) ||
+      sample_steps == 0 ||
+      !read_varint (&p, end, &lap_time_ms) ||
+      !read_varint (&p, end, &n_samples) ||
+      /* Each sample is at least a byte per field */
+      n_samples > (gsize)(end - p) / GHOST_N_FIELDS)
+    goto invalid;
+
+  ghost = ghost_new (key);
+  ghost->sample_steps = sample_steps;
+  ghost->lap_time = lap_time_ms / 1000.0;
+  ghost->n_steps = n_samples * sample_steps;
+  g_array_set_size (ghost->samples, n_samples);
+
+  for (guint i = 0; i < n_samples; i++)
+    {
+      for (int j = 0; j < GHOST_N_FIELDS; j++)
+        {
+          guint32 v;
+
+          if (!read_varint (&p, end, &v))
+            {
+              ghost_free (ghost);
+              goto invalid;
+            }
+
+          fields[j] = (gint32)((guint32)fields[j] + (guint32)((v >> 1) ^ -(v & 1)));
+        }
+
+      sample_set_fields (&g_array_index (ghost->samples, GhostSample, i), fields);
+    }
+
+  return ghost;
+
+ invalid:
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+               "%s is not a valid ghost", path);
+  return NULL;
+}
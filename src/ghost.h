@@ -0,0 +1,26 @@
+#pragma once
+
+#include <glib.h>
+#include "sim.h"
+
+/* The poses of a ship over a lap, sampled every few simulation steps
+ * and quantized, to draw a ghost racing it again. */
+typedef struct _Ghost Ghost;
+
+Ghost *   ghost_new             (const char     *key);
+Ghost *   ghost_new_from_file   (const char     *path,
+                                 GError        **error);
+gboolean  ghost_save            (Ghost          *ghost,
+                                 const char     *path,
+                                 GError        **error);
+void      ghost_free            (Ghost          *ghost);
+const char *ghost_get_key       (Ghost          *ghost);
+void      ghost_add_step        (Ghost          *ghost,
+                                 const SimPose  *pose);
+void      ghost_set_lap_time    (Ghost          *ghost,
+                                 double          lap_time);
+double    ghost_get_lap_time    (Ghost          *ghost);
+float     ghost_get_n_steps     (Ghost          *ghost);
+void      ghost_get_pose        (Ghost          *ghost,
+                                 float           step,
+                                 SimPose        *pose);
@@ -6,7 +6,10 @@
 #include <gthree/gthreearea.h>
 #include "camerachase.h"
 #include "shipcontrols.h"
+#include "ships.h"
 #include "shipeffects.h"
+#include "shipprofiles.h"
+#include "aipilot.h"
 #include "analysismap.h"
 #include "utils.h"
 #include "hud.h"
@@ -14,17 +17,27 @@
 #include "gameplay.h"
 #include "sounds.h"
 
+#define TRACK_MODEL "tracks/cityscape/cityscape.glb"
+
 GthreeEffectComposer *composer;
 GthreeObject *the_ship;
+GthreeObject *the_ghost;
 CameraChase *camera_chase;
+Ships *ships;
 ShipControls *ship_controls;
 ShipEffects *ship_effects;
+ParticlePool *effects_pool;
 AnalysisMap *height_map;
 AnalysisMap *collision_map;
+RacingLine *racing_line;
+AiPilot *autopilot;
+ShipProfilesMonitor *profiles_monitor;
 GthreeUniforms *hex_uniforms;
+gint64 start_time;
 
 GtkWidget *the_stack;
 GtkWidget *start_button;
+GtkWidget *replay_button;
 HUD *hud;
 Gameplay *gameplay;
 
@@ -47,6 +60,20 @@ enable_shadows (GthreeObject *root)
   gthree_object_traverse (root, _enable_shadow_cb, NULL);
 }
 
+static gboolean
+_make_ghostly_cb (GthreeObject *object,
+                  gpointer      user_data)
+{
+  if (GTHREE_IS_MESH (object))
+    {
+      GthreeMaterial *material = gthree_mesh_get_material (GTHREE_MESH (object), 0);
+      gthree_material_set_is_transparent (material, TRUE);
+      gthree_material_set_opacity (material, 0.35);
+    }
+
+  return TRUE;
+}
+
 static void
 resize_area (GthreeArea *area,
              gint width,
@@ -56,6 +83,7 @@ resize_area (GthreeArea *area,
   gthree_perspective_camera_set_aspect (camera, (float)width / (float)(height));
 
   hud_update_screen_size (hud, width, height);
+  particle_pool_set_viewport_height (effects_pool, height);
 
   gthree_uniforms_set_float (hex_uniforms, "size", 512.0 * (width ) / (1633.0 * gtk_widget_get_scale_factor (GTK_WIDGET (area))));
   gthree_uniforms_set_float (hex_uniforms, "rx", width / gtk_widget_get_scale_factor (GTK_WIDGET (area)));
@@ -67,6 +95,7 @@ init_scene (GthreeScene *scene)
 {
   g_autoptr(GthreeObject) track = NULL;
   g_autoptr(GthreeObject) ship = NULL;
+  g_autoptr(GthreeObject) ghost = NULL;
   g_autoptr(GthreeTexture) skybox = NULL;
   GthreeAmbientLight *ambient_light;
   GthreeDirectionalLight *sun;
@@ -78,7 +107,7 @@ init_scene (GthreeScene *scene)
   graphene_vec3_init (&white, 1, 1, 1);
   graphene_vec3_init (&grey, 0.75, 0.75, 0.75);
 
-  track = load_model ("tracks/cityscape/cityscape.glb");
+  track = load_model (TRACK_MODEL);
   ship = load_model ("ships/feisar/feisar.glb");
 
   enable_shadows (track);
@@ -93,11 +122,20 @@ init_scene (GthreeScene *scene)
   gthree_object_set_matrix_auto_update (GTHREE_OBJECT (ship), TRUE);
   the_ship = ship;
 
+  /* A see-through copy of the ship for the best lap, which doesn't cast
+   * shadows */
+  ghost = load_model ("ships/feisar/feisar.glb");
+  gthree_object_traverse (ghost, _make_ghostly_cb, NULL);
+  gthree_object_set_matrix_auto_update (ghost, FALSE);
+  gthree_object_set_visible (ghost, FALSE);
+  gthree_object_add_child (GTHREE_OBJECT (scene), ghost);
+  the_ghost = ghost;
+
   gthree_object_set_position_point3d (GTHREE_OBJECT (ship),
                               graphene_point3d_init (&pos,
-                                                     -1134*2,
-                                                     387,
-                                                     -443*2));
+                                                     SIM_START_X,
+                                                     SIM_START_Y,
+                                                     SIM_START_Z));
 
   ambient_light = gthree_ambient_light_new (&grey);
   gthree_light_set_intensity (GTHREE_LIGHT (ambient_light), 0.7);
@@ -128,31 +166,60 @@ init_scene (GthreeScene *scene)
 
 }
 
+/* The simulation runs in fixed steps of 16.6 ms, which is the unit dt is
+ * measured in, so handling doesn't depend on the frame rate. If we fall
+ * too far behind the rest of the backlog is dropped rather than spending
+ * ever longer frames catching up. */
+#define SIM_STEP_USEC 16600
+#define SIM_MAX_STEPS 8
+
 static gboolean
 tick (GtkWidget     *widget,
       GdkFrameClock *frame_clock,
       gpointer       user_data)
 {
   static gint64 last_frame_time_i = 0;
+  static gint64 sim_accumulator = 0;
   float delta_time_sec = 0;
   gint64 frame_time_i;
   float dt;
+  int n_steps;
   graphene_vec3_t col;
 
   frame_time_i = gdk_frame_clock_get_frame_time (frame_clock);
   if (last_frame_time_i != 0)
-    delta_time_sec = (frame_time_i - last_frame_time_i) / (float) G_USEC_PER_SEC;
+    {
+      delta_time_sec = (frame_time_i - last_frame_time_i) / (float) G_USEC_PER_SEC;
+      sim_accumulator += frame_time_i - last_frame_time_i;
+    }
   last_frame_time_i = frame_time_i;
 
   dt = delta_time_sec * 1000.0 / 16.6;
 
-  ship_controls_update (ship_controls, dt);
+  for (n_steps = 0; sim_accumulator >= SIM_STEP_USEC && n_steps < SIM_MAX_STEPS; n_steps++)
+    {
+      ship_controls_prepare_step (ship_controls);
+      ships_update (ships, 1.0);
+      ship_controls_finish_step (ship_controls);
+      ship_effects_step (ship_effects);
+      particle_pool_update (effects_pool, 1.0);
+      gameplay_update (gameplay, 1.0);
+      sim_accumulator -= SIM_STEP_USEC;
+    }
+
+  if (n_steps == SIM_MAX_STEPS)
+    sim_accumulator %= SIM_STEP_USEC;
+
+  /* Draw the ship between the last two steps, as far as we are into the
+   * next one */
+  ship_controls_interpolate (ship_controls, (float)sim_accumulator / SIM_STEP_USEC);
+  gameplay_interpolate (gameplay, (float)sim_accumulator / SIM_STEP_USEC);
+  particle_pool_interpolate (effects_pool, (float)sim_accumulator / SIM_STEP_USEC);
+
   ship_effects_update (ship_effects, dt);
 
   camera_chase_update (camera_chase, dt, ship_controls_get_speed_ratio (ship_controls));
 
-  gameplay_update (gameplay, dt);
-
   hud_update (hud, dt);
 
   if (ship_controls_get_shield_ratio (ship_controls) < 0.2)
@@ -221,10 +288,9 @@ disable_vertex_colors (GthreeObject *top,
 }
 
 static void
-realize_area (GtkWidget *widget)
+generate_analysis_maps (GthreeRenderer *renderer,
+                        GthreeScene *scene)
 {
-  GthreeRenderer *renderer = gthree_area_get_renderer (GTHREE_AREA (widget));
-  GthreeScene *scene = gthree_area_get_scene (GTHREE_AREA (widget));
   graphene_box_t bounding_box;
   graphene_point3d_t min, max;
   graphene_point3d_t pos;
@@ -236,16 +302,12 @@ realize_area (GtkWidget *widget)
   cairo_surface_t *surface;
   graphene_vec3_t white, black, red;
 
-  gthree_renderer_set_shadow_map_enabled (renderer, TRUE);
-  gthree_renderer_set_shadow_map_auto_update (renderer, FALSE);
-  gthree_renderer_set_shadow_map_needs_update (renderer, TRUE);
-
   graphene_vec3_init (&white, 1, 1, 1);
   graphene_vec3_init (&black, 0, 0, 0);
   graphene_vec3_init (&red, 1, 0, 0);
 
   gthree_object_update_matrix_world (GTHREE_OBJECT (scene), FALSE);
-  gthree_object_get_mesh_extents (GTHREE_OBJECT (scene), &bounding_box);
+  analysis_map_get_track_extents (GTHREE_OBJECT (scene), &bounding_box);
 
   graphene_box_get_min (&bounding_box, &min);
   graphene_box_get_max (&bounding_box, &max);
@@ -271,17 +333,12 @@ realize_area (GtkWidget *widget)
 
   gthree_renderer_set_clear_color (renderer, &white);
 
-  render_target = gthree_render_target_new (2048, 2048);
+  render_target = gthree_render_target_new (ANALYSIS_MAP_DEFAULT_SIZE, ANALYSIS_MAP_DEFAULT_SIZE);
   gthree_render_target_set_stencil_buffer (render_target, FALSE);
 
   gthree_scene_set_override_material (scene, GTHREE_MATERIAL (depth_material));
   gthree_renderer_set_render_target (renderer, render_target, 0, 0);
 
-  add_name_to_layer (GTHREE_OBJECT (scene), "tracks", 2);
-  // Don't use vertex colors for the tracks object, as its used for collision info
-  disable_vertex_colors (GTHREE_OBJECT (scene), "tracks");
-  add_name_to_layer (GTHREE_OBJECT (scene), "bonus-base", 3);
-
   gthree_object_set_layer (GTHREE_OBJECT (o_camera), 2);
   gthree_renderer_render (renderer, scene, GTHREE_CAMERA (o_camera));
 
@@ -293,8 +350,8 @@ realize_area (GtkWidget *widget)
                                  cairo_image_surface_get_stride (surface));
   //cairo_surface_write_to_png (surface, "analysis-height.png");
 
-  height_map = analysis_map_new (surface, &bounding_box);
-  ship_controls_set_height_map (ship_controls, height_map);
+  height_map = analysis_map_new (surface, &bounding_box, ANALYSIS_MAP_HEIGHT,
+                                ANALYSIS_MAP_LAYOUT_SPARSE);
   cairo_surface_destroy (surface);
 
   track_material = gthree_mesh_basic_material_new ();
@@ -324,8 +381,9 @@ realize_area (GtkWidget *widget)
                                  cairo_image_surface_get_stride (surface));
   //cairo_surface_write_to_png (surface, "analysis-collision.png");
 
-  collision_map = analysis_map_new (surface, &bounding_box);
-  ship_controls_set_collision_map (ship_controls, collision_map);
+  collision_map = analysis_map_new (surface, &bounding_box, ANALYSIS_MAP_COLLISION,
+                                   ANALYSIS_MAP_LAYOUT_SPARSE);
+  analysis_map_build_distance_field (collision_map, ANALYSIS_MASK_RIDEABLE);
   cairo_surface_destroy (surface);
 
   gthree_renderer_set_autoclear (renderer, TRUE);
@@ -333,12 +391,168 @@ realize_area (GtkWidget *widget)
   gthree_scene_set_override_material (scene, NULL);
 }
 
+static gboolean
+load_analysis_maps (const char *height_path,
+                    const char *collision_path,
+                    const char *key)
+{
+  g_autoptr(GError) error = NULL;
+  AnalysisMap *height, *collision;
+
+  height = analysis_map_new_from_file (height_path, key, &error);
+  if (height == NULL)
+    {
+      g_debug ("Not using stored height map: %s", error->message);
+      return FALSE;
+    }
+
+  collision = analysis_map_new_from_file (collision_path, key, &error);
+  if (collision == NULL || !analysis_map_has_distance_field (collision))
+    {
+      g_debug ("Not using stored collision map: %s",
+               error ? error->message : "No distance field");
+      g_clear_pointer (&collision, analysis_map_unref);
+      analysis_map_unref (height);
+      return FALSE;
+    }
+
+  height_map = height;
+  collision_map = collision;
+
+  return TRUE;
+}
+
+static void
+save_analysis_maps (const char *height_path,
+                    const char *collision_path,
+                    const char *key)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!analysis_map_save (height_map, height_path, key, &error) ||
+      !analysis_map_save (collision_map, collision_path, key, &error))
+    g_warning ("Failed to cache analysis maps: %s", error->message);
+}
+
+/* The racing line comes from the collision map the same way, baked,
+ * cached or traced now */
+static void
+load_racing_line (const char *key)
+{
+  g_autofree char *baked_path = get_map_path ("racing.line");
+  g_autofree char *cached_path = get_cache_path ("racing.line");
+  g_autoptr(GError) error = NULL;
+
+  if (key != NULL)
+    {
+      racing_line = racing_line_new_from_file (baked_path, key, NULL);
+      if (racing_line == NULL)
+        racing_line = racing_line_new_from_file (cached_path, key, NULL);
+      if (racing_line != NULL)
+        return;
+    }
+
+  racing_line = racing_line_new_from_map (collision_map, SIM_START_X, SIM_START_Z, 0, &error);
+  if (racing_line == NULL)
+    {
+      g_warning ("Failed to trace racing line: %s", error->message);
+      return;
+    }
+
+  if (key != NULL &&
+      !racing_line_save (racing_line, cached_path, key, &error))
+    g_warning ("Failed to cache racing line: %s", error->message);
+}
+
+static void
+report_memory_size (const char *name,
+                    AnalysisMap *map)
+{
+  gsize size, dense_size;
+
+  size = analysis_map_get_memory_size (map, &dense_size);
+  g_debug ("%s map uses %" G_GSIZE_FORMAT " KiB, %" G_GSIZE_FORMAT " KiB if dense",
+           name, size / 1024, dense_size / 1024);
+}
+
+static void
+realize_area (GtkWidget *widget)
+{
+  GthreeRenderer *renderer = gthree_area_get_renderer (GTHREE_AREA (widget));
+  GthreeScene *scene = gthree_area_get_scene (GTHREE_AREA (widget));
+  g_autofree char *track_path = get_model_path (TRACK_MODEL);
+  g_autofree char *baked_height_path = get_map_path ("height.map");
+  g_autofree char *baked_collision_path = get_map_path ("collision.map");
+  g_autofree char *cached_height_path = get_cache_path ("height.map");
+  g_autofree char *cached_collision_path = get_cache_path ("collision.map");
+  g_autofree char *key = NULL;
+  gint64 maps_start_time;
+  const char *source = "generated";
+
+  gthree_renderer_set_shadow_map_enabled (renderer, TRUE);
+  gthree_renderer_set_shadow_map_auto_update (renderer, FALSE);
+  gthree_renderer_set_shadow_map_needs_update (renderer, TRUE);
+
+  add_name_to_layer (GTHREE_OBJECT (scene), "tracks", 2);
+  // Don't use vertex colors for the tracks object, as its used for collision info
+  disable_vertex_colors (GTHREE_OBJECT (scene), "tracks");
+  add_name_to_layer (GTHREE_OBJECT (scene), "bonus-base", 3);
+
+  /* Rendering and reading back the maps is slow, so use the ones baked
+   * by hexgl-bake at build time, or the ones from the last run, if they
+   * were made from the same track */
+  maps_start_time = g_get_monotonic_time ();
+  key = analysis_map_make_key (track_path);
+  if (key != NULL &&
+      load_analysis_maps (baked_height_path, baked_collision_path, key))
+    source = "baked";
+  else if (key != NULL &&
+           load_analysis_maps (cached_height_path, cached_collision_path, key))
+    source = "cached";
+  else
+    {
+      generate_analysis_maps (renderer, scene);
+      if (key != NULL)
+        save_analysis_maps (cached_height_path, cached_collision_path, key);
+    }
+
+  g_debug ("Analysis maps %s in %.1f ms", source,
+           (g_get_monotonic_time () - maps_start_time) / 1000.0);
+  report_memory_size ("Height", height_map);
+  report_memory_size ("Collision", collision_map);
+
+  ships_set_maps (ships, height_map, collision_map);
+  gameplay_set_track_key (gameplay, key);
+
+  /* With HEXGL_AUTOPILOT set the ship flies itself, race after race,
+   * for leaving the game running unattended */
+  if (g_getenv ("HEXGL_AUTOPILOT") != NULL)
+    {
+      load_racing_line (key);
+      if (racing_line != NULL)
+        {
+          autopilot = ai_pilot_new (racing_line);
+          ship_controls_set_pilot (ship_controls, autopilot);
+        }
+    }
+}
+
 static gboolean
 render_area (GtkGLArea    *gl_area,
              GdkGLContext *context)
 {
+  static gboolean first_frame = TRUE;
+
   gthree_effect_composer_render (composer, gthree_area_get_renderer (GTHREE_AREA(gl_area)),
                                  0.1);
+
+  if (first_frame)
+    {
+      g_debug ("First frame rendered %.1f ms after startup",
+               (g_get_monotonic_time () - start_time) / 1000.0);
+      first_frame = FALSE;
+    }
+
   return TRUE;
 }
 
@@ -368,11 +582,89 @@ start_clicked (GtkButton  *button)
   gameplay_start (gameplay);
 }
 
+static void
+replay_clicked (GtkButton  *button)
+{
+  g_autofree char *path = get_replay_path ("last.replay");
+  g_autoptr(GError) error = NULL;
+  Replay *replay;
+
+  replay = replay_new_from_file (path, &error);
+  if (replay == NULL)
+    {
+      g_warning ("Failed to load replay: %s", error->message);
+      return;
+    }
+
+  /* On other maps it would go another way, like in hexgl-sim */
+  if (g_strcmp0 (replay_get_key (replay), gameplay_get_track_key (gameplay)) != 0)
+    {
+      g_warning ("Not playing %s, it was recorded on other maps", path);
+      replay_free (replay);
+      return;
+    }
+
+  gtk_stack_set_visible_child_name (GTK_STACK (the_stack), "game");
+
+  gameplay_start_replay (gameplay, replay);
+}
+
+static void
+update_replay_button (void)
+{
+  g_autofree char *path = get_replay_path ("last.replay");
+
+  gtk_widget_set_sensitive (replay_button, g_file_test (path, G_FILE_TEST_EXISTS));
+}
+
+static gboolean
+restart_race (gpointer user_data)
+{
+  start_clicked (NULL);
+
+  return G_SOURCE_REMOVE;
+}
+
 static void
 game_finished (void)
 {
   gtk_stack_set_visible_child_name (GTK_STACK (the_stack), "menu");
+  update_replay_button ();
   gtk_widget_grab_focus (start_button);
+
+  if (autopilot != NULL)
+    g_idle_add (restart_race, NULL);
+}
+
+/* Gives the ships the handling just loaded, right away, so it can be
+ * tried out while tuning it. A ship being recorded or played back keeps
+ * the handling of its replay, and gets the new one when the next race
+ * starts. */
+static void
+profiles_changed (gpointer user_data)
+{
+  for (guint i = 0; i < ships_get_n_ships (ships); i++)
+    {
+      SimState *state = ships_get_state (ships, i);
+
+      if (i == ship_controls_get_ship (ship_controls) &&
+          ship_controls_is_replaying (ship_controls))
+        continue;
+
+      sim_state_set_difficulty (state, state->difficulty);
+    }
+}
+
+static void
+load_profiles (void)
+{
+  g_autofree char *path = get_profile_path ("ships.ini");
+  g_autoptr(GError) error = NULL;
+
+  if (!ship_profiles_load (path, &error))
+    g_warning ("Failed to load ship profiles, using the built in ones: %s", error->message);
+
+  profiles_monitor = ship_profiles_monitor_new (path, profiles_changed, NULL);
 }
 
 int
@@ -384,7 +676,10 @@ main (int argc, char *argv[])
   GthreePass *clear_pass, *render_pass, *bloom_pass, *hex_pass;
   GthreeShader *hex_shader;
   graphene_vec3_t black;
-  GdkPixbuf *title_pixbuf = load_pixbuf ("title.png");
+  GdkPixbuf *title_pixbuf;
+
+  start_time = g_get_monotonic_time ();
+  title_pixbuf = load_pixbuf ("title.png");
 
   graphene_vec3_init (&black, 0, 0, 0);
 
@@ -400,7 +695,9 @@ main (int argc, char *argv[])
 
   /* Set up game */
 
-  ship_controls = ship_controls_new ();
+  load_profiles ();
+  ships = ships_new ();
+  ship_controls = ship_controls_new (ships);
   hud = hud_new (ship_controls, window);
 
   scene = gthree_scene_new ();
@@ -413,9 +710,12 @@ main (int argc, char *argv[])
 
   ship_controls_control (ship_controls, the_ship);
 
-  ship_effects = ship_effects_new (scene, ship_controls);
+  effects_pool = ship_effects_pool_new (scene);
+  ship_effects = ship_effects_new (scene, ship_controls, effects_pool);
 
   gameplay = gameplay_new (ship_controls, hud, camera_chase, game_finished);
+  gameplay_set_ghost_mesh (gameplay, the_ghost);
+  gameplay_set_ship_effects (gameplay, ship_effects);
 
   composer = gthree_effect_composer_new  ();
 
@@ -469,6 +769,14 @@ main (int argc, char *argv[])
   gtk_widget_set_valign (button, GTK_ALIGN_CENTER);
   g_signal_connect (button, "clicked", G_CALLBACK (start_clicked), NULL);
 
+  replay_button = button = gtk_button_new_with_label ("Watch last race");
+  gtk_box_pack_start (GTK_BOX (box), button,
+                      FALSE, FALSE, 0);
+  gtk_widget_show (button);
+  gtk_widget_set_halign (button, GTK_ALIGN_CENTER);
+  g_signal_connect (button, "clicked", G_CALLBACK (replay_clicked), NULL);
+  update_replay_button ();
+
   area = gthree_area_new (scene, GTHREE_CAMERA (camera));
   g_signal_connect (area, "resize", G_CALLBACK (resize_area), camera);
   g_signal_connect (area, "render", G_CALLBACK (render_area), NULL);
@@ -486,6 +794,10 @@ main (int argc, char *argv[])
 
   gtk_widget_show (window);
 
+  /* Showing the game realizes it, which sets up the autopilot */
+  if (g_getenv ("HEXGL_AUTOPILOT") != NULL)
+    g_idle_add (restart_race, NULL);
+
   gtk_main ();
 
   return EXIT_SUCCESS;
@@ -0,0 +1,608 @@
+/* hexgl-bake: builds the analysis maps of a track without a display
+ *
+ * The game renders the track from above with the gpu to get the height
+ * and collision maps. This does the same with a small software
+ * rasterizer over the track triangles, producing surfaces in the same
+ * encoding as the gpu readback, and writes them in the cache format so
+ * the game can load them at startup instead. The racing line the computer
+ * pilots follow is traced from the collision map and written with them.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "analysismap.h"
+#include "racingline.h"
+#include "sim.h"
+
+/* Cells of the grid --verify uses to find the triangles under a point */
+#define VERIFY_GRID_SIZE 256
+
+typedef struct {
+  /* World space positions and vertex colors */
+  graphene_vec3_t v[3];
+  graphene_vec3_t c[3];
+} Triangle;
+
+typedef struct {
+  int width;
+  int height;
+  graphene_point3d_t min;
+  graphene_point3d_t max;
+  /* Per pixel depth buffer, as world space heights */
+  float *depth;
+  guint32 *pixels;
+  int stride;
+} Raster;
+
+typedef enum {
+  /* Write the packed depth, like GthreeMeshDepthMaterial */
+  SHADE_DEPTH,
+  /* Write the vertex colors, like a basic material with vertex colors */
+  SHADE_VERTEX_COLORS,
+  /* Write a constant color */
+  SHADE_COLOR,
+} ShadeMode;
+
+typedef struct {
+  graphene_point3d_t min;
+  graphene_point3d_t max;
+  GArray *triangles;
+  /* Triangle indexes per cell */
+  GArray *cells[VERIFY_GRID_SIZE * VERIFY_GRID_SIZE];
+} TriangleGrid;
+
+static int size = ANALYSIS_MAP_DEFAULT_SIZE;
+static char *precision = NULL;
+static int verify_samples = 0;
+
+static GOptionEntry entries[] = {
+  { "size", 's', 0, G_OPTION_ARG_INT, &size, "Width and height of the maps", "N" },
+  { "precision", 'p', 0, G_OPTION_ARG_STRING, &precision, "Storage of the heights, float or 16bit", "PRECISION" },
+  { "verify", 0, 0, G_OPTION_ARG_INT, &verify_samples, "Compare the heights against N ray casts into the track", "N" },
+  { NULL }
+};
+
+static gboolean
+collect_triangles_cb (GthreeObject *object,
+                      gpointer      user_data)
+{
+  GArray *triangles = user_data;
+  GthreeGeometry *geometry;
+  GthreeAttribute *position, *color, *index;
+  const graphene_matrix_t *world;
+  int count;
+
+  if (!GTHREE_IS_MESH (object))
+    return TRUE;
+
+  geometry = gthree_mesh_get_geometry (GTHREE_MESH (object));
+  position = gthree_geometry_get_position (geometry);
+  color = gthree_geometry_get_color (geometry);
+  index = gthree_geometry_get_index (geometry);
+  world = gthree_object_get_world_matrix (object);
+
+  if (position == NULL)
+    return TRUE;
+
+  if (index)
+    count = gthree_attribute_get_count (index);
+  else
+    count = gthree_attribute_get_count (position);
+
+  for (int i = 0; i + 2 < count; i += 3)
+    {
+      Triangle t;
+
+      for (int j = 0; j < 3; j++)
+        {
+          guint vertex = index ? gthree_attribute_get_uint (index, i + j) : i + j;
+          graphene_point3d_t p;
+
+          graphene_point3d_init (&p,
+                                 gthree_attribute_get_x (position, vertex),
+                                 gthree_attribute_get_y (position, vertex),
+                                 gthree_attribute_get_z (position, vertex));
+          graphene_matrix_transform_point3d (world, &p, &p);
+          graphene_point3d_to_vec3 (&p, &t.v[j]);
+
+          /* Without a color attribute the shader sees the default, black */
+          if (color)
+            graphene_vec3_init (&t.c[j],
+                                gthree_attribute_get_x (color, vertex),
+                                gthree_attribute_get_y (color, vertex),
+                                gthree_attribute_get_z (color, vertex));
+          else
+            graphene_vec3_init (&t.c[j], 0, 0, 0);
+        }
+
+      g_array_append_val (triangles, t);
+    }
+
+  return TRUE;
+}
+
+/* Returns the world space triangles of all meshes under objects called name */
+static GArray *
+collect_triangles (GthreeObject *top,
+                   const char *name)
+{
+  GArray *triangles = g_array_new (FALSE, FALSE, sizeof (Triangle));
+  g_autoptr(GList) objects = NULL;
+  GList *l;
+
+  objects = gthree_object_find_by_name (top, name);
+  for (l = objects; l != NULL; l = l->next)
+    gthree_object_traverse (GTHREE_OBJECT (l->data), collect_triangles_cb, triangles);
+
+  return triangles;
+}
+
+static void
+raster_init (Raster *raster,
+             cairo_surface_t *surface,
+             const graphene_box_t *bounding_box)
+{
+  raster->width = cairo_image_surface_get_width (surface);
+  raster->height = cairo_image_surface_get_height (surface);
+  raster->pixels = (guint32 *)cairo_image_surface_get_data (surface);
+  raster->stride = cairo_image_surface_get_stride (surface) / 4;
+  raster->depth = g_new (float, raster->width * raster->height);
+
+  graphene_box_get_min (bounding_box, &raster->min);
+  graphene_box_get_max (bounding_box, &raster->max);
+}
+
+static void
+raster_clear (Raster *raster,
+              guint32 pixel)
+{
+  for (int y = 0; y < raster->height; y++)
+    for (int x = 0; x < raster->width; x++)
+      {
+        raster->pixels[y * raster->stride + x] = pixel;
+        raster->depth[y * raster->width + x] = -INFINITY;
+      }
+}
+
+/* Same packing as the RGBA depth packing format, the alpha channel has
+ * the most significant byte and red the least */
+static guint32
+pack_depth (double depth)
+{
+  guint32 q = (guint32) CLAMP (depth * 4294967296.0, 0, 4294967295.0);
+
+  return
+    (q & 0xff000000) |
+    (q & 0x000000ff) << 16 |
+    (q & 0x0000ff00) |
+    (q & 0x00ff0000) >> 16;
+}
+
+static guint32
+pack_color (float r, float g, float b)
+{
+  return 0xff000000 |
+    (guint32) (CLAMP (r, 0, 1) * 255 + 0.5) << 16 |
+    (guint32) (CLAMP (g, 0, 1) * 255 + 0.5) << 8 |
+    (guint32) (CLAMP (b, 0, 1) * 255 + 0.5);
+}
+
+/* Twice the signed area of a,b,p in the x,z plane */
+static float
+edge (const graphene_vec3_t *a,
+      const graphene_vec3_t *b,
+      float px, float pz)
+{
+  return
+    (graphene_vec3_get_x (b) - graphene_vec3_get_x (a)) * (pz - graphene_vec3_get_z (a)) -
+    (graphene_vec3_get_z (b) - graphene_vec3_get_z (a)) * (px - graphene_vec3_get_x (a));
+}
+
+/* Gets the barycentric coordinates of px,pz in the x,z projection of v,
+ * returns FALSE if it's outside */
+static gboolean
+barycentric (const graphene_vec3_t v[3],
+             float px, float pz,
+             float w[3])
+{
+  float area = edge (&v[0], &v[1], graphene_vec3_get_x (&v[2]), graphene_vec3_get_z (&v[2]));
+
+  if (fabsf (area) < 1e-12)
+    return FALSE;
+
+  w[0] = edge (&v[1], &v[2], px, pz) / area;
+  w[1] = edge (&v[2], &v[0], px, pz) / area;
+  w[2] = edge (&v[0], &v[1], px, pz) / area;
+
+  return w[0] >= 0 && w[1] >= 0 && w[2] >= 0;
+}
+
+static float
+interpolate (const graphene_vec3_t v[3],
+             const float w[3],
+             int component)
+{
+  float a[3], b[3], c[3];
+
+  graphene_vec3_to_float (&v[0], a);
+  graphene_vec3_to_float (&v[1], b);
+  graphene_vec3_to_float (&v[2], c);
+
+  return w[0] * a[component] + w[1] * b[component] + w[2] * c[component];
+}
+
+/* Pixels are sampled at their centers, and the highest surface wins,
+ * like the orthographic camera looking down with depth testing. The
+ * pixel grid has the same mapping as the lookups in AnalysisMap. */
+static void
+rasterize (Raster *raster,
+           GArray *triangles,
+           ShadeMode mode,
+           const graphene_vec3_t *color)
+{
+  float range = raster->max.y - raster->min.y;
+
+  for (guint i = 0; i < triangles->len; i++)
+    {
+      Triangle *t = &g_array_index (triangles, Triangle, i);
+      graphene_vec3_t v[3];
+      float min_x = G_MAXFLOAT, max_x = -G_MAXFLOAT;
+      float min_z = G_MAXFLOAT, max_z = -G_MAXFLOAT;
+      int x0, x1, y0, y1;
+
+      for (int j = 0; j < 3; j++)
+        {
+          graphene_vec3_init (&v[j],
+                              raster->width * (graphene_vec3_get_x (&t->v[j]) - raster->min.x) / (raster->max.x - raster->min.x),
+                              graphene_vec3_get_y (&t->v[j]),
+                              raster->height * (graphene_vec3_get_z (&t->v[j]) - raster->min.z) / (raster->max.z - raster->min.z));
+          min_x = MIN (min_x, graphene_vec3_get_x (&v[j]));
+          max_x = MAX (max_x, graphene_vec3_get_x (&v[j]));
+          min_z = MIN (min_z, graphene_vec3_get_z (&v[j]));
+          max_z = MAX (max_z, graphene_vec3_get_z (&v[j]));
+        }
+
+      x0 = MAX (floorf (min_x), 0);
+      y0 = MAX (floorf (min_z), 0);
+      x1 = MIN (ceilf (max_x), raster->width - 1);
+      y1 = MIN (ceilf (max_z), raster->height - 1);
+
+      for (int y = y0; y <= y1; y++)
+        for (int x = x0; x <= x1; x++)
+          {
+            float w[3], height;
+            guint32 pixel;
+
+            if (!barycentric (v, x + 0.5, y + 0.5, w))
+              continue;
+
+            height = interpolate (v, w, 1);
+            if (height < raster->depth[y * raster->width + x])
+              continue;
+
+            switch (mode)
+              {
+              case SHADE_DEPTH:
+                pixel = pack_depth ((raster->max.y - height) / range);
+                break;
+              case SHADE_VERTEX_COLORS:
+                pixel = pack_color (interpolate (t->c, w, 0),
+                                    interpolate (t->c, w, 1),
+                                    interpolate (t->c, w, 2));
+                break;
+              case SHADE_COLOR:
+              default:
+                pixel = pack_color (graphene_vec3_get_x (color),
+                                    graphene_vec3_get_y (color),
+                                    graphene_vec3_get_z (color));
+                break;
+              }
+
+            raster->depth[y * raster->width + x] = height;
+            raster->pixels[y * raster->stride + x] = pixel;
+          }
+    }
+}
+
+static void
+triangle_grid_cell (TriangleGrid *grid,
+                    float x, float z,
+                    int *cx, int *cz)
+{
+  *cx = CLAMP ((int) (VERIFY_GRID_SIZE * (x - grid->min.x) / (grid->max.x - grid->min.x)), 0, VERIFY_GRID_SIZE - 1);
+  *cz = CLAMP ((int) (VERIFY_GRID_SIZE * (z - grid->min.z) / (grid->max.z - grid->min.z)), 0, VERIFY_GRID_SIZE - 1);
+}
+
+static void
+triangle_grid_init (TriangleGrid *grid,
+                    GArray *triangles,
+                    const graphene_box_t *bounding_box)
+{
+  graphene_box_get_min (bounding_box, &grid->min);
+  graphene_box_get_max (bounding_box, &grid->max);
+  grid->triangles = triangles;
+
+  for (int i = 0; i < VERIFY_GRID_SIZE * VERIFY_GRID_SIZE; i++)
+    grid->cells[i] = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  for (guint i = 0; i < triangles->len; i++)
+    {
+      Triangle *t = &g_array_index (triangles, Triangle, i);
+      int x0, z0, x1, z1;
+
+      triangle_grid_cell (grid,
+                          MIN (graphene_vec3_get_x (&t->v[0]), MIN (graphene_vec3_get_x (&t->v[1]), graphene_vec3_get_x (&t->v[2]))),
+                          MIN (graphene_vec3_get_z (&t->v[0]), MIN (graphene_vec3_get_z (&t->v[1]), graphene_vec3_get_z (&t->v[2]))),
+                          &x0, &z0);
+      triangle_grid_cell (grid,
+                          MAX (graphene_vec3_get_x (&t->v[0]), MAX (graphene_vec3_get_x (&t->v[1]), graphene_vec3_get_x (&t->v[2]))),
+                          MAX (graphene_vec3_get_z (&t->v[0]), MAX (graphene_vec3_get_z (&t->v[1]), graphene_vec3_get_z (&t->v[2]))),
+                          &x1, &z1);
+
+      for (int z = z0; z <= z1; z++)
+        for (int x = x0; x <= x1; x++)
+          g_array_append_val (grid->cells[z * VERIFY_GRID_SIZE + x], i);
+    }
+}
+
+static void
+triangle_grid_destroy (TriangleGrid *grid)
+{
+  for (int i = 0; i < VERIFY_GRID_SIZE * VERIFY_GRID_SIZE; i++)
+    g_array_unref (grid->cells[i]);
+}
+
+/* Casts a ray straight down at x,z and returns the height of the
+ * highest triangle it hits, or FALSE if there is none */
+static gboolean
+triangle_grid_raycast (TriangleGrid *grid,
+                       float x, float z,
+                       float *height)
+{
+  GArray *cell;
+  gboolean hit = FALSE;
+  int cx, cz;
+
+  triangle_grid_cell (grid, x, z, &cx, &cz);
+  cell = grid->cells[cz * VERIFY_GRID_SIZE + cx];
+
+  for (guint i = 0; i < cell->len; i++)
+    {
+      Triangle *t = &g_array_index (grid->triangles, Triangle, g_array_index (cell, guint, i));
+      float w[3], h;
+
+      if (!barycentric (t->v, x, z, w))
+        continue;
+
+      h = interpolate (t->v, w, 1);
+      if (!hit || h > *height)
+        *height = h;
+      hit = TRUE;
+    }
+
+  return hit;
+}
+
+static int
+compare_float (gconstpointer a,
+               gconstpointer b)
+{
+  float fa = *(const float *)a, fb = *(const float *)b;
+
+  return (fa > fb) - (fa < fb);
+}
+
+/* Reports how far the filtered heights of the map are from the actual
+ * track surface, at random points where the track exists */
+static void
+verify_heights (AnalysisMap *height_map,
+                GArray *triangles,
+                const graphene_box_t *bounding_box)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (1);
+  g_autoptr(GArray) errors = g_array_new (FALSE, FALSE, sizeof (float));
+  graphene_point3d_t min, max;
+  TriangleGrid grid;
+  double sum = 0;
+  int misses = 0;
+
+  graphene_box_get_min (bounding_box, &min);
+  graphene_box_get_max (bounding_box, &max);
+  triangle_grid_init (&grid, triangles, bounding_box);
+
+  for (int i = 0; i < verify_samples; i++)
+    {
+      float x = g_rand_double_range (rand, min.x, max.x);
+      float z = g_rand_double_range (rand, min.z, max.z);
+      float expected, error;
+
+      if (!triangle_grid_raycast (&grid, x, z, &expected))
+        {
+          misses++;
+          continue;
+        }
+
+      error = fabsf (analysis_map_lookup_depthmapped (height_map, x, z) - expected);
+      g_array_append_val (errors, error);
+      sum += error;
+    }
+
+  triangle_grid_destroy (&grid);
+
+  if (errors->len == 0)
+    {
+      g_print ("verify: no samples hit the track\n");
+      return;
+    }
+
+  /* The max is dominated by points next to the edges of the track,
+   * where the filter mixes in the background, so show percentiles too */
+  g_array_sort (errors, compare_float);
+  g_print ("verify: %u samples on the track, %d off it\n", errors->len, misses);
+  g_print ("verify: height error mean %g, median %g, 99%% %g, max %g (map height range %g)\n",
+           sum / errors->len,
+           g_array_index (errors, float, errors->len / 2),
+           g_array_index (errors, float, (guint) (errors->len * 0.99)),
+           g_array_index (errors, float, errors->len - 1),
+           max.y - min.y);
+}
+
+static void
+report_memory_size (const char *name,
+                    AnalysisMap *map)
+{
+  gsize size, dense_size;
+
+  size = analysis_map_get_memory_size (map, &dense_size);
+  g_print ("%s map: %" G_GSIZE_FORMAT " KiB, %" G_GSIZE_FORMAT " KiB if dense\n",
+           name, size / 1024, dense_size / 1024);
+}
+
+static gboolean
+bake (GthreeObject *track,
+      AnalysisMapPrecision height_precision,
+      const char *key,
+      const char *height_path,
+      const char *collision_path,
+      const char *racing_line_path,
+      GError **error)
+{
+  g_autoptr(GArray) tracks = NULL;
+  g_autoptr(GArray) bonus_bases = NULL;
+  graphene_box_t bounding_box;
+  graphene_vec3_t red;
+  cairo_surface_t *surface;
+  AnalysisMap *height_map, *collision_map;
+  RacingLine *racing_line;
+  Raster raster;
+  gboolean res;
+
+  gthree_object_update_matrix_world (track, FALSE);
+  analysis_map_get_track_extents (track, &bounding_box);
+
+  tracks = collect_triangles (track, "tracks");
+  bonus_bases = collect_triangles (track, "bonus-base");
+
+  surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, size, size);
+  raster_init (&raster, surface, &bounding_box);
+
+  /* Same passes as generate_analysis_maps() in the game. Heights are
+   * the tracks on a white (farthest) background. */
+  raster_clear (&raster, 0xffffffff);
+  rasterize (&raster, tracks, SHADE_DEPTH, NULL);
+
+  cairo_surface_mark_dirty (surface);
+  height_map = analysis_map_new (surface, &bounding_box, ANALYSIS_MAP_HEIGHT,
+                                ANALYSIS_MAP_LAYOUT_SPARSE);
+  analysis_map_set_height_precision (height_map, height_precision);
+
+  /* The collision colors are the vertex colors of the tracks, with the
+   * bonus bases on top in red, on black */
+  raster_clear (&raster, 0xff000000);
+  rasterize (&raster, tracks, SHADE_VERTEX_COLORS, NULL);
+  rasterize (&raster, bonus_bases, SHADE_COLOR, graphene_vec3_init (&red, 1, 0, 0));
+
+  cairo_surface_mark_dirty (surface);
+  collision_map = analysis_map_new (surface, &bounding_box, ANALYSIS_MAP_COLLISION,
+                                   ANALYSIS_MAP_LAYOUT_SPARSE);
+  analysis_map_build_distance_field (collision_map, ANALYSIS_MASK_RIDEABLE);
+
+  g_free (raster.depth);
+  cairo_surface_destroy (surface);
+
+  report_memory_size ("height", height_map);
+  report_memory_size ("collision", collision_map);
+
+  if (verify_samples > 0)
+    verify_heights (height_map, tracks, &bounding_box);
+
+  racing_line = racing_line_new_from_map (collision_map, SIM_START_X, SIM_START_Z, 0, error);
+
+  res =
+    racing_line != NULL &&
+    analysis_map_save (height_map, height_path, key, error) &&
+    analysis_map_save (collision_map, collision_path, key, error) &&
+    racing_line_save (racing_line, racing_line_path, key, error);
+
+  g_clear_pointer (&racing_line, racing_line_unref);
+  analysis_map_unref (height_map);
+  analysis_map_unref (collision_map);
+
+  return res;
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GFile) parent = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GthreeLoader) loader = NULL;
+  g_autofree char *key = NULL;
+  g_autofree char *height_path = NULL;
+  g_autofree char *collision_path = NULL;
+  g_autofree char *racing_line_path = NULL;
+  AnalysisMapPrecision height_precision;
+  GthreeObject *track;
+
+  context = g_option_context_new ("TRACK.glb OUTPUT-DIR - bake analysis maps");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  if (precision == NULL || strcmp (precision, "float") == 0)
+    height_precision = ANALYSIS_MAP_PRECISION_FLOAT;
+  else if (strcmp (precision, "16bit") == 0)
+    height_precision = ANALYSIS_MAP_PRECISION_16BIT;
+  else
+    {
+      g_printerr ("Unknown precision %s, use float or 16bit\n", precision);
+      return EXIT_FAILURE;
+    }
+
+  if (argc != 3 || size <= 0)
+    {
+      g_autofree char *help = g_option_context_get_help (context, TRUE, NULL);
+      g_printerr ("%s", help);
+      return EXIT_FAILURE;
+    }
+
+  file = g_file_new_for_commandline_arg (argv[1]);
+  parent = g_file_get_parent (file);
+  bytes = g_file_load_bytes (file, NULL, NULL, &error);
+  if (bytes == NULL)
+    {
+      g_printerr ("Failed to load %s: %s\n", argv[1], error->message);
+      return EXIT_FAILURE;
+    }
+
+  loader = gthree_loader_parse_gltf (bytes, parent, &error);
+  if (loader == NULL)
+    {
+      g_printerr ("Failed to parse %s: %s\n", argv[1], error->message);
+      return EXIT_FAILURE;
+    }
+
+  track = GTHREE_OBJECT (gthree_loader_get_scene (loader, 0));
+
+  /* Must match the key the game computes for the installed model */
+  key = analysis_map_make_key (argv[1]);
+  height_path = g_build_filename (argv[2], "height.map", NULL);
+  collision_path = g_build_filename (argv[2], "collision.map", NULL);
+  racing_line_path = g_build_filename (argv[2], "racing.line", NULL);
+
+  if (!bake (track, height_precision, key, height_path, collision_path, racing_line_path, &error))
+    {
+      g_printerr ("Failed to bake analysis maps: %s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,579 @@
+/* hexgl-sim: runs replays through the ship simulation without a display
+ *
+ * Each replay is simulated as fast as possible on the baked analysis
+ * maps, and the state it ends in is printed, so recorded races can be
+ * used to check that changes to the physics don't change the outcome,
+ * and to time it. With --ships it also times many ships raced together,
+ * for the cost per ship as their number grows.
+ *
+ * With --ai there need not be any replays, the ships are flown by the
+ * computer pilot along the racing line instead, for soak testing the
+ * physics and the pilot over many laps. With --pack the ships start
+ * packed together behind the start line, for timing how they bump into
+ * each other. With --spike one step a second is made that many times
+ * longer, like after a frame hitch, and no ship may go through a wall in
+ * it.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aipilot.h"
+#include "analysismap.h"
+#include "racingline.h"
+#include "replay.h"
+#include "ships.h"
+#include "shipprofiles.h"
+#include "sim.h"
+
+static char *maps_dir = NULL;
+static int repeat = 1;
+static int max_ships = 0;
+static int ai_laps = 0;
+static int difficulty = 0;
+static char *track_path = NULL;
+static char *profiles_path = NULL;
+static gboolean pack = FALSE;
+static int spike = 0;
+
+static GOptionEntry entries[] = {
+  { "maps", 'm', 0, G_OPTION_ARG_FILENAME, &maps_dir, "Directory with height.map and collision.map", "DIR" },
+  { "repeat", 'r', 0, G_OPTION_ARG_INT, &repeat, "Run each replay N times, for timing", "N" },
+  { "ships", 's', 0, G_OPTION_ARG_INT, &max_ships, "Also time 1, 2, 4... up to N ships racing the replay together", "N" },
+  { "ai", 'a', 0, G_OPTION_ARG_INT, &ai_laps, "Have the computer pilot fly N laps, with as many ships as --ships", "N" },
+  { "difficulty", 'd', 0, G_OPTION_ARG_INT, &difficulty, "Difficulty for --ai, 0 or 1", "N" },
+  { "track", 't', 0, G_OPTION_ARG_FILENAME, &track_path, "Track the maps were made from, for --ai", "FILE" },
+  { "profiles", 0, 0, G_OPTION_ARG_FILENAME, &profiles_path, "Ship handling for --ai instead of the installed one", "FILE" },
+  { "pack", 'p', 0, G_OPTION_ARG_NONE, &pack, "Start the --ai ships packed behind the start line", NULL },
+  { "spike", 0, 0, G_OPTION_ARG_INT, &spike, "Make one --ai step a second N times longer, and check no ship goes through a wall", "N" },
+  { NULL }
+};
+
+static gboolean
+same_outcome (const SimState *a,
+              const SimState *b)
+{
+  return memcmp (&a->position, &b->position, sizeof (graphene_point3d_t)) == 0 &&
+    a->yaw == b->yaw && a->shield == b->shield;
+}
+
+/* The wall response of the game needs the distance field, the sim's
+ * fallback for maps without one doesn't replay the same */
+static AnalysisMap *
+load_collision_map (const char *path,
+                    const char *key,
+                    GError **error)
+{
+  AnalysisMap *map;
+
+  map = analysis_map_new_from_file (path, key, error);
+  if (map != NULL && !analysis_map_has_distance_field (map))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s has no distance field", path);
+      g_clear_pointer (&map, analysis_map_unref);
+    }
+
+  return map;
+}
+
+/* Races n_ships copies of the replay together, spread evenly along it so
+ * they are on different parts of the track like in a real race. The
+ * first one starts at the beginning, and has to end up where the replay
+ * on its own did. */
+static gboolean
+run_ships (const char *path,
+           Replay *replay,
+           AnalysisMap *height_map,
+           AnalysisMap *collision_map,
+           guint n_ships,
+           const SimState *expected,
+           GError **error)
+{
+  guint n_steps = replay_get_n_steps (replay);
+  guint active_step = replay_get_active_step (replay);
+  g_autofree guint *offsets = g_new (guint, n_ships);
+  graphene_vec3_t position;
+  float yaw;
+  Ships *ships;
+  gint64 start_time, elapsed;
+  gboolean res = TRUE;
+  guint i, step;
+
+  ships = ships_new ();
+  ships_set_maps (ships, height_map, collision_map);
+  /* They are copies of the same ship, and meet a lap apart */
+  ships_set_collisions (ships, FALSE);
+  replay_get_start (replay, &position, &yaw);
+
+  for (i = 0; i < n_ships; i++)
+    {
+      guint ship = ships_add (ships);
+      SimState *state = ships_get_state (ships, ship);
+
+      sim_state_set_difficulty (state, replay_get_difficulty (replay));
+      state->params = *replay_get_params (replay);
+      ships_reset (ships, ship, &position, yaw);
+
+      offsets[i] = (guint64)n_steps * i / n_ships;
+      for (step = 0; step < offsets[i]; step++)
+        {
+          if (step == active_step)
+            state->active = TRUE;
+          sim_step (state, replay_get_step (replay, step), 1.0);
+        }
+    }
+
+  start_time = g_get_monotonic_time ();
+
+  for (step = 0; step < n_steps; step++)
+    {
+      for (i = 0; i < n_ships; i++)
+        {
+          guint replay_step = offsets[i] + step;
+
+          if (replay_step == active_step)
+            ships_get_state (ships, i)->active = TRUE;
+
+          /* The ones that started along the way coast past the end */
+          ships_set_input (ships, i,
+                           replay_step < n_steps ? replay_get_step (replay, replay_step) : 0);
+        }
+
+      ships_update (ships, 1.0);
+    }
+
+  elapsed = g_get_monotonic_time () - start_time;
+
+  if (!same_outcome (ships_get_state (ships, 0), expected))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "%s did not replay the same way with %u ships", path, n_ships);
+      res = FALSE;
+    }
+  else
+    g_print ("%s: %u ships, %.0f ns per ship step\n", path, n_ships,
+             (double)elapsed * 1000 / MAX ((guint64)n_steps * n_ships, 1));
+
+  ships_free (ships);
+
+  return res;
+}
+
+static gboolean
+run_replay (const char *path,
+            GError **error)
+{
+  g_autofree char *height_path = g_build_filename (maps_dir, "height.map", NULL);
+  g_autofree char *collision_path = g_build_filename (maps_dir, "collision.map", NULL);
+  AnalysisMap *height_map, *collision_map;
+  Replay *replay;
+  SimState state, first;
+  gint64 start_time, elapsed;
+  gboolean res = TRUE;
+
+  replay = replay_new_from_file (path, error);
+  if (replay == NULL)
+    return FALSE;
+
+  height_map = analysis_map_new_from_file (height_path, replay_get_key (replay), error);
+  if (height_map == NULL)
+    {
+      replay_free (replay);
+      return FALSE;
+    }
+
+  collision_map = load_collision_map (collision_path, replay_get_key (replay), error);
+  if (collision_map == NULL)
+    {
+      analysis_map_unref (height_map);
+      replay_free (replay);
+      return FALSE;
+    }
+
+  start_time = g_get_monotonic_time ();
+
+  for (int i = 0; i < repeat; i++)
+    {
+      sim_state_init (&state);
+      state.height_map = height_map;
+      state.collision_map = collision_map;
+
+      replay_run (replay, &state);
+
+      if (i == 0)
+        first = state;
+      else if (!same_outcome (&state, &first))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "%s did not replay the same way twice", path);
+          res = FALSE;
+          break;
+        }
+    }
+
+  elapsed = g_get_monotonic_time () - start_time;
+
+  if (res)
+    {
+      g_print ("%s: %u steps, position %.9g %.9g %.9g, yaw %.9g, speed %.9g, shield %.9g, checkpoint %d%s\n",
+               path, replay_get_n_steps (replay),
+               state.position.x, state.position.y, state.position.z,
+               state.yaw, state.speed, state.shield, state.check_point,
+               state.destroyed ? ", destroyed" : "");
+      g_print ("%s: %.0f steps/s\n", path,
+               (double)replay_get_n_steps (replay) * repeat * G_USEC_PER_SEC / MAX (elapsed, 1));
+    }
+
+  for (guint n_ships = 1; res && max_ships > 0; n_ships = MIN (n_ships * 2, (guint)max_ships))
+    {
+      res = run_ships (path, replay, height_map, collision_map, n_ships, &state, error);
+      if (n_ships == (guint)max_ships)
+        break;
+    }
+
+  analysis_map_unref (height_map);
+  analysis_map_unref (collision_map);
+  replay_free (replay);
+
+  return res;
+}
+
+/* A lap is over when checkpoint 0 comes right after this one */
+#define AI_LAST_CHECK_POINT 2
+/* Ships taking longer than this for a lap are stuck */
+#define AI_MAX_LAP_SECONDS 300
+
+typedef struct {
+  int laps;
+  int check_point;
+  /* Step the current lap started at, or -1 before the first one */
+  gint64 lap_start;
+  gint64 best_lap;
+  guint crashes;
+  guint bumps;
+  /* Steps that went through a wall, with --spike */
+  guint walls_crossed;
+  /* Finished, or destroyed */
+  gboolean done;
+} AiRace;
+
+static RacingLine *
+load_racing_line (AnalysisMap *collision_map,
+                  const char *key,
+                  GError **error)
+{
+  g_autofree char *path = g_build_filename (maps_dir, "racing.line", NULL);
+  g_autoptr(GError) local_error = NULL;
+  RacingLine *line;
+  gint64 start_time;
+
+  line = racing_line_new_from_file (path, key, &local_error);
+  if (line != NULL)
+    return line;
+
+  g_print ("ai: Not using %s: %s\n", path, local_error->message);
+
+  start_time = g_get_monotonic_time ();
+  line = racing_line_new_from_map (collision_map, SIM_START_X, SIM_START_Z, 0, error);
+  if (line != NULL)
+    g_print ("ai: Traced racing line of %u points in %.1f ms\n",
+             racing_line_get_n_points (line),
+             (g_get_monotonic_time () - start_time) / 1000.0);
+
+  return line;
+}
+
+/* Ships packed at the start are this many abreast, this far apart */
+#define AI_PACK_ABREAST 4
+#define AI_PACK_SPACING_X (3 * SIM_SHIP_RADIUS)
+#define AI_PACK_SPACING_Z (3 * SIM_SHIP_HALF_LENGTH)
+
+/* Whether x0,z0 to x1,z1 goes into a wall and out onto the track again,
+ * looked at every half unit rather than with analysis_map_trace_class(),
+ * which is what is being checked. Over the void ships may go. */
+static gboolean
+crosses_wall (AnalysisMap *collision_map,
+              float x0, float z0,
+              float x1, float z1)
+{
+  int n = ceilf (hypotf (x1 - x0, z1 - z0) * 2);
+  gboolean in_wall = FALSE;
+
+  for (int i = 1; i <= n; i++)
+    {
+      float t = (float)i / n;
+      guint32 mask = analysis_map_lookup_class_mask (collision_map,
+                                                     x0 + (x1 - x0) * t,
+                                                     z0 + (z1 - z0) * t);
+
+      if (mask == ANALYSIS_CLASS_MASK (ANALYSIS_CLASS_WALL))
+        in_wall = TRUE;
+      else if (in_wall && (mask & ANALYSIS_MASK_RIDEABLE) != 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Starts the ships spread evenly along the line, so they go over
+ * different parts of the track at the same time, or with pack in rows
+ * behind the start */
+static void
+start_ai_ships (Ships *ships,
+                RacingLine *line,
+                AiRace *races,
+                guint n_ships)
+{
+  float length = racing_line_get_length (line);
+  float start = racing_line_find (line, SIM_START_X, SIM_START_Z);
+
+  for (guint i = 0; i < n_ships; i++)
+    {
+      guint ship = ships_add (ships);
+      SimState *state = ships_get_state (ships, ship);
+      graphene_vec3_t position;
+      float s, x, z, ahead_x, ahead_z, hx, hz, d, across = 0;
+
+      if (pack)
+        {
+          s = start - (i / AI_PACK_ABREAST) * AI_PACK_SPACING_Z;
+          across = ((i % AI_PACK_ABREAST) - (AI_PACK_ABREAST - 1) / 2.0f) * AI_PACK_SPACING_X;
+        }
+      else
+        s = start + length * i / n_ships;
+
+      racing_line_get_position (line, s, &x, &z);
+      racing_line_get_position (line, s + racing_line_get_spacing (line), &ahead_x, &ahead_z);
+      hx = ahead_x - x;
+      hz = ahead_z - z;
+      d = sqrtf (hx * hx + hz * hz);
+
+      /* To the left is hz,-hx */
+      graphene_vec3_init (&position, x + hz / d * across, SIM_START_Y, z - hx / d * across);
+
+      sim_state_set_difficulty (state, difficulty);
+      ships_reset (ships, ship, &position, atan2f (hx, hz));
+      state->active = TRUE;
+
+      /* Packed ships are behind the line as if finishing a lap, and time
+       * from crossing it. Spread out only the first starts on it, the
+       * rest time from the next lap. */
+      races[i].check_point = pack ? AI_LAST_CHECK_POINT : -1;
+      races[i].lap_start = i == 0 && !pack ? 0 : -1;
+      races[i].best_lap = G_MAXINT64;
+    }
+}
+
+static gboolean
+run_ai (GError **error)
+{
+  g_autofree char *height_path = g_build_filename (maps_dir, "height.map", NULL);
+  g_autofree char *collision_path = g_build_filename (maps_dir, "collision.map", NULL);
+  g_autofree char *key = NULL;
+  g_autofree AiRace *races = NULL;
+  AnalysisMap *height_map = NULL, *collision_map = NULL;
+  RacingLine *line = NULL;
+  AiPilot *pilot = NULL;
+  Ships *ships = NULL;
+  guint n_ships = MAX (max_ships, 1);
+  g_autofree graphene_point3d_t *previous = NULL;
+  guint n_finished = 0, n_done = 0, walls_crossed = 0;
+  gint64 step, max_steps, start_time, elapsed;
+  gboolean res = FALSE;
+
+  key = analysis_map_make_key (track_path);
+  if (key == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Can't read %s", track_path);
+      return FALSE;
+    }
+
+  height_map = analysis_map_new_from_file (height_path, key, error);
+  if (height_map == NULL)
+    goto out;
+
+  collision_map = load_collision_map (collision_path, key, error);
+  if (collision_map == NULL)
+    goto out;
+
+  line = load_racing_line (collision_map, key, error);
+  if (line == NULL)
+    goto out;
+
+  /* The pilot keeps nothing about the ship it flies, so one does for all */
+  pilot = ai_pilot_new (line);
+  ships = ships_new ();
+  ships_set_maps (ships, height_map, collision_map);
+  races = g_new0 (AiRace, n_ships);
+  previous = g_new0 (graphene_point3d_t, n_ships);
+  start_ai_ships (ships, line, races, n_ships);
+
+  /* Most start partway, and need up to a lap more */
+  max_steps = (gint64)(ai_laps + 1) * AI_MAX_LAP_SECONDS * 1000 / SIM_STEP_MS;
+  start_time = g_get_monotonic_time ();
+
+  for (step = 0; step < max_steps && n_done < n_ships; step++)
+    {
+      gboolean spiked = spike > 1 && step % (int)(1000 / SIM_STEP_MS) == 0;
+
+      for (guint i = 0; i < n_ships; i++)
+        {
+          ships_set_input (ships, i, ai_pilot_get_input (pilot, ships_get_state (ships, i)));
+          previous[i] = ships_get_state (ships, i)->position;
+        }
+
+      ships_update (ships, spiked ? spike : 1.0);
+
+      for (guint i = 0; i < n_ships; i++)
+        {
+          const SimState *state = ships_get_state (ships, i);
+          AiRace *race = &races[i];
+          int cp = state->check_point;
+
+          if (race->done)
+            continue;
+
+          if (ships_get_events (ships, i) & SIM_EVENT_CRASH)
+            race->crashes++;
+
+          if (ships_get_events (ships, i) & SIM_EVENT_BUMP)
+            race->bumps++;
+
+          if (spiked && crosses_wall (collision_map,
+                                      previous[i].x, previous[i].z,
+                                      state->position.x, state->position.z))
+            {
+              race->walls_crossed++;
+              walls_crossed++;
+            }
+
+          if (state->destroyed)
+            {
+              race->done = TRUE;
+              n_done++;
+              continue;
+            }
+
+          if (cp == 0 && race->check_point == AI_LAST_CHECK_POINT)
+            {
+              if (race->lap_start >= 0)
+                {
+                  race->best_lap = MIN (race->best_lap, step + 1 - race->lap_start);
+                  race->laps++;
+                  if (race->laps == ai_laps)
+                    {
+                      race->done = TRUE;
+                      n_finished++;
+                      n_done++;
+                    }
+                }
+
+              race->lap_start = step + 1;
+            }
+
+          if (cp != -1)
+            race->check_point = cp;
+        }
+    }
+
+  elapsed = g_get_monotonic_time () - start_time;
+
+  for (guint i = 0; i < n_ships; i++)
+    {
+      const AiRace *race = &races[i];
+
+      g_print ("ai: ship %u, %d laps, best lap %.2f s, %u crashes, %u bumps, %u through walls%s\n",
+               i, race->laps,
+               race->laps > 0 ? race->best_lap * SIM_STEP_MS / 1000 : 0.0,
+               race->crashes, race->bumps, race->walls_crossed,
+               ships_get_state (ships, i)->destroyed ? ", destroyed" : "");
+    }
+
+  g_print ("ai: %u ships, %" G_GINT64_FORMAT " steps, %.0f ns per ship step\n", n_ships, step,
+           (double)elapsed * 1000 / MAX (step * n_ships, 1));
+
+  if (n_finished < n_ships)
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "%u of %u ships did not finish %d laps", n_ships - n_finished, n_ships, ai_laps);
+  else if (walls_crossed > 0)
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Ships went through walls %u times", walls_crossed);
+  else
+    res = TRUE;
+
+ out:
+  g_clear_pointer (&ships, ships_free);
+  g_clear_pointer (&pilot, ai_pilot_free);
+  g_clear_pointer (&line, racing_line_unref);
+  g_clear_pointer (&collision_map, analysis_map_unref);
+  g_clear_pointer (&height_map, analysis_map_unref);
+
+  return res;
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  int status = EXIT_SUCCESS;
+
+  context = g_option_context_new ("[REPLAY...] - simulate replays headless");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  if ((argc < 2 && ai_laps <= 0) || repeat <= 0 || ai_laps < 0 || spike < 0)
+    {
+      g_autofree char *help = g_option_context_get_help (context, TRUE, NULL);
+      g_printerr ("%s", help);
+      return EXIT_FAILURE;
+    }
+
+  if (maps_dir == NULL)
+    maps_dir = g_build_filename (DATADIR, "maps", NULL);
+
+  if (track_path == NULL)
+    track_path = g_build_filename (DATADIR, "models", "tracks", "cityscape", "cityscape.glb", NULL);
+
+  /* The game races with the installed handling if there is one, and
+   * the built in one otherwise, so --ai needs the same here. Replays
+   * bring the handling they were recorded with. */
+  if (profiles_path == NULL)
+    {
+      profiles_path = g_build_filename (DATADIR, "profiles", "ships.ini", NULL);
+      if (!g_file_test (profiles_path, G_FILE_TEST_EXISTS))
+        g_clear_pointer (&profiles_path, g_free);
+    }
+
+  if (profiles_path != NULL && !ship_profiles_load (profiles_path, &error))
+    {
+      g_printerr ("Failed to load ship profiles: %s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  if (ai_laps > 0 && !run_ai (&error))
+    {
+      g_printerr ("Failed to run the computer pilot: %s\n", error->message);
+      g_clear_error (&error);
+      status = EXIT_FAILURE;
+    }
+
+  for (int i = 1; i < argc; i++)
+    {
+      if (!run_replay (argv[i], &error))
+        {
+          g_printerr ("Failed to run %s: %s\n", argv[i], error->message);
+          g_clear_error (&error);
+          status = EXIT_FAILURE;
+        }
+    }
+
+  return status;
+}
@@ -0,0 +1,350 @@
+#include <math.h>
+#include <string.h>
+#include "particlepool.h"
+#include "shaders.h"
+
+/* The attributes hold what each particle was added with: position,
+ * velocity, colour, the time and frame it was added, and its size, tile
+ * and ageing. The particles are kept in a ring in the order they were
+ * added, the live ones being the used slots before head. A particle
+ * that dies before older ones keeps its slot until they have gone too,
+ * the shader hides it. */
+struct _ParticlePool {
+  GthreeShaderMaterial *material;
+  GthreeUniforms *uniforms;
+  GthreePoints *points;
+  GthreeGeometry *geometry;
+
+  GthreeAttribute *position_attr;
+  GthreeAttribute *velocity_attr;
+  GthreeAttribute *color_attr;
+  GthreeAttribute *spawn_time_attr;
+  GthreeAttribute *style_attr;
+
+  /* The frame each slot dies in */
+  int *death_frames;
+  int size;
+  /* How many of the slots the emitters have taken with
+   * particle_pool_grow(), at most size */
+  int reserved;
+  int head;
+  int used;
+  /* How many particles were live at the last update */
+  int drawn;
+  /* The slots added to since the last update, to upload */
+  int dirty_start;
+  int dirty_end;
+  /* Since the ring last emptied. frame counts updates, as the ageing is
+   * per update, and time adds up their dt for the motion. */
+  int frame;
+  float time;
+  /* The dt of the last update */
+  float dt;
+};
+
+static int
+pool_tail (ParticlePool *pool)
+{
+  return (pool->head - pool->used + pool->size) % pool->size;
+}
+
+/* Makes attr hold size items, with the live ones first in the order
+ * they were added */
+static GthreeAttribute *
+resize_attribute (ParticlePool *pool,
+                  GthreeAttribute *old,
+                  const char *name,
+                  int item_size,
+                  int size)
+{
+  GthreeAttribute *attr;
+
+  attr = gthree_attribute_new (name, GTHREE_ATTRIBUTE_TYPE_FLOAT, size, item_size, FALSE);
+
+  if (old != NULL)
+    {
+      const float *from = gthree_attribute_peek_float (old);
+      float *to = gthree_attribute_peek_float (attr);
+      int tail = pool_tail (pool);
+      int first = MIN (pool->used, pool->size - tail);
+
+      memcpy (to, from + tail * item_size, first * item_size * sizeof (float));
+      memcpy (to + first * item_size, from, (pool->used - first) * item_size * sizeof (float));
+    }
+
+  gthree_geometry_add_attribute (pool->geometry, name, attr);
+  g_clear_object (&old);
+
+  return attr;
+}
+
+/* Makes room for extra more particles. The live ones are kept, so this
+ * can be done at any time, such as when another ship joins. Room given
+ * back by particle_pool_shrink() is used first. */
+void
+particle_pool_grow (ParticlePool *pool,
+                    int extra)
+{
+  int size;
+  int *death_frames;
+  int tail;
+
+  if (extra <= 0)
+    return;
+
+  pool->reserved += extra;
+  if (pool->reserved <= pool->size)
+    return;
+
+  size = pool->reserved;
+
+  pool->position_attr = resize_attribute (pool, pool->position_attr, "position", 3, size);
+  pool->velocity_attr = resize_attribute (pool, pool->velocity_attr, "velocity", 3, size);
+  pool->color_attr = resize_attribute (pool, pool->color_attr, "spawn_color", 3, size);
+  pool->spawn_time_attr = resize_attribute (pool, pool->spawn_time_attr, "spawn_time", 2, size);
+  pool->style_attr = resize_attribute (pool, pool->style_attr, "style", 3, size);
+
+  death_frames = g_new0 (int, size);
+  if (pool->size > 0)
+    {
+      tail = pool_tail (pool);
+      for (int i = 0; i < pool->used; i++)
+        death_frames[i] = pool->death_frames[(tail + i) % pool->size];
+    }
+  g_free (pool->death_frames);
+  pool->death_frames = death_frames;
+
+  /* The new attributes are all uploaded */
+  pool->size = size;
+  pool->head = pool->used % pool->size;
+  pool->dirty_start = pool->dirty_end = 0;
+  if (pool->used > 0)
+    gthree_geometry_set_draw_range (pool->geometry, 0, pool->used);
+  gthree_geometry_invalidate_bounds (pool->geometry);
+}
+
+ParticlePool *
+particle_pool_new (int max)
+{
+  ParticlePool *pool = g_new0 (ParticlePool, 1);
+  g_autoptr(GthreeShader) shader = particles_shader_clone ();
+
+  pool->uniforms = gthree_shader_get_uniforms (shader);
+  pool->material = gthree_shader_material_new (shader);
+  gthree_material_set_depth_test (GTHREE_MATERIAL (pool->material), FALSE);
+
+  pool->geometry = gthree_geometry_new ();
+  particle_pool_grow (pool, max);
+  gthree_geometry_set_draw_range (pool->geometry, 0, 0);
+
+  pool->points = gthree_points_new (pool->geometry, GTHREE_MATERIAL (pool->material));
+
+  return pool;
+}
+
+void
+particle_pool_free (ParticlePool *pool)
+{
+  g_clear_object (&pool->points);
+  g_clear_object (&pool->material);
+  g_clear_object (&pool->position_attr);
+  g_clear_object (&pool->velocity_attr);
+  g_clear_object (&pool->color_attr);
+  g_clear_object (&pool->spawn_time_attr);
+  g_clear_object (&pool->style_attr);
+  g_clear_object (&pool->geometry);
+  g_free (pool->death_frames);
+  g_free (pool);
+}
+
+GthreeObject *
+particle_pool_get_object (ParticlePool *pool)
+{
+  return GTHREE_OBJECT (pool->points);
+}
+
+/* The texture for all the particles, n_tiles images side by side, which
+ * each particle picks one of */
+void
+particle_pool_set_atlas (ParticlePool *pool,
+                         GthreeTexture *atlas,
+                         int n_tiles)
+{
+  gthree_uniforms_set_texture (pool->uniforms, "map", atlas);
+  gthree_uniforms_set_float (pool->uniforms, "tiles", n_tiles);
+}
+
+/* The points material scales the size by half the viewport height, the
+ * shader has to be told it */
+void
+particle_pool_set_viewport_height (ParticlePool *pool,
+                                   int height)
+{
+  gthree_uniforms_set_float (pool->uniforms, "scale", height * 0.5f);
+}
+
+/* Gives back room for extra particles, such as when a ship leaves. The
+ * slots are kept for the next particle_pool_grow(). The particles live
+ * now still die in their own time, only fewer can be added until then. */
+void
+particle_pool_shrink (ParticlePool *pool,
+                      int extra)
+{
+  pool->reserved = MAX (0, pool->reserved - MAX (extra, 0));
+}
+
+/* How many more particles can be added before some die */
+int
+particle_pool_get_free (ParticlePool *pool)
+{
+  return MAX (0, pool->reserved - pool->used);
+}
+
+/* The number of updates a particle ageing this much lives for, with the
+ * same test as the shader */
+static int
+life_frames (float ageing)
+{
+  int n;
+
+  if (ageing <= 0)
+    return G_MAXINT;
+
+  n = MAX (1, (int) ceilf (1 / ageing));
+  while (1.0f - ageing * n > 0)
+    n++;
+  while (n > 1 && 1.0f - ageing * (n - 1) <= 0)
+    n--;
+
+  return n;
+}
+
+/* Adds a particle, it is uploaded by the next update. There must be a
+ * free slot. */
+void
+particle_pool_add (ParticlePool *pool,
+                   const float *position,
+                   const float *velocity,
+                   const float *color,
+                   float size,
+                   int tile,
+                   float ageing)
+{
+  int j;
+  float *spawn_time, *style;
+
+  g_return_if_fail (pool->used < pool->size);
+
+  /* Start the clock again while nothing is live, so the times stay
+   * small. The ring is refilled from the start, so every slot gets
+   * written before it wraps and no slot drawn is from before. */
+  if (pool->used == 0)
+    {
+      pool->head = 0;
+      pool->frame = 0;
+      pool->time = 0;
+    }
+
+  j = pool->head;
+
+  memcpy (gthree_attribute_peek_float (pool->position_attr) + j * 3, position, 3 * sizeof (float));
+  memcpy (gthree_attribute_peek_float (pool->velocity_attr) + j * 3, velocity, 3 * sizeof (float));
+  memcpy (gthree_attribute_peek_float (pool->color_attr) + j * 3, color, 3 * sizeof (float));
+
+  spawn_time = gthree_attribute_peek_float (pool->spawn_time_attr) + j * 2;
+  spawn_time[0] = pool->time;
+  spawn_time[1] = pool->frame;
+
+  style = gthree_attribute_peek_float (pool->style_attr) + j * 3;
+  style[0] = size;
+  style[1] = tile;
+  style[2] = ageing;
+
+  pool->death_frames[j] = pool->frame + MIN (life_frames (ageing), G_MAXINT - pool->frame);
+
+  if (pool->dirty_end == pool->dirty_start)
+    {
+      pool->dirty_start = j;
+      pool->dirty_end = j + 1;
+    }
+  else if (j == pool->dirty_end)
+    pool->dirty_end++;
+  else /* Wrapped around */
+    {
+      pool->dirty_start = 0;
+      pool->dirty_end = pool->size;
+    }
+
+  pool->head = (j + 1) % pool->size;
+  pool->used++;
+}
+
+static void
+upload_range (GthreeAttribute *attr,
+              int start,
+              int end,
+              int item_size)
+{
+  gthree_attribute_set_update_range (attr, start * item_size, (end - start) * item_size);
+  gthree_attribute_set_needs_update (attr);
+}
+
+/* Uploads what was added, retires the particles that died and moves the
+ * clock on for the shader. Nothing is moved here. */
+void
+particle_pool_update (ParticlePool *pool,
+                      float dt)
+{
+  int tail;
+
+  // Nothing live and nothing drawn, there is nothing to do until an add
+  if (pool->used == 0 && pool->drawn == 0)
+    return;
+
+  pool->frame++;
+  pool->time += dt;
+  pool->dt = dt;
+
+  tail = pool_tail (pool);
+  while (pool->used > 0 && pool->frame >= pool->death_frames[tail])
+    {
+      tail = (tail + 1) % pool->size;
+      pool->used--;
+    }
+
+  if (pool->dirty_end != pool->dirty_start)
+    {
+      upload_range (pool->position_attr, pool->dirty_start, pool->dirty_end, 3);
+      upload_range (pool->velocity_attr, pool->dirty_start, pool->dirty_end, 3);
+      upload_range (pool->color_attr, pool->dirty_start, pool->dirty_end, 3);
+      upload_range (pool->spawn_time_attr, pool->dirty_start, pool->dirty_end, 2);
+      upload_range (pool->style_attr, pool->dirty_start, pool->dirty_end, 3);
+      gthree_geometry_invalidate_bounds (pool->geometry);
+      pool->dirty_start = pool->dirty_end = 0;
+    }
+
+  gthree_uniforms_set_float (pool->uniforms, "frame", pool->frame);
+  gthree_uniforms_set_float (pool->uniforms, "time", pool->time);
+
+  // Only the live ones while they don't wrap, the shader hides the dead
+  // ones otherwise
+  if (pool->used == 0)
+    gthree_geometry_set_draw_range (pool->geometry, 0, 0);
+  else if (tail + pool->used <= pool->size)
+    gthree_geometry_set_draw_range (pool->geometry, tail, pool->used);
+  else
+    gthree_geometry_set_draw_range (pool->geometry, 0, pool->size);
+  pool->drawn = pool->used;
+}
+
+/* Draws the particles alpha of the way from the update before the last
+ * one to the last one, like the ships between their last two steps, so
+ * the updates can go with the simulation and the drawing with the
+ * frames. The ones added since wait where they were added. */
+void
+particle_pool_interpolate (ParticlePool *pool,
+                           float alpha)
+{
+  gthree_uniforms_set_float (pool->uniforms, "frame", pool->frame - 1 + alpha);
+  gthree_uniforms_set_float (pool->uniforms, "time", pool->time - (1 - alpha) * pool->dt);
+}
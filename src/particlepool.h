@@ -0,0 +1,34 @@
+#pragma once
+
+#include <gthree/gthree.h>
+
+/* Particles from any number of emitters, kept in one set of attributes
+ * and drawn with one points object. Each particle has its own size,
+ * life and tile of the atlas texture, and is only uploaded when it is
+ * added; the shader moves and fades it from there. */
+typedef struct _ParticlePool ParticlePool;
+
+ParticlePool *particle_pool_new                 (int            max);
+void          particle_pool_free                (ParticlePool  *pool);
+GthreeObject *particle_pool_get_object          (ParticlePool  *pool);
+void          particle_pool_grow                (ParticlePool  *pool,
+                                                 int            extra);
+void          particle_pool_shrink              (ParticlePool  *pool,
+                                                 int            extra);
+void          particle_pool_set_atlas           (ParticlePool  *pool,
+                                                 GthreeTexture *atlas,
+                                                 int            n_tiles);
+void          particle_pool_set_viewport_height (ParticlePool  *pool,
+                                                 int            height);
+int           particle_pool_get_free            (ParticlePool  *pool);
+void          particle_pool_add                 (ParticlePool  *pool,
+                                                 const float   *position,
+                                                 const float   *velocity,
+                                                 const float   *color,
+                                                 float          size,
+                                                 int            tile,
+                                                 float          ageing);
+void          particle_pool_update              (ParticlePool  *pool,
+                                                 float          dt);
+void          particle_pool_interpolate         (ParticlePool  *pool,
+                                                 float          alpha);
@@ -1,14 +1,47 @@
 #include "particles.h"
+#include "particlepool.h"
+#include "rng.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+/* The particles are kept as one array per component, so the update can
+ * go through four at a time */
+enum {
+  PARTICLE_X,
+  PARTICLE_Y,
+  PARTICLE_Z,
+  PARTICLE_VX,
+  PARTICLE_VY,
+  PARTICLE_VZ,
+  PARTICLE_R,
+  PARTICLE_G,
+  PARTICLE_B,
+  PARTICLE_LIFE,
+  PARTICLE_N_COMPONENTS
+};
+
+/* Each new particle takes this many random numbers: the spawn offset
+ * and velocity on each axis, and the colour mix. They are made for up to
+ * EMIT_BATCH particles at a time. */
+#define PARTICLE_N_RANDOM 7
+#define EMIT_BATCH 64
 
+/* What a frame's update does to the live particles, after the dead ones
+ * are gone */
 typedef struct {
-  int index;
-  graphene_vec3_t position;
-  graphene_vec3_t velocity;
-  graphene_vec3_t force;
-  graphene_vec3_t color;
-  graphene_vec3_t base_color;
-  float life;
-}  Particle;
+  float friction;
+  float dvx, dvy, dvz;
+  float dt;
+} ParticleStep;
+
+typedef void (*ParticleStepFunc) (float              **components,
+                                  int                  n,
+                                  const ParticleStep  *step,
+                                  float               *positions,
+                                  float               *colors);
 
 struct _Particles {
   GthreePointsMaterial *material;
@@ -19,9 +52,20 @@ struct _Particles {
   GthreeAttribute *position_attr;
   GthreeAttribute *color_attr;
 
-  Particle *buffer;
+  /* Set when the particles are added to a pool rather than kept here,
+   * with the tile of the pool's atlas they use */
+  ParticlePool *pool;
+  int tile;
+
+  /* The live particles are kept at the start of each component array,
+   * and go in the same places in the attributes, so only those are
+   * drawn. The base colour is in r,g,b, it fades as the particle ages. */
+  float *buffer;
+  float *components[PARTICLE_N_COMPONENTS];
   int buffer_size;
   int buffer_used;
+  /* How many particles the draw range covered after the last update */
+  int buffer_drawn;
 
   float size;
   float life;
@@ -30,6 +74,8 @@ struct _Particles {
   float spawn_rate;
   float spawn_count;
 
+  Rng rng;
+
   graphene_vec3_t color1;
   graphene_vec3_t color2;
 
@@ -40,14 +86,6 @@ struct _Particles {
   graphene_vec3_t force;
 };
 
-static void
-particle_reset (Particle *particle)
-{
-  graphene_vec3_init (&particle->position,
-                      100000, 100000, 100000);
-  graphene_vec3_init (&particle->color, 0, 0, 1.0);
- }
-
 GthreeObject *
 particles_get_object (Particles *particles)
 {
@@ -94,14 +132,24 @@ particles_set_map (Particles             *particles,
                    GthreeTexture         *texture)
 {
   g_set_object (&particles->map, texture);
-  gthree_points_material_set_map (particles->material, particles->map);
+  if (particles->pool == NULL)
+    gthree_points_material_set_map (particles->material, particles->map);
 }
 
 void
 particles_set_size (Particles *particles, float size)
 {
   particles->size = size;
-  gthree_points_material_set_size (particles->material, particles->size);
+  if (particles->pool == NULL)
+    gthree_points_material_set_size (particles->material, particles->size);
+}
+
+/* The particles emitted after this are the same each time for the same
+ * seed and settings */
+void
+particles_set_seed (Particles *particles, guint32 seed)
+{
+  rng_init (&particles->rng, seed);
 }
 
 void
@@ -116,28 +164,19 @@ particles_set_color2 (Particles *particles, GdkRGBA *color)
   graphene_vec3_init (&particles->color2, color->red, color->green, color->blue);
 }
 
-Particles *
-particles_new (int max, float size)
+static Particles *
+particles_alloc (int max, float size)
 {
   Particles *particles = g_new0 (Particles, 1);
 
   particles->buffer_size = max;
-  particles->buffer_used = 0;
-  particles->buffer = g_new0 (Particle, particles->buffer_size);
-
-  for (int i = 0; i < particles->buffer_size; i++)
-    {
-      Particle *p = &particles->buffer[i];
-      p->index = i;
-      particle_reset (p);
-    }
-
   particles->size = size;
   particles->life = 60;
   particles->ageing = 1 / particles->life;
   particles->friction = 1.0;
   particles->spawn_rate = 0;
   particles->spawn_count = 0;
+  rng_init (&particles->rng, g_random_int ());
   graphene_vec3_init (&particles->spawn_point, 0, 0, 0);
   graphene_vec3_init (&particles->spawn_radius, 0, 0, 0);
   graphene_vec3_init (&particles->velocity, 0, 0, 0);
@@ -147,6 +186,20 @@ particles_new (int max, float size)
   graphene_vec3_init (&particles->color1, 1.0, 0, 0);
   graphene_vec3_init (&particles->color2, 0.0, 1.0, 0);
 
+  return particles;
+}
+
+Particles *
+particles_new (int max, float size)
+{
+  Particles *particles = particles_alloc (max, size);
+
+  particles->buffer_used = 0;
+  particles->buffer_drawn = 0;
+  particles->buffer = g_new0 (float, particles->buffer_size * PARTICLE_N_COMPONENTS);
+  for (int c = 0; c < PARTICLE_N_COMPONENTS; c++)
+    particles->components[c] = particles->buffer + c * particles->buffer_size;
+
   particles->position_attr = gthree_attribute_new ("position", GTHREE_ATTRIBUTE_TYPE_FLOAT,
                                                    particles->buffer_size, 3, FALSE);
   gthree_attribute_set_dynamic (particles->position_attr, TRUE);
@@ -162,12 +215,27 @@ particles_new (int max, float size)
   particles->geometry = gthree_geometry_new ();
   gthree_geometry_add_attribute (particles->geometry, "position",   particles->position_attr);
   gthree_geometry_add_attribute (particles->geometry, "color", particles->color_attr);
+  gthree_geometry_set_draw_range (particles->geometry, 0, 0);
 
   particles->points = gthree_points_new (particles->geometry, GTHREE_MATERIAL (particles->material));
 
   return particles;
 }
 
+/* An emitter for pool, which keeps and draws its particles, in the
+ * given tile of the pool's atlas. Nothing is drawn for it here, so it
+ * has no object, and the map is not used. */
+Particles *
+particles_new_pooled (ParticlePool *pool, float size, int tile)
+{
+  Particles *particles = particles_alloc (0, size);
+
+  particles->pool = pool;
+  particles->tile = tile;
+
+  return particles;
+}
+
 void
 particles_free (Particles *particles)
 {
@@ -177,51 +245,276 @@ particles_free (Particles *particles)
   g_free (particles);
 }
 
+/* Picks where a new particle starts, how it moves and its colour, from
+ * PARTICLE_N_RANDOM numbers in [0, 1) */
 static void
-init_random_vector (graphene_vec3_t *dst)
+particle_spawn (Particles *particles,
+                const float *random,
+                float *position,
+                float *velocity,
+                float *color)
 {
-  graphene_vec3_init (dst,
-                      g_random_double_range (-1, 1),
-                      g_random_double_range (-1, 1),
-                      g_random_double_range (-1, 1));
+  float mix;
+
+  position[0] = graphene_vec3_get_x (&particles->spawn_point) +
+    (random[0] * 2 - 1) * graphene_vec3_get_x (&particles->spawn_radius);
+  position[1] = graphene_vec3_get_y (&particles->spawn_point) +
+    (random[1] * 2 - 1) * graphene_vec3_get_y (&particles->spawn_radius);
+  position[2] = graphene_vec3_get_z (&particles->spawn_point) +
+    (random[2] * 2 - 1) * graphene_vec3_get_z (&particles->spawn_radius);
+
+  velocity[0] = graphene_vec3_get_x (&particles->velocity) +
+    (random[3] * 2 - 1) * graphene_vec3_get_x (&particles->velocity_randomness);
+  velocity[1] = graphene_vec3_get_y (&particles->velocity) +
+    (random[4] * 2 - 1) * graphene_vec3_get_y (&particles->velocity_randomness);
+  velocity[2] = graphene_vec3_get_z (&particles->velocity) +
+    (random[5] * 2 - 1) * graphene_vec3_get_z (&particles->velocity_randomness);
+
+  mix = random[6];
+  color[0] = graphene_vec3_get_x (&particles->color1) +
+    (graphene_vec3_get_x (&particles->color2) - graphene_vec3_get_x (&particles->color1)) * mix;
+  color[1] = graphene_vec3_get_y (&particles->color1) +
+    (graphene_vec3_get_y (&particles->color2) - graphene_vec3_get_y (&particles->color1)) * mix;
+  color[2] = graphene_vec3_get_z (&particles->color1) +
+    (graphene_vec3_get_z (&particles->color2) - graphene_vec3_get_z (&particles->color1)) * mix;
+}
+
+/* The random numbers for particle i of emitable, made a batch at a time */
+static const float *
+emit_random (Particles *particles,
+             float *random,
+             int i,
+             int emitable)
+{
+  int k = i % EMIT_BATCH;
+
+  if (k == 0)
+    rng_fill (&particles->rng, random, MIN (emitable - i, EMIT_BATCH) * PARTICLE_N_RANDOM);
+
+  return random + k * PARTICLE_N_RANDOM;
+}
+
+/* Adds the new particles to the pool, with the size, tile and life of
+ * this emitter */
+static void
+particles_emit_pooled (Particles *particles,
+                       int count)
+{
+  int emitable = MIN (count, particle_pool_get_free (particles->pool));
+  float random[EMIT_BATCH * PARTICLE_N_RANDOM];
+
+  for (int i = 0; i < emitable; i++)
+    {
+      float position[3], velocity[3], color[3];
+
+      particle_spawn (particles, emit_random (particles, random, i, emitable),
+                      position, velocity, color);
+      particle_pool_add (particles->pool, position, velocity, color,
+                         particles->size, particles->tile, particles->ageing);
+    }
 }
 
 void
 particles_emit (Particles *particles,
                 int count)
 {
-  int emitable = MIN (count, particles->buffer_size - particles->buffer_used);
+  float **c = particles->components;
+  float random[EMIT_BATCH * PARTICLE_N_RANDOM];
+  int emitable;
 
+  if (particles->pool)
+    {
+      particles_emit_pooled (particles, count);
+      return;
+    }
+
+  emitable = MIN (count, particles->buffer_size - particles->buffer_used);
   for (int i = 0; i < emitable; i++)
     {
-      int buffer_index = particles->buffer_used++;
-      Particle *p = &particles->buffer[buffer_index];
+      int j = particles->buffer_used++;
+      float position[3], velocity[3], color[3];
+
+      particle_spawn (particles, emit_random (particles, random, i, emitable),
+                      position, velocity, color);
+
+      c[PARTICLE_X][j] = position[0];
+      c[PARTICLE_Y][j] = position[1];
+      c[PARTICLE_Z][j] = position[2];
+      c[PARTICLE_VX][j] = velocity[0];
+      c[PARTICLE_VY][j] = velocity[1];
+      c[PARTICLE_VZ][j] = velocity[2];
+      c[PARTICLE_R][j] = color[0];
+      c[PARTICLE_G][j] = color[1];
+      c[PARTICLE_B][j] = color[2];
+      c[PARTICLE_LIFE][j] = 1;
+    }
+}
 
-      init_random_vector (&p->position);
-      graphene_vec3_multiply (&p->position, &particles->spawn_radius, &p->position);
-      graphene_vec3_add (&p->position, &particles->spawn_point, &p->position);
+/* Ages the particles, and moves the last live one into the place of
+ * each that died, so they stay packed at the start */
+static void
+particles_age (Particles *particles)
+{
+  float **c = particles->components;
+  float *life = c[PARTICLE_LIFE];
+  int n = particles->buffer_used;
 
-      init_random_vector (&p->velocity);
-      graphene_vec3_multiply (&p->velocity, &particles->velocity_randomness, &p->velocity);
-      graphene_vec3_add (&p->velocity, &particles->velocity, &p->velocity);
+  for (int i = 0; i < n; i++)
+    life[i] -= particles->ageing;
 
-      p->force = particles->force;
+  for (int i = 0; i < n; )
+    {
+      if (life[i] > 0)
+        {
+          i++;
+          continue;
+        }
 
-      graphene_vec3_interpolate (&particles->color1,
-                                 &particles->color2,
-                                 g_random_double_range (0, 1),
-                                 &p->base_color);
+      n--;
+      for (int k = 0; k < PARTICLE_N_COMPONENTS; k++)
+        c[k][i] = c[k][n];
+    }
 
-      p->life = 1;
+  particles->buffer_used = n;
+}
+
+/* The fade with age, full brightness for the first half of the life */
+static inline float
+particle_fade (float life)
+{
+  return MIN (life + 0.5f, 1.0f);
+}
+
+static void
+particles_step_scalar (float **c,
+                       int n,
+                       const ParticleStep *step,
+                       float *positions,
+                       float *colors)
+{
+  for (int i = 0; i < n; i++)
+    {
+      float l = particle_fade (c[PARTICLE_LIFE][i]);
+
+      c[PARTICLE_VX][i] = c[PARTICLE_VX][i] * step->friction + step->dvx;
+      c[PARTICLE_VY][i] = c[PARTICLE_VY][i] * step->friction + step->dvy;
+      c[PARTICLE_VZ][i] = c[PARTICLE_VZ][i] * step->friction + step->dvz;
+
+      c[PARTICLE_X][i] += c[PARTICLE_VX][i] * step->dt;
+      c[PARTICLE_Y][i] += c[PARTICLE_VY][i] * step->dt;
+      c[PARTICLE_Z][i] += c[PARTICLE_VZ][i] * step->dt;
+
+      positions[i * 3 + 0] = c[PARTICLE_X][i];
+      positions[i * 3 + 1] = c[PARTICLE_Y][i];
+      positions[i * 3 + 2] = c[PARTICLE_Z][i];
+
+      colors[i * 3 + 0] = c[PARTICLE_R][i] * l;
+      colors[i * 3 + 1] = c[PARTICLE_G][i] * l;
+      colors[i * 3 + 2] = c[PARTICLE_B][i] * l;
     }
 }
 
+#ifdef HAVE_X86_KERNELS
+
+/* Stores a,b,c of four particles as a0 b0 c0 a1 b1 c1 ..., the layout
+ * of the vec3 attributes */
+__attribute__((target("sse2"))) static inline void
+store_vec3_sse2 (float *out,
+                 __m128 a,
+                 __m128 b,
+                 __m128 c)
+{
+  __m128 ab_lo = _mm_unpacklo_ps (a, b);
+  __m128 ab_hi = _mm_unpackhi_ps (a, b);
+  __m128 m0 = _mm_shuffle_ps (c, ab_lo, _MM_SHUFFLE (2, 2, 0, 0));
+  __m128 m1 = _mm_shuffle_ps (ab_lo, c, _MM_SHUFFLE (1, 1, 3, 3));
+  __m128 m2 = _mm_shuffle_ps (ab_hi, c, _MM_SHUFFLE (3, 2, 3, 2));
+
+  _mm_storeu_ps (out + 0, _mm_shuffle_ps (ab_lo, m0, _MM_SHUFFLE (2, 0, 1, 0)));
+  _mm_storeu_ps (out + 4, _mm_shuffle_ps (m1, ab_hi, _MM_SHUFFLE (1, 0, 2, 0)));
+  _mm_storeu_ps (out + 8, _mm_shuffle_ps (m2, m2, _MM_SHUFFLE (3, 1, 0, 2)));
+}
+
+/* Same as particles_step_scalar(), four particles at a time */
+__attribute__((target("sse2"))) static void
+particles_step_sse2 (float **c,
+                     int n,
+                     const ParticleStep *step,
+                     float *positions,
+                     float *colors)
+{
+  const __m128 friction = _mm_set1_ps (step->friction);
+  const __m128 dvx = _mm_set1_ps (step->dvx);
+  const __m128 dvy = _mm_set1_ps (step->dvy);
+  const __m128 dvz = _mm_set1_ps (step->dvz);
+  const __m128 dt = _mm_set1_ps (step->dt);
+  const __m128 half = _mm_set1_ps (0.5f);
+  const __m128 one = _mm_set1_ps (1.0f);
+  int i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      __m128 vx, vy, vz, x, y, z, l;
+
+      vx = _mm_add_ps (_mm_mul_ps (_mm_loadu_ps (c[PARTICLE_VX] + i), friction), dvx);
+      vy = _mm_add_ps (_mm_mul_ps (_mm_loadu_ps (c[PARTICLE_VY] + i), friction), dvy);
+      vz = _mm_add_ps (_mm_mul_ps (_mm_loadu_ps (c[PARTICLE_VZ] + i), friction), dvz);
+      _mm_storeu_ps (c[PARTICLE_VX] + i, vx);
+      _mm_storeu_ps (c[PARTICLE_VY] + i, vy);
+      _mm_storeu_ps (c[PARTICLE_VZ] + i, vz);
+
+      x = _mm_add_ps (_mm_loadu_ps (c[PARTICLE_X] + i), _mm_mul_ps (vx, dt));
+      y = _mm_add_ps (_mm_loadu_ps (c[PARTICLE_Y] + i), _mm_mul_ps (vy, dt));
+      z = _mm_add_ps (_mm_loadu_ps (c[PARTICLE_Z] + i), _mm_mul_ps (vz, dt));
+      _mm_storeu_ps (c[PARTICLE_X] + i, x);
+      _mm_storeu_ps (c[PARTICLE_Y] + i, y);
+      _mm_storeu_ps (c[PARTICLE_Z] + i, z);
+      store_vec3_sse2 (positions + i * 3, x, y, z);
+
+      /* particle_fade() */
+      l = _mm_min_ps (_mm_add_ps (_mm_loadu_ps (c[PARTICLE_LIFE] + i), half), one);
+      store_vec3_sse2 (colors + i * 3,
+                       _mm_mul_ps (_mm_loadu_ps (c[PARTICLE_R] + i), l),
+                       _mm_mul_ps (_mm_loadu_ps (c[PARTICLE_G] + i), l),
+                       _mm_mul_ps (_mm_loadu_ps (c[PARTICLE_B] + i), l));
+    }
+
+  if (i < n)
+    {
+      float *rest[PARTICLE_N_COMPONENTS];
+
+      for (int k = 0; k < PARTICLE_N_COMPONENTS; k++)
+        rest[k] = c[k] + i;
+
+      particles_step_scalar (rest, n - i, step, positions + i * 3, colors + i * 3);
+    }
+}
+
+#endif
+
+static ParticleStepFunc
+get_step_func (void)
+{
+  static ParticleStepFunc func = NULL;
+
+  if (func == NULL)
+    {
+      func = particles_step_scalar;
+#ifdef HAVE_X86_KERNELS
+      __builtin_cpu_init ();
+      if (__builtin_cpu_supports ("sse2"))
+        func = particles_step_sse2;
+#endif
+    }
+
+  return func;
+}
+
 void
 particles_update (Particles *particles,
                   float dt)
 {
-  float l;
-  graphene_vec3_t df, dv;
+  ParticleStep step;
 
   particles->spawn_count += particles->spawn_rate;
   if (particles->spawn_count >= 1.0f)
@@ -231,52 +524,38 @@ particles_update (Particles *particles,
       particles_emit (particles, count);
    }
 
-  for (int i = 0; i < particles->buffer_used; i++)
-    {
-      Particle *p = &particles->buffer[i];
-
-      p->life -= particles->ageing;
-
-      if (p->life <= 0)
-        {
-          particle_reset (p);
-
-          // Swap this and last used so we don't get a hole in the buffer array with unused particles
-          if (i != particles->buffer_used -1)
-            {
-              Particle tmp = *p;
-              particles->buffer[i] = particles->buffer[particles->buffer_used-1];
-              particles->buffer[particles->buffer_used-1] = tmp;
-            }
-
-          particles->buffer_used--;
-
-          i--; // compensate for the i++ in the loop since we deleted one
-          continue;
-        }
-
-      l = p->life > 0.5 ? 1.0 : p->life + 0.5;
+  // The pool moves them, for all its emitters at once
+  if (particles->pool)
+    return;
 
-      graphene_vec3_scale (&p->base_color, l, &p->color);
+  particles_age (particles);
 
-      graphene_vec3_scale (&p->velocity, particles->friction, &p->velocity);
+  // Nothing to draw now or before, so nothing changed
+  if (particles->buffer_used == 0 && particles->buffer_drawn == 0)
+    return;
 
-      graphene_vec3_scale (&p->force, dt, &df);
-      graphene_vec3_add (&p->velocity, &df, &p->velocity);
-
-      graphene_vec3_scale (&p->velocity, dt, &dv);
-      graphene_vec3_add (&p->position, &dv, &p->position);
+  if (particles->buffer_used != particles->buffer_drawn)
+    {
+      gthree_geometry_set_draw_range (particles->geometry, 0, particles->buffer_used);
+      particles->buffer_drawn = particles->buffer_used;
     }
 
-  // Update buffer
-  for (int i = 0; i < particles->buffer_size; i++)
-    {
-      Particle *p = &particles->buffer[i];
+  if (particles->buffer_used == 0)
+    return;
 
-      gthree_attribute_set_vec3 (particles->position_attr, p->index, &p->position);
-      gthree_attribute_set_vec3 (particles->color_attr, p->index, &p->color);
-    }
+  // Move them, straight into the attributes, only where the live particles are
+  step.friction = particles->friction;
+  step.dvx = graphene_vec3_get_x (&particles->force) * dt;
+  step.dvy = graphene_vec3_get_y (&particles->force) * dt;
+  step.dvz = graphene_vec3_get_z (&particles->force) * dt;
+  step.dt = dt;
+
+  get_step_func () (particles->components, particles->buffer_used, &step,
+                    gthree_attribute_peek_float (particles->position_attr),
+                    gthree_attribute_peek_float (particles->color_attr));
 
+  gthree_attribute_set_update_range (particles->position_attr, 0, particles->buffer_used * 3);
+  gthree_attribute_set_update_range (particles->color_attr, 0, particles->buffer_used * 3);
   gthree_attribute_set_needs_update (particles->position_attr);
   gthree_attribute_set_needs_update (particles->color_attr);
   gthree_geometry_invalidate_bounds (particles->geometry);
@@ -1,10 +1,14 @@
 #include <gthree/gthree.h>
 #include <gtk/gtk.h>
+#include "particlepool.h"
 
 typedef struct _Particles Particles;
 
 Particles *   particles_new                     (int                    max,
                                                  float                  size);
+Particles *   particles_new_pooled              (ParticlePool          *pool,
+                                                 float                  size,
+                                                 int                    tile);
 GthreeObject *particles_get_object              (Particles             *particles);
 void          particles_free                    (Particles             *particles);
 void          particles_emit                    (Particles             *particles,
@@ -23,6 +27,8 @@ void          particles_set_life                (Particles             *particle
                                                  float                  life);
 void          particles_set_size                (Particles             *particles,
                                                  float                  size);
+void          particles_set_seed                (Particles             *particles,
+                                                 guint32                seed);
 void          particles_set_color1              (Particles             *particles,
                                                  GdkRGBA               *color);
 void          particles_set_color2              (Particles             *particles,
@@ -0,0 +1,756 @@
+#include <math.h>
+#include <string.h>
+#include <gio/gio.h>
+#include "racingline.h"
+
+/* Distance between the points the line is traced and stored at */
+#define RACING_LINE_SPACING 8.0f
+/* How close to the walls the line may be pulled */
+#define RACING_LINE_MARGIN 12.0f
+/* Steps of the scan across the track for its middle, and how far out
+ * from the line it looks for the edges */
+#define RACING_LINE_SCAN_STEP 1.0f
+#define RACING_LINE_MAX_HALF_WIDTH 250.0f
+#define RACING_LINE_MAX_POINTS 65536
+/* How far each step of the trace moves towards the middle of the track,
+ * and how many points back it takes the heading from */
+#define RACING_LINE_MAX_CENTERING 2.0f
+#define RACING_LINE_HEADING_POINTS 4
+/* Shorter traces than this back at the start are not a lap */
+#define RACING_LINE_MIN_POINTS 100
+/* Passes of tightening for each distance between the points pulled
+ * together, which starts at this many points and halves down to 1 */
+#define RACING_LINE_TIGHTEN_ITERATIONS 100
+#define RACING_LINE_TIGHTEN_MAX_REACH 32
+/* The curvature is measured across this many points either side, and
+ * smoothed over this many more */
+#define RACING_LINE_CURVATURE_REACH 4
+#define RACING_LINE_CURVATURE_SMOOTHING 6
+/* Size of the grid cells racing_line_find() looks in, each lists the
+ * segments that pass within a cell of it */
+#define RACING_LINE_CELL_SIZE 32.0f
+
+/* The file is a header and the points, all little endian:
+ *
+ *   magic[8] version:u32 key_length:u32 key[key_length] spacing:f32
+ *   n_points:u32 { x:f32 z:f32 curvature:f32 }[n_points]
+ */
+#define RACING_LINE_MAGIC "HEXGLRLN"
+#define RACING_LINE_VERSION 1
+#define RACING_LINE_MAX_KEY_LENGTH 256
+
+typedef struct {
+  float x, z;
+  /* Signed, positive is turning the way SIM_INPUT_LEFT does */
+  float curvature;
+} RacingLinePoint;
+
+struct _RacingLine {
+  grefcount refcount;
+
+  /* A closed loop, the last point joins up with the first */
+  GArray *points;
+  float spacing;
+
+  /* The grid for racing_line_find(), the segments from point i to i+1
+   * near cell c are cell_segments[cell_start[c]..cell_start[c+1]] */
+  float grid_min_x, grid_min_z;
+  int grid_width, grid_height;
+  guint *cell_start;
+  guint *cell_segments;
+};
+
+static RacingLinePoint *
+get_point (RacingLine *line,
+           int i)
+{
+  int n = line->points->len;
+
+  return &g_array_index (line->points, RacingLinePoint, ((i % n) + n) % n);
+}
+
+static void
+racing_line_build_index (RacingLine *line)
+{
+  float min_x = G_MAXFLOAT, min_z = G_MAXFLOAT, max_x = -G_MAXFLOAT, max_z = -G_MAXFLOAT;
+  int n_cells, pass;
+  guint *cursor;
+
+  for (guint i = 0; i < line->points->len; i++)
+    {
+      RacingLinePoint *p = get_point (line, i);
+
+      min_x = MIN (min_x, p->x);
+      min_z = MIN (min_z, p->z);
+      max_x = MAX (max_x, p->x);
+      max_z = MAX (max_z, p->z);
+    }
+
+  /* A cell of border around the line */
+  line->grid_min_x = min_x - RACING_LINE_CELL_SIZE;
+  line->grid_min_z = min_z - RACING_LINE_CELL_SIZE;
+  line->grid_width = (int)((max_x - min_x) / RACING_LINE_CELL_SIZE) + 3;
+  line->grid_height = (int)((max_z - min_z) / RACING_LINE_CELL_SIZE) + 3;
+  n_cells = line->grid_width * line->grid_height;
+
+  line->cell_start = g_new0 (guint, n_cells + 1);
+  cursor = g_new0 (guint, n_cells);
+
+  /* Count the segments of each cell, then fill them in */
+  for (pass = 0; pass < 2; pass++)
+    {
+      for (guint i = 0; i < line->points->len; i++)
+        {
+          RacingLinePoint *a = get_point (line, i);
+          RacingLinePoint *b = get_point (line, i + 1);
+          int x0 = (MIN (a->x, b->x) - line->grid_min_x) / RACING_LINE_CELL_SIZE - 1;
+          int z0 = (MIN (a->z, b->z) - line->grid_min_z) / RACING_LINE_CELL_SIZE - 1;
+          int x1 = (MAX (a->x, b->x) - line->grid_min_x) / RACING_LINE_CELL_SIZE + 1;
+          int z1 = (MAX (a->z, b->z) - line->grid_min_z) / RACING_LINE_CELL_SIZE + 1;
+
+          for (int z = MAX (z0, 0); z <= MIN (z1, line->grid_height - 1); z++)
+            for (int x = MAX (x0, 0); x <= MIN (x1, line->grid_width - 1); x++)
+              {
+                int c = z * line->grid_width + x;
+
+                if (pass == 0)
+                  line->cell_start[c + 1]++;
+                else
+                  line->cell_segments[line->cell_start[c] + cursor[c]++] = i;
+              }
+        }
+
+      if (pass == 0)
+        {
+          for (int c = 0; c < n_cells; c++)
+            line->cell_start[c + 1] += line->cell_start[c];
+          line->cell_segments = g_new (guint, line->cell_start[n_cells]);
+        }
+    }
+
+  g_free (cursor);
+}
+
+/* Takes ownership of points */
+static RacingLine *
+racing_line_new (GArray *points,
+                 float spacing)
+{
+  RacingLine *line = g_new0 (RacingLine, 1);
+
+  g_ref_count_init (&line->refcount);
+  line->points = points;
+  line->spacing = spacing;
+  racing_line_build_index (line);
+
+  return line;
+}
+
+RacingLine *
+racing_line_ref (RacingLine *line)
+{
+  g_ref_count_inc (&line->refcount);
+  return line;
+}
+
+void
+racing_line_unref (RacingLine *line)
+{
+  if (g_ref_count_dec (&line->refcount))
+    {
+      g_array_unref (line->points);
+      g_free (line->cell_start);
+      g_free (line->cell_segments);
+      g_free (line);
+    }
+}
+
+guint
+racing_line_get_n_points (RacingLine *line)
+{
+  return line->points->len;
+}
+
+/* The distance between points, and so the s of point i is i times this */
+float
+racing_line_get_spacing (RacingLine *line)
+{
+  return line->spacing;
+}
+
+float
+racing_line_get_length (RacingLine *line)
+{
+  return line->points->len * line->spacing;
+}
+
+/* Squared distance from x,z to the segment a-b, and how far along it
+ * the nearest point is in t */
+static float
+segment_distance2 (const RacingLinePoint *a,
+                   const RacingLinePoint *b,
+                   float x, float z,
+                   float *t)
+{
+  float dx = b->x - a->x, dz = b->z - a->z;
+  float len2 = dx * dx + dz * dz;
+  float u = len2 > 0 ? ((x - a->x) * dx + (z - a->z) * dz) / len2 : 0;
+  float px, pz;
+
+  u = CLAMP (u, 0, 1);
+  px = a->x + u * dx - x;
+  pz = a->z + u * dz - z;
+  *t = u;
+
+  return px * px + pz * pz;
+}
+
+/* Returns how far along the line the point on it nearest to x,z is.
+ * This only looks at the segments listed in the grid cell of x,z, unless
+ * it is so far off the line that there are none. */
+float
+racing_line_find (RacingLine *line,
+                  float x,
+                  float z)
+{
+  float best = G_MAXFLOAT, best_s = 0;
+  int cx = floorf ((x - line->grid_min_x) / RACING_LINE_CELL_SIZE);
+  int cz = floorf ((z - line->grid_min_z) / RACING_LINE_CELL_SIZE);
+  guint start = 0, end = 0;
+  gboolean all = TRUE;
+
+  if (cx >= 0 && cx < line->grid_width && cz >= 0 && cz < line->grid_height)
+    {
+      int c = cz * line->grid_width + cx;
+
+      start = line->cell_start[c];
+      end = line->cell_start[c + 1];
+      all = start == end;
+    }
+
+  if (all)
+    {
+      start = 0;
+      end = line->points->len;
+    }
+
+  for (guint k = start; k < end; k++)
+    {
+      guint i = all ? k : line->cell_segments[k];
+      float t, d2;
+
+      d2 = segment_distance2 (get_point (line, i), get_point (line, i + 1), x, z, &t);
+      if (d2 < best)
+        {
+          best = d2;
+          best_s = (i + t) * line->spacing;
+        }
+    }
+
+  return best_s;
+}
+
+/* Splits s, which wraps around, into a point and how far towards the
+ * next one it is */
+static int
+split_s (RacingLine *line,
+         float s,
+         float *t)
+{
+  float u = fmodf (s / line->spacing, line->points->len);
+  int i;
+
+  if (u < 0)
+    u += line->points->len;
+
+  i = (int)u;
+  *t = u - i;
+
+  return i;
+}
+
+/* The point s along the line, on the Catmull-Rom spline through the
+ * points */
+void
+racing_line_get_position (RacingLine *line,
+                          float s,
+                          float *x,
+                          float *z)
+{
+  const RacingLinePoint *p0, *p1, *p2, *p3;
+  float t, t2, t3;
+  int i;
+
+  i = split_s (line, s, &t);
+  p0 = get_point (line, i - 1);
+  p1 = get_point (line, i);
+  p2 = get_point (line, i + 1);
+  p3 = get_point (line, i + 2);
+  t2 = t * t;
+  t3 = t2 * t;
+
+  *x = 0.5f * (2 * p1->x + (p2->x - p0->x) * t +
+               (2 * p0->x - 5 * p1->x + 4 * p2->x - p3->x) * t2 +
+               (3 * p1->x - p0->x - 3 * p2->x + p3->x) * t3);
+  *z = 0.5f * (2 * p1->z + (p2->z - p0->z) * t +
+               (2 * p0->z - 5 * p1->z + 4 * p2->z - p3->z) * t2 +
+               (3 * p1->z - p0->z - 3 * p2->z + p3->z) * t3);
+}
+
+/* The curvature s along the line, 1 / the radius of the turn */
+float
+racing_line_get_curvature (RacingLine *line,
+                           float s)
+{
+  float t;
+  int i = split_s (line, s, &t);
+
+  return get_point (line, i)->curvature * (1 - t) + get_point (line, i + 1)->curvature * t;
+}
+
+/* Finds the middle of the track on the line through x,z across the
+ * heading hx,hz. Returns FALSE if x,z is off the track. */
+static gboolean
+find_middle (AnalysisMap *map,
+             float x, float z,
+             float hx, float hz,
+             float *mx, float *mz)
+{
+  float left = 0, right = 0;
+
+  if (analysis_map_lookup_distance (map, x, z, NULL) <= 0)
+    return FALSE;
+
+  /* hz,-hx is to the left */
+  while (left < RACING_LINE_MAX_HALF_WIDTH &&
+         analysis_map_lookup_distance (map,
+                                       x + hz * (left + RACING_LINE_SCAN_STEP),
+                                       z - hx * (left + RACING_LINE_SCAN_STEP),
+                                       NULL) > 0)
+    left += RACING_LINE_SCAN_STEP;
+
+  while (right < RACING_LINE_MAX_HALF_WIDTH &&
+         analysis_map_lookup_distance (map,
+                                       x - hz * (right + RACING_LINE_SCAN_STEP),
+                                       z + hx * (right + RACING_LINE_SCAN_STEP),
+                                       NULL) > 0)
+    right += RACING_LINE_SCAN_STEP;
+
+  *mx = x + hz * (left - right) / 2;
+  *mz = z - hx * (left - right) / 2;
+
+  return TRUE;
+}
+
+/* Follows the middle of the track from x,z in the direction of yaw until
+ * it gets back to the start. Each step goes RACING_LINE_SPACING ahead and
+ * only a bit towards the middle there, as on wide or curving track the
+ * middle found across the heading jumps about, and heads on from a few
+ * points back, so the heading doesn't swing with it. */
+static GArray *
+trace_middle (AnalysisMap *map,
+              float x, float z,
+              float yaw,
+              GError **error)
+{
+  g_autoptr(GArray) points = g_array_new (FALSE, FALSE, sizeof (RacingLinePoint));
+  RacingLinePoint point = { 0, }, previous;
+  float hx = sinf (yaw), hz = cosf (yaw);
+  int check_point = -1, max_check_point = -1;
+
+  if (!find_middle (map, x, z, hx, hz, &point.x, &point.z))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "The start at %.0f,%.0f is off the track", x, z);
+      return NULL;
+    }
+
+  g_array_append_val (points, point);
+
+  while (points->len < RACING_LINE_MAX_POINTS)
+    {
+      const RacingLinePoint *start = &g_array_index (points, RacingLinePoint, 0);
+      const RacingLinePoint *back;
+      float mx, mz, dx, dz, d, t;
+      int cp;
+
+      previous = point;
+      x = previous.x + hx * RACING_LINE_SPACING;
+      z = previous.z + hz * RACING_LINE_SPACING;
+
+      if (!find_middle (map, x, z, hx, hz, &mx, &mz))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Lost the track at %.0f,%.0f", previous.x, previous.z);
+          return NULL;
+        }
+
+      dx = mx - x;
+      dz = mz - z;
+      d = sqrtf (dx * dx + dz * dz);
+      if (d > RACING_LINE_MAX_CENTERING)
+        {
+          dx *= RACING_LINE_MAX_CENTERING / d;
+          dz *= RACING_LINE_MAX_CENTERING / d;
+        }
+      point.x = x + dx;
+      point.z = z + dz;
+
+      back = &g_array_index (points, RacingLinePoint,
+                             points->len - MIN (points->len, RACING_LINE_HEADING_POINTS));
+      dx = point.x - back->x;
+      dz = point.z - back->z;
+      d = sqrtf (dx * dx + dz * dz);
+      hx = dx / d;
+      hz = dz / d;
+
+      cp = analysis_class_get_check_point (analysis_map_lookup_class (map, point.x, point.z));
+      if (cp != -1 && cp != check_point)
+        {
+          if (cp < check_point && cp != 0)
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Went through checkpoint %d after %d at %.0f,%.0f",
+                           cp, check_point, point.x, point.z);
+              return NULL;
+            }
+
+          check_point = cp;
+          max_check_point = MAX (max_check_point, cp);
+        }
+
+      if (points->len >= RACING_LINE_MIN_POINTS && max_check_point > 0 &&
+          segment_distance2 (&previous, &point, start->x, start->z, &t) <
+          RACING_LINE_SPACING * RACING_LINE_SPACING)
+        return g_steal_pointer (&points);
+
+      g_array_append_val (points, point);
+    }
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+               "Never got back to the start");
+  return NULL;
+}
+
+/* Returns points spaced evenly around the closed loop through points,
+ * with the spacing as close to RACING_LINE_SPACING as goes evenly */
+static GArray *
+resample (GArray *points,
+          float *spacing)
+{
+  GArray *res = g_array_new (FALSE, FALSE, sizeof (RacingLinePoint));
+  float length = 0, step, next = 0, walked = 0;
+  guint n_points, i;
+
+  for (i = 0; i < points->len; i++)
+    {
+      const RacingLinePoint *a = &g_array_index (points, RacingLinePoint, i);
+      const RacingLinePoint *b = &g_array_index (points, RacingLinePoint, (i + 1) % points->len);
+
+      length += hypotf (b->x - a->x, b->z - a->z);
+    }
+
+  n_points = MAX (3, (guint)roundf (length / RACING_LINE_SPACING));
+  step = length / n_points;
+
+  for (i = 0; i < points->len && res->len < n_points; i++)
+    {
+      const RacingLinePoint *a = &g_array_index (points, RacingLinePoint, i);
+      const RacingLinePoint *b = &g_array_index (points, RacingLinePoint, (i + 1) % points->len);
+      float d = hypotf (b->x - a->x, b->z - a->z);
+
+      while (next <= walked + d && res->len < n_points)
+        {
+          float t = d > 0 ? (next - walked) / d : 0;
+          RacingLinePoint p = { a->x + (b->x - a->x) * t, a->z + (b->z - a->z) * t, 0 };
+
+          g_array_append_val (res, p);
+          next += step;
+        }
+
+      walked += d;
+    }
+
+  *spacing = step;
+
+  return res;
+}
+
+/* Moves each point towards the middle of the points reach before and
+ * after it, as long as it stays clear of the walls. Repeated, this pulls
+ * the line tight around the insides of the corners like a rubber band.
+ * With a reach of 1 that takes as many passes as the square of the
+ * points in a turn to settle, so the long ones are pulled in with a
+ * longer reach first. */
+static void
+tighten (AnalysisMap *map,
+         GArray *points,
+         guint reach)
+{
+  guint n = points->len;
+
+  for (int iteration = 0; iteration < RACING_LINE_TIGHTEN_ITERATIONS; iteration++)
+    for (guint i = 0; i < n; i++)
+      {
+        RacingLinePoint *p = &g_array_index (points, RacingLinePoint, i);
+        const RacingLinePoint *prev = &g_array_index (points, RacingLinePoint, (i + n - reach % n) % n);
+        const RacingLinePoint *next = &g_array_index (points, RacingLinePoint, (i + reach) % n);
+        float x = (p->x + (prev->x + next->x) / 2) / 2;
+        float z = (p->z + (prev->z + next->z) / 2) / 2;
+        float d = analysis_map_lookup_distance (map, x, z, NULL);
+
+        /* The circles as big as the distances around both ends cover
+         * the move if they overlap, so it doesn't jump over a wall */
+        if (d >= RACING_LINE_MARGIN &&
+            hypotf (x - p->x, z - p->z) < d + analysis_map_lookup_distance (map, p->x, p->z, NULL))
+          {
+            p->x = x;
+            p->z = z;
+          }
+      }
+}
+
+/* The curvature of the circle through each point and the ones either
+ * side, smoothed, as the line is pulled against walls that are only as
+ * smooth as the map */
+static void
+compute_curvature (GArray *points)
+{
+  guint n = points->len;
+  g_autofree float *curvature = g_new (float, n);
+
+  for (guint i = 0; i < n; i++)
+    {
+      const RacingLinePoint *a = &g_array_index (points, RacingLinePoint, (i + n - RACING_LINE_CURVATURE_REACH) % n);
+      const RacingLinePoint *b = &g_array_index (points, RacingLinePoint, i);
+      const RacingLinePoint *c = &g_array_index (points, RacingLinePoint, (i + RACING_LINE_CURVATURE_REACH) % n);
+      float cross = (b->x - a->x) * (c->z - b->z) - (b->z - a->z) * (c->x - b->x);
+      float lengths = hypotf (b->x - a->x, b->z - a->z) *
+        hypotf (c->x - b->x, c->z - b->z) * hypotf (c->x - a->x, c->z - a->z);
+
+      /* Turning from +z towards +x increases the yaw, and is a negative
+       * cross product here */
+      curvature[i] = lengths > 0 ? -2 * cross / lengths : 0;
+    }
+
+  /* A triangle filter, whose weights add up to (width + 1)^2 */
+  for (guint i = 0; i < n; i++)
+    {
+      int width = RACING_LINE_CURVATURE_SMOOTHING;
+      float sum = 0;
+
+      for (int j = -width; j <= width; j++)
+        sum += (width + 1 - ABS (j)) * curvature[(i + n + j) % n];
+
+      g_array_index (points, RacingLinePoint, i).curvature = sum / ((width + 1) * (width + 1));
+    }
+}
+
+/* Builds the line from a collision map with a distance field, from a
+ * start on the track facing the way the track goes */
+RacingLine *
+racing_line_new_from_map (AnalysisMap *collision_map,
+                          float start_x,
+                          float start_z,
+                          float start_yaw,
+                          GError **error)
+{
+  g_autoptr(GArray) traced = NULL;
+  GArray *points, *tightened;
+  float spacing;
+
+  if (!analysis_map_has_distance_field (collision_map))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "The collision map has no distance field");
+      return NULL;
+    }
+
+  traced = trace_middle (collision_map, start_x, start_z, start_yaw, error);
+  if (traced == NULL)
+    return NULL;
+
+  points = resample (traced, &spacing);
+  for (guint reach = RACING_LINE_TIGHTEN_MAX_REACH; reach > 0; reach /= 2)
+    {
+      tighten (collision_map, points, reach);
+
+      /* Tightening bunches the points up on the insides of corners */
+      tightened = resample (points, &spacing);
+      g_array_unref (points);
+      points = tightened;
+    }
+
+  compute_curvature (points);
+
+  return racing_line_new (points, spacing);
+}
+
+static void
+append_u32 (GByteArray *data,
+            guint32 v)
+{
+  v = GUINT32_TO_LE (v);
+  g_byte_array_append (data, (guint8 *)&v, 4);
+}
+
+static void
+append_float (GByteArray *data,
+              float f)
+{
+  guint32 v;
+
+  memcpy (&v, &f, 4);
+  append_u32 (data, v);
+}
+
+gboolean
+racing_line_save (RacingLine *line,
+                  const char *path,
+                  const char *key,
+                  GError **error)
+{
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  g_autoptr(GFile) parent = g_file_get_parent (file);
+  g_autoptr(GByteArray) data = g_byte_array_new ();
+  g_autoptr(GError) local_error = NULL;
+  gsize key_length = strlen (key);
+
+  g_return_val_if_fail (key_length <= RACING_LINE_MAX_KEY_LENGTH, FALSE);
+
+  g_byte_array_append (data, (const guint8 *)RACING_LINE_MAGIC, 8);
+  append_u32 (data, RACING_LINE_VERSION);
+  append_u32 (data, key_length);
+  g_byte_array_append (data, (const guint8 *)key, key_length);
+  append_float (data, line->spacing);
+  append_u32 (data, line->points->len);
+
+  for (guint i = 0; i < line->points->len; i++)
+    {
+      const RacingLinePoint *p = get_point (line, i);
+
+      append_float (data, p->x);
+      append_float (data, p->z);
+      append_float (data, p->curvature);
+    }
+
+  if (!g_file_make_directory_with_parents (parent, NULL, &local_error) &&
+      !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  return g_file_replace_contents (file, (const char *)data->data, data->len,
+                                  NULL, FALSE, G_FILE_CREATE_NONE, NULL, NULL, error);
+}
+
+typedef struct {
+  const guint8 *data;
+  gsize length;
+  gsize offset;
+} Reader;
+
+static gboolean
+read_bytes (Reader *reader,
+            gpointer dest,
+            gsize n)
+{
+  if (reader->length - reader->offset < n)
+    return FALSE;
+
+  memcpy (dest, reader->data + reader->offset, n);
+  reader->offset += n;
+  return TRUE;
+}
+
+static gboolean
+read_u32 (Reader *reader,
+          guint32 *v)
+{
+  if (!read_bytes (reader, v, 4))
+    return FALSE;
+
+  *v = GUINT32_FROM_LE (*v);
+  return TRUE;
+}
+
+static gboolean
+read_float (Reader *reader,
+            float *f)
+{
+  guint32 v;
+
+  if (!read_u32 (reader, &v))
+    return FALSE;
+
+  memcpy (f, &v, 4);
+  return TRUE;
+}
+
+/* Loads a line saved with the same key, i.e. made from the same maps */
+RacingLine *
+racing_line_new_from_file (const char *path,
+                           const char *key,
+                           GError **error)
+{
+  g_autofree char *contents = NULL;
+  g_autofree char *file_key = NULL;
+  g_autoptr(GArray) points = NULL;
+  guint32 version, key_length, n_points;
+  float spacing;
+  gsize length;
+  Reader reader;
+  char magic[8];
+
+  if (!g_file_get_contents (path, &contents, &length, error))
+    return NULL;
+
+  reader.data = (const guint8 *)contents;
+  reader.length = length;
+  reader.offset = 0;
+
+  if (!read_bytes (&reader, magic, 8) ||
+      memcmp (magic, RACING_LINE_MAGIC, 8) != 0 ||
+      !read_u32 (&reader, &version) ||
+      version != RACING_LINE_VERSION ||
+      !read_u32 (&reader, &key_length) ||
+      key_length > RACING_LINE_MAX_KEY_LENGTH)
+    goto invalid;
+
+  file_key = g_malloc0 (key_length + 1);
+  if (!read_bytes (&reader, file_key, key_length) ||
+      !read_float (&reader, &spacing) ||
+      !read_u32 (&reader, &n_points) ||
+      !(spacing > 0) ||
+      n_points < 3 || n_points > RACING_LINE_MAX_POINTS)
+    goto invalid;
+
+  if (strcmp (file_key, key) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s is out of date", path);
+      return NULL;
+    }
+
+  points = g_array_sized_new (FALSE, FALSE, sizeof (RacingLinePoint), n_points);
+  for (guint i = 0; i < n_points; i++)
+    {
+      RacingLinePoint p;
+
+      if (!read_float (&reader, &p.x) ||
+          !read_float (&reader, &p.z) ||
+          !read_float (&reader, &p.curvature) ||
+          !isfinite (p.x) || !isfinite (p.z) || !isfinite (p.curvature))
+        goto invalid;
+
+      g_array_append_val (points, p);
+    }
+
+  return racing_line_new (g_steal_pointer (&points), spacing);
+
+ invalid:
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+               "%s is not a valid racing line", path);
+  return NULL;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <glib.h>
+#include "analysismap.h"
+
+/* A line around the track for computer pilots to follow, as a closed
+ * spline through evenly spaced points. It is made from the collision
+ * map: the middle of the track is traced from the start, checking that
+ * the checkpoints come in order, and then pulled tight against the
+ * insides of the corners, keeping clear of the walls. */
+typedef struct _RacingLine RacingLine;
+
+RacingLine * racing_line_new_from_map    (AnalysisMap  *collision_map,
+                                          float         start_x,
+                                          float         start_z,
+                                          float         start_yaw,
+                                          GError      **error);
+RacingLine * racing_line_new_from_file   (const char   *path,
+                                          const char   *key,
+                                          GError      **error);
+gboolean     racing_line_save            (RacingLine   *line,
+                                          const char   *path,
+                                          const char   *key,
+                                          GError      **error);
+RacingLine * racing_line_ref             (RacingLine   *line);
+void         racing_line_unref           (RacingLine   *line);
+guint        racing_line_get_n_points    (RacingLine   *line);
+float        racing_line_get_spacing     (RacingLine   *line);
+float        racing_line_get_length      (RacingLine   *line);
+float        racing_line_find            (RacingLine   *line,
+                                          float         x,
+                                          float         z);
+void         racing_line_get_position    (RacingLine   *line,
+                                          float         s,
+                                          float        *x,
+                                          float        *z);
+float        racing_line_get_curvature   (RacingLine   *line,
+                                          float         s);
@@ -0,0 +1,396 @@
+#include <string.h>
+#include <gio/gio.h>
+#include "replay.h"
+
+/* The file is a header followed by the inputs as runs of the same input,
+ * all little endian so replays can be shared between machines:
+ *
+ *   magic[8] version:u32 seed:u32 difficulty:i32 active_step:u32
+ *   n_steps:u32 position:f32[3] yaw:f32 params:f32[REPLAY_N_PARAMS]
+ *   key_length:u32 key[key_length] n_runs:u32 { input:u8 length:u16 }[n_runs]
+ *
+ * params are the fields of SimParams in order, so adding one needs a
+ * new version.
+ */
+#define REPLAY_MAGIC "HEXGLRPL"
+#define REPLAY_VERSION 2
+#define REPLAY_N_PARAMS (sizeof (SimParams) / sizeof (float))
+#define REPLAY_MAX_KEY_LENGTH 256
+#define REPLAY_MAX_RUN_LENGTH G_MAXUINT16
+
+G_STATIC_ASSERT (REPLAY_N_PARAMS * sizeof (float) == sizeof (SimParams));
+
+struct _Replay {
+  char *key;
+  guint32 seed;
+  int difficulty;
+  graphene_vec3_t position;
+  float yaw;
+  /* The handling it was recorded with, which the profiles may no
+   * longer give for difficulty */
+  SimParams params;
+  guint active_step;
+  /* One SimInput per step */
+  GByteArray *steps;
+};
+
+Replay *
+replay_new (const char *key,
+            guint32 seed,
+            int difficulty,
+            const graphene_vec3_t *position,
+            float yaw)
+{
+  Replay *replay = g_new0 (Replay, 1);
+
+  replay->key = g_strdup (key);
+  replay->seed = seed;
+  replay->difficulty = difficulty;
+  replay->position = *position;
+  replay->yaw = yaw;
+  if (difficulty >= 0 && difficulty < SIM_N_DIFFICULTIES)
+    replay->params = *sim_get_params (difficulty);
+  else
+    sim_params_init (&replay->params, difficulty);
+  replay->active_step = G_MAXUINT;
+  replay->steps = g_byte_array_new ();
+
+  return replay;
+}
+
+void
+replay_free (Replay *replay)
+{
+  g_free (replay->key);
+  g_byte_array_unref (replay->steps);
+  g_free (replay);
+}
+
+const char *
+replay_get_key (Replay *replay)
+{
+  return replay->key;
+}
+
+guint32
+replay_get_seed (Replay *replay)
+{
+  return replay->seed;
+}
+
+int
+replay_get_difficulty (Replay *replay)
+{
+  return replay->difficulty;
+}
+
+void
+replay_get_start (Replay *replay,
+                  graphene_vec3_t *position,
+                  float *yaw)
+{
+  *position = replay->position;
+  *yaw = replay->yaw;
+}
+
+/* The handling to play it back with, what difficulty gave when it was
+ * recorded */
+const SimParams *
+replay_get_params (Replay *replay)
+{
+  return &replay->params;
+}
+
+/* The step before which the ship was set active, i.e. the end of the
+ * countdown */
+void
+replay_set_active_step (Replay *replay,
+                        guint step)
+{
+  replay->active_step = step;
+}
+
+guint
+replay_get_active_step (Replay *replay)
+{
+  return replay->active_step;
+}
+
+void
+replay_add_step (Replay *replay,
+                 SimInput input)
+{
+  guint8 byte = input;
+
+  g_byte_array_append (replay->steps, &byte, 1);
+}
+
+guint
+replay_get_n_steps (Replay *replay)
+{
+  return replay->steps->len;
+}
+
+SimInput
+replay_get_step (Replay *replay,
+                 guint step)
+{
+  g_return_val_if_fail (step < replay->steps->len, 0);
+
+  return replay->steps->data[step];
+}
+
+/* Runs the whole replay from the start, as fast as possible */
+void
+replay_run (Replay *replay,
+            SimState *state)
+{
+  sim_state_set_difficulty (state, replay->difficulty);
+  state->params = replay->params;
+  sim_state_reset (state, &replay->position, replay->yaw);
+  state->active = FALSE;
+
+  for (guint i = 0; i < replay->steps->len; i++)
+    {
+      if (i == replay->active_step)
+        state->active = TRUE;
+
+      sim_step (state, replay->steps->data[i], 1.0);
+    }
+}
+
+static void
+append_u32 (GByteArray *data,
+            guint32 v)
+{
+  v = GUINT32_TO_LE (v);
+  g_byte_array_append (data, (guint8 *)&v, 4);
+}
+
+static void
+append_float (GByteArray *data,
+              float f)
+{
+  guint32 v;
+
+  memcpy (&v, &f, 4);
+  append_u32 (data, v);
+}
+
+static void
+append_params (GByteArray *data,
+               const SimParams *params)
+{
+  float p[REPLAY_N_PARAMS];
+
+  memcpy (p, params, sizeof (p));
+  for (guint i = 0; i < REPLAY_N_PARAMS; i++)
+    append_float (data, p[i]);
+}
+
+gboolean
+replay_save (Replay *replay,
+             const char *path,
+             GError **error)
+{
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  g_autoptr(GFile) parent = g_file_get_parent (file);
+  g_autoptr(GByteArray) data = g_byte_array_new ();
+  g_autoptr(GError) local_error = NULL;
+  gsize key_length = strlen (replay->key);
+  guint n_runs_offset, n_runs = 0;
+  guint i, j;
+
+  g_return_val_if_fail (key_length <= REPLAY_MAX_KEY_LENGTH, FALSE);
+
+  g_byte_array_append (data, (const guint8 *)REPLAY_MAGIC, 8);
+  append_u32 (data, REPLAY_VERSION);
+  append_u32 (data, replay->seed);
+  append_u32 (data, replay->difficulty);
+  append_u32 (data, replay->active_step);
+  append_u32 (data, replay->steps->len);
+  append_float (data, graphene_vec3_get_x (&replay->position));
+  append_float (data, graphene_vec3_get_y (&replay->position));
+  append_float (data, graphene_vec3_get_z (&replay->position));
+  append_float (data, replay->yaw);
+  append_params (data, &replay->params);
+  append_u32 (data, key_length);
+  g_byte_array_append (data, (const guint8 *)replay->key, key_length);
+
+  n_runs_offset = data->len;
+  append_u32 (data, 0);
+
+  for (i = 0; i < replay->steps->len; i = j)
+    {
+      guint8 input = replay->steps->data[i];
+      guint16 length;
+
+      for (j = i + 1;
+           j < replay->steps->len && replay->steps->data[j] == input &&
+           j - i < REPLAY_MAX_RUN_LENGTH;
+           j++)
+        ;
+
+      length = GUINT16_TO_LE (j - i);
+      g_byte_array_append (data, &input, 1);
+      g_byte_array_append (data, (guint8 *)&length, 2);
+      n_runs++;
+    }
+
+  n_runs = GUINT32_TO_LE (n_runs);
+  memcpy (data->data + n_runs_offset, &n_runs, 4);
+
+  if (!g_file_make_directory_with_parents (parent, NULL, &local_error) &&
+      !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  return g_file_replace_contents (file, (const char *)data->data, data->len,
+                                  NULL, FALSE, G_FILE_CREATE_NONE, NULL, NULL, error);
+}
+
+typedef struct {
+  const guint8 *data;
+  gsize length;
+  gsize offset;
+} Reader;
+
+static gboolean
+read_bytes (Reader *reader,
+            gpointer dest,
+            gsize n)
+{
+  if (reader->length - reader->offset < n)
+    return FALSE;
+
+  memcpy (dest, reader->data + reader->offset, n);
+  reader->offset += n;
+  return TRUE;
+}
+
+static gboolean
+read_u32 (Reader *reader,
+          guint32 *v)
+{
+  if (!read_bytes (reader, v, 4))
+    return FALSE;
+
+  *v = GUINT32_FROM_LE (*v);
+  return TRUE;
+}
+
+static gboolean
+read_float (Reader *reader,
+            float *f)
+{
+  guint32 v;
+
+  if (!read_u32 (reader, &v))
+    return FALSE;
+
+  memcpy (f, &v, 4);
+  return TRUE;
+}
+
+static gboolean
+read_params (Reader *reader,
+             SimParams *params)
+{
+  float p[REPLAY_N_PARAMS];
+
+  for (guint i = 0; i < REPLAY_N_PARAMS; i++)
+    if (!read_float (reader, &p[i]))
+      return FALSE;
+
+  memcpy (params, p, sizeof (p));
+  return TRUE;
+}
+
+Replay *
+replay_new_from_file (const char *path,
+                      GError **error)
+{
+  g_autofree char *contents = NULL;
+  gsize length;
+  Reader reader;
+  char magic[8];
+  guint32 version, seed, difficulty, active_step, n_steps, key_length, n_runs;
+  float x, y, z, yaw;
+  SimParams params;
+  g_autofree char *key = NULL;
+  graphene_vec3_t position;
+  Replay *replay;
+
+  if (!g_file_get_contents (path, &contents, &length, error))
+    return NULL;
+
+  reader.data = (const guint8 *)contents;
+  reader.length = length;
+  reader.offset = 0;
+
+  if (!read_bytes (&reader, magic, 8) ||
+      memcmp (magic, REPLAY_MAGIC, 8) != 0 ||
+      !read_u32 (&reader, &version) ||
+      version != REPLAY_VERSION ||
+      !read_u32 (&reader, &seed) ||
+      !read_u32 (&reader, &difficulty) ||
+      !read_u32 (&reader, &active_step) ||
+      !read_u32 (&reader, &n_steps) ||
+      !read_float (&reader, &x) ||
+      !read_float (&reader, &y) ||
+      !read_float (&reader, &z) ||
+      !read_float (&reader, &yaw) ||
+      !read_params (&reader, &params) ||
+      !read_u32 (&reader, &key_length) ||
+      key_length > REPLAY_MAX_KEY_LENGTH)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s is not a valid replay", path);
+      return NULL;
+    }
+
+  key = g_malloc0 (key_length + 1);
+  if (!read_bytes (&reader, key, key_length) ||
+      !read_u32 (&reader, &n_runs))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s is truncated", path);
+      return NULL;
+    }
+
+  replay = replay_new (key, seed, (gint32)difficulty,
+                       graphene_vec3_init (&position, x, y, z), yaw);
+  replay->params = params;
+  replay->active_step = active_step;
+
+  for (guint i = 0; i < n_runs; i++)
+    {
+      guint8 input;
+      guint16 run_length;
+
+      if (!read_bytes (&reader, &input, 1) ||
+          !read_bytes (&reader, &run_length, 2) ||
+          GUINT16_FROM_LE (run_length) > n_steps - replay->steps->len)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "%s is truncated", path);
+          replay_free (replay);
+          return NULL;
+        }
+
+      for (guint j = 0; j < GUINT16_FROM_LE (run_length); j++)
+        g_byte_array_append (replay->steps, &input, 1);
+    }
+
+  if (replay->steps->len != n_steps)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s is truncated", path);
+      replay_free (replay);
+      return NULL;
+    }
+
+  return replay;
+}
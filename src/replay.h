@@ -0,0 +1,40 @@
+#pragma once
+
+#include <glib.h>
+#include <graphene.h>
+#include "sim.h"
+
+/* A race as the input held down at every simulation step, plus what is
+ * needed to start the simulation the same way, including the handling
+ * of the ship. Played back through sim_step() it gives exactly the same
+ * race. */
+typedef struct _Replay Replay;
+
+Replay *  replay_new               (const char             *key,
+                                    guint32                 seed,
+                                    int                     difficulty,
+                                    const graphene_vec3_t  *position,
+                                    float                   yaw);
+Replay *  replay_new_from_file     (const char             *path,
+                                    GError                **error);
+gboolean  replay_save              (Replay                 *replay,
+                                    const char             *path,
+                                    GError                **error);
+void      replay_free              (Replay                 *replay);
+const char *replay_get_key         (Replay                 *replay);
+guint32   replay_get_seed          (Replay                 *replay);
+int       replay_get_difficulty    (Replay                 *replay);
+const SimParams *replay_get_params (Replay                 *replay);
+void      replay_get_start         (Replay                 *replay,
+                                    graphene_vec3_t        *position,
+                                    float                  *yaw);
+void      replay_set_active_step   (Replay                 *replay,
+                                    guint                   step);
+guint     replay_get_active_step   (Replay                 *replay);
+void      replay_add_step          (Replay                 *replay,
+                                    SimInput                input);
+guint     replay_get_n_steps       (Replay                 *replay);
+SimInput  replay_get_step          (Replay                 *replay,
+                                    guint                   step);
+void      replay_run               (Replay                 *replay,
+                                    SimState               *state);
@@ -0,0 +1,179 @@
+#include <string.h>
+#include "rng.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+/* The top 24 bits make a float in [0, 1) */
+#define RNG_FLOAT_SCALE (1.0f / 16777216.0f)
+
+typedef void (*RngFillFunc) (Rng   *rng,
+                             float *values,
+                             int    n);
+
+static guint64
+splitmix64 (guint64 *x)
+{
+  guint64 z = (*x += 0x9e3779b97f4a7c15ull);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+/* Spreads seed over all of the state, so close seeds give unrelated
+ * sequences */
+void
+rng_init (Rng *rng,
+          guint32 seed)
+{
+  guint64 x = seed;
+
+  for (int l = 0; l < RNG_LANES; l++)
+    {
+      guint64 a = splitmix64 (&x);
+      guint64 b = splitmix64 (&x);
+
+      rng->s[0][l] = a;
+      rng->s[1][l] = a >> 32;
+      rng->s[2][l] = b;
+      rng->s[3][l] = b >> 32;
+
+      /* An all zero state only ever gives zeros */
+      if ((rng->s[0][l] | rng->s[1][l] | rng->s[2][l] | rng->s[3][l]) == 0)
+        rng->s[0][l] = 1;
+    }
+}
+
+static inline guint32
+rotl (guint32 x,
+      int k)
+{
+  return (x << k) | (x >> (32 - k));
+}
+
+/* Value i comes from lane i % RNG_LANES, and every lane steps the same
+ * number of times, so a partial group still uses up four numbers */
+static void
+rng_fill_scalar (Rng *rng,
+                 float *values,
+                 int n)
+{
+  for (int l = 0; l < RNG_LANES; l++)
+    {
+      guint32 s0 = rng->s[0][l], s1 = rng->s[1][l], s2 = rng->s[2][l], s3 = rng->s[3][l];
+
+      for (int i = 0; i < n; i += RNG_LANES)
+        {
+          guint32 result = s0 + s3;
+          guint32 t = s1 << 9;
+
+          s2 ^= s0;
+          s3 ^= s1;
+          s1 ^= s2;
+          s0 ^= s3;
+          s2 ^= t;
+          s3 = rotl (s3, 11);
+
+          if (i + l < n)
+            values[i + l] = (result >> 8) * RNG_FLOAT_SCALE;
+        }
+
+      rng->s[0][l] = s0;
+      rng->s[1][l] = s1;
+      rng->s[2][l] = s2;
+      rng->s[3][l] = s3;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* Same as rng_fill_scalar(), all four lanes at once */
+__attribute__((target("sse2"))) static void
+rng_fill_sse2 (Rng *rng,
+               float *values,
+               int n)
+{
+  __m128i s0 = _mm_loadu_si128 ((const __m128i *) rng->s[0]);
+  __m128i s1 = _mm_loadu_si128 ((const __m128i *) rng->s[1]);
+  __m128i s2 = _mm_loadu_si128 ((const __m128i *) rng->s[2]);
+  __m128i s3 = _mm_loadu_si128 ((const __m128i *) rng->s[3]);
+  const __m128 scale = _mm_set1_ps (RNG_FLOAT_SCALE);
+
+  for (int i = 0; i < n; i += RNG_LANES)
+    {
+      __m128i result = _mm_add_epi32 (s0, s3);
+      __m128i t = _mm_slli_epi32 (s1, 9);
+      __m128 f;
+
+      s2 = _mm_xor_si128 (s2, s0);
+      s3 = _mm_xor_si128 (s3, s1);
+      s1 = _mm_xor_si128 (s1, s2);
+      s0 = _mm_xor_si128 (s0, s3);
+      s2 = _mm_xor_si128 (s2, t);
+      s3 = _mm_or_si128 (_mm_slli_epi32 (s3, 11), _mm_srli_epi32 (s3, 21));
+
+      /* 24 bits, so the signed conversion is exact */
+      f = _mm_mul_ps (_mm_cvtepi32_ps (_mm_srli_epi32 (result, 8)), scale);
+
+      if (i + RNG_LANES <= n)
+        _mm_storeu_ps (values + i, f);
+      else
+        {
+          float rest[RNG_LANES];
+
+          _mm_storeu_ps (rest, f);
+          memcpy (values + i, rest, (n - i) * sizeof (float));
+        }
+    }
+
+  _mm_storeu_si128 ((__m128i *) rng->s[0], s0);
+  _mm_storeu_si128 ((__m128i *) rng->s[1], s1);
+  _mm_storeu_si128 ((__m128i *) rng->s[2], s2);
+  _mm_storeu_si128 ((__m128i *) rng->s[3], s3);
+}
+
+#endif
+
+static RngFillFunc
+get_fill_func (void)
+{
+  static RngFillFunc func = NULL;
+
+  if (func == NULL)
+    {
+      func = rng_fill_scalar;
+#ifdef HAVE_X86_KERNELS
+      __builtin_cpu_init ();
+      if (__builtin_cpu_supports ("sse2"))
+        func = rng_fill_sse2;
+#endif
+    }
+
+  return func;
+}
+
+/* Fills values with n numbers from [0, 1) */
+void
+rng_fill (Rng *rng,
+          float *values,
+          int n)
+{
+  get_fill_func () (rng, values, n);
+}
+
+/* One number from [min, max). This uses up a whole group, so it is
+ * cheaper to get many with rng_fill(). */
+float
+rng_float_range (Rng *rng,
+                 float min,
+                 float max)
+{
+  float value;
+
+  rng_fill (rng, &value, 1);
+
+  return min + (max - min) * value;
+}
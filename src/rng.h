@@ -0,0 +1,23 @@
+#pragma once
+
+#include <glib.h>
+
+/* A small seeded generator for the effects, which need cheap numbers
+ * that come out the same again from the same seed rather than good
+ * ones. It is four xoshiro128+ generators side by side, so batches are
+ * made four numbers at a time. */
+#define RNG_LANES 4
+
+typedef struct {
+  /* Word i of the state of lane l is s[i][l] */
+  guint32 s[4][RNG_LANES];
+} Rng;
+
+void  rng_init        (Rng     *rng,
+                       guint32  seed);
+void  rng_fill        (Rng     *rng,
+                       float   *values,
+                       int      n);
+float rng_float_range (Rng     *rng,
+                       float    min,
+                       float    max);
@@ -77,3 +77,101 @@ GthreeShader * hexvignette_shader_clone (void)
 
   return gthree_shader_clone (hexvignette_shader);
 }
+
+
+/* ------------------------------------------------------------------------------------------------
+//	Pooled particles
+//  Each particle only has what it was spawned with, and the frame and
+//  time since then give where it is. Runs the same steps as
+//  particles_update(), with the average dt of the particle's life.
+//  Drawn from before they were added, they wait at the start.
+//  style is the size, the tile of the atlas and the ageing.
+------------------------------------------------------------------------------------------------ */
+
+static const char *particles_vertex_shader =
+  "uniform float time;\n"
+  "uniform float frame;\n"
+  "uniform float friction;\n"
+  "uniform vec3 force;\n"
+  "uniform float scale;\n"
+
+  "attribute vec3 velocity;\n"
+  "attribute vec3 spawn_color;\n"
+  "attribute vec2 spawn_time;\n"
+  "attribute vec3 style;\n"
+
+  "varying vec3 vColor;\n"
+  "varying float vTile;\n"
+
+  "void main() {\n"
+
+  "  float n = max(frame - spawn_time.y, 0.0);\n"
+  "  float t = max(time - spawn_time.x, 0.0);\n"
+  "  float life = 1.0 - style.z * n;\n"
+
+  "  if (life <= 0.0) {\n"
+  "    gl_PointSize = 0.0;\n"
+  "    gl_Position = vec4(2.0, 2.0, 2.0, 1.0);\n"
+  "    return;\n"
+  "  }\n"
+
+  "  float dt = n > 0.0 ? t / n : 0.0;\n"
+  "  vec3 p;\n"
+  "  if (friction == 1.0) {\n"
+  "    p = position + velocity * t + force * (t * dt * (n + 1.0) * 0.5);\n"
+  "  } else {\n"
+  "    float s = friction * (1.0 - pow(friction, n)) / (1.0 - friction);\n"
+  "    p = position + (velocity * s + force * dt * (n - s) / (1.0 - friction)) * dt;\n"
+  "  }\n"
+
+  "  vColor = spawn_color * min(life + 0.5, 1.0);\n"
+  "  vTile = style.y;\n"
+
+  "  vec4 mvPosition = modelViewMatrix * vec4( p, 1.0 );\n"
+  "  gl_PointSize = style.x * ( scale / -mvPosition.z );\n"
+  "  gl_Position = projectionMatrix * mvPosition;\n"
+
+  "}";
+
+static const char *particles_fragment_shader =
+  "uniform sampler2D map;\n"
+  "uniform float tiles;\n"
+
+  "varying vec3 vColor;\n"
+  "varying float vTile;\n"
+
+  "void main() {\n"
+  "  vec2 uv = vec2( ( vTile + gl_PointCoord.x ) / tiles, 1.0 - gl_PointCoord.y );\n"
+  "  gl_FragColor = vec4( vColor, 1.0 ) * texture2D( map, uv );\n"
+  "}";
+
+static float time_def = 0;
+static float frame_def = 0;
+static float friction_def = 1;
+static float force_def[3] = { 0, 0, 0 };
+static float scale_def = 300;
+static float tiles_def = 1;
+static GthreeUniformsDefinition particles_uniforms_defs[] = {
+  {"time", GTHREE_UNIFORM_TYPE_FLOAT, &time_def},
+  {"frame", GTHREE_UNIFORM_TYPE_FLOAT, &frame_def},
+  {"friction", GTHREE_UNIFORM_TYPE_FLOAT, &friction_def},
+  {"force", GTHREE_UNIFORM_TYPE_VECTOR3, &force_def },
+  {"scale", GTHREE_UNIFORM_TYPE_FLOAT, &scale_def},
+  {"map", GTHREE_UNIFORM_TYPE_TEXTURE, NULL },
+  {"tiles", GTHREE_UNIFORM_TYPE_FLOAT, &tiles_def},
+};
+static GthreeUniforms *particles_uniforms;
+static GthreeShader *particles_shader;
+
+GthreeShader * particles_shader_clone (void)
+{
+  if (particles_shader == NULL)
+    {
+      particles_uniforms = gthree_uniforms_new_from_definitions (particles_uniforms_defs, G_N_ELEMENTS (particles_uniforms_defs));
+      particles_shader = gthree_shader_new (NULL, particles_uniforms,
+                                            particles_vertex_shader,
+                                            particles_fragment_shader);
+    }
+
+  return gthree_shader_clone (particles_shader);
+}
@@ -1,3 +1,4 @@
 #include <gthree/gthree.h>
 
 GthreeShader * hexvignette_shader_clone (void);
+GthreeShader * particles_shader_clone (void);
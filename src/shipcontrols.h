@@ -1,29 +1,40 @@
 #include <gthree/gthree.h>
+#include "aipilot.h"
 #include "analysismap.h"
+#include "replay.h"
+#include "ships.h"
 
 typedef struct _ShipControls ShipControls;
 
-ShipControls *         ship_controls_new                  (void);
+ShipControls *         ship_controls_new                  (Ships        *ships);
 void                   ship_controls_set_difficulty       (ShipControls *controls,
                                                            int           difficulty);
+void                   ship_controls_set_params           (ShipControls *controls,
+                                                           const SimParams *params);
+int                    ship_controls_get_difficulty       (ShipControls *controls);
+guint                  ship_controls_get_ship             (ShipControls *controls);
 void                   ship_controls_control              (ShipControls *controls,
                                                            GthreeObject *mesh);
 void                   ship_controls_stop                 (ShipControls *controls);
 void                   ship_controls_set_active           (ShipControls *controls,
                                                            gboolean      active);
-void                   ship_controls_set_height_map       (ShipControls *controls,
-                                                           AnalysisMap  *map);
-void                   ship_controls_set_collision_map    (ShipControls *controls,
-                                                           AnalysisMap  *map);
 int                    ship_controls_get_check_point      (ShipControls *controls);
 GthreeObject *         ship_controls_get_mesh             (ShipControls *controls);
-GthreeObject *         ship_controls_get_dummy            (ShipControls *controls);
+void                   ship_controls_get_position         (ShipControls *controls,
+                                                           graphene_vec3_t *position);
+void                   ship_controls_get_pose             (ShipControls *controls,
+                                                           SimPose      *pose);
+void                   ship_controls_rotate               (ShipControls *controls,
+                                                           const graphene_vec3_t *v,
+                                                           graphene_vec3_t *res);
 const graphene_vec3_t *ship_controls_get_current_velocity (ShipControls *controls);
 gboolean               ship_controls_get_collision_left   (ShipControls *controls);
 gboolean               ship_controls_get_collision_right  (ShipControls *controls);
 void                   ship_controls_free                 (ShipControls *controls);
-void                   ship_controls_update               (ShipControls *controls,
-                                                           float         dt);
+void                   ship_controls_prepare_step         (ShipControls *controls);
+void                   ship_controls_finish_step          (ShipControls *controls);
+void                   ship_controls_interpolate          (ShipControls *controls,
+                                                           float         alpha);
 void                   ship_controls_reset                (ShipControls *controls,
                                                            const graphene_vec3_t *position,
                                                            const graphene_vec3_t *rotation);
@@ -37,6 +48,13 @@ gboolean               ship_controls_is_destroyed         (ShipControls *control
 float                  ship_controls_get_shield_ratio     (ShipControls *controls);
 int                    ship_controls_get_shield           (ShipControls *controls,
                                                            float scale);
+void                   ship_controls_record               (ShipControls *controls,
+                                                           Replay       *replay);
+void                   ship_controls_play                 (ShipControls *controls,
+                                                           Replay       *replay);
+gboolean               ship_controls_is_replaying         (ShipControls *controls);
+void                   ship_controls_set_pilot            (ShipControls *controls,
+                                                           AiPilot      *pilot);
 gboolean               ship_controls_key_press            (ShipControls *controls,
                                                            GdkEventKey  *event);
 gboolean               ship_controls_key_release          (ShipControls *controls,
@@ -2,10 +2,28 @@
 #include "shipcontrols.h"
 #include "utils.h"
 #include "particles.h"
+#include "rng.h"
+
+/* Each ship's share of the pool, what its four emitters could have live
+ * at once */
+#define SHIP_EFFECTS_MAX_PARTICLES 800
+
+/* The tiles of the pool's atlas */
+enum {
+  SPARK_TILE,
+  CLOUD_TILE,
+  N_TILES
+};
+
+static const char *particle_textures[N_TILES] = {
+  [SPARK_TILE] = "spark.png",
+  [CLOUD_TILE] = "cloud.png",
+};
 
 struct _ShipEffects {
   GthreeScene *scene;
   ShipControls *controls;
+  ParticlePool *pool;
   GthreeMeshBasicMaterial *booster_material;
   GthreeObject *booster;
   GthreeMesh *booster_mesh;
@@ -23,11 +41,33 @@ struct _ShipEffects {
   Particles *left_sparks;
   Particles *right_clouds;
   Particles *left_clouds;
+  graphene_vec3_t cloud_offset;
+  graphene_vec3_t cloud_radius;
+  graphene_vec3_t cloud_velocity;
+
+  /* For the booster flicker, drawn each step */
+  Rng rng;
+  float flicker;
 };
 
+/* The pool that the effects of all the ships add their particles to, so
+ * they are drawn at once however many ships there are */
+ParticlePool *
+ship_effects_pool_new (GthreeScene *scene)
+{
+  ParticlePool *pool = particle_pool_new (0);
+  g_autoptr(GthreeTexture) atlas = load_texture_atlas (particle_textures, N_TILES);
+
+  particle_pool_set_atlas (pool, atlas, N_TILES);
+  gthree_object_add_child (GTHREE_OBJECT (scene), particle_pool_get_object (pool));
+
+  return pool;
+}
+
 ShipEffects *
 ship_effects_new (GthreeScene *scene,
-                  ShipControls *controls)
+                  ShipControls *controls,
+                  ParticlePool *pool)
 {
   ShipEffects *effects = g_new0 (ShipEffects, 1);
   GthreeObject *the_ship;
@@ -37,6 +77,7 @@ ship_effects_new (GthreeScene *scene,
 
   effects->scene = scene;
   effects->controls = controls;
+  rng_init (&effects->rng, g_random_int ());
 
   the_ship = ship_controls_get_mesh (controls);
   effects->booster = gthree_object_find_first_by_name (the_ship, "booster");
@@ -101,53 +142,42 @@ ship_effects_new (GthreeScene *scene,
   GdkRGBA spark_color1 = { 1.0, 1.0, 1.0, 1.0 };
   GdkRGBA spark_color2 = { 1.0, 0.7529411764705882, 0.0, 1.0 };
 
-  g_autoptr(GthreeTexture) spark_texture = load_texture ("spark.png");
+  effects->pool = pool;
+  particle_pool_grow (pool, SHIP_EFFECTS_MAX_PARTICLES);
 
-  effects->right_sparks = particles_new (200, 2);
+  effects->right_sparks = particles_new_pooled (pool, 2, SPARK_TILE);
   particles_set_velocity_randomness (effects->right_sparks, graphene_vec3_init (&v, 0.4, 0.4, 0.4));
   particles_set_life (effects->right_sparks, 60);
   particles_set_color1 (effects->right_sparks, &spark_color1);
   particles_set_color2 (effects->right_sparks, &spark_color2);
-  particles_set_map (effects->right_sparks, spark_texture);
-
-  gthree_object_add_child (GTHREE_OBJECT (scene), particles_get_object (effects->right_sparks));
 
-  effects->left_sparks = particles_new (200, 2);
+  effects->left_sparks = particles_new_pooled (pool, 2, SPARK_TILE);
   particles_set_velocity_randomness (effects->left_sparks, graphene_vec3_init (&v, 0.4, 0.4, 0.4));
   particles_set_life (effects->left_sparks, 60);
   particles_set_color1 (effects->left_sparks, &spark_color1);
   particles_set_color2 (effects->left_sparks, &spark_color2);
-  particles_set_map (effects->left_sparks, spark_texture);
 
-  gthree_object_add_child (GTHREE_OBJECT (scene), particles_get_object (effects->left_sparks));
-
-  g_autoptr(GthreeTexture) cloud_texture = load_texture ("cloud.png");
   GdkRGBA cloud_color1 = { 0.6431372549019608, 0.9450980392156862, 1.0 };
   GdkRGBA cloud_color2 = { 0.4, 0.4, 0.4, 1.0 };
 
-  effects->right_clouds = particles_new (200, 6);
+  /* The clouds trail the ship. The pool is in world space, so they are
+   * placed from the ship each frame, like the sparks, and keep its
+   * velocity from when they were emitted. */
+  graphene_vec3_init (&effects->cloud_offset, -3, -0.3, 0);
+  graphene_vec3_init (&effects->cloud_radius, 1, 1, 2);
+  graphene_vec3_init (&effects->cloud_velocity, 0, 0, -0.4);
+
+  effects->right_clouds = particles_new_pooled (pool, 6, CLOUD_TILE);
   particles_set_life (effects->right_clouds, 60);
-  particles_set_spawn_point (effects->right_clouds, graphene_vec3_init (&v, -3, -0.3, 0));
-  particles_set_spawn_radius (effects->right_clouds, graphene_vec3_init (&v, 1, 1, 2));
-  particles_set_velocity (effects->right_clouds, graphene_vec3_init (&v, 0, 0, -0.4));
   particles_set_velocity_randomness (effects->right_clouds, graphene_vec3_init (&v, 0.05, 0.05, 0.1));
   particles_set_color1 (effects->right_clouds, &cloud_color1);
   particles_set_color2 (effects->right_clouds, &cloud_color2);
-  particles_set_map (effects->right_clouds, cloud_texture);
-
-  gthree_object_add_child (GTHREE_OBJECT (the_ship), particles_get_object (effects->right_clouds));
 
-  effects->left_clouds = particles_new (200, 6);
+  effects->left_clouds = particles_new_pooled (pool, 6, CLOUD_TILE);
   particles_set_life (effects->left_clouds, 60);
-  particles_set_spawn_point (effects->left_clouds, graphene_vec3_init (&v, 3, -0.3, 0));
-  particles_set_spawn_radius (effects->left_clouds, graphene_vec3_init (&v, 1, 1, 2));
-  particles_set_velocity (effects->left_clouds, graphene_vec3_init (&v, 0, 0, -0.4));
   particles_set_velocity_randomness (effects->left_clouds, graphene_vec3_init (&v, 0.05, 0.05, 0.1));
   particles_set_color1 (effects->left_clouds, &cloud_color1);
   particles_set_color2 (effects->left_clouds, &cloud_color2);
-  particles_set_map (effects->left_clouds, cloud_texture);
-
-  gthree_object_add_child (GTHREE_OBJECT (the_ship), particles_get_object (effects->left_clouds));
 
   return effects;
 }
@@ -160,47 +190,49 @@ ship_effects_free (ShipEffects *effects)
   g_clear_object (&effects->booster_material);
   g_clear_object (&effects->booster_light);
   g_clear_object (&effects->booster_sprite);
+
+  /* Our particles still in the pool die in their own time */
+  particles_free (effects->right_sparks);
+  particles_free (effects->left_sparks);
+  particles_free (effects->right_clouds);
+  particles_free (effects->left_clouds);
+  particle_pool_shrink (effects->pool, SHIP_EFFECTS_MAX_PARTICLES);
+
   g_free (effects);
 }
 
+/* Makes the flicker and the particles from here on the same each time
+ * for the same seed */
 void
-ship_effects_update (ShipEffects *effects,
-                      float dt)
+ship_effects_set_seed (ShipEffects *effects,
+                       guint32 seed)
 {
-  float boost_ratio = 0, opacity = 0, scale = 0, random = 0, intensity = 0;
-
-  if (!ship_controls_is_destroyed (effects->controls))
-    {
-      gboolean is_accel = ship_controls_is_accelerating (effects->controls);
-      boost_ratio = ship_controls_get_boost_ratio (effects->controls);
-      opacity =  (is_accel ? 0.8 : 0.3) + boost_ratio * 0.4;
-      scale = (is_accel  ? 1.0 : 0.8) + boost_ratio * 0.5;
-      intensity = is_accel ? 4.0 : 2.0;
-      random = g_random_double_range (0, 0.2);
-    }
-
-  if (effects->booster)
-    {
-      const graphene_euler_t *old_rotation = gthree_object_get_rotation (GTHREE_OBJECT (effects->booster_mesh));
-      graphene_euler_t r;
-      graphene_vec3_t s;
+  rng_init (&effects->rng, seed);
+  particles_set_seed (effects->right_sparks, seed + 1);
+  particles_set_seed (effects->left_sparks, seed + 2);
+  particles_set_seed (effects->right_clouds, seed + 3);
+  particles_set_seed (effects->left_clouds, seed + 4);
+}
 
-      gthree_object_set_rotation (GTHREE_OBJECT (effects->booster_mesh),
-                                  graphene_euler_init (&r,
-                                                       graphene_euler_get_x (old_rotation),
-                                                       graphene_euler_get_y (old_rotation) + 57,
-                                                       graphene_euler_get_z (old_rotation)));
-      gthree_object_set_scale (GTHREE_OBJECT (effects->booster_mesh),
-                               graphene_vec3_init (&s, scale, scale, scale));
-      gthree_material_set_opacity (GTHREE_MATERIAL (effects->booster_material), random + opacity);
-      gthree_light_set_intensity (GTHREE_LIGHT (effects->booster_light), intensity * (random + 0.8));
-      gthree_material_set_opacity (GTHREE_MATERIAL (gthree_sprite_get_material (effects->booster_sprite)), random + opacity);
-    }
+/* Emits the particles for the step just taken, and picks the flicker
+ * of the booster until the next one. This goes by the pose and state at
+ * the end of each step, not how the ship is drawn, so it is the same
+ * whatever the frame rate. */
+void
+ship_effects_step (ShipEffects *effects)
+{
+  SimPose pose;
+  graphene_matrix_t matrix;
+  graphene_vec3_t position;
 
-  /* Update particles */
+  if (ship_controls_is_destroyed (effects->controls))
+    effects->flicker = 0;
+  else
+    effects->flicker = rng_float_range (&effects->rng, 0, 0.2);
 
-  GthreeObject *dummy = ship_controls_get_dummy (effects->controls);
-  GthreeObject *mesh = ship_controls_get_mesh (effects->controls);
+  ship_controls_get_pose (effects->controls, &pose);
+  sim_pose_to_matrix (&pose, &matrix);
+  graphene_point3d_to_vec3 (&pose.position, &position);
 
   graphene_vec3_t shipVelocity;
   graphene_vec3_scale (ship_controls_get_current_velocity (effects->controls), 0.7, &shipVelocity);
@@ -214,18 +246,15 @@ ship_effects_update (ShipEffects *effects,
 
   // right sparks
 
-  graphene_matrix_transform_vec3 (gthree_object_get_matrix (mesh),
-                                  &effects->pOffset, &spawn_point);
+  graphene_matrix_transform_vec3 (&matrix, &effects->pOffset, &spawn_point);
   graphene_vec3_scale (&spawn_point, effects->pOffsetS, &spawn_point);
-  graphene_vec3_add (&spawn_point, gthree_object_get_position (dummy), &spawn_point);
+  graphene_vec3_add (&spawn_point, &position, &spawn_point);
 
-  graphene_matrix_transform_vec3 (gthree_object_get_matrix (dummy),
-                                  &effects->pVel, &spawn_vel);
+  sim_pose_rotate (&pose, &effects->pVel, &spawn_vel);
   graphene_vec3_scale (&spawn_vel, effects->pVelS, &spawn_vel);
   graphene_vec3_add (&spawn_vel, &shipVelocity, &spawn_vel);
 
-  graphene_matrix_transform_vec3 (gthree_object_get_matrix (mesh),
-                                  &effects->pRad, &spawn_rad);
+  graphene_matrix_transform_vec3 (&matrix, &effects->pRad, &spawn_rad);
   graphene_vec3_scale (&spawn_rad, effects->pRadS, &spawn_rad);
 
   particles_set_spawn_point (effects->right_sparks, &spawn_point);
@@ -235,14 +264,12 @@ ship_effects_update (ShipEffects *effects,
   // left sparks
 
   graphene_vec3_multiply (&effects->pOffset, &flip_x, &spawn_point);
-  graphene_matrix_transform_vec3 (gthree_object_get_matrix (mesh),
-                                  &spawn_point, &spawn_point);
+  graphene_matrix_transform_vec3 (&matrix, &spawn_point, &spawn_point);
   graphene_vec3_scale (&spawn_point, effects->pOffsetS, &spawn_point);
-  graphene_vec3_add (&spawn_point, gthree_object_get_position (dummy), &spawn_point);
+  graphene_vec3_add (&spawn_point, &position, &spawn_point);
 
   graphene_vec3_multiply (&effects->pVel, &flip_x, &spawn_vel);
-  graphene_matrix_transform_vec3 (gthree_object_get_matrix (mesh),
-                                  &spawn_vel, &spawn_vel);
+  graphene_matrix_transform_vec3 (&matrix, &spawn_vel, &spawn_vel);
   graphene_vec3_scale (&spawn_vel, effects->pVelS, &spawn_vel);
   graphene_vec3_add (&spawn_vel, &shipVelocity, &spawn_vel);
 
@@ -250,6 +277,31 @@ ship_effects_update (ShipEffects *effects,
   particles_set_velocity (effects->left_sparks, &spawn_vel);
   particles_set_spawn_radius (effects->left_sparks, &spawn_rad); // same as right
 
+  // clouds, from where they were in the ship
+
+  graphene_vec3_t ship_velocity = *ship_controls_get_current_velocity (effects->controls);
+
+  graphene_matrix_transform_vec3 (&matrix, &effects->cloud_offset, &spawn_point);
+  graphene_vec3_add (&spawn_point, &position, &spawn_point);
+
+  graphene_matrix_transform_vec3 (&matrix, &effects->cloud_velocity, &spawn_vel);
+  graphene_vec3_add (&spawn_vel, &ship_velocity, &spawn_vel);
+
+  // The random offset is symmetric, so the sign of each axis doesn't matter
+  graphene_matrix_transform_vec3 (&matrix, &effects->cloud_radius, &spawn_rad);
+
+  particles_set_spawn_point (effects->right_clouds, &spawn_point);
+  particles_set_velocity (effects->right_clouds, &spawn_vel);
+  particles_set_spawn_radius (effects->right_clouds, &spawn_rad);
+
+  graphene_vec3_multiply (&effects->cloud_offset, &flip_x, &spawn_point);
+  graphene_matrix_transform_vec3 (&matrix, &spawn_point, &spawn_point);
+  graphene_vec3_add (&spawn_point, &position, &spawn_point);
+
+  particles_set_spawn_point (effects->left_clouds, &spawn_point);
+  particles_set_velocity (effects->left_clouds, &spawn_vel);
+  particles_set_spawn_radius (effects->left_clouds, &spawn_rad);
+
   if (ship_controls_get_collision_right (effects->controls))
     {
       particles_emit (effects->right_sparks, 20);
@@ -262,8 +314,44 @@ ship_effects_update (ShipEffects *effects,
       particles_emit (effects->left_clouds, 5);
     }
 
-  particles_update (effects->right_sparks, dt);
-  particles_update (effects->left_sparks, dt);
-  particles_update (effects->right_clouds, dt);
-  particles_update (effects->left_clouds, dt);
+  particles_update (effects->right_sparks, 1.0);
+  particles_update (effects->left_sparks, 1.0);
+  particles_update (effects->right_clouds, 1.0);
+  particles_update (effects->left_clouds, 1.0);
+}
+
+/* Draws the booster for the frame, with the flicker of the last step */
+void
+ship_effects_update (ShipEffects *effects,
+                      float dt)
+{
+  float boost_ratio = 0, opacity = 0, scale = 0, random = 0, intensity = 0;
+
+  if (!ship_controls_is_destroyed (effects->controls))
+    {
+      gboolean is_accel = ship_controls_is_accelerating (effects->controls);
+      boost_ratio = ship_controls_get_boost_ratio (effects->controls);
+      opacity =  (is_accel ? 0.8 : 0.3) + boost_ratio * 0.4;
+      scale = (is_accel  ? 1.0 : 0.8) + boost_ratio * 0.5;
+      intensity = is_accel ? 4.0 : 2.0;
+      random = effects->flicker;
+    }
+
+  if (effects->booster)
+    {
+      const graphene_euler_t *old_rotation = gthree_object_get_rotation (GTHREE_OBJECT (effects->booster_mesh));
+      graphene_euler_t r;
+      graphene_vec3_t s;
+
+      gthree_object_set_rotation (GTHREE_OBJECT (effects->booster_mesh),
+                                  graphene_euler_init (&r,
+                                                       graphene_euler_get_x (old_rotation),
+                                                       graphene_euler_get_y (old_rotation) + 57,
+                                                       graphene_euler_get_z (old_rotation)));
+      gthree_object_set_scale (GTHREE_OBJECT (effects->booster_mesh),
+                               graphene_vec3_init (&s, scale, scale, scale));
+      gthree_material_set_opacity (GTHREE_MATERIAL (effects->booster_material), random + opacity);
+      gthree_light_set_intensity (GTHREE_LIGHT (effects->booster_light), intensity * (random + 0.8));
+      gthree_material_set_opacity (GTHREE_MATERIAL (gthree_sprite_get_material (effects->booster_sprite)), random + opacity);
+    }
 }
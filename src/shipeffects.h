@@ -1,11 +1,18 @@
 #include <gthree/gthree.h>
 #include "shipcontrols.h"
+#include "particlepool.h"
 
 typedef struct _ShipEffects ShipEffects;
 
+ParticlePool *ship_effects_pool_new (GthreeScene *scene);
+
 ShipEffects *ship_effects_new (GthreeScene *scene,
-                               ShipControls *controls);
+                               ShipControls *controls,
+                               ParticlePool *pool);
 
 void ship_effects_free (ShipEffects *effects);
+void ship_effects_step (ShipEffects *effects);
 void ship_effects_update (ShipEffects *effects,
                            float dt);
+void ship_effects_set_seed (ShipEffects *effects,
+                            guint32 seed);
@@ -0,0 +1,256 @@
+#include <gio/gio.h>
+#include <stdio.h>
+#include <string.h>
+#include "shipprofiles.h"
+
+#define SHIP_PROFILES_SHIP_GROUP "Ship"
+#define SHIP_PROFILES_DIFFICULTY_GROUP "Difficulty %d"
+
+/* Every SimParams field, with the values it may take. Anything outside
+ * these is a typo rather than tuning, and would only show up as a ship
+ * that can't be flown. */
+typedef struct {
+  const char *name;
+  gsize offset;
+  float min;
+  float max;
+} ShipProfileKey;
+
+#define SHIP_PROFILE_KEY(name, min, max) { #name, G_STRUCT_OFFSET (SimParams, name), min, max }
+
+static const ShipProfileKey profile_keys[] = {
+  SHIP_PROFILE_KEY (airResist, 0, 1),
+  SHIP_PROFILE_KEY (airDrift, 0, 1),
+  SHIP_PROFILE_KEY (thrust, 0, 1),
+  SHIP_PROFILE_KEY (airBrake, 0, 1),
+  /* Speeds are divided by it */
+  SHIP_PROFILE_KEY (maxSpeed, 0.1, 100),
+  SHIP_PROFILE_KEY (boosterSpeed, 0, 100),
+  SHIP_PROFILE_KEY (boosterDecay, 0, 1),
+  SHIP_PROFILE_KEY (angularSpeed, 0, 1),
+  SHIP_PROFILE_KEY (airAngularSpeed, 0, 1),
+  SHIP_PROFILE_KEY (repulsionRatio, 0, 10),
+  SHIP_PROFILE_KEY (repulsionCap, 0, 100),
+  SHIP_PROFILE_KEY (repulsionLerp, 0, 1),
+  SHIP_PROFILE_KEY (collisionSpeedDecrease, 0, 1),
+  SHIP_PROFILE_KEY (collisionSpeedDecreaseCoef, 0, 1),
+  SHIP_PROFILE_KEY (maxShield, 0, 100),
+  SHIP_PROFILE_KEY (shieldTiming, 0, 1000),
+  SHIP_PROFILE_KEY (shieldDamage, 0, 10),
+  SHIP_PROFILE_KEY (driftLerp, 0, 1),
+  SHIP_PROFILE_KEY (angularLerp, 0, 1),
+  SHIP_PROFILE_KEY (rollAngle, 0, G_PI),
+  SHIP_PROFILE_KEY (rollLerp, 0, 1),
+  SHIP_PROFILE_KEY (heightLerp, 0, 1),
+  SHIP_PROFILE_KEY (heightOffset, 0, 100),
+  SHIP_PROFILE_KEY (gradientLerp, 0, 1),
+  SHIP_PROFILE_KEY (gradientScale, 0, 100),
+  SHIP_PROFILE_KEY (tiltLerp, 0, 1),
+  SHIP_PROFILE_KEY (tiltScale, 0, 100),
+  SHIP_PROFILE_KEY (repulsionVScale, 0, 100),
+};
+
+/* SimParams is all floats, so this catches a field added without a key */
+G_STATIC_ASSERT (G_N_ELEMENTS (profile_keys) * sizeof (float) == sizeof (SimParams));
+
+static const ShipProfileKey *
+find_key (const char *name)
+{
+  for (guint i = 0; i < G_N_ELEMENTS (profile_keys); i++)
+    {
+      if (strcmp (profile_keys[i].name, name) == 0)
+        return &profile_keys[i];
+    }
+
+  return NULL;
+}
+
+/* Sets the fields in params that group has keys for */
+static gboolean
+read_group (GKeyFile *key_file,
+            const char *path,
+            const char *group,
+            SimParams *params,
+            GError **error)
+{
+  g_auto(GStrv) keys = NULL;
+
+  keys = g_key_file_get_keys (key_file, group, NULL, NULL);
+  if (keys == NULL)
+    return TRUE;
+
+  for (guint i = 0; keys[i] != NULL; i++)
+    {
+      const ShipProfileKey *key = find_key (keys[i]);
+      g_autoptr(GError) local_error = NULL;
+      double value;
+
+      if (key == NULL)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "%s: unknown key %s in [%s]", path, keys[i], group);
+          return FALSE;
+        }
+
+      value = g_key_file_get_double (key_file, group, keys[i], &local_error);
+      if (local_error != NULL)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "%s: %s in [%s] is not a number", path, keys[i], group);
+          return FALSE;
+        }
+
+      if (!(value >= key->min && value <= key->max))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "%s: %s in [%s] is %g, it must be from %g to %g",
+                       path, keys[i], group, value, key->min, key->max);
+          return FALSE;
+        }
+
+      G_STRUCT_MEMBER (float, params, key->offset) = value;
+    }
+
+  return TRUE;
+}
+
+/* Reads the handling for each difficulty from the file at path into
+ * params, which has SIM_N_DIFFICULTIES elements. Nothing is stored
+ * unless all of the file is valid. */
+gboolean
+ship_profiles_read (const char *path,
+                    SimParams *params,
+                    GError **error)
+{
+  g_autoptr(GKeyFile) key_file = g_key_file_new ();
+  g_auto(GStrv) groups = NULL;
+  SimParams read[SIM_N_DIFFICULTIES];
+
+  if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, error))
+    return FALSE;
+
+  /* Catch misspelt groups too, they would be ignored otherwise */
+  groups = g_key_file_get_groups (key_file, NULL);
+  for (guint i = 0; groups[i] != NULL; i++)
+    {
+      int difficulty;
+      char end;
+
+      if (strcmp (groups[i], SHIP_PROFILES_SHIP_GROUP) != 0 &&
+          (sscanf (groups[i], SHIP_PROFILES_DIFFICULTY_GROUP "%c", &difficulty, &end) != 1 ||
+           difficulty < 0 || difficulty >= SIM_N_DIFFICULTIES))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "%s: unknown group [%s]", path, groups[i]);
+          return FALSE;
+        }
+    }
+
+  for (int difficulty = 0; difficulty < SIM_N_DIFFICULTIES; difficulty++)
+    {
+      g_autofree char *group = g_strdup_printf (SHIP_PROFILES_DIFFICULTY_GROUP, difficulty);
+
+      sim_params_init (&read[difficulty], difficulty);
+
+      if (!read_group (key_file, path, SHIP_PROFILES_SHIP_GROUP, &read[difficulty], error) ||
+          !read_group (key_file, path, group, &read[difficulty], error))
+        return FALSE;
+    }
+
+  memcpy (params, read, sizeof (read));
+
+  return TRUE;
+}
+
+/* Reads the file at path, and makes it the handling ships get from
+ * sim_state_set_difficulty() */
+gboolean
+ship_profiles_load (const char *path,
+                    GError **error)
+{
+  SimParams params[SIM_N_DIFFICULTIES];
+
+  if (!ship_profiles_read (path, params, error))
+    return FALSE;
+
+  for (int difficulty = 0; difficulty < SIM_N_DIFFICULTIES; difficulty++)
+    sim_set_params (difficulty, &params[difficulty]);
+
+  return TRUE;
+}
+
+/* Loads the file again each time it is saved */
+struct _ShipProfilesMonitor {
+  char *path;
+  GFileMonitor *monitor;
+  ShipProfilesChangedFunc func;
+  gpointer user_data;
+};
+
+static void
+file_changed (GFileMonitor *file_monitor,
+              GFile *file,
+              GFile *other_file,
+              GFileMonitorEvent event_type,
+              gpointer user_data)
+{
+  ShipProfilesMonitor *monitor = user_data;
+  g_autoptr(GError) error = NULL;
+
+  /* Editors that save to a new file and rename it over give CREATED
+   * rather than CHANGES_DONE_HINT */
+  if (event_type != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+      event_type != G_FILE_MONITOR_EVENT_CREATED)
+    return;
+
+  /* A file being edited is often broken for a while, keep flying with
+   * what was there before until it is fixed */
+  if (!ship_profiles_load (monitor->path, &error))
+    {
+      g_warning ("Failed to reload ship profiles: %s", error->message);
+      return;
+    }
+
+  monitor->func (monitor->user_data);
+}
+
+/* Watches the file at path, and calls func after loading it each time it
+ * changes. The ships already racing have to be given the new handling
+ * by func. */
+ShipProfilesMonitor *
+ship_profiles_monitor_new (const char *path,
+                           ShipProfilesChangedFunc func,
+                           gpointer user_data)
+{
+  ShipProfilesMonitor *monitor;
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  g_autoptr(GError) error = NULL;
+  GFileMonitor *file_monitor;
+
+  file_monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE, NULL, &error);
+  if (file_monitor == NULL)
+    {
+      g_warning ("Can't watch %s for changes: %s", path, error->message);
+      return NULL;
+    }
+
+  monitor = g_new0 (ShipProfilesMonitor, 1);
+  monitor->path = g_strdup (path);
+  monitor->monitor = file_monitor;
+  monitor->func = func;
+  monitor->user_data = user_data;
+
+  g_signal_connect (file_monitor, "changed", G_CALLBACK (file_changed), monitor);
+
+  return monitor;
+}
+
+void
+ship_profiles_monitor_free (ShipProfilesMonitor *monitor)
+{
+  g_signal_handlers_disconnect_by_data (monitor->monitor, monitor);
+  g_file_monitor_cancel (monitor->monitor);
+  g_object_unref (monitor->monitor);
+  g_free (monitor->path);
+  g_free (monitor);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <glib.h>
+#include "sim.h"
+
+/* Ship handling for each difficulty, read from a key file so it can be
+ * tuned without rebuilding. The [Ship] group sets what is the same for
+ * all of them, and [Difficulty N] what differs for difficulty N. Keys
+ * are named after the SimParams fields, and any left out keep the built
+ * in values from sim_params_init(). */
+typedef struct _ShipProfilesMonitor ShipProfilesMonitor;
+
+/* Called after the file changed and the new handling was loaded */
+typedef void (*ShipProfilesChangedFunc) (gpointer user_data);
+
+gboolean              ship_profiles_read         (const char              *path,
+                                                  SimParams               *params,
+                                                  GError                 **error);
+gboolean              ship_profiles_load         (const char              *path,
+                                                  GError                 **error);
+ShipProfilesMonitor * ship_profiles_monitor_new  (const char              *path,
+                                                  ShipProfilesChangedFunc  func,
+                                                  gpointer                 user_data);
+void                  ship_profiles_monitor_free (ShipProfilesMonitor     *monitor);
@@ -0,0 +1,341 @@
+#include <math.h>
+#include <string.h>
+#include "ships.h"
+
+/* Ships are put in a grid of cells as big as the distance at which two
+ * can touch, so each only needs checking against the ones in its own
+ * and the neighbouring cells. The cells are hashed into a table of
+ * twice as many buckets as ships. */
+#define SHIPS_CELL_SIZE (2 * (SIM_SHIP_RADIUS + SIM_SHIP_HALF_LENGTH))
+
+typedef struct {
+  int x, z;
+} ShipCell;
+
+struct _Ships {
+  AnalysisMap *height_map;
+  AnalysisMap *collision_map;
+
+  GArray *states;
+  GArray *inputs;
+  /* What happened to each ship in the last step */
+  GArray *events;
+  /* Pose at the end of the last two steps */
+  GArray *previous_poses;
+  GArray *poses;
+
+  /* Whether the ships bump into each other, and the grid for finding
+   * which might, rebuilt each step as nearly all of them move. The ships
+   * in bucket b are bucket_ships[bucket_start[b]..bucket_start[b+1]]. */
+  gboolean collisions;
+  GArray *cells;
+  guint n_buckets;
+  guint *bucket_start;
+  guint *bucket_fill;
+  guint *bucket_ships;
+};
+
+Ships *
+ships_new (void)
+{
+  Ships *ships = g_new0 (Ships, 1);
+
+  ships->states = g_array_new (FALSE, TRUE, sizeof (SimState));
+  ships->inputs = g_array_new (FALSE, TRUE, sizeof (SimInput));
+  ships->events = g_array_new (FALSE, TRUE, sizeof (SimEvents));
+  ships->previous_poses = g_array_new (FALSE, TRUE, sizeof (SimPose));
+  ships->poses = g_array_new (FALSE, TRUE, sizeof (SimPose));
+  ships->collisions = TRUE;
+  ships->cells = g_array_new (FALSE, TRUE, sizeof (ShipCell));
+
+  return ships;
+}
+
+void
+ships_free (Ships *ships)
+{
+  g_clear_pointer (&ships->height_map, analysis_map_unref);
+  g_clear_pointer (&ships->collision_map, analysis_map_unref);
+  g_array_unref (ships->states);
+  g_array_unref (ships->inputs);
+  g_array_unref (ships->events);
+  g_array_unref (ships->previous_poses);
+  g_array_unref (ships->poses);
+  g_array_unref (ships->cells);
+  g_free (ships->bucket_start);
+  g_free (ships->bucket_fill);
+  g_free (ships->bucket_ships);
+  g_free (ships);
+}
+
+/* The maps all the ships run on, either may be NULL */
+void
+ships_set_maps (Ships *ships,
+                AnalysisMap *height_map,
+                AnalysisMap *collision_map)
+{
+  if (height_map)
+    analysis_map_ref (height_map);
+  if (collision_map)
+    analysis_map_ref (collision_map);
+
+  g_clear_pointer (&ships->height_map, analysis_map_unref);
+  g_clear_pointer (&ships->collision_map, analysis_map_unref);
+  ships->height_map = height_map;
+  ships->collision_map = collision_map;
+
+  for (guint i = 0; i < ships->states->len; i++)
+    {
+      SimState *state = &g_array_index (ships->states, SimState, i);
+
+      state->height_map = height_map;
+      state->collision_map = collision_map;
+    }
+}
+
+/* Whether the ships bump into each other, which they do by default */
+void
+ships_set_collisions (Ships *ships,
+                      gboolean collisions)
+{
+  ships->collisions = collisions;
+}
+
+/* Adds an inactive ship at the origin, and returns its index */
+guint
+ships_add (Ships *ships)
+{
+  guint ship = ships->states->len;
+  SimState *state;
+  SimPose *pose;
+
+  g_array_set_size (ships->states, ship + 1);
+  g_array_set_size (ships->inputs, ship + 1);
+  g_array_set_size (ships->events, ship + 1);
+  g_array_set_size (ships->previous_poses, ship + 1);
+  g_array_set_size (ships->poses, ship + 1);
+  g_array_set_size (ships->cells, ship + 1);
+
+  state = &g_array_index (ships->states, SimState, ship);
+  sim_state_init (state);
+  state->height_map = ships->height_map;
+  state->collision_map = ships->collision_map;
+
+  pose = &g_array_index (ships->poses, SimPose, ship);
+  sim_state_get_pose (state, pose);
+  g_array_index (ships->previous_poses, SimPose, ship) = *pose;
+
+  return ship;
+}
+
+guint
+ships_get_n_ships (Ships *ships)
+{
+  return ships->states->len;
+}
+
+/* The returned state is only valid until the next ships_add() */
+SimState *
+ships_get_state (Ships *ships,
+                 guint ship)
+{
+  g_return_val_if_fail (ship < ships->states->len, NULL);
+
+  return &g_array_index (ships->states, SimState, ship);
+}
+
+/* The input held down on ship from the next step on */
+void
+ships_set_input (Ships *ships,
+                 guint ship,
+                 SimInput input)
+{
+  g_return_if_fail (ship < ships->inputs->len);
+
+  g_array_index (ships->inputs, SimInput, ship) = input;
+}
+
+SimInput
+ships_get_input (Ships *ships,
+                 guint ship)
+{
+  g_return_val_if_fail (ship < ships->inputs->len, 0);
+
+  return g_array_index (ships->inputs, SimInput, ship);
+}
+
+SimEvents
+ships_get_events (Ships *ships,
+                  guint ship)
+{
+  g_return_val_if_fail (ship < ships->events->len, 0);
+
+  return g_array_index (ships->events, SimEvents, ship);
+}
+
+/* Like sim_state_reset(), and the ship is not interpolated from where
+ * it was before */
+void
+ships_reset (Ships *ships,
+             guint ship,
+             const graphene_vec3_t *position,
+             float yaw)
+{
+  SimState *state;
+  SimPose *pose;
+
+  g_return_if_fail (ship < ships->states->len);
+
+  state = &g_array_index (ships->states, SimState, ship);
+  sim_state_reset (state, position, yaw);
+
+  pose = &g_array_index (ships->poses, SimPose, ship);
+  sim_state_get_pose (state, pose);
+  g_array_index (ships->previous_poses, SimPose, ship) = *pose;
+  g_array_index (ships->events, SimEvents, ship) = 0;
+}
+
+static guint
+hash_cell (int x,
+           int z,
+           guint n_buckets)
+{
+  return ((guint)x * 73856093u ^ (guint)z * 19349663u) & (n_buckets - 1);
+}
+
+static gboolean
+can_collide (const SimState *state)
+{
+  return !state->destroyed && !state->falling;
+}
+
+/* The neighbouring cells to check each ship against: its own, and half
+ * of the ones around it, as the other half check it back */
+static const ShipCell neighbours[] = {
+  { 0, 0 }, { 1, 0 }, { -1, 1 }, { 0, 1 }, { 1, 1 },
+};
+
+/* Finds the ships that touch and pushes them apart. Each pair is only
+ * checked once: in the same cell from the lower index, otherwise from
+ * the cell the neighbour stencil reaches the other from. Other cells may
+ * share a bucket, so only ships really in the cell count. This goes the
+ * same way every time. */
+static void
+ships_collide (Ships *ships)
+{
+  SimState *states = (SimState *)ships->states->data;
+  SimEvents *events = (SimEvents *)ships->events->data;
+  ShipCell *cells = (ShipCell *)ships->cells->data;
+  guint n = ships->states->len;
+  guint n_buckets = 1;
+  guint i, b;
+
+  while (n_buckets < 2 * n)
+    n_buckets *= 2;
+
+  if (n_buckets > ships->n_buckets)
+    {
+      ships->n_buckets = n_buckets;
+      ships->bucket_start = g_renew (guint, ships->bucket_start, n_buckets + 1);
+      ships->bucket_fill = g_renew (guint, ships->bucket_fill, n_buckets);
+      ships->bucket_ships = g_renew (guint, ships->bucket_ships, n_buckets / 2);
+    }
+
+  memset (ships->bucket_start, 0, (n_buckets + 1) * sizeof (guint));
+
+  for (i = 0; i < n; i++)
+    {
+      cells[i].x = floorf (states[i].position.x / SHIPS_CELL_SIZE);
+      cells[i].z = floorf (states[i].position.z / SHIPS_CELL_SIZE);
+
+      if (can_collide (&states[i]))
+        ships->bucket_start[hash_cell (cells[i].x, cells[i].z, n_buckets) + 1]++;
+    }
+
+  for (b = 0; b < n_buckets; b++)
+    {
+      ships->bucket_start[b + 1] += ships->bucket_start[b];
+      ships->bucket_fill[b] = ships->bucket_start[b];
+    }
+
+  for (i = 0; i < n; i++)
+    if (can_collide (&states[i]))
+      ships->bucket_ships[ships->bucket_fill[hash_cell (cells[i].x, cells[i].z, n_buckets)]++] = i;
+
+  for (i = 0; i < n; i++)
+    {
+      if (!can_collide (&states[i]))
+        continue;
+
+      for (guint k = 0; k < G_N_ELEMENTS (neighbours); k++)
+        {
+          int x = cells[i].x + neighbours[k].x;
+          int z = cells[i].z + neighbours[k].z;
+
+          b = hash_cell (x, z, n_buckets);
+
+          for (guint m = ships->bucket_start[b]; m < ships->bucket_start[b + 1]; m++)
+            {
+              guint j = ships->bucket_ships[m];
+
+              if ((k == 0 && j <= i) || cells[j].x != x || cells[j].z != z)
+                continue;
+
+              if (sim_ships_collide (&states[i], &states[j]))
+                {
+                  events[i] |= SIM_EVENT_BUMP;
+                  events[j] |= SIM_EVENT_BUMP;
+                }
+            }
+        }
+    }
+}
+
+/* Steps all the ships by dt with their inputs */
+void
+ships_update (Ships *ships,
+              float dt)
+{
+  SimState *states = (SimState *)ships->states->data;
+  SimPose *poses = (SimPose *)ships->poses->data;
+  guint n = ships->states->len;
+
+  sim_step_batch (states,
+                  (const SimInput *)ships->inputs->data,
+                  (SimEvents *)ships->events->data,
+                  n, dt);
+
+  if (ships->collisions && n > 1)
+    ships_collide (ships);
+
+  /* The poses we had are now the previous ones */
+  memcpy (ships->previous_poses->data, poses, n * sizeof (SimPose));
+
+  for (guint i = 0; i < n; i++)
+    sim_state_get_pose (&states[i], &poses[i]);
+}
+
+/* The pose after the last step */
+void
+ships_get_pose (Ships *ships,
+                guint ship,
+                SimPose *pose)
+{
+  g_return_if_fail (ship < ships->poses->len);
+
+  *pose = g_array_index (ships->poses, SimPose, ship);
+}
+
+/* The pose alpha of the way from the previous step to the last one */
+void
+ships_interpolate (Ships *ships,
+                   guint ship,
+                   float alpha,
+                   SimPose *pose)
+{
+  g_return_if_fail (ship < ships->poses->len);
+
+  sim_pose_interpolate (&g_array_index (ships->previous_poses, SimPose, ship),
+                        &g_array_index (ships->poses, SimPose, ship),
+                        MIN (alpha, 1.0), pose);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <glib.h>
+#include <graphene.h>
+#include "analysismap.h"
+#include "sim.h"
+
+/* All the ships in a race, stepped together on the same maps, and
+ * bumping into each other. The state, input, events and poses of the
+ * ships are each kept in an array indexed by ship, so a step goes
+ * through each of them in order. The state of a ship stays a whole
+ * SimState, as the step branches on it ship by ship, and most of the
+ * time goes to the map lookups, which are made for all ships at once;
+ * hexgl-bench ships times both. */
+typedef struct _Ships Ships;
+
+Ships *   ships_new            (void);
+void      ships_free           (Ships                 *ships);
+void      ships_set_maps       (Ships                 *ships,
+                                AnalysisMap           *height_map,
+                                AnalysisMap           *collision_map);
+void      ships_set_collisions (Ships                 *ships,
+                                gboolean               collisions);
+guint     ships_add            (Ships                 *ships);
+guint     ships_get_n_ships    (Ships                 *ships);
+SimState *ships_get_state      (Ships                 *ships,
+                                guint                  ship);
+void      ships_set_input      (Ships                 *ships,
+                                guint                  ship,
+                                SimInput               input);
+SimInput  ships_get_input      (Ships                 *ships,
+                                guint                  ship);
+SimEvents ships_get_events     (Ships                 *ships,
+                                guint                  ship);
+void      ships_reset          (Ships                 *ships,
+                                guint                  ship,
+                                const graphene_vec3_t *position,
+                                float                  yaw);
+void      ships_update         (Ships                 *ships,
+                                float                  dt);
+void      ships_get_pose       (Ships                 *ships,
+                                guint                  ship,
+                                SimPose               *pose);
+void      ships_interpolate    (Ships                 *ships,
+                                guint                  ship,
+                                float                  alpha,
+                                SimPose               *pose);
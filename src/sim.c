@@ -0,0 +1,1054 @@
+#include <math.h>
+#include <string.h>
+#include "sim.h"
+
+#define RAD_TO_DEG(x)          ((x) * (180.f / GRAPHENE_PI))
+
+#define EPSILON 0.00000001
+
+/* How far short of a wall the sweep stops ships, so rounding doesn't put
+ * them in it */
+#define SWEEP_MARGIN 0.01f
+/* What the sweep lets ships go over: only walls stop them, off the edge
+ * they fall */
+#define SWEEP_PASS_MASK (ANALYSIS_MASK_RIDEABLE | ANALYSIS_CLASS_MASK (ANALYSIS_CLASS_VOID))
+
+static void sim_state_set_yaw (SimState *state,
+                               float     yaw);
+
+/* The handling of each difficulty, as sim_state_set_difficulty() gives
+ * it to ships, until replaced with sim_set_params() */
+static SimParams difficulty_params[SIM_N_DIFFICULTIES];
+static gboolean difficulty_params_set = FALSE;
+
+/* Initializes params to the built in handling for difficulty */
+void
+sim_params_init (SimParams *p,
+                 int difficulty)
+{
+  p->airResist = 0.02;
+  p->airDrift = 0.1;
+  p->thrust = 0.02;
+  p->airBrake = 0.02;
+  p->maxSpeed = 7.0;
+  p->boosterSpeed = p->maxSpeed * 0.2;
+  p->boosterDecay = 0.01;
+  p->angularSpeed = 0.005;
+  p->airAngularSpeed = 0.0065;
+  p->repulsionRatio = 0.5;
+  p->repulsionCap = 2.5;
+  p->repulsionLerp = 0.1;
+  p->collisionSpeedDecrease = 0.8;
+  p->collisionSpeedDecreaseCoef = 0.8;
+  p->maxShield = 1.0;
+  p->shieldTiming = 0;
+  p->shieldDamage = 0.25;
+  p->driftLerp = 0.35;
+  p->angularLerp = 0.35;
+  p->rollAngle = 0.6;
+  p->rollLerp = 0.08;
+  p->heightLerp = 0.4;
+  p->heightOffset = 9;
+  p->gradientLerp = 0.05;
+  p->gradientScale = 4.0;
+  p->tiltLerp = 0.05;
+  p->tiltScale = 4.0;
+  p->repulsionVScale = 4.0;
+
+  if (difficulty == 1)
+    {
+      p->airResist = 0.035;
+      p->airDrift = 0.07;
+      p->thrust = 0.035;
+      p->airBrake = 0.04;
+      p->maxSpeed = 9.6;
+      p->boosterSpeed = p->maxSpeed * 0.35;
+      p->boosterDecay = 0.007;
+      p->angularSpeed = 0.0140;
+      p->airAngularSpeed = 0.0165;
+      p->rollAngle = 0.6;
+      p->shieldDamage = 0.03;
+      p->collisionSpeedDecrease = 0.8;
+      p->collisionSpeedDecreaseCoef = 0.5;
+      p->rollLerp = 0.1;
+      p->driftLerp = 0.4;
+      p->angularLerp = 0.4;
+    }
+  else if (difficulty == 0)
+    {
+      p->airResist = 0.02;
+      p->airDrift = 0.06;
+      p->thrust = 0.02;
+      p->airBrake = 0.025;
+      p->maxSpeed = 7.0;
+      p->boosterSpeed = p->maxSpeed * 0.5;
+      p->boosterDecay = 0.007;
+      p->angularSpeed = 0.0125;
+      p->airAngularSpeed = 0.0135;
+      p->rollAngle = 0.6;
+      p->shieldDamage = 0.06;
+      p->collisionSpeedDecrease = 0.8;
+      p->collisionSpeedDecreaseCoef = 0.5;
+      p->rollLerp = 0.07;
+      p->driftLerp = 0.3;
+      p->angularLerp = 0.4;
+    }
+}
+
+/* Returns the handling ships get for difficulty, from 0 to
+ * SIM_N_DIFFICULTIES - 1 */
+const SimParams *
+sim_get_params (int difficulty)
+{
+  g_return_val_if_fail (difficulty >= 0 && difficulty < SIM_N_DIFFICULTIES, NULL);
+
+  if (!difficulty_params_set)
+    {
+      for (int i = 0; i < SIM_N_DIFFICULTIES; i++)
+        sim_params_init (&difficulty_params[i], i);
+      difficulty_params_set = TRUE;
+    }
+
+  return &difficulty_params[difficulty];
+}
+
+/* Replaces the handling for difficulty, or goes back to the built in
+ * one if params is NULL. Ships already racing keep what they had until
+ * sim_state_set_difficulty() is called on them again. */
+void
+sim_set_params (int difficulty,
+                const SimParams *params)
+{
+  g_return_if_fail (difficulty >= 0 && difficulty < SIM_N_DIFFICULTIES);
+
+  sim_get_params (difficulty);
+
+  if (params != NULL)
+    difficulty_params[difficulty] = *params;
+  else
+    sim_params_init (&difficulty_params[difficulty], difficulty);
+}
+
+void
+sim_state_init (SimState *state)
+{
+  memset (state, 0, sizeof (SimState));
+
+  state->active = FALSE;
+
+  state->drift = 0.0;
+  state->angular = 0.0;
+  state->speed = 0.0;
+  state->speedRatio = 0.0;
+  state->boost = 0.0;
+  state->roll = 0.0;
+  state->shield = 1.0;
+  state->shieldDelay = 60;
+  state->check_point = -1;
+  graphene_point3d_init (&state->repulsionForce, 0, 0, 0);
+  state->gradient = 0.0;
+  state->gradientTarget = 0.0;
+  state->tilt = 0.0;
+  state->tiltTarget = 0.0;
+
+  graphene_point3d_init (&state->position, 0, 0, 0);
+  sim_state_set_yaw (state, 0);
+
+  sim_state_set_difficulty (state, 0);
+}
+
+/* Gives the ship the handling for difficulty. Any other difficulty
+ * keeps the handling it has. */
+void
+sim_state_set_difficulty (SimState *state,
+                          int difficulty)
+{
+  state->difficulty = difficulty;
+
+  if (difficulty >= 0 && difficulty < SIM_N_DIFFICULTIES)
+    state->params = *sim_get_params (difficulty);
+}
+
+static void
+sim_state_set_yaw (SimState *state,
+                   float yaw)
+{
+  state->yaw = yaw;
+  state->cos_yaw = cosf (yaw);
+  state->sin_yaw = sinf (yaw);
+}
+
+/* Moves by x,y,z in ship space */
+static void
+sim_state_move (SimState *state,
+                float x, float y, float z)
+{
+  state->position.x += x * state->cos_yaw + z * state->sin_yaw;
+  state->position.y += y;
+  state->position.z += z * state->cos_yaw - x * state->sin_yaw;
+}
+
+/* Resets all of the motion state, so the same inputs from here always
+ * give the same race */
+void
+sim_state_reset (SimState *state,
+                 const graphene_vec3_t *position,
+                 float yaw)
+{
+  state->check_point = -1;
+  state->roll = 0.0;
+  state->drift = 0.0;
+  state->angular = 0.0;
+  state->speed = 0.0;
+  state->speedRatio = 0.0;
+  state->boost = 0.0;
+  state->shield = state->params.maxShield;
+  state->shieldDelay = 60;
+  state->destroyed = FALSE;
+  state->falling = FALSE;
+  state->fall_time = 0;
+  state->collision_left = FALSE;
+  state->collision_right = FALSE;
+  state->collision_front = FALSE;
+  graphene_vec3_init (&state->currentVelocity, 0, 0, 0);
+  state->gradient = 0.0;
+  state->gradientTarget = 0.0;
+  state->tilt = 0.0;
+  state->tiltTarget = 0.0;
+  graphene_point3d_init (&state->repulsionForce, 0, 0, 0);
+
+  graphene_point3d_init_from_vec3 (&state->position, position);
+  sim_state_set_yaw (state, yaw);
+}
+
+void
+sim_state_get_pose (const SimState *state,
+                    SimPose *pose)
+{
+  pose->position = state->position;
+  pose->yaw = state->yaw;
+  pose->gradient = state->gradient;
+  pose->tilt = state->tilt;
+  pose->roll = state->roll;
+}
+
+void
+sim_pose_interpolate (const SimPose *a,
+                      const SimPose *b,
+                      float alpha,
+                      SimPose *res)
+{
+  graphene_point3d_interpolate (&a->position, &b->position, alpha, &res->position);
+  res->yaw = a->yaw + (b->yaw - a->yaw) * alpha;
+  res->gradient = a->gradient + (b->gradient - a->gradient) * alpha;
+  res->tilt = a->tilt + (b->tilt - a->tilt) * alpha;
+  res->roll = a->roll + (b->roll - a->roll) * alpha;
+}
+
+/* Rotates v from ship space, ignoring gradient, tilt and roll */
+void
+sim_pose_rotate (const SimPose *pose,
+                 const graphene_vec3_t *v,
+                 graphene_vec3_t *res)
+{
+  float c = cosf (pose->yaw), s = sinf (pose->yaw);
+  float x = graphene_vec3_get_x (v), z = graphene_vec3_get_z (v);
+
+  graphene_vec3_init (res, x * c + z * s, graphene_vec3_get_y (v), z * c - x * s);
+}
+
+/* The ship transform with the gradient, tilt and roll applied, which
+ * are only visual and don't affect the physics */
+void
+sim_pose_to_matrix (const SimPose *pose,
+                    graphene_matrix_t *matrix)
+{
+  graphene_quaternion_t yaw;
+
+  graphene_matrix_init_identity (matrix);
+
+  if (fabs (pose->gradient) > EPSILON)
+    graphene_matrix_rotate_x (matrix, RAD_TO_DEG (pose->gradient));
+
+  if (fabs (pose->tilt) > EPSILON)
+    graphene_matrix_rotate_z (matrix, RAD_TO_DEG (pose->tilt));
+
+  if (fabs (pose->roll) > EPSILON)
+    graphene_matrix_rotate_z (matrix, RAD_TO_DEG (pose->roll));
+
+  graphene_quaternion_init (&yaw, 0, sinf (pose->yaw / 2), 0, cosf (pose->yaw / 2));
+  graphene_matrix_rotate_quaternion (matrix, &yaw);
+  graphene_matrix_translate (matrix, &pose->position);
+}
+
+int
+sim_state_get_real_speed (const SimState *state,
+                          float scale)
+{
+  return (int)roundf ((state->speed + state->boost) * scale);
+}
+
+float
+sim_state_get_speed_ratio (const SimState *state)
+{
+  return (state->speed + state->boost) / state->params.maxSpeed;
+}
+
+/* Probe offsets in ship space: center, gradient, tilt right, tilt left */
+#define SIM_N_HEIGHT_PROBES 4
+static const float height_probe_x[SIM_N_HEIGHT_PROBES] = { 0, 0, 5, -5 };
+static const float height_probe_z[SIM_N_HEIGHT_PROBES] = { 0, 5, 0, 0 };
+
+/* Where to look up the track height, the left tilt probe is only used
+ * as a fallback */
+static void
+sim_height_probes (const SimState *state,
+                   float *xs,
+                   float *zs)
+{
+  const graphene_point3d_t *pos = &state->position;
+  int i;
+
+  for (i = 0; i < SIM_N_HEIGHT_PROBES; i++)
+    {
+      xs[i] = pos->x + height_probe_x[i] * state->cos_yaw + height_probe_z[i] * state->sin_yaw;
+      zs[i] = pos->z + height_probe_z[i] * state->cos_yaw - height_probe_x[i] * state->sin_yaw;
+    }
+}
+
+static void
+sim_height_check (SimState *state,
+                  const float *heights,
+                  graphene_point3d_t *movement)
+{
+  const SimParams *p = &state->params;
+  const graphene_point3d_t *pos = &state->position;
+
+  float height = heights[0];
+
+  float delta = (height + p->heightOffset - pos->y);
+
+  if (delta > 0)
+    movement->y += delta;
+  else
+    movement->y += delta * p->heightLerp;
+
+  // gradient
+  float nheight = heights[1];
+  if (fabs (nheight - height) < 100)
+      state->gradientTarget = -atan2f (nheight - height, 5.0); //TODO: original had this???: * p->gradientScale;
+
+  // tilt
+  nheight = heights[2];
+
+  if (fabs (nheight - height) > 100) // If right project out of bounds, try left projection
+    {
+      nheight = heights[3];
+      // TODO: Shouldn't we flip tilt angle here ????
+    }
+
+  if (fabs (nheight - height) < 100)
+    state->tiltTarget = atan2f (nheight - height, 5.0); // *p->tiltScale;
+}
+
+/* collision is the class mask at the ship position */
+static SimEvents
+sim_booster_check (SimState *state,
+                   guint32 collision,
+                   graphene_point3d_t *movement,
+                   float dt)
+{
+  const SimParams *p = &state->params;
+  SimEvents events = 0;
+
+  state->boost -= p->boosterDecay * dt;
+  if (state->boost < 0)
+    {
+      state->boost = 0.0;
+      events |= SIM_EVENT_BOOST_END;
+    }
+
+  if (collision & ANALYSIS_CLASS_MASK (ANALYSIS_CLASS_BOOSTER))
+    {
+      events |= SIM_EVENT_BOOST;
+      state->boost = p->boosterSpeed;
+    }
+
+  movement->z += state->boost * dt;
+
+  return events;
+}
+
+static void
+sim_fall (SimState *state)
+{
+  state->active = FALSE;
+  state->collision_front = FALSE;
+  state->collision_left = FALSE;
+  state->collision_right = FALSE;
+  state->falling = TRUE;
+  state->fall_time = 0;
+}
+
+/* Without a distance field the way out of a wall comes from the track
+ * coverage repulsionVScale to the left and right of the ship, as it did
+ * before there was one. coverage is the coverage at the ship. Sets the
+ * push-out normal in ship space and returns TRUE if the ship is off the
+ * track on both sides. */
+static gboolean
+sim_coverage_probe (SimState *state,
+                    float coverage,
+                    float *normalX,
+                    float *normalZ)
+{
+  const SimParams *p = &state->params;
+  const graphene_point3d_t *pos = &state->position;
+  float sideX = state->cos_yaw * p->repulsionVScale;
+  float sideZ = -state->sin_yaw * p->repulsionVScale;
+  float lCov, rCov;
+
+  lCov = analysis_map_lookup_coverage (state->collision_map, pos->x + sideX, pos->z + sideZ);
+  rCov = analysis_map_lookup_coverage (state->collision_map, pos->x - sideX, pos->z - sideZ);
+
+  // Away from the side with less track, or back if they're the same
+  *normalX = (lCov > rCov) - (lCov < rCov);
+  *normalZ = *normalX == 0 ? -1 : 0;
+
+  return rCov < 0.5 && lCov < 0.5 && coverage < 0.1;
+}
+
+/* collision is the class at the ship position */
+static SimEvents
+sim_collision_check (SimState *state,
+                     AnalysisClass collision,
+                     float dt)
+{
+  const SimParams *p = &state->params;
+  SimEvents events = 0;
+  const graphene_point3d_t *pos = &state->position;
+  int check_point;
+
+  if (state->shieldDelay > 0)
+    state->shieldDelay -= dt;
+
+  state->collision_left = FALSE;
+  state->collision_right = FALSE;
+  state->collision_front = FALSE;
+
+  if ((ANALYSIS_CLASS_MASK (collision) & ANALYSIS_MASK_RIDEABLE) == 0)
+    {
+      events |= SIM_EVENT_CRASH;
+
+      // Shield
+      float sr = (float) sim_state_get_real_speed (state, 1) / p->maxSpeed;
+      state->shield -= sr * sr * 0.8 * p->shieldDamage;
+
+      float coverage = analysis_map_lookup_coverage (state->collision_map, pos->x, pos->z);
+
+      // Push-out normal in ship space, +x is to the left
+      float normalX = 0, normalZ = -1;
+      gboolean off_track;
+
+      if (analysis_map_has_distance_field (state->collision_map))
+        {
+          // Repulsion, push away from the wall along the distance field gradient.
+          // The ship x axis is (cos, -sin) and z is (sin, cos) in world x,z.
+          graphene_vec2_t gradient;
+          float distance;
+
+          graphene_vec2_init (&gradient, 0, 0);
+          distance = analysis_map_lookup_distance (state->collision_map, pos->x, pos->z, &gradient);
+
+          if (graphene_vec2_length (&gradient) > EPSILON)
+            {
+              graphene_vec2_normalize (&gradient, &gradient);
+              normalX = graphene_vec2_get_x (&gradient) * state->cos_yaw -
+                        graphene_vec2_get_y (&gradient) * state->sin_yaw;
+              normalZ = graphene_vec2_get_x (&gradient) * state->sin_yaw +
+                        graphene_vec2_get_y (&gradient) * state->cos_yaw;
+            }
+
+          off_track = collision == ANALYSIS_CLASS_VOID && distance < -p->repulsionVScale;
+        }
+      else
+        off_track = sim_coverage_probe (state, coverage, &normalX, &normalZ);
+
+      float repulsionAmount = fmaxf (0.8,
+                                     fminf (p->repulsionCap,
+                                            state->speed * p->repulsionRatio
+                                            )
+                                     );
+      if (normalZ < 0 && fabsf (normalX) < 0.25)
+        {
+          // Head on
+          state->repulsionForce.z += -repulsionAmount*4;
+          state->collision_front = TRUE;
+          state->speed = 0;
+        }
+      else if (normalX < 0)
+        {
+          // Repulse right
+          state->repulsionForce.x += -repulsionAmount;
+          state->collision_left = TRUE;
+        }
+      else
+        {
+          // Repulse left
+          state->repulsionForce.x += repulsionAmount;
+          state->collision_right = TRUE;
+        }
+
+      // DIRTY GAMEOVER, way off the track on both sides
+      if (off_track)
+        sim_fall (state);
+
+      state->speed *= p->collisionSpeedDecrease;
+      state->speed *= (1-p->collisionSpeedDecreaseCoef * (1 - coverage));
+      state->boost = 0;
+    }
+
+  check_point = analysis_class_get_check_point (collision);
+  if (check_point != -1)
+    state->check_point = check_point;
+
+  return events;
+}
+
+static float
+lerp (float a, float b, float alpha)
+{
+  return a * alpha + b * (1.0-alpha);
+}
+
+static void
+lerp_point (const graphene_point3d_t *a, const graphene_point3d_t *b, float alpha, graphene_point3d_t *dest)
+{
+  dest->x = lerp (a->x, b->x, alpha);
+  dest->y = lerp (a->y, b->y, alpha);
+  dest->z = lerp (a->z, b->z, alpha);
+}
+
+static void
+sim_destroy (SimState *state)
+{
+  state->active = FALSE;
+  state->destroyed = TRUE;
+  state->collision_front = FALSE;
+  state->collision_left = FALSE;
+  state->collision_right = FALSE;
+}
+
+/* What a step carries from one phase to the next */
+typedef struct {
+  graphene_point3d_t movement;
+  graphene_point3d_t previous_position;
+  float rotation;
+  float roll_amount;
+  /* Set by sim_sweep_check() if the ship was stopped at a wall */
+  gboolean hit_wall;
+  AnalysisClass wall;
+} SimStepScratch;
+
+/* The input and motion, up to where the maps are needed. Returns FALSE
+ * if there is nothing more to do this step. */
+static gboolean
+sim_step_begin (SimState *state,
+                SimInput input,
+                float dt,
+                SimStepScratch *step)
+{
+  const SimParams *p = &state->params;
+  graphene_point3d_t movement = { 0, 0, 0 };
+
+  if (state->falling)
+    {
+      state->position.y -= 20 * dt;
+
+      /* Two seconds */
+      state->fall_time += dt;
+      if (state->fall_time > 2000 / SIM_STEP_MS)
+        state->destroyed = TRUE;
+
+      return FALSE;
+    }
+
+  state->drift += (0.0 - state->drift) * p->driftLerp;
+  state->angular += (0.0 - state->angular) * p->angularLerp * 0.5;
+
+  float rollAmount = 0.0;
+  float angularAmount = 0.0;
+
+  if (state->active)
+    {
+      if (input & SIM_INPUT_LEFT)
+        {
+          angularAmount += p->angularSpeed * dt;
+          rollAmount -= p->rollAngle;
+        }
+
+      if (input & SIM_INPUT_RIGHT)
+        {
+          angularAmount -= p->angularSpeed * dt;
+          rollAmount += p->rollAngle;
+        }
+
+      if (input & SIM_INPUT_FORWARD)
+        state->speed += p->thrust * dt;
+      else
+        state->speed -= p->airResist * dt;
+
+      if (input & SIM_INPUT_LTRIGGER)
+        {
+          if (input & SIM_INPUT_LEFT)
+            angularAmount += p->airAngularSpeed * dt;
+          else
+            angularAmount += p->airAngularSpeed * 0.5 * dt;
+
+          state->speed -= p->airBrake * dt;
+          state->drift += (p->airDrift - state->drift) * p->driftLerp;
+          movement.x += state->speed * state->drift * dt;
+
+          if(state->drift > 0.0)
+            movement.z -= state->speed * state->drift * dt;
+
+          rollAmount -= p->rollAngle * 0.7;
+        }
+
+      if (input & SIM_INPUT_RTRIGGER)
+        {
+          if (input & SIM_INPUT_RIGHT)
+            angularAmount -= p->airAngularSpeed * dt;
+          else
+            angularAmount -= p->airAngularSpeed * 0.5 * dt;
+          state->speed -= p->airBrake * dt;
+          state->drift += (-p->airDrift - state->drift) * p->driftLerp;
+          movement.x += state->speed * state->drift * dt;
+          if(state->drift < 0.0)
+            movement.z += state->speed * state->drift * dt;
+          rollAmount += p->rollAngle * 0.7;
+        }
+    }
+
+  state->angular += (angularAmount - state->angular) * p->angularLerp;
+
+  state->speed = fmax (0.0, fmin (state->speed, p->maxSpeed));
+  state->speedRatio = state->speed / p->maxSpeed;
+  movement.z += state->speed * dt;
+
+  if (graphene_point3d_near (&state->repulsionForce, graphene_point3d_zero (), EPSILON))
+    graphene_point3d_init (&state->repulsionForce, 0, 0, 0);
+  else
+    {
+      if (state->repulsionForce.z != 0.0)
+        movement.z = 0;
+
+      movement.x += state->repulsionForce.x;
+      movement.y += state->repulsionForce.y;
+      movement.z += state->repulsionForce.z;
+
+      lerp_point (graphene_point3d_zero (), &state->repulsionForce,
+                  dt > 1.5 ? p->repulsionLerp*2 : p->repulsionLerp,
+                  &state->repulsionForce);
+    }
+
+  step->movement = movement;
+  step->previous_position = state->position;
+  step->rotation = state->angular;
+  step->roll_amount = rollAmount;
+  step->hit_wall = FALSE;
+
+  return TRUE;
+}
+
+/* One lookup where the ship ends up misses a wall it went all the way
+ * through in one step, which at boost speed is only a few texels thick.
+ * So after moving, walk the collision map from where the ship was, and
+ * stop it at the first wall on the way. start_mask is the class mask
+ * where it was: coming out of a wall the walls behind don't count.
+ *
+ * That makes a ship that ends a step inside a wall free to leave it
+ * either way, so it is stopped where that wall starts too, or where it
+ * was if it starts in the next texel over. Void it may go into, and
+ * fall. */
+static void
+sim_sweep_check (SimState *state,
+                 guint32 start_mask,
+                 SimStepScratch *step)
+{
+  const graphene_point3d_t *previous = &step->previous_position;
+  graphene_point3d_t *pos = &state->position;
+  float fraction;
+
+  if ((start_mask & ANALYSIS_MASK_RIDEABLE) == 0)
+    return;
+
+  step->hit_wall = analysis_map_trace_class (state->collision_map,
+                                             previous->x, previous->z,
+                                             pos->x, pos->z,
+                                             SWEEP_PASS_MASK,
+                                             &step->wall, &fraction);
+
+  if (!step->hit_wall &&
+      analysis_map_lookup_class (state->collision_map, pos->x, pos->z) == ANALYSIS_CLASS_WALL)
+    {
+      AnalysisClass class;
+      float back;
+
+      /* Back to the texel before the wall, there are no others on the
+       * way */
+      step->hit_wall = TRUE;
+      step->wall = ANALYSIS_CLASS_WALL;
+      if (analysis_map_trace_class (state->collision_map,
+                                    pos->x, pos->z,
+                                    previous->x, previous->z,
+                                    ANALYSIS_CLASS_MASK (ANALYSIS_CLASS_WALL),
+                                    &class, &back))
+        fraction = 1 - back;
+      else
+        fraction = 0;
+    }
+
+  if (step->hit_wall)
+    {
+      float length = hypotf (pos->x - previous->x, pos->z - previous->z);
+
+      fraction = MAX (0, fraction - SWEEP_MARGIN / length);
+      pos->x = previous->x + (pos->x - previous->x) * fraction;
+      pos->z = previous->z + (pos->z - previous->z) * fraction;
+    }
+}
+
+/* Rises or sinks to the height found, once on the new x,z */
+static void
+sim_step_settle (SimState *state,
+                 SimStepScratch *step)
+{
+  const graphene_point3d_t *previous = &step->previous_position;
+
+  sim_state_move (state, 0, step->movement.y, 0);
+
+  graphene_vec3_init (&state->currentVelocity,
+                      state->position.x - previous->x,
+                      state->position.y - previous->y,
+                      state->position.z - previous->z);
+}
+
+static SimEvents
+sim_step_end (SimState *state,
+              SimStepScratch *step)
+{
+  const SimParams *p = &state->params;
+  SimEvents events = 0;
+
+  /* Same as turning by the normalized quaternion (0, rotation, 0, 1) */
+  sim_state_set_yaw (state, state->yaw + 2 * atanf (step->rotation));
+
+  if (state->shield <= 0.0)
+    {
+      state->shield = 0.0;
+      sim_destroy (state);
+      events |= SIM_EVENT_DESTROYED;
+    }
+
+  // Gradient (visual only, no physics impact)
+  float gradientDelta = (state->gradientTarget - (state->gradient)) * p->gradientLerp;
+
+  if (fabs (gradientDelta) > EPSILON)
+    state->gradient += gradientDelta;
+
+  // Tilting (Idem)
+  float tiltDelta = (state->tiltTarget - state->tilt) * p->tiltLerp;
+
+  if (fabs (tiltDelta) > EPSILON)
+    state->tilt += tiltDelta;
+
+  // Rolling (Idem)
+  float rollDelta = (step->roll_amount - state->roll) * p->rollLerp;
+  if (fabs (rollDelta) > EPSILON)
+    state->roll += rollDelta;
+
+  return events;
+}
+
+/* Advances the simulation by dt with the given input held down */
+SimEvents
+sim_step (SimState *state,
+          SimInput input,
+          float dt)
+{
+  float xs[SIM_N_HEIGHT_PROBES], zs[SIM_N_HEIGHT_PROBES], heights[SIM_N_HEIGHT_PROBES];
+  SimStepScratch step;
+  SimEvents events = 0;
+  guint32 start_mask = 0;
+
+  if (!sim_step_begin (state, input, dt, &step))
+    return 0;
+
+  if (state->collision_map != NULL)
+    {
+      start_mask = analysis_map_lookup_class_mask (state->collision_map,
+                                                   state->position.x,
+                                                   state->position.z);
+      events |= sim_booster_check (state, start_mask, &step.movement, dt);
+    }
+
+  sim_state_move (state, step.movement.x, 0, step.movement.z);
+
+  if (state->collision_map != NULL)
+    sim_sweep_check (state, start_mask, &step);
+
+  if (state->height_map != NULL)
+    {
+      /* All probes in one go */
+      sim_height_probes (state, xs, zs);
+      analysis_map_lookup_depthmapped_batch (state->height_map, xs, zs, heights,
+                                             SIM_N_HEIGHT_PROBES);
+      sim_height_check (state, heights, &step.movement);
+    }
+
+  sim_step_settle (state, &step);
+
+  if (state->collision_map != NULL)
+    events |= sim_collision_check (state,
+                                   step.hit_wall ? step.wall :
+                                   analysis_map_lookup_class (state->collision_map,
+                                                              state->position.x,
+                                                              state->position.z),
+                                   dt);
+
+  return events | sim_step_end (state, &step);
+}
+
+/* Ships stepped together by sim_step_batch(), which bounds the scratch
+ * space on the stack */
+#define SIM_BATCH_SIZE 64
+
+static void
+sim_step_chunk (SimState *states,
+                const SimInput *inputs,
+                SimEvents *events,
+                guint n,
+                float dt)
+{
+  AnalysisMap *height_map = states[0].height_map;
+  AnalysisMap *collision_map = states[0].collision_map;
+  SimStepScratch steps[SIM_BATCH_SIZE];
+  /* The ships that aren't done after sim_step_begin() */
+  guint live[SIM_BATCH_SIZE];
+  float xs[SIM_BATCH_SIZE * SIM_N_HEIGHT_PROBES];
+  float zs[SIM_BATCH_SIZE * SIM_N_HEIGHT_PROBES];
+  float heights[SIM_BATCH_SIZE * SIM_N_HEIGHT_PROBES];
+  AnalysisClass classes[SIM_BATCH_SIZE];
+  guint i, j, n_live = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      events[i] = 0;
+      if (sim_step_begin (&states[i], inputs[i], dt, &steps[i]))
+        live[n_live++] = i;
+    }
+
+  if (n_live == 0)
+    return;
+
+  if (collision_map != NULL)
+    {
+      for (j = 0; j < n_live; j++)
+        {
+          xs[j] = states[live[j]].position.x;
+          zs[j] = states[live[j]].position.z;
+        }
+
+      analysis_map_lookup_class_batch (collision_map, xs, zs, classes, n_live);
+
+      for (j = 0; j < n_live; j++)
+        {
+          i = live[j];
+          events[i] |= sim_booster_check (&states[i], ANALYSIS_CLASS_MASK (classes[j]),
+                                          &steps[i].movement, dt);
+        }
+    }
+
+  for (j = 0; j < n_live; j++)
+    {
+      i = live[j];
+      sim_state_move (&states[i], steps[i].movement.x, 0, steps[i].movement.z);
+      if (collision_map != NULL)
+        sim_sweep_check (&states[i], ANALYSIS_CLASS_MASK (classes[j]), &steps[i]);
+    }
+
+  if (height_map != NULL)
+    {
+      for (j = 0; j < n_live; j++)
+        sim_height_probes (&states[live[j]],
+                           xs + j * SIM_N_HEIGHT_PROBES,
+                           zs + j * SIM_N_HEIGHT_PROBES);
+
+      analysis_map_lookup_depthmapped_batch (height_map, xs, zs, heights,
+                                             n_live * SIM_N_HEIGHT_PROBES);
+
+      for (j = 0; j < n_live; j++)
+        {
+          i = live[j];
+          sim_height_check (&states[i], heights + j * SIM_N_HEIGHT_PROBES,
+                            &steps[i].movement);
+        }
+    }
+
+  for (j = 0; j < n_live; j++)
+    {
+      i = live[j];
+      sim_step_settle (&states[i], &steps[i]);
+    }
+
+  if (collision_map != NULL)
+    {
+      for (j = 0; j < n_live; j++)
+        {
+          xs[j] = states[live[j]].position.x;
+          zs[j] = states[live[j]].position.z;
+        }
+
+      analysis_map_lookup_class_batch (collision_map, xs, zs, classes, n_live);
+
+      for (j = 0; j < n_live; j++)
+        {
+          i = live[j];
+          events[i] |= sim_collision_check (&states[i],
+                                            steps[i].hit_wall ? steps[i].wall : classes[j],
+                                            dt);
+        }
+    }
+
+  for (j = 0; j < n_live; j++)
+    {
+      i = live[j];
+      events[i] |= sim_step_end (&states[i], &steps[i]);
+    }
+}
+
+/* Advances n ships by dt, with inputs[i] held down on states[i], and
+ * stores what happened to each in events. The ships must all be on the
+ * same maps. Each ends up exactly as sim_step() would leave it, but the
+ * map lookups of each phase of the step are done for all of them in one
+ * go, which is where most of the time goes with many ships. */
+void
+sim_step_batch (SimState *states,
+                const SimInput *inputs,
+                SimEvents *events,
+                guint n,
+                float dt)
+{
+  guint start;
+
+  for (start = 1; start < n; start++)
+    g_return_if_fail (states[start].height_map == states[0].height_map &&
+                      states[start].collision_map == states[0].collision_map);
+
+  for (start = 0; start < n; start += SIM_BATCH_SIZE)
+    sim_step_chunk (states + start, inputs + start, events + start,
+                    MIN (n - start, SIM_BATCH_SIZE), dt);
+}
+
+/* Pushes a ship out of another one, along the world space normal nx,nz
+ * pointing away from it. It is moved out of the overlap, but no further
+ * than the first wall that way, and gets the same kind of sideways
+ * repulsion as from a wall, which the next steps sweep like any other
+ * move. Only repulsionForce.x is used, as any z stops the ship until it
+ * dies down. The one running into the other, rather than being run
+ * into, loses speed like on a wall. */
+static void
+sim_ship_bump (SimState *state,
+               float nx,
+               float nz,
+               float overlap)
+{
+  const SimParams *p = &state->params;
+  /* The normal in ship space, +x is to the left */
+  float normalX = nx * state->cos_yaw - nz * state->sin_yaw;
+  float normalZ = nx * state->sin_yaw + nz * state->cos_yaw;
+  float repulsionAmount = fmaxf (0.8, fminf (p->repulsionCap, state->speed * p->repulsionRatio));
+  AnalysisClass wall;
+  float fraction;
+
+  /* Like sim_sweep_check(), ships already in a wall can be pushed out */
+  if (state->collision_map != NULL &&
+      (analysis_map_lookup_class_mask (state->collision_map,
+                                       state->position.x,
+                                       state->position.z) & ANALYSIS_MASK_RIDEABLE) != 0 &&
+      analysis_map_trace_class (state->collision_map,
+                                state->position.x, state->position.z,
+                                state->position.x + nx * overlap,
+                                state->position.z + nz * overlap,
+                                ANALYSIS_MASK_RIDEABLE,
+                                &wall, &fraction))
+    overlap *= fraction;
+
+  state->position.x += nx * overlap;
+  state->position.z += nz * overlap;
+
+  state->repulsionForce.x += normalX * repulsionAmount;
+  if (normalX < 0)
+    state->collision_left = TRUE;
+  else
+    state->collision_right = TRUE;
+
+  if (normalZ < 0)
+    state->speed *= p->collisionSpeedDecrease;
+}
+
+/* Checks if two ships touch, each a capsule around a segment along its
+ * heading, and pushes them apart if so. Returns TRUE if they touched. */
+gboolean
+sim_ships_collide (SimState *a,
+                   SimState *b)
+{
+  const float L = SIM_SHIP_HALF_LENGTH;
+  float rx = a->position.x - b->position.x;
+  float rz = a->position.z - b->position.z;
+  /* Their headings, and the closest points of the segments at s along
+   * a's and t along b's */
+  float dot = a->sin_yaw * b->sin_yaw + a->cos_yaw * b->cos_yaw;
+  float c = a->sin_yaw * rx + a->cos_yaw * rz;
+  float f = b->sin_yaw * rx + b->cos_yaw * rz;
+  float denom = 1 - dot * dot;
+  float s, t, dx, dz, distance;
+
+  if (fabsf (a->position.y - b->position.y) > 2 * SIM_SHIP_RADIUS ||
+      rx * rx + rz * rz > 4 * (L + SIM_SHIP_RADIUS) * (L + SIM_SHIP_RADIUS))
+    return FALSE;
+
+  /* Minimizing |r + s da - t db| with s and t in -L..L. Parallel
+   * segments pick s = 0. */
+  s = denom > EPSILON ? CLAMP ((dot * f - c) / denom, -L, L) : 0;
+  t = dot * s + f;
+  if (t < -L || t > L)
+    {
+      t = CLAMP (t, -L, L);
+      s = CLAMP (dot * t - c, -L, L);
+    }
+
+  dx = rx + s * a->sin_yaw - t * b->sin_yaw;
+  dz = rz + s * a->cos_yaw - t * b->cos_yaw;
+  distance = sqrtf (dx * dx + dz * dz);
+
+  if (distance >= 2 * SIM_SHIP_RADIUS)
+    return FALSE;
+
+  if (distance > EPSILON)
+    {
+      dx /= distance;
+      dz /= distance;
+    }
+  else
+    {
+      /* Right on top of each other, push a to its left */
+      dx = a->cos_yaw;
+      dz = -a->sin_yaw;
+    }
+
+  sim_ship_bump (a, dx, dz, (2 * SIM_SHIP_RADIUS - distance) / 2);
+  sim_ship_bump (b, -dx, -dz, (2 * SIM_SHIP_RADIUS - distance) / 2);
+
+  return TRUE;
+}
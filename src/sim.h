@@ -0,0 +1,163 @@
+#pragma once
+
+#include <glib.h>
+#include <graphene.h>
+#include "analysismap.h"
+
+/* The ship simulation, free of any rendering, sound or input handling so
+ * it can run headless. All time is in steps of dt, where 1.0 is 16.6 ms. */
+
+/* Length in ms of a simulation step of dt 1.0 */
+#define SIM_STEP_MS 16.6
+
+/* Where races start, facing yaw 0 */
+#define SIM_START_X (-1134 * 2)
+#define SIM_START_Y 387
+#define SIM_START_Z (-443 * 2)
+
+/* Difficulties go from 0 to this - 1, each with its own handling */
+#define SIM_N_DIFFICULTIES 2
+
+/* Ships bump into each other as capsules of this radius, around a
+ * segment of twice this length along their heading */
+#define SIM_SHIP_RADIUS 3.5f
+#define SIM_SHIP_HALF_LENGTH 6.0f
+
+typedef enum {
+  SIM_INPUT_FORWARD  = 1 << 0,
+  SIM_INPUT_BACKWARD = 1 << 1,
+  SIM_INPUT_LEFT     = 1 << 2,
+  SIM_INPUT_RIGHT    = 1 << 3,
+  SIM_INPUT_LTRIGGER = 1 << 4,
+  SIM_INPUT_RTRIGGER = 1 << 5,
+  SIM_INPUT_USE      = 1 << 6,
+} SimInput;
+
+/* Things that happened during a step, for the caller to play sounds etc */
+typedef enum {
+  SIM_EVENT_CRASH     = 1 << 0,
+  SIM_EVENT_BOOST     = 1 << 1,
+  SIM_EVENT_BOOST_END = 1 << 2,
+  SIM_EVENT_DESTROYED = 1 << 3,
+  SIM_EVENT_BUMP      = 1 << 4,
+} SimEvents;
+
+typedef struct {
+  float airResist;
+  float airDrift;
+  float thrust;
+  float airBrake;
+  float maxSpeed;
+  float boosterSpeed;
+  float boosterDecay;
+  float angularSpeed;
+  float airAngularSpeed;
+  float repulsionRatio;
+  float repulsionCap;
+  float repulsionLerp;
+  float collisionSpeedDecrease;
+  float collisionSpeedDecreaseCoef;
+  float maxShield;
+  float shieldTiming;
+  float shieldDamage;
+  float driftLerp;
+  float angularLerp;
+  float rollAngle;
+  float rollLerp;
+  float heightLerp;
+  float heightOffset; // height above track
+  float gradientLerp;
+  float gradientScale;
+  float tiltLerp;
+  float tiltScale;
+  float repulsionVScale;
+} SimParams;
+
+typedef struct {
+  SimParams params;
+  int difficulty;
+
+  /* Not owned, may be NULL */
+  AnalysisMap *height_map;
+  AnalysisMap *collision_map;
+
+  gboolean active;
+  gboolean destroyed;
+  gboolean falling;
+  float fall_time;
+
+  /* The ship only ever rotates around y, so its orientation is a yaw
+   * angle, with the ship space x and z axes kept next to it */
+  graphene_point3d_t position;
+  float yaw;
+  float cos_yaw;
+  float sin_yaw;
+
+  /* motion state */
+  float drift;
+  float angular;
+  float speed;
+  float speedRatio;
+  float shield;
+  float shieldDelay;
+  float boost;
+  float roll;
+  graphene_point3d_t repulsionForce;
+  float gradient;
+  float gradientTarget;
+  float tilt;
+  float tiltTarget;
+  int check_point;
+
+  gboolean collision_left;
+  gboolean collision_right;
+  gboolean collision_front;
+
+  graphene_vec3_t currentVelocity;
+} SimState;
+
+/* Where to draw the ship */
+typedef struct {
+  graphene_point3d_t position;
+  float yaw;
+  float gradient;
+  float tilt;
+  float roll;
+} SimPose;
+
+void              sim_params_init           (SimParams             *params,
+                                             int                    difficulty);
+const SimParams  *sim_get_params            (int                    difficulty);
+void              sim_set_params            (int                    difficulty,
+                                             const SimParams       *params);
+void              sim_state_init            (SimState              *state);
+void              sim_state_set_difficulty  (SimState              *state,
+                                             int                    difficulty);
+void              sim_state_reset           (SimState              *state,
+                                             const graphene_vec3_t *position,
+                                             float                  yaw);
+void              sim_state_get_pose        (const SimState        *state,
+                                             SimPose               *pose);
+int               sim_state_get_real_speed  (const SimState        *state,
+                                             float                  scale);
+float             sim_state_get_speed_ratio (const SimState        *state);
+SimEvents         sim_step                  (SimState              *state,
+                                             SimInput               input,
+                                             float                  dt);
+void              sim_step_batch            (SimState              *states,
+                                             const SimInput        *inputs,
+                                             SimEvents             *events,
+                                             guint                  n,
+                                             float                  dt);
+gboolean          sim_ships_collide         (SimState              *a,
+                                             SimState              *b);
+
+void              sim_pose_interpolate      (const SimPose         *a,
+                                             const SimPose         *b,
+                                             float                  alpha,
+                                             SimPose               *res);
+void              sim_pose_rotate           (const SimPose         *pose,
+                                             const graphene_vec3_t *v,
+                                             graphene_vec3_t       *res);
+void              sim_pose_to_matrix        (const SimPose         *pose,
+                                             graphene_matrix_t     *matrix);
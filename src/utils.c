@@ -31,6 +31,57 @@ get_sound_path (const char *name)
   return g_file_get_path (file);
 }
 
+char *
+get_model_path (const char *name)
+{
+  GFile *datadir;
+  g_autoptr(GFile) base = NULL;
+  g_autoptr(GFile) file = NULL;
+
+  datadir = get_datadir ();
+  base = g_file_get_child (datadir, "models");
+  file = g_file_resolve_relative_path (base, name);
+  return g_file_get_path (file);
+}
+
+char *
+get_map_path (const char *name)
+{
+  GFile *datadir;
+  g_autoptr(GFile) base = NULL;
+  g_autoptr(GFile) file = NULL;
+
+  datadir = get_datadir ();
+  base = g_file_get_child (datadir, "maps");
+  file = g_file_resolve_relative_path (base, name);
+  return g_file_get_path (file);
+}
+
+char *
+get_profile_path (const char *name)
+{
+  GFile *datadir;
+  g_autoptr(GFile) base = NULL;
+  g_autoptr(GFile) file = NULL;
+
+  datadir = get_datadir ();
+  base = g_file_get_child (datadir, "profiles");
+  file = g_file_resolve_relative_path (base, name);
+  return g_file_get_path (file);
+}
+
+char *
+get_cache_path (const char *name)
+{
+  return g_build_filename (g_get_user_cache_dir (), "gnome-hexgl", name, NULL);
+}
+
+char *
+get_replay_path (const char *name)
+{
+  return g_build_filename (g_get_user_data_dir (), "gnome-hexgl", "replays", name, NULL);
+}
+
 GdkPixbuf *
 load_pixbuf (const char *name)
 {
@@ -70,6 +121,43 @@ load_texture (const char *name)
   return gthree_texture_new (pixbuf);
 }
 
+/* The textures in names side by side, each scaled to the size of the
+ * largest, so that image i is at u from i / n_names to (i + 1) / n_names */
+GthreeTexture *
+load_texture_atlas (const char **names,
+                    int n_names)
+{
+  g_autoptr(GdkPixbuf) atlas = NULL;
+  g_autofree GdkPixbuf **pixbufs = g_new (GdkPixbuf *, n_names);
+  int tile_size = 1;
+  int i;
+
+  for (i = 0; i < n_names; i++)
+    {
+      g_autoptr(GdkPixbuf) pixbuf = load_pixbuf (names[i]);
+
+      pixbufs[i] = gdk_pixbuf_add_alpha (pixbuf, FALSE, 0, 0, 0);
+      tile_size = MAX (tile_size, gdk_pixbuf_get_width (pixbufs[i]));
+      tile_size = MAX (tile_size, gdk_pixbuf_get_height (pixbufs[i]));
+    }
+
+  atlas = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8, tile_size * n_names, tile_size);
+
+  for (i = 0; i < n_names; i++)
+    {
+      double scale_x = (double) tile_size / gdk_pixbuf_get_width (pixbufs[i]);
+      double scale_y = (double) tile_size / gdk_pixbuf_get_height (pixbufs[i]);
+
+      gdk_pixbuf_scale (pixbufs[i], atlas,
+                        i * tile_size, 0, tile_size, tile_size,
+                        i * tile_size, 0, scale_x, scale_y,
+                        GDK_INTERP_BILINEAR);
+      g_object_unref (pixbufs[i]);
+    }
+
+  return gthree_texture_new (atlas);
+}
+
 GthreeTexture *
 load_skybox (const char *name)
 {
@@ -2,7 +2,14 @@
 #include <gtk/gtk.h>
 
 char *get_sound_path (const char *name);
+char *get_model_path (const char *name);
+char *get_map_path (const char *name);
+char *get_profile_path (const char *name);
+char *get_cache_path (const char *name);
+char *get_replay_path (const char *name);
 GdkPixbuf *load_pixbuf (const char *name);
 GthreeTexture *load_texture (const char *name);
+GthreeTexture *load_texture_atlas (const char **names,
+                                   int n_names);
 GthreeTexture *load_skybox (const char *name);
 GthreeObject *load_model (const char *name);
@@ -0,0 +1,143 @@
+/* Checks that every batch height kernel gives exactly what the scalar
+ * lookup does, in every layout and height precision. The kernels are
+ * static, so this builds analysismap.c in. */
+
+#include "analysismap.c"
+#include "testmaps.h"
+
+/* Odd sizes, so the grids don't end on whole tiles or 32-bit words */
+#define MAP_WIDTH 301
+#define MAP_HEIGHT 203
+
+/* Not a multiple of the vector width, so the kernels run their tails */
+#define N_POINTS 4099
+
+typedef struct {
+  const char *name;
+  HeightBatchFunc func;
+} Kernel;
+
+static const Kernel kernels[] = {
+  { "scalar", height_batch_scalar },
+#ifdef HAVE_X86_KERNELS
+  { "sse2", height_batch_sse2 },
+  { "avx2", height_batch_avx2 },
+#endif
+};
+
+static const char *layout_names[] = { "linear", "tiled", "sparse" };
+static const char *precision_names[] = { "float", "16bit" };
+
+typedef struct {
+  AnalysisMapLayout layout;
+  AnalysisMapPrecision precision;
+  const Kernel *kernel;
+} BatchTest;
+
+static gboolean
+kernel_is_supported (const Kernel *kernel)
+{
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init ();
+  if (kernel->func == height_batch_avx2)
+    return __builtin_cpu_supports ("avx2");
+  if (kernel->func == height_batch_sse2)
+    return __builtin_cpu_supports ("sse2");
+#endif
+
+  return TRUE;
+}
+
+/* Points all over the map, on texel centers and edges, on the edges of
+ * the map and past them */
+static void
+make_points (AnalysisMap *map,
+             float *x,
+             float *z,
+             int n)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  float size_x = map->max.x - map->min.x;
+  float size_z = map->max.z - map->min.z;
+
+  for (int i = 0; i < n; i++)
+    {
+      switch (i % 4)
+        {
+        case 0:
+          x[i] = g_rand_double_range (rand, map->min.x, map->max.x);
+          z[i] = g_rand_double_range (rand, map->min.z, map->max.z);
+          break;
+        case 1:
+          x[i] = map->min.x + g_rand_int_range (rand, 0, map->width) * size_x / map->width;
+          z[i] = map->min.z + g_rand_int_range (rand, 0, map->height) * size_z / map->height;
+          break;
+        case 2:
+          x[i] = map->min.x + g_rand_int_range (rand, 0, 2 * map->width) * size_x / (2 * map->width);
+          z[i] = g_rand_boolean (rand) ? map->min.z : map->max.z;
+          break;
+        default:
+          x[i] = g_rand_double_range (rand, map->min.x - size_x / 4, map->max.x + size_x / 4);
+          z[i] = g_rand_double_range (rand, map->min.z - size_z / 4, map->max.z + size_z / 4);
+          break;
+        }
+    }
+}
+
+static void
+test_batch (gconstpointer data)
+{
+  const BatchTest *test = data;
+  g_autofree float *x = g_new (float, N_POINTS);
+  g_autofree float *z = g_new (float, N_POINTS);
+  g_autofree float *heights = g_new (float, N_POINTS);
+  AnalysisMap *map;
+
+  if (!kernel_is_supported (test->kernel))
+    {
+      g_test_skip ("Not supported by this cpu");
+      return;
+    }
+
+  map = test_maps_height_map_new (MAP_WIDTH, MAP_HEIGHT, test->layout, test->precision);
+  make_points (map, x, z, N_POINTS);
+
+  /* Every count up to a few vectors, and then all of them */
+  for (int n = 0; n <= 2 * 8 + 1; n++)
+    {
+      test->kernel->func (map, x, z, heights, n);
+      for (int i = 0; i < n; i++)
+        g_assert_cmpfloat (heights[i], ==, analysis_map_lookup_depthmapped (map, x[i], z[i]));
+    }
+
+  test->kernel->func (map, x, z, heights, N_POINTS);
+  for (int i = 0; i < N_POINTS; i++)
+    g_assert_cmpfloat (heights[i], ==, analysis_map_lookup_depthmapped (map, x[i], z[i]));
+
+  analysis_map_unref (map);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  for (int layout = 0; layout < G_N_ELEMENTS (layout_names); layout++)
+    for (int precision = 0; precision < G_N_ELEMENTS (precision_names); precision++)
+      for (int k = 0; k < G_N_ELEMENTS (kernels); k++)
+        {
+          BatchTest *test = g_new0 (BatchTest, 1);
+          g_autofree char *path = NULL;
+
+          test->layout = layout;
+          test->precision = precision;
+          test->kernel = &kernels[k];
+
+          path = g_strdup_printf ("/analysismap/batch/%s/%s/%s",
+                                  layout_names[layout], precision_names[precision],
+                                  kernels[k].name);
+          g_test_add_data_func_full (path, test, test_batch, g_free);
+        }
+
+  return g_test_run ();
+}
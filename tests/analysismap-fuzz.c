@@ -0,0 +1,198 @@
+/* Throws random, huge, infinite and NaN coordinates at every lookup of
+ * the maps, in every layout, and checks what comes back is something
+ * the map holds. Run under a sanitizer this also catches reads outside
+ * the grids. The batch kernels are static, so this builds analysismap.c
+ * in. */
+
+#include <float.h>
+#include "analysismap.c"
+#include "testmaps.h"
+
+#define MAP_WIDTH 203
+#define MAP_HEIGHT 157
+#define N_POINTS 20000
+
+static const char *layout_names[] = { "linear", "tiled", "sparse" };
+
+static float
+fuzz_coordinate (GRand *rand,
+                 float min,
+                 float max)
+{
+  union {
+    guint32 bits;
+    float f;
+  } any;
+  float sign = g_rand_boolean (rand) ? 1 : -1;
+
+  switch (g_rand_int_range (rand, 0, 8))
+    {
+    case 0:
+      return g_rand_double_range (rand, min, max);
+    case 1:
+      /* Around the edges */
+      return (g_rand_boolean (rand) ? min : max) + g_rand_double_range (rand, -20, 20);
+    case 2:
+      return sign * powf (10, g_rand_int_range (rand, 4, 39));
+    case 3:
+      return sign * INFINITY;
+    case 4:
+      return NAN;
+    case 5:
+      return sign * FLT_MAX;
+    case 6:
+      return sign * (g_rand_boolean (rand) ? 0 : FLT_MIN / 4);
+    default:
+      any.bits = g_rand_int (rand);
+      return any.f;
+    }
+}
+
+static void
+make_points (GRand *rand,
+             AnalysisMap *map,
+             float *x,
+             float *z,
+             int n)
+{
+  for (int i = 0; i < n; i++)
+    {
+      x[i] = fuzz_coordinate (rand, map->min.x, map->max.x);
+      z[i] = fuzz_coordinate (rand, map->min.z, map->max.z);
+    }
+}
+
+/* Every kernel gives the same as the scalar lookup, which is a height
+ * from the grid or the top of the box */
+static void
+check_heights (AnalysisMap *map,
+               const float *x,
+               const float *z,
+               int n)
+{
+  g_autofree float *heights = g_new (float, n);
+  HeightBatchFunc kernels[3];
+  int n_kernels = 0;
+  float slack = (map->max.y - map->min.y) * 1e-5;
+
+  kernels[n_kernels++] = height_batch_scalar;
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("sse2"))
+    kernels[n_kernels++] = height_batch_sse2;
+  if (__builtin_cpu_supports ("avx2"))
+    kernels[n_kernels++] = height_batch_avx2;
+#endif
+
+  for (int i = 0; i < n; i++)
+    {
+      float h = analysis_map_lookup_depthmapped (map, x[i], z[i]);
+
+      g_assert_cmpfloat (h, >=, map->min.y - slack);
+      g_assert_cmpfloat (h, <=, map->max.y + slack);
+    }
+
+  for (int k = 0; k < n_kernels; k++)
+    {
+      kernels[k] (map, x, z, heights, n);
+      for (int i = 0; i < n; i++)
+        g_assert_cmpfloat (heights[i], ==, analysis_map_lookup_depthmapped (map, x[i], z[i]));
+    }
+}
+
+static void
+test_height (gconstpointer data)
+{
+  AnalysisMapLayout layout = GPOINTER_TO_INT (data);
+  g_autoptr(GRand) rand = g_rand_new_with_seed (layout);
+  g_autofree float *x = g_new (float, N_POINTS);
+  g_autofree float *z = g_new (float, N_POINTS);
+
+  for (int precision = ANALYSIS_MAP_PRECISION_FLOAT; precision <= ANALYSIS_MAP_PRECISION_16BIT; precision++)
+    {
+      AnalysisMap *map = test_maps_height_map_new (MAP_WIDTH, MAP_HEIGHT, layout, precision);
+
+      make_points (rand, map, x, z, N_POINTS);
+      check_heights (map, x, z, N_POINTS);
+
+      analysis_map_unref (map);
+    }
+}
+
+static void
+test_collision (gconstpointer data)
+{
+  AnalysisMapLayout layout = GPOINTER_TO_INT (data);
+  g_autoptr(GRand) rand = g_rand_new_with_seed (layout);
+  g_autofree float *x = g_new (float, N_POINTS);
+  g_autofree float *z = g_new (float, N_POINTS);
+  g_autofree AnalysisClass *classes = g_new (AnalysisClass, N_POINTS);
+  AnalysisMap *map = test_maps_collision_map_new (MAP_WIDTH, MAP_HEIGHT, layout);
+  /* No distance is further than the corners are apart */
+  float max_distance = hypotf (map->max.x - map->min.x, map->max.z - map->min.z);
+
+  make_points (rand, map, x, z, N_POINTS);
+  analysis_map_lookup_class_batch (map, x, z, classes, N_POINTS);
+
+  for (int i = 0; i < N_POINTS; i++)
+    {
+      AnalysisClass class = analysis_map_lookup_class (map, x[i], z[i]);
+      float coverage = analysis_map_lookup_coverage (map, x[i], z[i]);
+      graphene_vec2_t gradient;
+      float distance;
+
+      g_assert_cmpint (class, <=, ANALYSIS_CLASS_CHECKPOINT_LAST);
+      g_assert_cmpint (classes[i], ==, class);
+      g_assert_cmpuint (analysis_map_lookup_class_mask (map, x[i], z[i]), ==, ANALYSIS_CLASS_MASK (class));
+
+      g_assert_cmpfloat (coverage, >=, 0);
+      g_assert_cmpfloat (coverage, <=, 1);
+
+      distance = analysis_map_lookup_distance (map, x[i], z[i], &gradient);
+      g_assert_cmpfloat (fabsf (distance), <=, max_distance);
+      g_assert_true (isfinite (graphene_vec2_get_x (&gradient)));
+      g_assert_true (isfinite (graphene_vec2_get_y (&gradient)));
+    }
+
+  /* Traces between all kinds of points, including ones on the map */
+  for (int i = 0; i + 1 < N_POINTS; i++)
+    {
+      AnalysisClass class;
+      float fraction;
+
+      if (analysis_map_trace_class (map, x[i], z[i], x[i + 1], z[i + 1],
+                                    ANALYSIS_MASK_RIDEABLE, &class, &fraction))
+        {
+          g_assert_cmpuint (ANALYSIS_CLASS_MASK (class) & ANALYSIS_MASK_RIDEABLE, ==, 0);
+          g_assert_cmpfloat (fraction, >=, 0);
+          g_assert_cmpfloat (fraction, <=, 1);
+        }
+
+      if (analysis_map_trace_class (map, x[i], z[i], x[i + 1], z[i + 1],
+                                    0, &class, &fraction))
+        {
+          g_assert_cmpint (class, <=, ANALYSIS_CLASS_CHECKPOINT_LAST);
+          g_assert_cmpfloat (fraction, >=, 0);
+          g_assert_cmpfloat (fraction, <=, 1);
+        }
+    }
+
+  analysis_map_unref (map);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  for (int layout = 0; layout < G_N_ELEMENTS (layout_names); layout++)
+    {
+      g_autofree char *height_path = g_strdup_printf ("/analysismap/fuzz/height/%s", layout_names[layout]);
+      g_autofree char *collision_path = g_strdup_printf ("/analysismap/fuzz/collision/%s", layout_names[layout]);
+
+      g_test_add_data_func (height_path, GINT_TO_POINTER (layout), test_height);
+      g_test_add_data_func (collision_path, GINT_TO_POINTER (layout), test_collision);
+    }
+
+  return g_test_run ();
+}
@@ -0,0 +1,129 @@
+/* Bakes smooth synthetic heights at each map size and height precision,
+ * and checks the filtered lookups stay within what the texel spacing
+ * and the storage allow */
+
+#include <math.h>
+#include "testmaps.h"
+
+#define N_SAMPLES 100000
+
+/* Float rounding in the lookup, from the texel coordinates and the
+ * filtering. It stays well under this on these maps. */
+#define ROUNDING_ERROR 1e-3
+
+typedef struct {
+  int size;
+  AnalysisMapPrecision precision;
+} PrecisionTest;
+
+/* The map-size option, passed in by meson */
+#ifndef MAP_SIZE
+#define MAP_SIZE ANALYSIS_MAP_DEFAULT_SIZE
+#endif
+
+static const int sizes[] = { 64, 256, 1024, ANALYSIS_MAP_DEFAULT_SIZE };
+
+/* How far the lookups may be from the true heights. Bilinear filtering
+ * is off by at most an eighth of the second derivative times the
+ * squared spacing along each axis, and storing the heights rounds them
+ * to half a step. Packed depths have 32 bits over the height of the
+ * box, which float heights keep, and 16-bit heights have 16. */
+static float
+get_error_bound (int size,
+                 AnalysisMapPrecision precision,
+                 const graphene_point3d_t *min,
+                 const graphene_point3d_t *max)
+{
+  float spacing_x = (max->x - min->x) / size;
+  float spacing_z = (max->z - min->z) / size;
+  float range = max->y - min->y;
+  float max_xx, max_zz, storage;
+
+  test_maps_hills_get_curvature (&max_xx, &max_zz);
+
+  if (precision == ANALYSIS_MAP_PRECISION_16BIT)
+    storage = range / 65535 / 2;
+  else
+    storage = range / 4294967296.0;
+
+  return (spacing_x * spacing_x * max_xx + spacing_z * spacing_z * max_zz) / 8 +
+    storage + ROUNDING_ERROR;
+}
+
+static void
+test_precision (gconstpointer data)
+{
+  const PrecisionTest *test = data;
+  g_autoptr(GRand) rand = g_rand_new_with_seed (test->size);
+  graphene_box_t box;
+  graphene_point3d_t min, max;
+  cairo_surface_t *surface;
+  AnalysisMap *map;
+  float bound, last_x, last_z;
+  double max_error = 0;
+
+  test_maps_get_bounding_box (&box);
+  graphene_box_get_min (&box, &min);
+  graphene_box_get_max (&box, &max);
+
+  /* The same steps as hexgl-bake */
+  surface = test_maps_height_surface_new (test->size, test->size, &box, test_maps_hills);
+  map = analysis_map_new (surface, &box, ANALYSIS_MAP_HEIGHT, ANALYSIS_MAP_LAYOUT_SPARSE);
+  analysis_map_set_height_precision (map, test->precision);
+  g_assert_cmpint (analysis_map_get_height_precision (map), ==, test->precision);
+
+  /* Past the last texel the filter blends in the guard border */
+  test_maps_texel_to_world (surface, &box, test->size - 1, test->size - 1, &last_x, &last_z);
+
+  for (int i = 0; i < N_SAMPLES; i++)
+    {
+      float x = g_rand_double_range (rand, min.x, last_x);
+      float z = g_rand_double_range (rand, min.z, last_z);
+      double error = fabs (analysis_map_lookup_depthmapped (map, x, z) - test_maps_hills (x, z));
+
+      max_error = MAX (max_error, error);
+    }
+
+  bound = get_error_bound (test->size, test->precision, &min, &max);
+  g_test_message ("size %d: max height error %g, bound %g", test->size, max_error, bound);
+  g_assert_cmpfloat (max_error, <=, bound);
+
+  analysis_map_unref (map);
+  cairo_surface_destroy (surface);
+}
+
+static void
+add_tests (int size)
+{
+  for (int precision = ANALYSIS_MAP_PRECISION_FLOAT; precision <= ANALYSIS_MAP_PRECISION_16BIT; precision++)
+    {
+      PrecisionTest *test = g_new0 (PrecisionTest, 1);
+      g_autofree char *path = NULL;
+
+      test->size = size;
+      test->precision = precision;
+
+      path = g_strdup_printf ("/analysismap/precision/%d/%s", size,
+                              precision == ANALYSIS_MAP_PRECISION_16BIT ? "16bit" : "float");
+      g_test_add_data_func_full (path, test, test_precision, g_free);
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  int i;
+
+  g_test_init (&argc, &argv, NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+    add_tests (sizes[i]);
+
+  /* And the size the build bakes the maps at, if it's another one */
+  for (i = 0; i < G_N_ELEMENTS (sizes) && sizes[i] != MAP_SIZE; i++)
+    ;
+  if (i == G_N_ELEMENTS (sizes))
+    add_tests (MAP_SIZE);
+
+  return g_test_run ();
+}
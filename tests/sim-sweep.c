@@ -0,0 +1,276 @@
+/* Drives ships into a wall one texel thick at every step size, with
+ * sim_step() and sim_step_batch(), and checks the sweep stops them at
+ * it rather than letting a long step go through. Off the edge of the
+ * track it must not stop them, they fall. */
+
+#include <math.h>
+#include "sim.h"
+#include "testmaps.h"
+
+#define MAP_SIZE 512
+/* The texel column of the wall, or where the void starts */
+#define WALL_TEXEL 300
+
+#define MIN_DT 0.25
+#define MAX_DT 32
+
+/* Off straight at the wall, yaw G_PI / 2 being head on */
+static const float angles[] = { -1.0, -0.5, -0.1, 0, 0.2, 0.7, 1.1 };
+/* How far the ships start before the wall, in texels, and as a part of
+ * how far they go in a step */
+static const float texel_offsets[] = { 0.6, 1.5, 3 };
+static const float step_offsets[] = { 0.2, 0.5, 0.9, 0.99, 1.5 };
+
+#define N_SHIPS (G_N_ELEMENTS (angles) * (G_N_ELEMENTS (texel_offsets) + G_N_ELEMENTS (step_offsets)))
+
+typedef struct {
+  AnalysisMap *map;
+  float spacing;
+  /* The world x where the wall texel starts and ends, for the nearest
+   * lookups. A void goes on from wall_start to the side of the map. */
+  float wall_start;
+  float wall_end;
+} Wall;
+
+/* Track, with a wall across it at WALL_TEXEL, or with pixel VOID the
+ * end of the track there */
+static void
+wall_init (Wall *wall,
+           guint32 pixel)
+{
+  graphene_box_t box;
+  graphene_point3d_t min, max;
+  cairo_surface_t *surface;
+  float x, z;
+
+  test_maps_get_bounding_box (&box);
+  graphene_box_get_min (&box, &min);
+  graphene_box_get_max (&box, &max);
+  surface = test_maps_collision_surface_new (MAP_SIZE, MAP_SIZE, TEST_MAPS_TRACK);
+
+  wall->spacing = (max.x - min.x) / MAP_SIZE;
+  test_maps_texel_to_world (surface, &box, WALL_TEXEL, 0, &x, &z);
+  wall->wall_start = x - wall->spacing / 2;
+  wall->wall_end = x + wall->spacing / 2;
+
+  if (pixel == TEST_MAPS_VOID)
+    test_maps_fill_rect (surface, &box, x, min.z, max.x, max.z, pixel);
+  else
+    test_maps_fill_rect (surface, &box, x, min.z, x, max.z, pixel);
+  wall->map = analysis_map_new (surface, &box, ANALYSIS_MAP_COLLISION, ANALYSIS_MAP_LAYOUT_LINEAR);
+  analysis_map_build_distance_field (wall->map, ANALYSIS_MASK_RIDEABLE);
+  cairo_surface_destroy (surface);
+}
+
+/* A ship at full speed, offset before the wall along x and heading
+ * angle off straight at it */
+static void
+start_ship (SimState *state,
+            const Wall *wall,
+            float offset,
+            float angle)
+{
+  graphene_vec3_t position;
+
+  sim_state_init (state);
+  state->collision_map = wall->map;
+  sim_state_reset (state, graphene_vec3_init (&position, wall->wall_start - offset, 0, 0),
+                   G_PI / 2 + angle);
+  state->active = TRUE;
+  state->speed = state->params.maxSpeed;
+}
+
+static float
+get_offset (const Wall *wall,
+            float dt,
+            guint i)
+{
+  guint n_texel = G_N_ELEMENTS (texel_offsets);
+
+  i %= n_texel + G_N_ELEMENTS (step_offsets);
+  if (i < n_texel)
+    return texel_offsets[i] * wall->spacing;
+
+  return step_offsets[i - n_texel] * sim_get_params (0)->maxSpeed * dt;
+}
+
+static void
+start_ships (SimState *states,
+             const Wall *wall,
+             float dt)
+{
+  for (guint i = 0; i < N_SHIPS; i++)
+    start_ship (&states[i], wall, get_offset (wall, dt, i),
+                angles[i / (N_SHIPS / G_N_ELEMENTS (angles))]);
+}
+
+/* A step from start_x with yaw went as far as it would have with no
+ * wall there, or crashed and stopped where the wall starts, or where
+ * it was from the texel next to the wall. Either way it is left on the
+ * track, where the next step sweeps from. */
+static void
+check_step (const Wall *wall,
+            const SimState *state,
+            SimEvents events,
+            float start_x,
+            float yaw,
+            float dt)
+{
+  float reach = start_x + sinf (yaw) * state->params.maxSpeed * dt;
+  /* The sweep stops a little short */
+  float tolerance = 0.02;
+
+  if (reach >= wall->wall_start)
+    {
+      g_assert_true (events & SIM_EVENT_CRASH);
+      if (state->position.x != start_x)
+        g_assert_cmpfloat (fabsf (state->position.x - wall->wall_start), <, tolerance);
+    }
+  else
+    {
+      g_assert_false (events & SIM_EVENT_CRASH);
+      g_assert_cmpfloat (fabsf (state->position.x - reach), <, tolerance);
+    }
+
+  g_assert_cmpint (analysis_map_lookup_class (wall->map, state->position.x, state->position.z), ==,
+                   ANALYSIS_CLASS_TRACK);
+}
+
+static void
+test_single_step (void)
+{
+  SimState states[N_SHIPS];
+  SimEvents events[N_SHIPS];
+  SimInput inputs[N_SHIPS];
+  float start_x[N_SHIPS], yaw[N_SHIPS];
+  Wall wall;
+
+  wall_init (&wall, TEST_MAPS_WALL);
+
+  for (guint i = 0; i < N_SHIPS; i++)
+    inputs[i] = SIM_INPUT_FORWARD;
+
+  for (float dt = MIN_DT; dt <= MAX_DT; dt += 0.25)
+    {
+      start_ships (states, &wall, dt);
+      for (guint i = 0; i < N_SHIPS; i++)
+        {
+          start_x[i] = states[i].position.x;
+          yaw[i] = states[i].yaw;
+          events[i] = sim_step (&states[i], inputs[i], dt);
+          check_step (&wall, &states[i], events[i], start_x[i], yaw[i], dt);
+        }
+
+      /* The same in one go */
+      start_ships (states, &wall, dt);
+      sim_step_batch (states, inputs, events, N_SHIPS, dt);
+      for (guint i = 0; i < N_SHIPS; i++)
+        check_step (&wall, &states[i], events[i], start_x[i], yaw[i], dt);
+    }
+
+  analysis_map_unref (wall.map);
+}
+
+/* Keeps driving at the wall after hitting it, pushed back and sideways
+ * off it, and never gets through */
+static void
+test_many_steps (void)
+{
+  SimState states[N_SHIPS];
+  SimEvents events[N_SHIPS];
+  SimInput inputs[N_SHIPS];
+  Wall wall;
+
+  wall_init (&wall, TEST_MAPS_WALL);
+
+  for (guint i = 0; i < N_SHIPS; i++)
+    inputs[i] = SIM_INPUT_FORWARD;
+
+  for (float dt = MIN_DT; dt <= MAX_DT; dt += 0.25)
+    {
+      start_ships (states, &wall, dt);
+      for (int step = 0; step < 50; step++)
+        {
+          sim_step_batch (states, inputs, events, N_SHIPS, dt);
+          for (guint i = 0; i < N_SHIPS; i++)
+            g_assert_cmpfloat (states[i].position.x, <, wall.wall_end);
+        }
+
+      start_ships (states, &wall, dt);
+      for (guint i = 0; i < N_SHIPS; i++)
+        for (int step = 0; step < 50; step++)
+          {
+            sim_step (&states[i], inputs[i], dt);
+            g_assert_cmpfloat (states[i].position.x, <, wall.wall_end);
+          }
+    }
+
+  analysis_map_unref (wall.map);
+}
+
+/* A step from start_x with yaw over the edge of the track goes as far
+ * as it would with no edge there, and the ship falls once it is well
+ * off it */
+static void
+check_edge_step (const Wall *edge,
+                 const SimState *state,
+                 SimEvents events,
+                 float start_x,
+                 float yaw,
+                 float dt)
+{
+  float reach = start_x + sinf (yaw) * state->params.maxSpeed * dt;
+
+  g_assert_cmpfloat (fabsf (state->position.x - reach), <, 0.02);
+
+  if (reach < edge->wall_start)
+    g_assert_false (events & SIM_EVENT_CRASH);
+  else if (reach > edge->wall_start + state->params.repulsionVScale + 2 * edge->spacing)
+    g_assert_true (state->falling);
+}
+
+static void
+test_void_edge (void)
+{
+  SimState states[N_SHIPS];
+  SimEvents events[N_SHIPS];
+  SimInput inputs[N_SHIPS];
+  float start_x[N_SHIPS], yaw[N_SHIPS];
+  Wall edge;
+
+  wall_init (&edge, TEST_MAPS_VOID);
+
+  for (guint i = 0; i < N_SHIPS; i++)
+    inputs[i] = SIM_INPUT_FORWARD;
+
+  for (float dt = MIN_DT; dt <= MAX_DT; dt += 0.25)
+    {
+      start_ships (states, &edge, dt);
+      for (guint i = 0; i < N_SHIPS; i++)
+        {
+          start_x[i] = states[i].position.x;
+          yaw[i] = states[i].yaw;
+          events[i] = sim_step (&states[i], inputs[i], dt);
+          check_edge_step (&edge, &states[i], events[i], start_x[i], yaw[i], dt);
+        }
+
+      start_ships (states, &edge, dt);
+      sim_step_batch (states, inputs, events, N_SHIPS, dt);
+      for (guint i = 0; i < N_SHIPS; i++)
+        check_edge_step (&edge, &states[i], events[i], start_x[i], yaw[i], dt);
+    }
+
+  analysis_map_unref (edge.map);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/sim/sweep/single-step", test_single_step);
+  g_test_add_func ("/sim/sweep/many-steps", test_many_steps);
+  g_test_add_func ("/sim/sweep/void-edge", test_void_edge);
+
+  return g_test_run ();
+}
@@ -0,0 +1,237 @@
+#include <math.h>
+#include "testmaps.h"
+
+/* Around the size of the track, with the same height range */
+#define BOX_MIN_X -1000
+#define BOX_MIN_Y -50
+#define BOX_MIN_Z -900
+#define BOX_MAX_X 1200
+#define BOX_MAX_Y 400
+#define BOX_MAX_Z 1100
+
+/* The walls on both sides of the ring track */
+#define RING_WALL 20
+
+/* The hills, a product of sines */
+#define HILLS_BASE 150
+#define HILLS_AMPLITUDE 100
+#define HILLS_SCALE_X 150
+#define HILLS_SCALE_Z 200
+
+void
+test_maps_get_bounding_box (graphene_box_t *box)
+{
+  graphene_point3d_t min, max;
+
+  graphene_box_init (box,
+                     graphene_point3d_init (&min, BOX_MIN_X, BOX_MIN_Y, BOX_MIN_Z),
+                     graphene_point3d_init (&max, BOX_MAX_X, BOX_MAX_Y, BOX_MAX_Z));
+}
+
+/* Where texel tx,tz of a map made from surface is in world x,z, in the
+ * mapping the lookups use. Texel coordinates may be fractional. */
+void
+test_maps_texel_to_world (cairo_surface_t *surface,
+                          const graphene_box_t *box,
+                          float tx,
+                          float tz,
+                          float *x,
+                          float *z)
+{
+  graphene_point3d_t min, max;
+
+  graphene_box_get_min (box, &min);
+  graphene_box_get_max (box, &max);
+
+  *x = min.x + tx * (max.x - min.x) / cairo_image_surface_get_width (surface);
+  *z = min.z + tz * (max.z - min.z) / cairo_image_surface_get_height (surface);
+}
+
+/* Smooth heights over the whole map, well inside the bounding box */
+float
+test_maps_hills (float x,
+                 float z)
+{
+  return HILLS_BASE + HILLS_AMPLITUDE * sinf (x / HILLS_SCALE_X) * cosf (z / HILLS_SCALE_Z);
+}
+
+/* The largest second derivatives of test_maps_hills() along x and z,
+ * which bound the error of bilinear filtering */
+void
+test_maps_hills_get_curvature (float *max_xx,
+                               float *max_zz)
+{
+  *max_xx = (float)HILLS_AMPLITUDE / (HILLS_SCALE_X * HILLS_SCALE_X);
+  *max_zz = (float)HILLS_AMPLITUDE / (HILLS_SCALE_Z * HILLS_SCALE_Z);
+}
+
+/* Same packing as pack_depth() in hexgl-bake */
+static guint32
+pack_depth (double depth)
+{
+  guint32 q = (guint32) CLAMP (depth * 4294967296.0, 0, 4294967295.0);
+
+  return
+    (q & 0xff000000) |
+    (q & 0x000000ff) << 16 |
+    (q & 0x0000ff00) |
+    (q & 0x00ff0000) >> 16;
+}
+
+/* An RGBA packed depth surface like the game renders, with the heights
+ * of func at each texel */
+cairo_surface_t *
+test_maps_height_surface_new (int width,
+                              int height,
+                              const graphene_box_t *box,
+                              TestMapsHeightFunc func)
+{
+  cairo_surface_t *surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
+  unsigned char *data = cairo_image_surface_get_data (surface);
+  int stride = cairo_image_surface_get_stride (surface);
+  graphene_point3d_t min, max;
+
+  graphene_box_get_min (box, &min);
+  graphene_box_get_max (box, &max);
+
+  for (int y = 0; y < height; y++)
+    {
+      guint32 *row = (guint32 *)(data + y * stride);
+
+      for (int x = 0; x < width; x++)
+        {
+          float wx, wz;
+
+          test_maps_texel_to_world (surface, box, x, y, &wx, &wz);
+          row[x] = pack_depth ((max.y - func (wx, wz)) / (max.y - min.y));
+        }
+    }
+
+  cairo_surface_mark_dirty (surface);
+
+  return surface;
+}
+
+/* A height map of test_maps_hills() */
+AnalysisMap *
+test_maps_height_map_new (int width,
+                          int height,
+                          AnalysisMapLayout layout,
+                          AnalysisMapPrecision precision)
+{
+  graphene_box_t box;
+  cairo_surface_t *surface;
+  AnalysisMap *map;
+
+  test_maps_get_bounding_box (&box);
+  surface = test_maps_height_surface_new (width, height, &box, test_maps_hills);
+  map = analysis_map_new (surface, &box, ANALYSIS_MAP_HEIGHT, layout);
+  analysis_map_set_height_precision (map, precision);
+  cairo_surface_destroy (surface);
+
+  return map;
+}
+
+/* A collision colour surface filled with pixel */
+cairo_surface_t *
+test_maps_collision_surface_new (int width,
+                                 int height,
+                                 guint32 pixel)
+{
+  cairo_surface_t *surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
+  unsigned char *data = cairo_image_surface_get_data (surface);
+  int stride = cairo_image_surface_get_stride (surface);
+
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++)
+      ((guint32 *)(data + y * stride))[x] = pixel;
+
+  cairo_surface_mark_dirty (surface);
+
+  return surface;
+}
+
+/* Sets the texels from x0,z0 to x1,z1 in world space to pixel */
+void
+test_maps_fill_rect (cairo_surface_t *surface,
+                     const graphene_box_t *box,
+                     float x0,
+                     float z0,
+                     float x1,
+                     float z1,
+                     guint32 pixel)
+{
+  unsigned char *data = cairo_image_surface_get_data (surface);
+  int stride = cairo_image_surface_get_stride (surface);
+
+  for (int y = 0; y < cairo_image_surface_get_height (surface); y++)
+    for (int x = 0; x < cairo_image_surface_get_width (surface); x++)
+      {
+        float wx, wz;
+
+        test_maps_texel_to_world (surface, box, x, y, &wx, &wz);
+        if (wx >= x0 && wx <= x1 && wz >= z0 && wz <= z1)
+          ((guint32 *)(data + y * stride))[x] = pixel;
+      }
+
+  cairo_surface_mark_dirty (surface);
+}
+
+/* Draws a ring track with walls on both sides, a booster and three
+ * checkpoints across it */
+void
+test_maps_draw_ring (cairo_surface_t *surface,
+                     const graphene_box_t *box)
+{
+  unsigned char *data = cairo_image_surface_get_data (surface);
+  int stride = cairo_image_surface_get_stride (surface);
+
+  for (int y = 0; y < cairo_image_surface_get_height (surface); y++)
+    for (int x = 0; x < cairo_image_surface_get_width (surface); x++)
+      {
+        guint32 *pixel = &((guint32 *)(data + y * stride))[x];
+        float wx, wz, r, angle;
+
+        test_maps_texel_to_world (surface, box, x, y, &wx, &wz);
+        r = hypotf (wx - TEST_MAPS_RING_X, wz - TEST_MAPS_RING_Z);
+        angle = atan2f (wz - TEST_MAPS_RING_Z, wx - TEST_MAPS_RING_X);
+
+        if (r < TEST_MAPS_RING_INNER - RING_WALL || r > TEST_MAPS_RING_OUTER + RING_WALL)
+          continue;
+
+        if (r < TEST_MAPS_RING_INNER || r > TEST_MAPS_RING_OUTER)
+          *pixel = TEST_MAPS_WALL;
+        else if (fabsf (angle) < 0.03)
+          *pixel = TEST_MAPS_CHECKPOINT (0);
+        else if (fabsf (angle - 2.1) < 0.03)
+          *pixel = TEST_MAPS_CHECKPOINT (1);
+        else if (fabsf (angle + 2.1) < 0.03)
+          *pixel = TEST_MAPS_CHECKPOINT (2);
+        else if (fabsf (angle - 1) < 0.05 && r > (TEST_MAPS_RING_INNER + TEST_MAPS_RING_OUTER) / 2)
+          *pixel = TEST_MAPS_BOOSTER;
+        else
+          *pixel = TEST_MAPS_TRACK;
+      }
+
+  cairo_surface_mark_dirty (surface);
+}
+
+/* A collision map of the ring track, with its distance field */
+AnalysisMap *
+test_maps_collision_map_new (int width,
+                             int height,
+                             AnalysisMapLayout layout)
+{
+  graphene_box_t box;
+  cairo_surface_t *surface;
+  AnalysisMap *map;
+
+  test_maps_get_bounding_box (&box);
+  surface = test_maps_collision_surface_new (width, height, TEST_MAPS_VOID);
+  test_maps_draw_ring (surface, &box);
+  map = analysis_map_new (surface, &box, ANALYSIS_MAP_COLLISION, layout);
+  analysis_map_build_distance_field (map, ANALYSIS_MASK_RIDEABLE);
+  cairo_surface_destroy (surface);
+
+  return map;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <glib.h>
+#include "analysismap.h"
+
+/* Synthetic analysis maps for the tests and benchmarks, drawn in the
+ * same encodings as the surfaces the game and hexgl-bake make, so they
+ * don't need the track model or baked maps. */
+
+/* Collision colours, see classify_pixel() in analysismap.c */
+#define TEST_MAPS_VOID    0xff000000
+#define TEST_MAPS_WALL    0xff808080
+#define TEST_MAPS_TRACK   0xffffffff
+#define TEST_MAPS_BOOSTER 0xffff0000
+/* Checkpoints 0 to 7, the blue channel picks which */
+#define TEST_MAPS_CHECKPOINT(n) (0xffffff00 | ((n) * 255 + 9) / 10)
+
+/* The ring track test_maps_draw_ring() draws, around x,z with the track
+ * between the inner and outer radius */
+#define TEST_MAPS_RING_X 100
+#define TEST_MAPS_RING_Z 100
+#define TEST_MAPS_RING_INNER 400
+#define TEST_MAPS_RING_OUTER 800
+
+typedef float (*TestMapsHeightFunc) (float x,
+                                     float z);
+
+void             test_maps_get_bounding_box      (graphene_box_t       *box);
+void             test_maps_texel_to_world        (cairo_surface_t      *surface,
+                                                  const graphene_box_t *box,
+                                                  float                 tx,
+                                                  float                 tz,
+                                                  float                *x,
+                                                  float                *z);
+
+float            test_maps_hills                 (float                 x,
+                                                  float                 z);
+void             test_maps_hills_get_curvature   (float                *max_xx,
+                                                  float                *max_zz);
+cairo_surface_t *test_maps_height_surface_new    (int                   width,
+                                                  int                   height,
+                                                  const graphene_box_t *box,
+                                                  TestMapsHeightFunc    func);
+AnalysisMap *    test_maps_height_map_new        (int                   width,
+                                                  int                   height,
+                                                  AnalysisMapLayout     layout,
+                                                  AnalysisMapPrecision  precision);
+
+cairo_surface_t *test_maps_collision_surface_new (int                   width,
+                                                  int                   height,
+                                                  guint32               pixel);
+void             test_maps_fill_rect             (cairo_surface_t      *surface,
+                                                  const graphene_box_t *box,
+                                                  float                 x0,
+                                                  float                 z0,
+                                                  float                 x1,
+                                                  float                 z1,
+                                                  guint32               pixel);
+void             test_maps_draw_ring             (cairo_surface_t      *surface,
+                                                  const graphene_box_t *box);
+AnalysisMap *    test_maps_collision_map_new     (int                   width,
+                                                  int                   height,
+                                                  AnalysisMapLayout     layout);